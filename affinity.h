@@ -0,0 +1,209 @@
+#ifndef AFFINITY_H
+#define AFFINITY_H
+// CPU placement for the server's threads. Each role can be pinned to its
+// own set of CPUs with --cpus, and memory a role's threads mostly touch is
+// then committed on the NUMA node of those CPUs. Threads of a role that
+// runs many of them (connections, auth workers) get one CPU of the set
+// each, round robin, so they keep their caches warm. Only the first
+// processor group (64 logical CPUs) is used.
+#include "common.h"
+
+#define AFFINITY_ACCEPT 0            // The accept loop
+#define AFFINITY_CONNECTION 1        // Connection readers and their writers
+#define AFFINITY_AUTH 2              // Auth workers
+#define AFFINITY_BACKGROUND 3        // Snapshots, bulk scheduler, replication, watchers
+#define AFFINITY_ROLES 4
+#define AFFINITY_MAX_CPUS (int)(sizeof(DWORD_PTR) * 8)
+
+const char *affinity_role_names[AFFINITY_ROLES] = { "accept", "conn", "auth", "background" };
+DWORD_PTR affinity_masks[AFFINITY_ROLES]; // 0 = not pinned
+
+// Bits of a CPU list like "0-3,8" (the whole list is checked)
+// Returns 0 if it is malformed or names a CPU past AFFINITY_MAX_CPUS
+DWORD_PTR affinity_parse_list(const char *list) {
+    DWORD_PTR mask = 0;
+    const char *p = list;
+    while (*p != '\0') {
+        char *end;
+        long first = strtol(p, &end, 10);
+        long last = first;
+        if (end == p) {
+            return 0;
+        }
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p) {
+                return 0;
+            }
+        }
+        if (first < 0 || last < first || last >= AFFINITY_MAX_CPUS) {
+            return 0;
+        }
+        for (long cpu = first; cpu <= last; cpu++) {
+            mask |= (DWORD_PTR)1 << cpu;
+        }
+        if (*end == ',') {
+            end++;
+        } else if (*end != '\0') {
+            return 0;
+        }
+        p = end;
+    }
+    return mask;
+}
+
+// "role=list" from --cpus. Returns 0 if the role or list is bad.
+int affinity_parse(const char *spec) {
+    const char *equals = strchr(spec, '=');
+    if (equals == NULL) {
+        return 0;
+    }
+    for (int role = 0; role < AFFINITY_ROLES; role++) {
+        size_t length = strlen(affinity_role_names[role]);
+        if ((size_t)(equals - spec) == length && strncmp(spec, affinity_role_names[role], length) == 0) {
+            affinity_masks[role] = affinity_parse_list(equals + 1);
+            return affinity_masks[role] != 0;
+        }
+    }
+    return 0;
+}
+
+// The CPUs of a mask as a list, e.g. "0-3,8"
+void affinity_format(DWORD_PTR mask, char *text, size_t size) {
+    int length = 0;
+    text[0] = '\0';
+    for (int cpu = 0; cpu < AFFINITY_MAX_CPUS; cpu++) {
+        if (!(mask & ((DWORD_PTR)1 << cpu))) {
+            continue;
+        }
+        int last = cpu;
+        while (last + 1 < AFFINITY_MAX_CPUS && (mask & ((DWORD_PTR)1 << (last + 1)))) {
+            last++;
+        }
+        length += snprintf(text + length, length < (int)size ? size - length : 0,
+                           last > cpu ? "%s%d-%d" : "%s%d", length > 0 ? "," : "", cpu, last);
+        cpu = last;
+    }
+}
+
+// The n-th CPU of a mask, counting round (mask must not be 0)
+int affinity_nth_cpu(DWORD_PTR mask, int n) {
+    int count = 0;
+    for (int cpu = 0; cpu < AFFINITY_MAX_CPUS; cpu++) {
+        count += (mask >> cpu) & 1;
+    }
+    n %= count;
+    for (int cpu = 0; cpu < AFFINITY_MAX_CPUS; cpu++) {
+        if ((mask & ((DWORD_PTR)1 << cpu)) && n-- == 0) {
+            return cpu;
+        }
+    }
+    return 0;
+}
+
+// Pin the calling thread: to the n-th CPU of its role's set, or to the
+// whole set if n < 0. Does nothing if the role isn't pinned.
+void affinity_pin(int role, int n) {
+    DWORD_PTR mask = affinity_masks[role];
+    if (mask == 0) {
+        return;
+    }
+    if (n >= 0) {
+        mask = (DWORD_PTR)1 << affinity_nth_cpu(mask, n);
+    }
+    if (SetThreadAffinityMask(GetCurrentThread(), mask) == 0) {
+        printf("Failed to pin a %s thread. Error Code: %d\n", affinity_role_names[role], GetLastError());
+    }
+}
+
+// NUMA node of a role's first CPU, NUMA_NO_PREFERRED_NODE if not pinned
+DWORD affinity_node(int role) {
+    UCHAR node;
+    if (affinity_masks[role] == 0 ||
+        !GetNumaProcessorNode((UCHAR)affinity_nth_cpu(affinity_masks[role], 0), &node)) {
+        return NUMA_NO_PREFERRED_NODE;
+    }
+    return node;
+}
+
+// Commit reserved memory on the node of a role's CPUs
+// Returns NULL on failure, like VirtualAlloc
+void *affinity_commit(void *address, SIZE_T size, int role) {
+    DWORD node = affinity_node(role);
+    if (node == NUMA_NO_PREFERRED_NODE) {
+        return VirtualAlloc(address, size, MEM_COMMIT, PAGE_READWRITE);
+    }
+    return VirtualAllocExNuma(GetCurrentProcess(), address, size, MEM_COMMIT, PAGE_READWRITE, node);
+}
+
+// Drop CPUs this process may not run on. Returns 0 if a role has none left.
+int affinity_check() {
+    DWORD_PTR process_mask, system_mask;
+    if (!GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask)) {
+        return 1;
+    }
+    for (int role = 0; role < AFFINITY_ROLES; role++) {
+        if (affinity_masks[role] != 0 && (affinity_masks[role] & ~process_mask) != 0) {
+            char list[256];
+            affinity_format(affinity_masks[role] & ~process_mask, list, sizeof(list));
+            printf("CPUs %s are not available; not pinning %s threads to them\n",
+                   list, affinity_role_names[role]);
+            affinity_masks[role] &= process_mask;
+            if (affinity_masks[role] == 0) {
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+// Print the CPUs, cores and NUMA nodes, where each role runs, and the
+// CPUs receive-side scaling should deliver to (the NIC's RSS queues are
+// set on the adapter, not by the server)
+void affinity_report() {
+    DWORD size = 0;
+    int cores = 0, cpus = 0;
+    GetLogicalProcessorInformation(NULL, &size);
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION *info = size > 0 ? malloc(size) : NULL;
+    if (info != NULL && GetLogicalProcessorInformation(info, &size)) {
+        for (DWORD i = 0; i < size / sizeof(*info); i++) {
+            if (info[i].Relationship == RelationProcessorCore) {
+                cores++;
+                for (DWORD_PTR mask = info[i].ProcessorMask; mask != 0; mask &= mask - 1) {
+                    cpus++;
+                }
+            }
+        }
+    }
+    free(info);
+
+    ULONG highest_node = 0;
+    GetNumaHighestNodeNumber(&highest_node);
+    printf("CPU topology: %d logical CPUs, %d cores, %lu NUMA nodes\n",
+           cpus, cores, (unsigned long)highest_node + 1);
+    char list[256];
+    for (ULONG node = 0; node <= highest_node; node++) {
+        ULONGLONG mask = 0;
+        if (GetNumaNodeProcessorMask((UCHAR)node, &mask)) {
+            affinity_format((DWORD_PTR)mask, list, sizeof(list));
+            printf("- node %lu: CPUs %s\n", (unsigned long)node, list);
+        }
+    }
+
+    for (int role = 0; role < AFFINITY_ROLES; role++) {
+        if (affinity_masks[role] == 0) {
+            printf("- %s threads: not pinned\n", affinity_role_names[role]);
+            continue;
+        }
+        affinity_format(affinity_masks[role], list, sizeof(list));
+        printf("- %s threads: CPUs %s (node %lu)\n", affinity_role_names[role], list,
+               (unsigned long)affinity_node(role));
+    }
+    if (affinity_masks[AFFINITY_CONNECTION] != 0) {
+        affinity_format(affinity_masks[AFFINITY_CONNECTION], list, sizeof(list));
+        printf("  Steer the NIC's RSS queues to CPUs %s to match\n", list);
+    }
+}
+
+#endif // AFFINITY_H
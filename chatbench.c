@@ -0,0 +1,679 @@
+#define FD_SETSIZE 1024 // Before winsock2.h: select() over every bench connection
+#include "common.h"
+
+// Load generator for the chat server: N simulated users on one event loop,
+// sending a mix of chat messages, DMs and history requests at a fixed rate
+// (or replaying a chat log as a timed trace), with delivery latency measured
+// from send to arrival at each recipient.
+
+#define MAX_BENCH_CLIENTS 1000
+#define BENCH_PASSWORD "benchpass"
+#define BENCH_PREFIX "bench"
+#define DRAIN_SECONDS 2          // Wait this long for stragglers at the end
+
+// Connection states
+#define BENCH_REGISTERING 0
+#define BENCH_LOGGING_IN 1
+#define BENCH_READY 2
+#define BENCH_FAILED 3
+
+typedef struct {
+    SOCKET socket;
+    int state;
+    char username[MAX_USERNAME];
+    unsigned int next_request_id;
+    unsigned int auth_request_id;
+    char in_buffer[sizeof(Message)]; // Partial frame read so far
+    int in_length;
+    Message out;                     // Frame being sent
+    int out_offset;                  // Bytes of out already sent
+    int out_pending;
+    unsigned long long next_send_us; // When the next scripted operation is due
+    unsigned int history_request_id; // Outstanding history request, 0 if none
+    unsigned long long history_sent_us;
+    unsigned int sent_seq;
+    unsigned int user_id;            // From the login response; DMs are addressed by it
+} bench_client_t;
+
+// Latency samples in microseconds
+typedef struct {
+    unsigned int *values;
+    size_t count;
+    size_t capacity;
+} samples_t;
+
+// One chat log record to replay
+typedef struct {
+    unsigned long long offset_us;    // From the first record
+    int type;
+    int sender;                      // Bench client that sends it
+    int recipient;                   // For DMs
+    int length;                      // Original text length, for padding
+} trace_record_t;
+
+// Configuration (from command line)
+char server_ip[16] = "127.0.0.1";
+int server_port = SERVER_PORT;
+int client_count = 10;
+double duration_seconds = 30.0;
+double rate_per_client = 10.0;       // Operations per second per client
+int mix_chat = 90;                   // Relative weights of the operations
+int mix_dm = 9;
+int mix_history = 1;
+int payload_size = 64;               // Characters of text per message
+char replay_path[MAX_PATH] = "";
+double replay_speed = 1.0;
+char name_prefix[16] = BENCH_PREFIX;
+
+bench_client_t *bench = NULL;
+LARGE_INTEGER counter_frequency;
+
+// Results
+samples_t chat_latency;
+samples_t dm_latency;
+samples_t history_latency;
+unsigned long long sent_chat = 0;
+unsigned long long sent_dm = 0;
+unsigned long long sent_history = 0;
+unsigned long long delivered = 0;
+unsigned long long history_errors = 0;
+unsigned long long skipped = 0;      // Operations due while the previous send was still pending
+
+trace_record_t *trace = NULL;
+size_t trace_count = 0;
+size_t trace_next = 0;
+
+// Function prototypes
+void parse_arguments(int argc, char *argv[]);
+unsigned long long now_us();
+unsigned int hash_name(const char *name);
+int connect_clients();
+void start_auth(bench_client_t *client, int type);
+int load_trace(const char *path);
+unsigned long long record_time_us(const Message *record);
+int run_phase(unsigned long long until_us, int scripted);
+void schedule_operations(unsigned long long now);
+void replay_due(unsigned long long now, unsigned long long start_us);
+void start_operation(bench_client_t *client, int index, unsigned long long now);
+void build_bench_message(bench_client_t *client, int index, int type, int recipient, int length, unsigned long long now);
+int flush_output(bench_client_t *client);
+int read_input(bench_client_t *client);
+void handle_frame(bench_client_t *client, Message *msg);
+void add_sample(samples_t *samples, unsigned long long value);
+int compare_samples(const void *a, const void *b);
+void report_latency(const char *label, samples_t *samples);
+void report(double elapsed);
+
+int main(int argc, char *argv[]) {
+    WSADATA wsa_data;
+
+    parse_arguments(argc, argv);
+    QueryPerformanceFrequency(&counter_frequency);
+    srand((unsigned int)GetTickCount());
+
+    if (WSAStartup(MAKEWORD(2, 2), &wsa_data) != 0) {
+        printf("Failed to initialize Winsock. Error Code: %d\n", WSAGetLastError());
+        return 1;
+    }
+
+    if (replay_path[0] != '\0' && !load_trace(replay_path)) {
+        WSACleanup();
+        return 1;
+    }
+
+    bench = calloc(client_count, sizeof(bench_client_t));
+    if (bench == NULL) {
+        printf("Out of memory\n");
+        WSACleanup();
+        return 1;
+    }
+
+    printf("Connecting %d clients to %s:%d...\n", client_count, server_ip, server_port);
+    if (!connect_clients()) {
+        WSACleanup();
+        return 1;
+    }
+
+    // Setup: register (an existing account is fine) and log everyone in
+    unsigned long long setup_start = now_us();
+    if (!run_phase(0, 0)) {
+        WSACleanup();
+        return 1;
+    }
+    printf("All clients logged in (%.1f s)\n", (now_us() - setup_start) / 1e6);
+
+    // Measured phase
+    unsigned long long start = now_us();
+    for (int i = 0; i < client_count; i++) {
+        // Spread the first sends over one interval so clients don't move in lockstep
+        bench[i].next_send_us = start + (unsigned long long)(1e6 / rate_per_client * i / client_count);
+    }
+
+    if (trace != NULL) {
+        printf("Replaying %zu records at %.1fx...\n", trace_count, replay_speed);
+        run_phase(start, 2);
+    } else {
+        printf("Running for %.0f s at %.1f ops/s per client...\n", duration_seconds, rate_per_client);
+        run_phase(start + (unsigned long long)(duration_seconds * 1e6), 1);
+    }
+    double elapsed = (now_us() - start) / 1e6;
+
+    // Let in-flight deliveries arrive before reporting
+    run_phase(now_us() + DRAIN_SECONDS * 1000000ULL, 0);
+
+    report(elapsed);
+
+    for (int i = 0; i < client_count; i++) {
+        closesocket(bench[i].socket);
+    }
+    WSACleanup();
+    return 0;
+}
+
+void parse_arguments(int argc, char *argv[]) {
+    int positional = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--clients") == 0 && i + 1 < argc) {
+            client_count = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--duration") == 0 && i + 1 < argc) {
+            duration_seconds = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+            rate_per_client = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--mix") == 0 && i + 1 < argc) {
+            if (sscanf(argv[++i], "%d:%d:%d", &mix_chat, &mix_dm, &mix_history) != 3) {
+                printf("--mix takes chat:dm:history weights, e.g. 90:9:1\n");
+                exit(1);
+            }
+        } else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+            payload_size = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            strncpy(replay_path, argv[++i], MAX_PATH - 1);
+        } else if (strcmp(argv[i], "--speed") == 0 && i + 1 < argc) {
+            replay_speed = atof(argv[++i]);
+        } else if (strcmp(argv[i], "--prefix") == 0 && i + 1 < argc) {
+            strncpy(name_prefix, argv[++i], sizeof(name_prefix) - 1);
+        } else if (positional == 0) {
+            strncpy(server_ip, argv[i], sizeof(server_ip) - 1);
+            positional++;
+        } else if (positional == 1 && atoi(argv[i]) > 0) {
+            server_port = atoi(argv[i]);
+            positional++;
+        } else {
+            printf("Usage: chatbench.exe [server_ip] [port] [--clients n] [--duration seconds]\n"
+                   "                     [--rate ops/s per client] [--mix chat:dm:history] [--size chars]\n"
+                   "                     [--replay chatlog.txt] [--speed x] [--prefix name]\n");
+            exit(1);
+        }
+    }
+
+    if (client_count < 2 || client_count > MAX_BENCH_CLIENTS) {
+        printf("--clients must be between 2 and %d\n", MAX_BENCH_CLIENTS);
+        exit(1);
+    }
+    if (rate_per_client <= 0 || replay_speed <= 0 || mix_chat + mix_dm + mix_history <= 0 ||
+        mix_chat < 0 || mix_dm < 0 || mix_history < 0) {
+        printf("--rate, --speed and the --mix total must be positive\n");
+        exit(1);
+    }
+
+    // The send time and IDs take about 40 characters of each message
+    if (payload_size < 48) {
+        payload_size = 48;
+    }
+    if (payload_size > FRAGMENT_TEXT) {
+        payload_size = FRAGMENT_TEXT;
+    }
+}
+
+unsigned long long now_us() {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (unsigned long long)(counter.QuadPart / counter_frequency.QuadPart) * 1000000ULL +
+           (unsigned long long)(counter.QuadPart % counter_frequency.QuadPart) * 1000000ULL / counter_frequency.QuadPart;
+}
+
+// FNV-1a
+unsigned int hash_name(const char *name) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char*)name; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+// Open every connection and send its registration
+int connect_clients() {
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_addr.s_addr = inet_addr(server_ip);
+    server_addr.sin_port = htons(server_port);
+
+    for (int i = 0; i < client_count; i++) {
+        bench_client_t *client = &bench[i];
+        snprintf(client->username, MAX_USERNAME, "%s%d", name_prefix, i);
+        client->next_request_id = 1;
+
+        client->socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (client->socket == INVALID_SOCKET ||
+            connect(client->socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0) {
+            printf("Connection %d failed. Error Code: %d\n", i, WSAGetLastError());
+            return 0;
+        }
+
+        // Everything after connect goes through the event loop
+        u_long non_blocking = 1;
+        ioctlsocket(client->socket, FIONBIO, &non_blocking);
+        BOOL no_delay = TRUE;
+        setsockopt(client->socket, IPPROTO_TCP, TCP_NODELAY, (const char*)&no_delay, sizeof(no_delay));
+
+        start_auth(client, MSG_REGISTER);
+    }
+    return 1;
+}
+
+void start_auth(bench_client_t *client, int type) {
+    Message *msg = &client->out;
+    memset(msg, 0, sizeof(Message));
+    msg->type = type;
+    msg->request_id = client->next_request_id++;
+    snprintf(msg->content, MAX_MESSAGE, "%s:%s", client->username, BENCH_PASSWORD);
+
+    client->auth_request_id = msg->request_id;
+    client->state = type == MSG_REGISTER ? BENCH_REGISTERING : BENCH_LOGGING_IN;
+    client->out_offset = 0;
+    client->out_pending = 1;
+}
+
+// Record times: epoch microseconds, or the formatted time of older logs
+unsigned long long record_time_us(const Message *record) {
+    if (record->time_us != 0) {
+        return record->time_us;
+    }
+
+    struct tm parts;
+    memset(&parts, 0, sizeof(parts));
+    if (sscanf(record->timestamp, "%d-%d-%d %d:%d:%d", &parts.tm_year, &parts.tm_mon, &parts.tm_mday,
+               &parts.tm_hour, &parts.tm_min, &parts.tm_sec) != 6) {
+        return 0;
+    }
+    parts.tm_year -= 1900;
+    parts.tm_mon -= 1;
+    parts.tm_isdst = -1;
+    return (unsigned long long)mktime(&parts) * 1000000ULL;
+}
+
+// Turn a chat log into a trace: each sender is played by one bench client
+// (chosen by name) and each record is sent at its original offset / speed
+int load_trace(const char *path) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        printf("Cannot open %s\n", path);
+        return 0;
+    }
+
+    char line[MAX_LOG_LINE];
+    size_t capacity = 0;
+    unsigned long long first = 0;
+    log_record_t record;
+
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = 0;
+        if (!parse_log_line(line, &record) || strcmp(record.sender, "SERVER") == 0) {
+            continue;
+        }
+        unsigned long long when = record_time_us(&record.msg);
+        if (when == 0) {
+            continue;
+        }
+
+        if (trace_count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            trace_record_t *grown = realloc(trace, capacity * sizeof(trace_record_t));
+            if (grown == NULL) {
+                printf("Out of memory\n");
+                fclose(file);
+                return 0;
+            }
+            trace = grown;
+        }
+
+        if (trace_count == 0) {
+            first = when;
+        }
+        trace_record_t *entry = &trace[trace_count++];
+        entry->offset_us = when > first ? (unsigned long long)((when - first) / replay_speed) : 0;
+        entry->type = record.msg.type;
+        entry->sender = (int)(hash_name(record.sender) % (unsigned int)client_count);
+        entry->recipient = (int)(hash_name(record.recipient) % (unsigned int)client_count);
+        if (entry->recipient == entry->sender) {
+            entry->recipient = (entry->sender + 1) % client_count;
+        }
+        entry->length = (int)strlen(record.msg.content);
+    }
+    fclose(file);
+
+    if (trace_count == 0) {
+        printf("No chat records in %s\n", path);
+        return 0;
+    }
+    printf("Loaded %zu records from %s\n", trace_count, path);
+    return 1;
+}
+
+// The event loop. scripted: 0 = setup (until_us 0) or drain until until_us,
+// 1 = timed operation mix until until_us, 2 = trace replay started at
+// until_us, until the trace is done. Setup returns once every client is
+// logged in. Returns 0 if setup failed.
+int run_phase(unsigned long long until_us, int scripted) {
+    unsigned long long start = now_us();
+
+    while (1) {
+        unsigned long long now = now_us();
+
+        if (scripted == 1) {
+            if (now >= until_us) {
+                return 1;
+            }
+            schedule_operations(now);
+        } else if (scripted == 2) {
+            if (trace_next == trace_count) {
+                return 1;
+            }
+            replay_due(now, until_us);
+        } else if (until_us != 0 && now >= until_us) {
+            return 1;
+        }
+
+        // Setup is done once everyone is in
+        if (until_us == 0) {
+            int ready = 0;
+            for (int i = 0; i < client_count; i++) {
+                if (bench[i].state == BENCH_FAILED) {
+                    printf("Client %s failed to log in\n", bench[i].username);
+                    return 0;
+                }
+                ready += bench[i].state == BENCH_READY;
+            }
+            if (ready == client_count) {
+                return 1;
+            }
+            if (now - start > 120 * 1000000ULL) {
+                printf("Timed out logging in (%d of %d ready)\n", ready, client_count);
+                return 0;
+            }
+        }
+
+        fd_set readable, writable;
+        FD_ZERO(&readable);
+        FD_ZERO(&writable);
+        for (int i = 0; i < client_count; i++) {
+            if (bench[i].socket == INVALID_SOCKET) {
+                continue;
+            }
+            FD_SET(bench[i].socket, &readable);
+            if (bench[i].out_pending) {
+                FD_SET(bench[i].socket, &writable);
+            }
+        }
+
+        // Wake at least every millisecond for the send schedule
+        struct timeval timeout;
+        timeout.tv_sec = 0;
+        timeout.tv_usec = 1000;
+        if (select(0, &readable, &writable, NULL, &timeout) == SOCKET_ERROR) {
+            printf("select failed. Error Code: %d\n", WSAGetLastError());
+            return 0;
+        }
+
+        for (int i = 0; i < client_count; i++) {
+            bench_client_t *client = &bench[i];
+            if (client->socket == INVALID_SOCKET) {
+                continue;
+            }
+            if (FD_ISSET(client->socket, &writable) && !flush_output(client)) {
+                client->state = BENCH_FAILED;
+            }
+            if (FD_ISSET(client->socket, &readable) && !read_input(client)) {
+                printf("Connection for %s closed\n", client->username);
+                closesocket(client->socket);
+                client->socket = INVALID_SOCKET;
+                client->state = BENCH_FAILED;
+            }
+        }
+    }
+}
+
+// Start every operation that has come due
+void schedule_operations(unsigned long long now) {
+    for (int i = 0; i < client_count; i++) {
+        bench_client_t *client = &bench[i];
+        if (client->state != BENCH_READY || now < client->next_send_us) {
+            continue;
+        }
+
+        if (client->out_pending) {
+            skipped++;
+        } else {
+            start_operation(client, i, now);
+        }
+
+        // Fixed rate; a client that fell far behind doesn't try to catch up
+        client->next_send_us += (unsigned long long)(1e6 / rate_per_client);
+        if (client->next_send_us + 1000000ULL < now) {
+            client->next_send_us = now;
+        }
+    }
+}
+
+void replay_due(unsigned long long now, unsigned long long start_us) {
+    while (trace_next < trace_count && start_us + trace[trace_next].offset_us <= now) {
+        trace_record_t *entry = &trace[trace_next];
+        bench_client_t *client = &bench[entry->sender];
+        if (client->state == BENCH_FAILED) {
+            trace_next++; // Its connection is gone
+            continue;
+        }
+        if (client->state != BENCH_READY || client->out_pending) {
+            return; // Hold the trace until this client can send
+        }
+
+        int type = entry->type == MSG_PRIVATE ? MSG_PRIVATE : MSG_CHAT;
+        build_bench_message(client, entry->sender, type, entry->recipient, entry->length, now);
+        trace_next++;
+    }
+}
+
+void start_operation(bench_client_t *client, int index, unsigned long long now) {
+    int pick = rand() % (mix_chat + mix_dm + mix_history);
+
+    if (pick >= mix_chat + mix_dm && client->history_request_id == 0) {
+        // Recent history, timed until its end marker
+        Message *msg = &client->out;
+        memset(msg, 0, sizeof(Message));
+        msg->type = MSG_HISTORY;
+        msg->request_id = client->next_request_id++;
+
+        client->history_request_id = msg->request_id;
+        client->history_sent_us = now;
+        client->out_offset = 0;
+        client->out_pending = 1;
+        sent_history++;
+        return;
+    }
+
+    if (pick >= mix_chat && pick < mix_chat + mix_dm) {
+        int recipient = rand() % (client_count - 1);
+        if (recipient >= index) {
+            recipient++;
+        }
+        build_bench_message(client, index, MSG_PRIVATE, recipient, payload_size, now);
+    } else {
+        build_bench_message(client, index, MSG_CHAT, -1, payload_size, now);
+    }
+}
+
+// The text carries the send time, so each recipient can measure the delivery
+void build_bench_message(bench_client_t *client, int index, int type, int recipient, int length, unsigned long long now) {
+    Message *msg = &client->out;
+    memset(msg, 0, sizeof(Message));
+    msg->type = type;
+    if (type == MSG_PRIVATE) {
+        msg->recipient_id = bench[recipient].user_id;
+        sent_dm++;
+    } else {
+        sent_chat++;
+    }
+
+    if (length > FRAGMENT_TEXT) {
+        length = FRAGMENT_TEXT;
+    }
+    int used = snprintf(msg->content, MAX_MESSAGE, "#bench %d %u %llu ", index, ++client->sent_seq, now);
+    while (used < length + 1) {
+        msg->content[used++] = 'x';
+    }
+    msg->content[used] = '\0';
+
+    client->out_offset = 0;
+    client->out_pending = 1;
+}
+
+// Send what's left of the pending frame. Returns 0 on a send error
+int flush_output(bench_client_t *client) {
+    while (client->out_pending) {
+        int sent = send(client->socket, (const char*)&client->out + client->out_offset,
+                        (int)sizeof(Message) - client->out_offset, 0);
+        if (sent == SOCKET_ERROR) {
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+        client->out_offset += sent;
+        if (client->out_offset == (int)sizeof(Message)) {
+            client->out_pending = 0;
+        }
+    }
+    return 1;
+}
+
+// Read whatever has arrived and handle each complete frame
+// Returns 0 if the connection is gone
+int read_input(bench_client_t *client) {
+    while (1) {
+        int received = recv(client->socket, client->in_buffer + client->in_length,
+                            (int)sizeof(Message) - client->in_length, 0);
+        if (received == 0) {
+            return 0;
+        }
+        if (received == SOCKET_ERROR) {
+            return WSAGetLastError() == WSAEWOULDBLOCK;
+        }
+
+        client->in_length += received;
+        if (client->in_length == (int)sizeof(Message)) {
+            Message msg;
+            memcpy(&msg, client->in_buffer, sizeof(Message));
+            client->in_length = 0;
+            handle_frame(client, &msg);
+        }
+    }
+}
+
+void handle_frame(bench_client_t *client, Message *msg) {
+    unsigned long long now = now_us();
+
+    switch (msg->type) {
+        case MSG_SUCCESS:
+        case MSG_ERROR:
+            if (msg->request_id != 0 && msg->request_id == client->auth_request_id) {
+                client->auth_request_id = 0;
+                if (client->state == BENCH_REGISTERING) {
+                    start_auth(client, MSG_LOGIN); // Registered, or already was
+                    flush_output(client);
+                } else if (msg->type == MSG_SUCCESS) {
+                    client->user_id = msg->recipient_id;
+                    client->state = BENCH_READY;
+                } else {
+                    printf("Login failed for %s: %s\n", client->username, msg->content);
+                    client->state = BENCH_FAILED;
+                }
+            } else if (msg->request_id != 0 && msg->request_id == client->history_request_id) {
+                history_errors++;
+                client->history_request_id = 0;
+            }
+            break;
+
+        case MSG_CHAT:
+        case MSG_PRIVATE: {
+            char text[MAX_MESSAGE];
+            int sender;
+            unsigned int seq;
+            unsigned long long sent_us;
+
+            msg->content[MAX_MESSAGE - 1] = '\0';
+            strcpy(text, msg->content);
+            decrypt_message(text);
+            if (sscanf(text, "#bench %d %u %llu", &sender, &seq, &sent_us) == 3 && sent_us <= now) {
+                add_sample(msg->type == MSG_PRIVATE ? &dm_latency : &chat_latency, now - sent_us);
+                delivered++;
+            }
+            break;
+        }
+
+        case MSG_HISTORY:
+            if (msg->request_id != 0 && msg->request_id == client->history_request_id &&
+                strncmp(msg->content, "--- End of History", 18) == 0) {
+                add_sample(&history_latency, now - client->history_sent_us);
+                client->history_request_id = 0;
+            }
+            break;
+    }
+}
+
+void add_sample(samples_t *samples, unsigned long long value) {
+    if (samples->count == samples->capacity) {
+        size_t capacity = samples->capacity ? samples->capacity * 2 : 4096;
+        unsigned int *grown = realloc(samples->values, capacity * sizeof(unsigned int));
+        if (grown == NULL) {
+            return;
+        }
+        samples->values = grown;
+        samples->capacity = capacity;
+    }
+    samples->values[samples->count++] = value > 0xFFFFFFFFULL ? 0xFFFFFFFFu : (unsigned int)value;
+}
+
+int compare_samples(const void *a, const void *b) {
+    unsigned int x = *(const unsigned int*)a;
+    unsigned int y = *(const unsigned int*)b;
+    return x < y ? -1 : x > y;
+}
+
+void report_latency(const char *label, samples_t *samples) {
+    if (samples->count == 0) {
+        printf("%-20s no samples\n", label);
+        return;
+    }
+
+    qsort(samples->values, samples->count, sizeof(unsigned int), compare_samples);
+    size_t n = samples->count;
+    printf("%-20s n=%-8zu p50 %8.3f ms  p99 %8.3f ms  p999 %8.3f ms  max %8.3f ms\n", label, n,
+           samples->values[n * 50 / 100] / 1000.0, samples->values[n * 99 / 100] / 1000.0,
+           samples->values[n * 999 / 1000] / 1000.0, samples->values[n - 1] / 1000.0);
+}
+
+void report(double elapsed) {
+    unsigned long long sent = sent_chat + sent_dm + sent_history;
+
+    printf("\n===== chatbench: %d clients, %.1f s =====\n", client_count, elapsed);
+    printf("Sent:       %llu chat, %llu DM, %llu history (%.1f ops/s)\n",
+           sent_chat, sent_dm, sent_history, sent / elapsed);
+    printf("Delivered:  %llu messages (%.1f msg/s)\n", delivered, delivered / elapsed);
+    if (skipped > 0) {
+        printf("Skipped:    %llu operations (previous send still pending - server or network saturated)\n", skipped);
+    }
+    if (history_errors > 0) {
+        printf("History errors: %llu\n", history_errors);
+    }
+    report_latency("Chat delivery", &chat_latency);
+    report_latency("DM delivery", &dm_latency);
+    report_latency("History request", &history_latency);
+}
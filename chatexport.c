@@ -0,0 +1,837 @@
+#include "common.h"
+
+// Offline export of the chat log for analytics: the log is split on record
+// boundaries and parsed by one thread per CPU, and the records go out as
+// one file per column, with senders/recipients and message texts stored
+// once each in dictionaries. Aggregate queries then read only the columns
+// they need. Safe to run next to a live server: the log is only appended
+// to, so everything up to the last complete record at startup is final.
+
+#define MAX_THREADS 64                // WaitForMultipleObjects limit
+#define EXPORT_VERSION 2
+#define LINE_SIZE MAX_LOG_LINE
+#define MAX_HOURS (24 * 366 * 100)    // Span the hours query counts in one array
+#define DEFAULT_TOP 20
+
+#define TYPE_CHAT 1                   // type column values
+#define TYPE_PRIVATE 2
+
+// Strings interned to IDs 1, 2, ... in first-seen order (0 = none)
+typedef struct {
+    char *data;                       // The strings, back to back
+    size_t used;
+    size_t data_capacity;
+    size_t *offsets;                  // offsets[id] = start in data
+    unsigned int *lengths;
+    unsigned int count;
+    unsigned int id_capacity;
+    unsigned int *slots;              // Open addressing: IDs, 0 = empty
+    unsigned int slot_count;          // Power of two, at most half full
+} dict_t;
+
+// One thread's share of the log and the rows it parsed from it
+typedef struct {
+    const char *start;                // Whole records only
+    const char *end;
+    unsigned int rows;
+    unsigned int capacity;
+    unsigned long long *time_us;
+    unsigned int *sender;             // IDs in users (local until merged)
+    unsigned int *recipient;
+    unsigned char *type;
+    unsigned int *length;
+    unsigned int *content;            // IDs in contents
+    unsigned short *fragment;
+    unsigned short *fragments;
+    dict_t users;
+    dict_t contents;
+    unsigned int skipped;             // Lines that aren't records
+    int failed;                       // Out of memory
+} worker_t;
+
+// Column files, in manifest order
+typedef struct {
+    const char *name;
+    const char *kind;                 // u64, u32, u16 or u8
+    size_t width;
+} column_t;
+
+column_t columns[] = {
+    { "time_us", "u64", 8 },          // Epoch microseconds, 0 if unknown
+    { "sender", "u32", 4 },           // users.dict ID
+    { "recipient", "u32", 4 },        // users.dict ID, 0 for public messages
+    { "type", "u8", 1 },              // TYPE_CHAT or TYPE_PRIVATE
+    { "length", "u32", 4 },           // Bytes of text (one fragment's, for long messages)
+    { "content", "u32", 4 },          // contents.dict ID
+    { "fragment", "u16", 2 },         // k of a long message's k/n, 0 if not split
+    { "fragments", "u16", 2 },        // n, 0 if not split
+};
+#define COLUMN_COUNT (int)(sizeof(columns) / sizeof(columns[0]))
+
+// Configuration (from command line)
+char log_path[MAX_PATH] = CHATLOG_FILE;
+char export_dir[MAX_PATH] = "export";
+char query[16] = "";                  // Empty = export
+int thread_count = 0;                 // 0 = one per CPU
+int top = DEFAULT_TOP;
+
+worker_t workers[MAX_THREADS];
+LARGE_INTEGER counter_frequency;
+
+// Function prototypes
+void parse_arguments(int argc, char *argv[]);
+double now_s();
+int dict_init(dict_t *dict);
+void dict_free(dict_t *dict);
+unsigned int dict_hash(const char *text, unsigned int length);
+unsigned int dict_intern(dict_t *dict, const char *text, unsigned int length);
+int dict_write(const dict_t *dict, const char *path);
+int dict_read(dict_t *dict, const char *path);
+unsigned long long record_time(const Message *msg);
+int add_row(worker_t *worker, const log_record_t *record);
+DWORD WINAPI scan_range(LPVOID arg);
+int export_log();
+int write_export(int count, dict_t *users, dict_t *contents, unsigned long long bytes);
+void *map_column(const char *name, size_t width, unsigned int rows, HANDLE *file, HANDLE *mapping);
+void unmap_column(void *view, HANDLE file, HANDLE mapping);
+unsigned int read_manifest_rows();
+int query_users();
+long long local_seconds(long long seconds);
+int query_hours();
+
+int main(int argc, char *argv[]) {
+    parse_arguments(argc, argv);
+    QueryPerformanceFrequency(&counter_frequency);
+
+    if (strcmp(query, "users") == 0) {
+        return query_users();
+    }
+    if (strcmp(query, "hours") == 0) {
+        return query_hours();
+    }
+    return export_log();
+}
+
+void parse_arguments(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            strncpy(log_path, argv[++i], MAX_PATH - 1);
+        } else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) {
+            strncpy(export_dir, argv[++i], MAX_PATH - 1);
+        } else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+            if (thread_count < 1) {
+                thread_count = 1;
+            } else if (thread_count > MAX_THREADS) {
+                thread_count = MAX_THREADS;
+            }
+        } else if (strcmp(argv[i], "--query") == 0 && i + 1 < argc &&
+                   (strcmp(argv[i + 1], "users") == 0 || strcmp(argv[i + 1], "hours") == 0)) {
+            strncpy(query, argv[++i], sizeof(query) - 1);
+        } else if (strcmp(argv[i], "--top") == 0 && i + 1 < argc) {
+            top = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Usage: chatexport.exe [--log chatlog.txt] [--out dir] [--threads n]\n"
+                            "       chatexport.exe --query users|hours [--out dir] [--top n]\n");
+            exit(1);
+        }
+    }
+}
+
+double now_s() {
+    LARGE_INTEGER now;
+    QueryPerformanceCounter(&now);
+    return (double)now.QuadPart / (double)counter_frequency.QuadPart;
+}
+
+// Returns 0 if out of memory
+int dict_init(dict_t *dict) {
+    memset(dict, 0, sizeof(dict_t));
+    dict->data_capacity = 4096;
+    dict->id_capacity = 256;
+    dict->slot_count = 512;
+    dict->data = malloc(dict->data_capacity);
+    dict->offsets = malloc(dict->id_capacity * sizeof(size_t));
+    dict->lengths = malloc(dict->id_capacity * sizeof(unsigned int));
+    dict->slots = calloc(dict->slot_count, sizeof(unsigned int));
+    return dict->data != NULL && dict->offsets != NULL && dict->lengths != NULL && dict->slots != NULL;
+}
+
+void dict_free(dict_t *dict) {
+    free(dict->data);
+    free(dict->offsets);
+    free(dict->lengths);
+    free(dict->slots);
+    memset(dict, 0, sizeof(dict_t));
+}
+
+// FNV-1a
+unsigned int dict_hash(const char *text, unsigned int length) {
+    unsigned int hash = 2166136261u;
+    for (unsigned int i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// The string's ID, added if new. Returns 0 if out of memory
+unsigned int dict_intern(dict_t *dict, const char *text, unsigned int length) {
+    unsigned int mask = dict->slot_count - 1;
+    unsigned int slot = dict_hash(text, length) & mask;
+    while (dict->slots[slot] != 0) {
+        unsigned int id = dict->slots[slot];
+        if (dict->lengths[id] == length && memcmp(dict->data + dict->offsets[id], text, length) == 0) {
+            return id;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    // New string: make room for it (IDs start at 1)
+    if (dict->count + 2 > dict->id_capacity) {
+        unsigned int capacity = dict->id_capacity * 2;
+        size_t *offsets = realloc(dict->offsets, capacity * sizeof(size_t));
+        if (offsets == NULL) {
+            return 0;
+        }
+        dict->offsets = offsets;
+        unsigned int *lengths = realloc(dict->lengths, capacity * sizeof(unsigned int));
+        if (lengths == NULL) {
+            return 0;
+        }
+        dict->lengths = lengths;
+        dict->id_capacity = capacity;
+    }
+    if (dict->used + length > dict->data_capacity) {
+        size_t capacity = dict->data_capacity * 2;
+        while (dict->used + length > capacity) {
+            capacity *= 2;
+        }
+        char *data = realloc(dict->data, capacity);
+        if (data == NULL) {
+            return 0;
+        }
+        dict->data = data;
+        dict->data_capacity = capacity;
+    }
+
+    unsigned int id = ++dict->count;
+    memcpy(dict->data + dict->used, text, length);
+    dict->offsets[id] = dict->used;
+    dict->lengths[id] = length;
+    dict->used += length;
+    dict->slots[slot] = id;
+
+    // Keep the table at most half full
+    if (dict->count * 2 > dict->slot_count) {
+        unsigned int slot_count = dict->slot_count * 2;
+        unsigned int *slots = calloc(slot_count, sizeof(unsigned int));
+        if (slots == NULL) {
+            return 0;
+        }
+        for (unsigned int n = 1; n <= dict->count; n++) {
+            unsigned int s = dict_hash(dict->data + dict->offsets[n], dict->lengths[n]) & (slot_count - 1);
+            while (slots[s] != 0) {
+                s = (s + 1) & (slot_count - 1);
+            }
+            slots[s] = n;
+        }
+        free(dict->slots);
+        dict->slots = slots;
+        dict->slot_count = slot_count;
+    }
+    return id;
+}
+
+// Dictionary file: each string as a u32 length and its bytes, in ID order
+// Returns 0 on a write error
+int dict_write(const dict_t *dict, const char *path) {
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        return 0;
+    }
+    for (unsigned int id = 1; id <= dict->count; id++) {
+        fwrite(&dict->lengths[id], sizeof(unsigned int), 1, file);
+        fwrite(dict->data + dict->offsets[id], 1, dict->lengths[id], file);
+    }
+    int ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+// Returns 0 if the file can't be read or is cut short
+int dict_read(dict_t *dict, const char *path) {
+    memset(dict, 0, sizeof(dict_t));
+    FILE *file = fopen(path, "rb");
+    if (file == NULL || !dict_init(dict)) {
+        if (file != NULL) {
+            fclose(file);
+        }
+        return 0;
+    }
+    unsigned int length;
+    char text[LINE_SIZE];
+    int ok = 1;
+    while (ok && fread(&length, sizeof(length), 1, file) == 1) {
+        ok = length <= sizeof(text) && fread(text, 1, length, file) == length &&
+             dict_intern(dict, text, length) != 0;
+    }
+    fclose(file);
+    return ok;
+}
+
+// Epoch microseconds of a record; older records have only a formatted
+// local time. 0 if neither is usable.
+unsigned long long record_time(const Message *msg) {
+    if (msg->time_us != 0) {
+        return msg->time_us;
+    }
+    struct tm local_time;
+    memset(&local_time, 0, sizeof(local_time));
+    if (sscanf(msg->timestamp, "%d-%d-%d %d:%d:%d", &local_time.tm_year, &local_time.tm_mon,
+               &local_time.tm_mday, &local_time.tm_hour, &local_time.tm_min, &local_time.tm_sec) != 6) {
+        return 0;
+    }
+    local_time.tm_year -= 1900;
+    local_time.tm_mon -= 1;
+    local_time.tm_isdst = -1;
+    time_t seconds = mktime(&local_time);
+    return seconds == (time_t)-1 ? 0 : (unsigned long long)seconds * 1000000ULL;
+}
+
+// Returns 0 if out of memory
+int add_row(worker_t *worker, const log_record_t *record) {
+    const Message *msg = &record->msg;
+    if (worker->rows == worker->capacity) {
+        unsigned int capacity = worker->capacity == 0 ? 4096 : worker->capacity * 2;
+        void *grown[COLUMN_COUNT] = {
+            realloc(worker->time_us, capacity * sizeof(unsigned long long)),
+            realloc(worker->sender, capacity * sizeof(unsigned int)),
+            realloc(worker->recipient, capacity * sizeof(unsigned int)),
+            realloc(worker->type, capacity),
+            realloc(worker->length, capacity * sizeof(unsigned int)),
+            realloc(worker->content, capacity * sizeof(unsigned int)),
+            realloc(worker->fragment, capacity * sizeof(unsigned short)),
+            realloc(worker->fragments, capacity * sizeof(unsigned short)),
+        };
+        // Keep whatever did move, so nothing leaks on failure
+        worker->time_us = grown[0] != NULL ? grown[0] : worker->time_us;
+        worker->sender = grown[1] != NULL ? grown[1] : worker->sender;
+        worker->recipient = grown[2] != NULL ? grown[2] : worker->recipient;
+        worker->type = grown[3] != NULL ? grown[3] : worker->type;
+        worker->length = grown[4] != NULL ? grown[4] : worker->length;
+        worker->content = grown[5] != NULL ? grown[5] : worker->content;
+        worker->fragment = grown[6] != NULL ? grown[6] : worker->fragment;
+        worker->fragments = grown[7] != NULL ? grown[7] : worker->fragments;
+        for (int c = 0; c < COLUMN_COUNT; c++) {
+            if (grown[c] == NULL) {
+                return 0;
+            }
+        }
+        worker->capacity = capacity;
+    }
+
+    unsigned int n = worker->rows;
+    unsigned int length = (unsigned int)strlen(msg->content);
+    worker->time_us[n] = record_time(msg);
+    worker->sender[n] = dict_intern(&worker->users, record->sender, (unsigned int)strlen(record->sender));
+    worker->recipient[n] = 0;
+    if (msg->type == MSG_PRIVATE) {
+        worker->recipient[n] = dict_intern(&worker->users, record->recipient, (unsigned int)strlen(record->recipient));
+    }
+    worker->type[n] = msg->type == MSG_PRIVATE ? TYPE_PRIVATE : TYPE_CHAT;
+    worker->length[n] = length;
+    worker->content[n] = dict_intern(&worker->contents, msg->content, length);
+    worker->fragment[n] = msg->fragment;
+    worker->fragments[n] = msg->fragments;
+    if (worker->sender[n] == 0 || worker->content[n] == 0 ||
+        (msg->type == MSG_PRIVATE && worker->recipient[n] == 0)) {
+        return 0;
+    }
+    worker->rows++;
+    return 1;
+}
+
+// Worker thread: parse every record in [start, end)
+DWORD WINAPI scan_range(LPVOID arg) {
+    worker_t *worker = arg;
+    if (!dict_init(&worker->users) || !dict_init(&worker->contents)) {
+        worker->failed = 1;
+        return 0;
+    }
+
+    char line[LINE_SIZE];
+    log_record_t record;
+    const char *p = worker->start;
+    while (p < worker->end) {
+        const char *newline = memchr(p, '\n', worker->end - p);
+        const char *line_end = newline != NULL ? newline : worker->end;
+        size_t length = (size_t)(line_end - p);
+        if (length > 0 && p[length - 1] == '\r') {
+            length--;
+        }
+        copy_field(line, sizeof(line), p, p + length);
+        p = line_end + 1;
+
+        if (!parse_log_line(line, &record)) {
+            worker->skipped++;
+            continue;
+        }
+        if (!add_row(worker, &record)) {
+            worker->failed = 1;
+            return 0;
+        }
+    }
+    return 0;
+}
+
+// Export mode: map the log, scan it in parallel, merge and write the columns
+// Returns the process exit code
+int export_log() {
+    double started = now_s();
+
+    // The server keeps appending while we read
+    HANDLE file = CreateFile(log_path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                             OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        fprintf(stderr, "Cannot open %s. Error Code: %d\n", log_path, GetLastError());
+        return 1;
+    }
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        fprintf(stderr, "Cannot read the size of %s. Error Code: %d\n", log_path, GetLastError());
+        CloseHandle(file);
+        return 1;
+    }
+
+    HANDLE mapping = NULL;
+    const char *view = NULL;
+    if (size.QuadPart > 0) {
+        mapping = CreateFileMapping(file, NULL, PAGE_READONLY, size.HighPart, size.LowPart, NULL);
+        view = mapping != NULL ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, (size_t)size.QuadPart) : NULL;
+        if (view == NULL) {
+            fprintf(stderr, "Cannot map %s. Error Code: %d\n", log_path, GetLastError());
+            if (mapping != NULL) {
+                CloseHandle(mapping);
+            }
+            CloseHandle(file);
+            return 1;
+        }
+    }
+
+    // Stop after the last complete record: a line still being written is
+    // left for the next export
+    size_t bytes = (size_t)size.QuadPart;
+    while (bytes > 0 && view[bytes - 1] != '\n') {
+        bytes--;
+    }
+
+    // Equal byte ranges, each moved forward to the start of a record
+    if (thread_count == 0) {
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        thread_count = info.dwNumberOfProcessors < MAX_THREADS ? (int)info.dwNumberOfProcessors : MAX_THREADS;
+    }
+    int count = bytes / thread_count >= 4096 ? thread_count : 1;
+    const char *previous = view;
+    for (int t = 0; t < count; t++) {
+        const char *end = t == count - 1 ? view + bytes : view + bytes / count * (t + 1);
+        if (end < previous) {
+            end = previous;
+        }
+        const char *newline = end < view + bytes ? memchr(end, '\n', view + bytes - end) : NULL;
+        if (t < count - 1) {
+            end = newline != NULL ? newline + 1 : view + bytes;
+        }
+        memset(&workers[t], 0, sizeof(worker_t));
+        workers[t].start = previous;
+        workers[t].end = end;
+        previous = end;
+    }
+
+    HANDLE threads[MAX_THREADS];
+    int started_threads = 0;
+    for (int t = 0; t < count; t++) {
+        threads[t] = CreateThread(NULL, 0, scan_range, &workers[t], 0, NULL);
+        if (threads[t] == NULL) {
+            // Not fatal: this share is scanned here instead
+            scan_range(&workers[t]);
+            continue;
+        }
+        threads[started_threads++] = threads[t];
+    }
+    WaitForMultipleObjects(started_threads, threads, TRUE, INFINITE);
+    for (int t = 0; t < started_threads; t++) {
+        CloseHandle(threads[t]);
+    }
+    double scanned = now_s();
+
+    int failed = 0;
+    for (int t = 0; t < count; t++) {
+        failed |= workers[t].failed;
+    }
+
+    // Merge: one dictionary each for the export, and the workers' local
+    // IDs rewritten to point into them
+    dict_t users, contents;
+    int ok = !failed && dict_init(&users) && dict_init(&contents);
+    for (int t = 0; t < count && ok; t++) {
+        worker_t *worker = &workers[t];
+        unsigned int *user_ids = malloc((worker->users.count + 1) * sizeof(unsigned int));
+        unsigned int *content_ids = malloc((worker->contents.count + 1) * sizeof(unsigned int));
+        ok = user_ids != NULL && content_ids != NULL;
+        for (unsigned int id = 1; ok && id <= worker->users.count; id++) {
+            user_ids[id] = dict_intern(&users, worker->users.data + worker->users.offsets[id],
+                                       worker->users.lengths[id]);
+            ok = user_ids[id] != 0;
+        }
+        for (unsigned int id = 1; ok && id <= worker->contents.count; id++) {
+            content_ids[id] = dict_intern(&contents, worker->contents.data + worker->contents.offsets[id],
+                                          worker->contents.lengths[id]);
+            ok = content_ids[id] != 0;
+        }
+        if (ok) {
+            user_ids[0] = 0;
+            for (unsigned int n = 0; n < worker->rows; n++) {
+                worker->sender[n] = user_ids[worker->sender[n]];
+                worker->recipient[n] = user_ids[worker->recipient[n]];
+                worker->content[n] = content_ids[worker->content[n]];
+            }
+        }
+        free(user_ids);
+        free(content_ids);
+    }
+
+    if (!ok) {
+        fprintf(stderr, "Out of memory\n");
+    } else if (!write_export(count, &users, &contents, bytes)) {
+        fprintf(stderr, "Cannot write the export to %s. Error Code: %d\n", export_dir, GetLastError());
+        ok = 0;
+    }
+
+    if (ok) {
+        unsigned int rows = 0, skipped = 0;
+        for (int t = 0; t < count; t++) {
+            rows += workers[t].rows;
+            skipped += workers[t].skipped;
+        }
+        double finished = now_s();
+        printf("Exported %u records (%u users, %u distinct texts) from %.1f MB of %s to %s\n",
+               rows, users.count, contents.count, bytes / 1048576.0, log_path, export_dir);
+        printf("%d threads: scan %.3f s, merge and write %.3f s\n", count, scanned - started, finished - scanned);
+        if (skipped > 0) {
+            printf("%u lines were not records\n", skipped);
+        }
+    }
+
+    for (int t = 0; t < count; t++) {
+        free(workers[t].time_us);
+        free(workers[t].sender);
+        free(workers[t].recipient);
+        free(workers[t].type);
+        free(workers[t].length);
+        free(workers[t].content);
+        free(workers[t].fragment);
+        free(workers[t].fragments);
+        dict_free(&workers[t].users);
+        dict_free(&workers[t].contents);
+    }
+    dict_free(&users);
+    dict_free(&contents);
+    if (view != NULL) {
+        UnmapViewOfFile(view);
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    return ok ? 0 : 1;
+}
+
+// Column files (workers' rows in log order), dictionaries and the manifest
+// Returns 0 on a write error
+int write_export(int count, dict_t *users, dict_t *contents, unsigned long long bytes) {
+    CreateDirectory(export_dir, NULL);
+    char path[MAX_PATH + 32];
+    unsigned int rows = 0;
+    for (int t = 0; t < count; t++) {
+        rows += workers[t].rows;
+    }
+
+    for (int c = 0; c < COLUMN_COUNT; c++) {
+        snprintf(path, sizeof(path), "%s\\%s.col", export_dir, columns[c].name);
+        FILE *file = fopen(path, "wb");
+        if (file == NULL) {
+            return 0;
+        }
+        for (int t = 0; t < count; t++) {
+            worker_t *worker = &workers[t];
+            const void *data[COLUMN_COUNT] = {
+                worker->time_us, worker->sender, worker->recipient,
+                worker->type, worker->length, worker->content,
+                worker->fragment, worker->fragments
+            };
+            if (worker->rows > 0) {
+                fwrite(data[c], columns[c].width, worker->rows, file);
+            }
+        }
+        int ok = !ferror(file);
+        if (fclose(file) != 0 || !ok) {
+            return 0;
+        }
+    }
+
+    snprintf(path, sizeof(path), "%s\\users.dict", export_dir);
+    if (!dict_write(users, path)) {
+        return 0;
+    }
+    snprintf(path, sizeof(path), "%s\\contents.dict", export_dir);
+    if (!dict_write(contents, path)) {
+        return 0;
+    }
+
+    // Written last: an export without a manifest is incomplete
+    snprintf(path, sizeof(path), "%s\\manifest.txt", export_dir);
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return 0;
+    }
+    fprintf(file, "chatexport %d\n", EXPORT_VERSION);
+    fprintf(file, "source %s\n", log_path);
+    fprintf(file, "bytes %llu\n", bytes);
+    fprintf(file, "rows %u\n", rows);
+    fprintf(file, "dict users users.dict %u\n", users->count);
+    fprintf(file, "dict contents contents.dict %u\n", contents->count);
+    for (int c = 0; c < COLUMN_COUNT; c++) {
+        fprintf(file, "column %s %s %s.col\n", columns[c].name, columns[c].kind, columns[c].name);
+    }
+    int ok = !ferror(file);
+    return fclose(file) == 0 && ok;
+}
+
+// Map one column file of the export read-only
+// Returns NULL if it is missing or shorter than rows values
+void *map_column(const char *name, size_t width, unsigned int rows, HANDLE *file, HANDLE *mapping) {
+    char path[MAX_PATH + 32];
+    snprintf(path, sizeof(path), "%s\\%s.col", export_dir, name);
+    *file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    *mapping = NULL;
+    LARGE_INTEGER size;
+    if (*file == INVALID_HANDLE_VALUE) {
+        return NULL;
+    }
+    if (rows == 0 || !GetFileSizeEx(*file, &size) || (unsigned long long)size.QuadPart < (unsigned long long)rows * width) {
+        CloseHandle(*file);
+        *file = INVALID_HANDLE_VALUE;
+        return NULL;
+    }
+    *mapping = CreateFileMapping(*file, NULL, PAGE_READONLY, 0, 0, NULL);
+    void *view = *mapping != NULL ? MapViewOfFile(*mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+    if (view == NULL) {
+        if (*mapping != NULL) {
+            CloseHandle(*mapping);
+        }
+        CloseHandle(*file);
+        *file = INVALID_HANDLE_VALUE;
+        *mapping = NULL;
+    }
+    return view;
+}
+
+void unmap_column(void *view, HANDLE file, HANDLE mapping) {
+    if (view != NULL) {
+        UnmapViewOfFile(view);
+        CloseHandle(mapping);
+        CloseHandle(file);
+    }
+}
+
+// Row count from the export's manifest, 0 if there is none
+unsigned int read_manifest_rows() {
+    char path[MAX_PATH + 32];
+    snprintf(path, sizeof(path), "%s\\manifest.txt", export_dir);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        fprintf(stderr, "No export in %s (run chatexport without --query first)\n", export_dir);
+        return 0;
+    }
+    char line[MAX_PATH + 64];
+    int version = 0;
+    unsigned int rows = 0;
+    while (fgets(line, sizeof(line), file)) {
+        sscanf(line, "chatexport %d", &version);
+        sscanf(line, "rows %u", &rows);
+    }
+    fclose(file);
+    if (version != EXPORT_VERSION) {
+        fprintf(stderr, "%s was written by a different chatexport version\n", path);
+        return 0;
+    }
+    if (rows == 0) {
+        fprintf(stderr, "The export in %s is empty\n", export_dir);
+    }
+    return rows;
+}
+
+// Messages, private messages and bytes sent per user, busiest first
+int query_users() {
+    double started = now_s();
+    unsigned int rows = read_manifest_rows();
+    if (rows == 0) {
+        return 1;
+    }
+    dict_t users;
+    char path[MAX_PATH + 32];
+    snprintf(path, sizeof(path), "%s\\users.dict", export_dir);
+    if (!dict_read(&users, path)) {
+        fprintf(stderr, "Cannot read %s\n", path);
+        dict_free(&users);
+        return 1;
+    }
+
+    HANDLE files[4], mappings[4];
+    const unsigned int *sender = map_column("sender", 4, rows, &files[0], &mappings[0]);
+    const unsigned char *type = map_column("type", 1, rows, &files[1], &mappings[1]);
+    const unsigned int *length = map_column("length", 4, rows, &files[2], &mappings[2]);
+    const unsigned short *fragment = map_column("fragment", 2, rows, &files[3], &mappings[3]);
+    unsigned long long *totals = calloc((size_t)(users.count + 1) * 3, sizeof(unsigned long long));
+    unsigned int *order = malloc((users.count + 1) * sizeof(unsigned int));
+    int ok = sender != NULL && type != NULL && length != NULL && fragment != NULL && totals != NULL && order != NULL;
+    if (!ok) {
+        fprintf(stderr, "Cannot read the columns in %s\n", export_dir);
+    }
+
+    for (unsigned int n = 0; ok && n < rows; n++) {
+        unsigned int id = sender[n] <= users.count ? sender[n] : 0;
+        // A long message is one record per fragment; count it once, at its first
+        int first = fragment[n] <= 1;
+        totals[id * 3] += first;
+        totals[id * 3 + 1] += first && type[n] == TYPE_PRIVATE;
+        totals[id * 3 + 2] += length[n];
+    }
+
+    if (ok) {
+        // Insertion sort by message count; there are few users
+        unsigned int ranked = 0;
+        for (unsigned int id = 1; id <= users.count; id++) {
+            if (totals[id * 3] == 0) {
+                continue;
+            }
+            unsigned int j = ranked++;
+            while (j > 0 && totals[order[j - 1] * 3] < totals[id * 3]) {
+                order[j] = order[j - 1];
+                j--;
+            }
+            order[j] = id;
+        }
+
+        printf("%-*s %10s %10s %12s\n", MAX_USERNAME / 2, "user", "messages", "private", "bytes");
+        for (unsigned int r = 0; r < ranked && (top <= 0 || r < (unsigned int)top); r++) {
+            unsigned int id = order[r];
+            printf("%-*.*s %10llu %10llu %12llu\n", MAX_USERNAME / 2, (int)users.lengths[id],
+                   users.data + users.offsets[id], totals[id * 3], totals[id * 3 + 1], totals[id * 3 + 2]);
+        }
+        printf("%u records, %u senders, %.3f s\n", rows, ranked, now_s() - started);
+    }
+
+    free(totals);
+    free(order);
+    unmap_column((void *)sender, files[0], mappings[0]);
+    unmap_column((void *)type, files[1], mappings[1]);
+    unmap_column((void *)length, files[2], mappings[2]);
+    unmap_column((void *)fragment, files[3], mappings[3]);
+    dict_free(&users);
+    return ok ? 0 : 1;
+}
+
+// Seconds since the epoch shifted by the local UTC offset in effect then, so
+// dividing by 3600 gives local hours. The offset only changes on the hour or
+// half hour, so it is looked up once per quarter hour rather than per record.
+long long local_seconds(long long seconds) {
+    static long long cached_slot = -1, cached_offset = 0;
+    long long slot = seconds / 900;
+    if (slot != cached_slot) {
+        time_t utc = (time_t)(slot * 900);
+        struct tm local_time;
+        cached_offset = 0;
+        if (localtime_s(&local_time, &utc) == 0) {
+            time_t shifted = _mkgmtime(&local_time);
+            cached_offset = shifted != (time_t)-1 ? (long long)(shifted - utc) : 0;
+        }
+        cached_slot = slot;
+    }
+    return seconds + cached_offset;
+}
+
+// Messages and bytes per hour (local time), oldest first
+int query_hours() {
+    double started = now_s();
+    unsigned int rows = read_manifest_rows();
+    if (rows == 0) {
+        return 1;
+    }
+    HANDLE files[3], mappings[3];
+    const unsigned long long *time_us = map_column("time_us", 8, rows, &files[0], &mappings[0]);
+    const unsigned int *length = map_column("length", 4, rows, &files[1], &mappings[1]);
+    const unsigned short *fragment = map_column("fragment", 2, rows, &files[2], &mappings[2]);
+    if (time_us == NULL || length == NULL || fragment == NULL) {
+        fprintf(stderr, "Cannot read the columns in %s\n", export_dir);
+        unmap_column((void *)time_us, files[0], mappings[0]);
+        unmap_column((void *)length, files[1], mappings[1]);
+        unmap_column((void *)fragment, files[2], mappings[2]);
+        return 1;
+    }
+
+    unsigned long long first = ~0ULL, last = 0;
+    unsigned int unknown = 0;
+    for (unsigned int n = 0; n < rows; n++) {
+        if (time_us[n] == 0) {
+            unknown++;
+            continue;
+        }
+        unsigned long long hour = (unsigned long long)local_seconds((long long)(time_us[n] / 1000000ULL)) / 3600;
+        first = hour < first ? hour : first;
+        last = hour > last ? hour : last;
+    }
+
+    int ok = 1;
+    if (unknown < rows) {
+        unsigned long long span = last - first + 1;
+        unsigned long long *totals = span <= MAX_HOURS ? calloc((size_t)span * 2, sizeof(unsigned long long)) : NULL;
+        if (totals == NULL) {
+            fprintf(stderr, "The records span too many hours to count\n");
+            ok = 0;
+        } else {
+            for (unsigned int n = 0; n < rows; n++) {
+                if (time_us[n] != 0) {
+                    unsigned long long hour = (unsigned long long)local_seconds((long long)(time_us[n] / 1000000ULL)) / 3600 - first;
+                    totals[hour * 2] += fragment[n] <= 1;
+                    totals[hour * 2 + 1] += length[n];
+                }
+            }
+            printf("%-16s %10s %12s\n", "hour", "messages", "bytes");
+            for (unsigned long long hour = 0; hour < span; hour++) {
+                if (totals[hour * 2] == 0 && totals[hour * 2 + 1] == 0) {
+                    continue;
+                }
+                // The bucket is already in local time, so format it as UTC
+                char timestamp[26] = "?";
+                time_t bucket = (time_t)((first + hour) * 3600);
+                struct tm bucket_time;
+                if (gmtime_s(&bucket_time, &bucket) == 0) {
+                    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H", &bucket_time);
+                }
+                printf("%s:00 %10llu %12llu\n", timestamp, totals[hour * 2], totals[hour * 2 + 1]);
+            }
+            free(totals);
+        }
+    }
+    if (ok) {
+        if (unknown > 0) {
+            printf("%u records (%u without a usable time), %.3f s\n", rows, unknown, now_s() - started);
+        } else {
+            printf("%u records, %.3f s\n", rows, now_s() - started);
+        }
+    }
+
+    unmap_column((void *)time_us, files[0], mappings[0]);
+    unmap_column((void *)length, files[1], mappings[1]);
+    unmap_column((void *)fragment, files[2], mappings[2]);
+    return ok ? 0 : 1;
+}
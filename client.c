@@ -1,4 +1,6 @@
 #include "common.h"
+#include "sha256.h"
+#include "multicast.h"
 
 // Global variables
 SOCKET server_socket;
@@ -6,7 +8,143 @@ char username[MAX_USERNAME];
 int logged_in = 0;
 HANDLE recv_thread;
 int running = 1;
+int in_chat_mode = 0;              // Main thread is at the chat mode prompt
+int event_loop_mode = 0;           // --event-loop: single-threaded client
 char server_ip[16] = "127.0.0.1"; // Default server IP
+int server_port = SERVER_PORT;     // Leader port, or a follower's port for history/search
+struct sockaddr_in server_addr;
+
+// Session state for fast reconnects
+#define RECONNECT_ATTEMPTS 5
+char session_token[SESSION_TOKEN_LEN] = "";
+unsigned int last_seq = 0;         // Highest chat log seq received
+unsigned int resume_through = 0;   // Records up to here were replayed by the last resume
+
+// Sent chat/private messages awaiting the server's cumulative ack, oldest
+// first; resent after a resume so nothing is lost and nothing duplicated
+Message unacked[MAX_UNACKED];
+int unacked_count = 0;
+unsigned int next_msg_id = 1;
+HANDLE unacked_mutex;
+
+// Requests awaiting a response, matched on the echoed request_id so
+// several (login, history, searches, private messages) can be in flight.
+// Slot = id % MAX_PENDING_REQUESTS; a request that never got an answer is
+// simply overwritten once the IDs wrap around to its slot
+#define MAX_PENDING_REQUESTS 64
+typedef struct {
+    unsigned int id;               // 0 = free
+    int type;                      // Message type of the request
+} pending_request_t;
+
+pending_request_t pending_requests[MAX_PENDING_REQUESTS];
+unsigned int next_request_id = 1;
+HANDLE requests_mutex;
+
+// Local history cache, one "<seq> <log line>" per record. Records are
+// appended only in order from seq 1, so the last one is the high-water
+// mark to sync from. A gap (our own messages, others' private messages)
+// marks the cache behind; the next view fetches everything after it
+FILE *cache_file = NULL;
+long *cache_offsets = NULL;        // cache_offsets[seq - 1] = file offset of record seq
+unsigned int cache_capacity = 0;
+unsigned int cache_seq = 0;        // High-water mark
+unsigned int sync_request_id = 0;  // Outstanding sync, 0 if none
+int cache_behind = 0;              // Live records were skipped since the last sync
+HANDLE sync_done;                  // Set when no sync is outstanding
+int show_after_sync = 0;           // Event loop: show the cache once the sync ends
+char show_query[MAX_MESSAGE];
+unsigned int show_last = 0;
+HANDLE cache_mutex;
+char history_line[MAX_LOG_LINE];   // A history record too long for one frame, joined
+int history_length = 0;
+
+// File transfers, one upload and one download at a time. Both survive a
+// reconnect: the resumed session re-offers the upload and re-requests the
+// download from the last whole chunk
+#define UPLOAD_BURST 8             // Event loop: chunks sent per pass, between input and network
+FILE *upload_file = NULL;
+char upload_name[MAX_PATH];
+unsigned int upload_recipient_id = 0; // 0 = shared with everyone
+char upload_hash[SHA256_HEX_LEN];
+unsigned long long upload_size = 0;
+unsigned int upload_chunks = 0;
+unsigned int upload_next = 0;      // Next chunk to send
+int upload_sending = 0;            // The server said where to start
+int upload_blocked = 0;            // Event loop: socket buffer full, wait for FD_WRITE
+unsigned int upload_request_id = 0;
+HANDLE upload_ready;               // Set when the offer is answered or the upload ends
+HANDLE upload_mutex;               // Menu mode: main thread sends, receiver thread answers
+
+FILE *download_file = NULL;        // <name>.part until the hash checks out
+char download_name[MAX_PATH];
+char download_hash[SHA256_HEX_LEN];
+unsigned long long download_size = 0;
+unsigned long long download_received = 0;
+unsigned int download_request_id = 0;
+unsigned int raw_remaining = 0;    // Raw file bytes still to read after a MSG_FILE_DATA header
+
+// Frames carry user IDs only; the server sends the names (MSG_USERS)
+// after login and resume, and again for each new registration
+char (*user_names)[MAX_USERNAME] = NULL; // user_names[id - 1], "" = not heard of
+unsigned int user_name_count = 0;
+unsigned int users_requested = 0;  // Highest unknown ID we asked the server about
+#define MAX_USER_ID 0x1000000      // Anything above is a garbled frame, not a user
+HANDLE users_mutex;
+
+// Long messages arrive as fragments, possibly interleaved with other
+// senders' messages; each sender's text is collected here as it comes in
+#define MAX_REASSEMBLY 8
+typedef struct {
+    int in_use;
+    unsigned int sender_id;
+    int type;
+    unsigned short next;           // Fragment expected next
+    char *text;
+    size_t length;
+} reassembly_t;
+
+reassembly_t reassembly[MAX_REASSEMBLY];
+
+// Multicast fan-out (--multicast): public messages come as datagrams on
+// the server's group, each with a seq. They are delivered in seq order
+// through a small window, and gaps (including a lost tail the heartbeat
+// gives away) are resent over the TCP session (MSG_MULTICAST "repair")
+#define MCAST_WINDOW 256           // Seqs held ahead of a gap
+#define MCAST_SILENCE_MS 5000      // Nothing from the group this long: back to TCP
+int multicast_wanted = 0;
+char multicast_if[16] = "";        // Local interface to join on (empty = any)
+SOCKET mcast_socket = INVALID_SOCKET;
+WSAEVENT mcast_event = WSA_INVALID_EVENT; // Event loop: datagrams waiting
+unsigned int own_user_id = 0;      // Our own messages reach the group too
+unsigned int mcast_request_id = 0; // Outstanding "on" or "off", 0 if none
+unsigned int mcast_epoch = 0;
+unsigned char mcast_key[MCAST_KEY_LEN]; // From the "on" reply; opens the epoch's datagrams
+unsigned int mcast_next = 0;       // Next seq to deliver, 0 = not subscribed
+unsigned int mcast_highest = 0;    // Highest seq known to have been sent
+Message mcast_window[MCAST_WINDOW];
+unsigned int mcast_window_seq[MCAST_WINDOW]; // Seq held in each slot, 0 = empty
+unsigned int mcast_repair_id = 0;  // Outstanding repair, 0 if none
+unsigned int mcast_repair_to = 0;
+DWORD mcast_heard = 0;             // GetTickCount of the last datagram
+
+// Event-loop mode: partial frame read so far, and the line being typed
+char frame_buffer[sizeof(Message)];
+int frame_length = 0;
+char input_line[MAX_LONG_MESSAGE + 1];
+int input_length = 0;
+
+// Event-loop mode: piped or redirected input comes from a reader thread,
+// one buffer at a time
+HANDLE piped_ready = NULL;         // Set when piped_buffer holds piped_length new bytes
+HANDLE piped_taken = NULL;         // Set once the loop has used them
+char piped_buffer[512];
+DWORD piped_length = 0;            // 0 = input ended
+
+// Event-loop mode: the connection dropped and the next resume attempt is
+// due at reconnect_due (GetTickCount)
+int reconnect_attempt = 0;         // 0 = connected
+DWORD reconnect_due = 0;
 
 // Function prototypes
 DWORD WINAPI receive_messages(LPVOID arg);
@@ -16,18 +154,95 @@ void login_user();
 void send_chat_message();
 void send_private_message();
 void request_chat_history();
+void search_chat_history();
+void read_history_stream(unsigned int request_id);
 void logout_user();
 void cleanup();
 void enter_chat_mode();
+int reconnect_session();
+int try_reconnect(int attempt);
+int send_tracked_message(Message *msg);
+void handle_ack(unsigned int acked_id);
+void retransmit_unacked();
+void begin_session(const Message *msg);
+int handle_incoming_message(Message *msg);
+int send_frame(const Message *msg);
+int try_send_frame(const Message *msg);
+int send_all(const char *data, int remaining);
+void build_chat_message(Message *msg, int type, unsigned int recipient_id, const char *text);
+int send_chat_text(int type, const char *recipient, const char *text);
+char *reassemble_fragment(const Message *msg, const char *text);
+void learn_users(const char *lines);
+void user_name(unsigned int id, char *name);
+unsigned int find_user_id(const char *name);
+void run_event_loop();
+int drain_socket(WSAEVENT net_event);
+int continue_reconnect(WSAEVENT net_event);
+void read_console_keys(HANDLE console_in);
+DWORD WINAPI read_piped_input(LPVOID arg);
+int take_piped_input();
+void input_char(char c);
+void clear_input_line();
+void redraw_input_line();
+void handle_command(char *line);
+unsigned int track_request(Message *msg);
+int finish_request(unsigned int request_id, int keep);
+int wait_for_response(unsigned int request_id, Message *response, int timeout_ms);
+void open_history_cache();
+void reset_history_cache();
+int cache_record(unsigned int seq, const char *line);
+void sync_history_cache();
+void handle_sync_frame(const Message *msg, const char *line);
+const char *join_history_part(const Message *msg);
+void show_cached_history(const char *query, unsigned int last);
+void view_history(const char *query);
+void finish_sync();
+void upload_file_menu();
+void download_file_menu();
+int begin_upload(const char *path, const char *recipient);
+void send_upload_offer();
+int pump_upload(int max_chunks);
+void handle_upload_response(const Message *msg);
+void end_upload();
+int begin_download(const char *hash, const char *name);
+void send_download_request();
+void handle_download_frame(const Message *msg);
+void read_download_data();
+void write_download_data(const char *data, int length);
+void finish_download();
+unsigned int send_multicast_request(const char *content);
+void multicast_subscribe();
+void multicast_close();
+int open_multicast(const char *group, int port);
+int handle_multicast_reply(const Message *msg);
+int multicast_read();
+int multicast_accept(unsigned int seq, const Message *msg);
+int multicast_deliver(unsigned int through);
+void multicast_request_repair();
+int multicast_repair_done();
+int multicast_poll();
 
 int main(int argc, char *argv[]) {
-    struct sockaddr_in server_addr;
     WSADATA wsa_data;
     
-    // Check if server IP is provided as a command line argument
-    if (argc > 1) {
-        strncpy(server_ip, argv[1], sizeof(server_ip) - 1);
-        server_ip[sizeof(server_ip) - 1] = '\0'; // Ensure null termination
+    // Usage: client.exe [server_ip] [port] [--event-loop] [--multicast] [--multicast-if ip]
+    int positional = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--event-loop") == 0) {
+            event_loop_mode = 1;
+        } else if (strcmp(argv[i], "--multicast") == 0) {
+            multicast_wanted = 1;
+        } else if (strcmp(argv[i], "--multicast-if") == 0 && i + 1 < argc) {
+            strncpy(multicast_if, argv[++i], sizeof(multicast_if) - 1);
+        } else if (positional == 0) {
+            // Server IP provided as a command line argument
+            strncpy(server_ip, argv[i], sizeof(server_ip) - 1);
+            server_ip[sizeof(server_ip) - 1] = '\0'; // Ensure null termination
+            positional++;
+        } else if (positional == 1 && atoi(argv[i]) > 0) {
+            server_port = atoi(argv[i]);
+            positional++;
+        }
     }
     
     printf("Using server IP: %s\n", server_ip); 
@@ -38,6 +253,24 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
+    unacked_mutex = CreateMutex(NULL, FALSE, NULL);
+    requests_mutex = CreateMutex(NULL, FALSE, NULL);
+    cache_mutex = CreateMutex(NULL, FALSE, NULL);
+    users_mutex = CreateMutex(NULL, FALSE, NULL);
+    sync_done = CreateEvent(NULL, TRUE, TRUE, NULL);
+    upload_ready = CreateEvent(NULL, TRUE, FALSE, NULL);
+    upload_mutex = CreateMutex(NULL, FALSE, NULL);
+    if (multicast_wanted && event_loop_mode) {
+        mcast_event = WSACreateEvent();
+    }
+    if (unacked_mutex == NULL || requests_mutex == NULL || cache_mutex == NULL || users_mutex == NULL ||
+        sync_done == NULL || upload_ready == NULL || upload_mutex == NULL ||
+        (multicast_wanted && event_loop_mode && mcast_event == WSA_INVALID_EVENT)) {
+        printf("CreateMutex error: %d\n", GetLastError());
+        WSACleanup();
+        return 1;
+    }
+    
     // Create socket
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket == INVALID_SOCKET) {
@@ -49,7 +282,7 @@ int main(int argc, char *argv[]) {
     // Prepare server address
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(SERVER_PORT);
+    server_addr.sin_port = htons(server_port);
     
     // Convert IP address from text to binary - using inet_addr instead of inet_pton for better compatibility
     server_addr.sin_addr.s_addr = inet_addr(server_ip);
@@ -60,7 +293,7 @@ int main(int argc, char *argv[]) {
         return 1;
     }
     
-    printf("Attempting to connect to server at %s:%d...\n", server_ip, SERVER_PORT);
+    printf("Attempting to connect to server at %s:%d...\n", server_ip, server_port);
     
     // Connection attempt with retry logic
     int max_retries = 3;
@@ -74,7 +307,7 @@ int main(int argc, char *argv[]) {
                 printf("Connection attempt %d failed: Connection refused (Error 10061)\n", retry_count + 1);
                 printf("Possible causes:\n");
                 printf("1. The server is not running\n");
-                printf("2. The server is not listening on port %d\n", SERVER_PORT);
+                printf("2. The server is not listening on port %d\n", server_port);
                 printf("3. A firewall is blocking the connection\n");
                 
                 if (retry_count < max_retries - 1) {
@@ -97,13 +330,20 @@ int main(int argc, char *argv[]) {
         printf("Failed to connect after %d attempts. Please:\n", max_retries);
         printf("1. Ensure the server is running (run server.exe first)\n");
         printf("2. Check if a firewall is blocking the connection\n");
-        printf("3. Verify the server is configured to use port %d\n", SERVER_PORT);
+        printf("3. Verify the server is configured to use port %d\n", server_port);
         closesocket(server_socket);
         WSACleanup();
         return 1;
     }
     
     printf("Connected to chat server.\n");
+    open_history_cache();
+    
+    if (event_loop_mode) {
+        run_event_loop();
+        cleanup();
+        return 0;
+    }
     
     // Main menu loop
     while (running) {
@@ -136,11 +376,8 @@ int main(int argc, char *argv[]) {
                 }
                 break;
             case 5:
-                if (logged_in) {
-                    request_chat_history();
-                } else {
-                    printf("You must be logged in to view chat history.\n");
-                }
+                // Followers serve history too, after a login there
+                request_chat_history();
                 break;
             case 6:
                 if (logged_in) {
@@ -159,6 +396,19 @@ int main(int argc, char *argv[]) {
                     printf("You must be logged in to enter chat mode.\n");
                 }
                 break;
+            case 9:
+                search_chat_history();
+                break;
+            case 10:
+            case 11:
+                if (!logged_in) {
+                    printf("You must be logged in to transfer files.\n");
+                } else if (choice == 10) {
+                    upload_file_menu();
+                } else {
+                    download_file_menu();
+                }
+                break;
             default:
                 printf("Invalid choice. Please try again.\n");
         }
@@ -185,6 +435,11 @@ void display_menu() {
     if (logged_in) {
         printf("8. Enter chat mode (continuous messaging)\n");
     }
+    printf("9. Search chat history\n");
+    if (logged_in) {
+        printf("10. Upload a file\n");
+        printf("11. Download a file\n");
+    }
 }
 
 void register_user() {
@@ -201,9 +456,10 @@ void register_user() {
     
     // Prepare registration message
     Message msg;
+    memset(&msg, 0, sizeof(Message));
     msg.type = MSG_REGISTER;
-    strcpy(msg.sender, username);
-    strcpy(msg.content, password);
+    snprintf(msg.content, MAX_MESSAGE, "%s:%s", username, password);
+    unsigned int request_id = track_request(&msg);
     
     // Send registration request
     if (send(server_socket, (const char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
@@ -211,9 +467,9 @@ void register_user() {
         return;
     }
     
-    // Receive response
-    if (recv(server_socket, (char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
-        printf("Recv failed. Error Code: %d\n", WSAGetLastError());
+    // Receive response (hashing the password can take a moment)
+    if (!wait_for_response(request_id, &msg, 15000)) {
+        printf("No response from server.\n");
         return;
     }
     
@@ -240,8 +496,8 @@ void login_user() {
     Message msg;
     memset(&msg, 0, sizeof(Message)); // Clear the message structure
     msg.type = MSG_LOGIN;
-    strcpy(msg.sender, username);
-    strcpy(msg.content, password);
+    snprintf(msg.content, MAX_MESSAGE, "%s:%s", username, password);
+    unsigned int request_id = track_request(&msg);
     
     printf("Sending login request...\n");
     
@@ -251,68 +507,20 @@ void login_user() {
         return;
     }
     
-    // Receive response with better handling of message types
+    // Wait for the response carrying our request ID; anything else that
+    // arrives meanwhile (e.g. broadcasts) is shown as usual
     printf("Waiting for server response...\n");
     
-    // If the server sends a chat message announcing the join,
-    // it means the login was successful even if we didn't receive
-    // the explicit success message
     int login_success = 0;
-    int max_attempts = 3;
-    int attempts = 0;
-    
-    while (!login_success && attempts < max_attempts) {
-        fd_set readSet;
-        struct timeval timeout;
-        timeout.tv_sec = 3;  // 3 second timeout
-        timeout.tv_usec = 0;
-        
-        FD_ZERO(&readSet);
-        FD_SET(server_socket, &readSet);
-        
-        if (select(0, &readSet, NULL, NULL, &timeout) <= 0) {
-            printf("No response from server. Attempt %d of %d.\n", attempts + 1, max_attempts);
-            attempts++;
-            continue;
-        }
-        
-        if (recv(server_socket, (char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
-            printf("Recv failed. Error Code: %d\n", WSAGetLastError());
-            return;
-        }
-        
-        // Process the received message
-        switch (msg.type) {
-            case MSG_SUCCESS:
-                printf("Login successful! Welcome to the chat.\n");
-                login_success = 1;
-                break;
-                
-            case MSG_ERROR:
-                printf("Login failed: %s\n", msg.content);
-                return;
-                
-            case MSG_CHAT:
-                // Check if this is a join announcement from the server
-                if (strcmp(msg.sender, "SERVER") == 0 && 
-                    strstr(msg.content, username) != NULL && 
-                    strstr(msg.content, "joined the chat") != NULL) {
-                    printf("Login successful! Welcome to the chat.\n");
-                    login_success = 1;
-                } else {
-                    // Store this message for later display
-                    printf("Received chat message during login: [%s] %s: %s\n", 
-                           msg.timestamp, msg.sender, msg.content);
-                }
-                break;
-                
-            default:
-                printf("Received unexpected message type: %d\n", msg.type);
-                // Continue trying - don't return
-                break;
-        }
-        
-        attempts++;
+    if (!wait_for_response(request_id, &msg, 15000)) {
+        printf("No response from server.\n");
+    } else if (msg.type == MSG_SUCCESS) {
+        printf("Login successful! Welcome to the chat.\n");
+        login_success = 1;
+        begin_session(&msg);
+    } else {
+        printf("Login failed: %s\n", msg.content);
+        return;
     }
     
     if (login_success) {
@@ -337,7 +545,7 @@ void login_user() {
 }
 
 void send_chat_message() {
-    char message[MAX_MESSAGE];
+    char message[MAX_LONG_MESSAGE + 2];
     
     printf("\n===== Send Public Message =====\n");
     printf("Enter message (press Enter to send):\n");
@@ -350,32 +558,21 @@ void send_chat_message() {
         return;
     }
     
-    // Prepare message
-    Message msg;
-    memset(&msg, 0, sizeof(Message)); // Clear the message structure
-    msg.type = MSG_CHAT;
-    strcpy(msg.sender, username);
-    
-    // Fix: Add a special marker character at the beginning that won't be affected by encryption
-    char marker_message[MAX_MESSAGE];
-    sprintf(marker_message, "#%s", message); // Add # as a marker
-    strcpy(msg.content, marker_message);
-    
     printf("Sending message...\n");
     
     // Send message
-    if (send(server_socket, (const char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
-        printf("Send failed. Error Code: %d\n", WSAGetLastError());
-        printf("You may have been disconnected. Please try logging in again.\n");
-        logged_in = 0;
-    } else {
+    int result = send_chat_text(MSG_CHAT, NULL, message);
+    if (result > 0) {
         printf("Message sent successfully.\n");
+    } else if (result == 0) {
+        printf("Send failed. Error Code: %d\n", WSAGetLastError());
+        printf("The message will be resent once the connection is restored.\n");
     }
 }
 
 void send_private_message() {
     char recipient[MAX_USERNAME];
-    char message[MAX_MESSAGE];
+    char message[MAX_LONG_MESSAGE + 2];
     
     printf("\n===== Send Private Message =====\n");
     printf("Enter recipient username: ");
@@ -392,42 +589,73 @@ void send_private_message() {
         return;
     }
     
-    // Prepare message
-    Message msg;
-    msg.type = MSG_PRIVATE;
-    strcpy(msg.sender, username);
-    strcpy(msg.recipient, recipient);
-    
-    // Fix: Add a special marker character at the beginning
-    char marker_message[MAX_MESSAGE];
-    sprintf(marker_message, "#%s", message); // Add # as a marker
-    strcpy(msg.content, marker_message);
-    
     // Send message
-    if (send(server_socket, (const char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
+    if (send_chat_text(MSG_PRIVATE, recipient, message) == 0) {
         printf("Send failed. Error Code: %d\n", WSAGetLastError());
+        printf("The message will be resent once the connection is restored.\n");
     }
 }
 
 void request_chat_history() {
-    // Prepare request
+    view_history(NULL);
+}
+
+void search_chat_history() {
+    char query[MAX_MESSAGE];
+    
+    printf("\n===== Search Chat History =====\n");
+    printf("Enter search text: ");
+    fgets(query, sizeof(query), stdin);
+    query[strcspn(query, "\n")] = 0; // Remove newline
+    
+    if (strlen(query) == 0) {
+        printf("Search text cannot be empty.\n");
+        return;
+    }
+    
+    view_history(query);
+}
+
+// Show history from the local cache, first fetching whatever it is missing
+void view_history(const char *query) {
+    if (!logged_in || cache_behind) {
+        sync_history_cache();
+        if (sync_request_id != 0) {
+            if (logged_in) {
+                // The receiver thread applies the records
+                WaitForSingleObject(sync_done, 10000);
+            } else {
+                // No receiver thread (e.g. on a follower): read them here
+                read_history_stream(sync_request_id);
+            }
+        }
+    }
+    
+    show_cached_history(query, 0);
+}
+
+// Handle frames until the given history request finishes (ends or fails)
+void read_history_stream(unsigned int request_id) {
     Message msg;
-    msg.type = MSG_HISTORY;
-    strcpy(msg.sender, username);
     
-    // Send request
-    if (send(server_socket, (const char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
-        printf("Send failed. Error Code: %d\n", WSAGetLastError());
+    while (recv_full(server_socket, (char*)&msg, sizeof(Message)) > 0) {
+        int finished = msg.request_id == request_id &&
+                       (msg.type == MSG_ERROR || strncmp(msg.content, "--- End of History", 18) == 0);
+        handle_incoming_message(&msg);
+        if (finished) {
+            return;
+        }
     }
     
-    printf("\nRequesting chat history...\n");
+    printf("Connection to server lost.\n");
+    finish_sync();
 }
 
 void logout_user() {
     // Prepare logout message
     Message msg;
+    memset(&msg, 0, sizeof(Message));
     msg.type = MSG_LOGOUT;
-    strcpy(msg.sender, username);
     
     // Send logout request
     if (send(server_socket, (const char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
@@ -435,6 +663,7 @@ void logout_user() {
     }
     
     logged_in = 0;
+    session_token[0] = '\0';
     printf("You have been logged out.\n");
     
     // Wait for receiver thread to terminate
@@ -443,16 +672,17 @@ void logout_user() {
         CloseHandle(recv_thread);
         recv_thread = NULL;
     }
+    multicast_close();
 }
 
 void enter_chat_mode() {
-    char message[MAX_MESSAGE];
-    Message msg;
+    char message[MAX_LONG_MESSAGE + 2];
     
     printf("\n===== Chat Mode =====\n");
     printf("Type your messages and press Enter to send.\n");
     printf("Type '/exit' to return to the main menu.\n\n");
     
+    in_chat_mode = 1;
     while (logged_in) {
         printf("Message: ");
         fgets(message, sizeof(message), stdin);
@@ -469,23 +699,13 @@ void enter_chat_mode() {
             continue;
         }
         
-        // Prepare message
-        memset(&msg, 0, sizeof(Message)); // Clear the message structure
-        msg.type = MSG_CHAT;
-        strcpy(msg.sender, username);
-        
-        // Fix: Add a special marker character at the beginning
-        char marker_message[MAX_MESSAGE];
-        sprintf(marker_message, "#%s", message); // Add # as a marker
-        strcpy(msg.content, marker_message);
-        
         // Send message
-        if (send(server_socket, (const char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
+        if (send_chat_text(MSG_CHAT, NULL, message) == 0) {
             printf("Send failed. Error Code: %d\n", WSAGetLastError());
-            printf("You may have been disconnected. Please try logging in again.\n");
-            logged_in = 0;
+            printf("The message will be resent once the connection is restored.\n");
         }
     }
+    in_chat_mode = 0;
 }
 
 DWORD WINAPI receive_messages(LPVOID arg) {
@@ -502,6 +722,10 @@ DWORD WINAPI receive_messages(LPVOID arg) {
         fd_set readSet;
         FD_ZERO(&readSet);
         FD_SET(server_socket, &readSet);
+        SOCKET group_socket = mcast_socket;
+        if (group_socket != INVALID_SOCKET) {
+            FD_SET(group_socket, &readSet);
+        }
         
         struct timeval timeout;
         timeout.tv_sec = 1;  // 1 second timeout
@@ -514,78 +738,42 @@ DWORD WINAPI receive_messages(LPVOID arg) {
             break;
         }
         
+        // Public messages from the multicast group, in order
+        int shown = multicast_poll();
+        if (selectResult > 0 && group_socket != INVALID_SOCKET && FD_ISSET(group_socket, &readSet)) {
+            shown += multicast_read();
+        }
+        if (shown > 0) {
+            printf(in_chat_mode ? "\nMessage: " : "\nEnter your choice: ");
+            fflush(stdout);
+        }
+        
         if (selectResult > 0 && FD_ISSET(server_socket, &readSet)) {
-            read_size = recv(server_socket, (char*)&msg, sizeof(Message), 0);
+            read_size = recv_full(server_socket, (char*)&msg, sizeof(Message));
             
             if (read_size > 0) {
-                // Process message based on type
-                switch (msg.type) {
-                    case MSG_CHAT: {
-                        // Fix: Added curly braces around this case code
-                        char decrypted_content[MAX_MESSAGE];
-                        strcpy(decrypted_content, msg.content);
-                        
-                        // Only decrypt messages from regular users, not SERVER messages
-                        if (strcmp(msg.sender, "SERVER") != 0) {
-                            decrypt_message(decrypted_content);
-                            
-                            // Remove the marker character if present
-                            if (decrypted_content[0] == '#') {
-                                memmove(decrypted_content, decrypted_content + 1, strlen(decrypted_content));
-                            }
-                        }
-                        printf("\n[%s] %s: %s\n", msg.timestamp, msg.sender, decrypted_content);
-                        break;
-                    }
-                    
-                    case MSG_PRIVATE: {
-                        // Fix: Added curly braces around this case code
-                        char private_content[MAX_MESSAGE];
-                        strcpy(private_content, msg.content);
-                        decrypt_message(private_content);
-                        
-                        // Remove the marker character if present
-                        if (private_content[0] == '#') {
-                            memmove(private_content, private_content + 1, strlen(private_content));
-                        }
-                        
-                        printf("\n[PRIVATE] [%s] %s: %s\n", msg.timestamp, msg.sender, private_content);
-                        break;
-                    }
-                    
-                    case MSG_HISTORY:
-                        printf("\n%s\n", msg.content);
-                        break;
-                    
-                    case MSG_SUCCESS:
-                        printf("\n[SERVER] %s\n", msg.content);
-                        break;
-                    
-                    case MSG_ERROR:
-                        printf("\n[ERROR] %s\n", msg.content);
-                        break;
-                    
-                    default:
-                        printf("\n[UNKNOWN] Received unknown message type: %d\n", msg.type);
-                        break;
+                if (!handle_incoming_message(&msg)) {
+                    continue; // Nothing was shown - keep the prompt as it is
                 }
                 
-                // Check if we're in the main thread or chat mode before showing prompt
-                DWORD current_thread_id = GetCurrentThreadId();
-                DWORD main_thread_id = GetCurrentThreadId(); // This will be different in the receiver thread
-                
-                if (current_thread_id != main_thread_id) {
+                // Reprint the prompt the main thread is waiting at
+                if (in_chat_mode) {
                     printf("\nMessage: "); // Better prompt for chat mode
                 } else {
                     printf("\nEnter your choice: "); // Original prompt for menu
                 }
                 fflush(stdout);
-            } else if (read_size == 0) {
-                printf("\nServer disconnected.\n");
-                logged_in = 0;
-                break;
             } else {
-                printf("\nRecv failed. Error Code: %d\n", WSAGetLastError());
+                if (read_size == 0) {
+                    printf("\nServer disconnected.\n");
+                } else {
+                    printf("\nRecv failed. Error Code: %d\n", WSAGetLastError());
+                }
+                
+                // Resume the session on a fresh connection instead of a full login
+                if (logged_in && session_token[0] != '\0' && reconnect_session()) {
+                    continue;
+                }
                 logged_in = 0;
                 break;
             }
@@ -596,6 +784,1797 @@ DWORD WINAPI receive_messages(LPVOID arg) {
     return 0;
 }
 
+// Open a new connection and present the session token plus the last seen
+// seq; the receiver loop picks up the response and the missed messages
+int reconnect_session() {
+    for (int attempt = 1; attempt <= RECONNECT_ATTEMPTS; attempt++) {
+        int result = try_reconnect(attempt);
+        if (result != 0) {
+            return result > 0;
+        }
+        Sleep(500 * attempt); // Back off so a restarted server isn't stormed
+    }
+    
+    printf("Could not reconnect to the server.\n");
+    return 0;
+}
+
+// One reconnect attempt. Returns 1 if the resume request went out on the
+// new connection, 0 to try again later, -1 if there is no point
+int try_reconnect(int attempt) {
+    printf("Reconnecting (attempt %d of %d)...\n", attempt, RECONNECT_ATTEMPTS);
+    
+    SOCKET new_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (new_socket == INVALID_SOCKET) {
+        return -1;
+    }
+    
+    if (connect(new_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+        closesocket(new_socket);
+        return 0;
+    }
+    
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.type = MSG_RESUME;
+    msg.seq = last_seq;
+    msg.sender_id = own_user_id;
+    strcpy(msg.token, session_token);
+    unsigned int request_id = track_request(&msg);
+    
+    if (send(new_socket, (const char*)&msg, sizeof(Message), 0) == SOCKET_ERROR) {
+        finish_request(request_id, 0);
+        closesocket(new_socket);
+        return 0;
+    }
+    
+    SOCKET old_socket = server_socket;
+    server_socket = new_socket;
+    closesocket(old_socket);
+    return 1;
+}
+
+// Assign the next message ID, remember the message until it is acked and
+// send it. Several messages may be in flight at once (up to MAX_UNACKED).
+// Returns 1 if sent, 0 if buffered for a resend after reconnect, -1 if
+// the send window stayed full
+int send_tracked_message(Message *msg) {
+    // Wait briefly for acks if the window is full
+    for (int waited = 0; ; waited += 10) {
+        WaitForSingleObject(unacked_mutex, INFINITE);
+        if (unacked_count < MAX_UNACKED) {
+            break;
+        }
+        ReleaseMutex(unacked_mutex);
+        
+        // The event loop processes acks itself, so it can't wait for them
+        if (event_loop_mode || waited >= 5000) {
+            printf("Too many unacknowledged messages - message not sent.\n");
+            return -1;
+        }
+        Sleep(10);
+    }
+    
+    msg->msg_id = next_msg_id++;
+    unacked[unacked_count++] = *msg;
+    int result = send_frame(msg);
+    ReleaseMutex(unacked_mutex);
+    
+    return result;
+}
+
+// Drop every buffered message covered by a cumulative ack
+void handle_ack(unsigned int acked_id) {
+    WaitForSingleObject(unacked_mutex, INFINITE);
+    
+    int dropped = 0;
+    while (dropped < unacked_count && unacked[dropped].msg_id <= acked_id) {
+        dropped++;
+    }
+    if (dropped > 0) {
+        memmove(unacked, unacked + dropped, (unacked_count - dropped) * sizeof(Message));
+        unacked_count -= dropped;
+    }
+    
+    ReleaseMutex(unacked_mutex);
+}
+
+// Resend everything still unacked on the (new) connection, oldest first;
+// the server drops any it already received by msg_id
+void retransmit_unacked() {
+    WaitForSingleObject(unacked_mutex, INFINITE);
+    
+    if (unacked_count > 0) {
+        printf("\nResending %d unacknowledged message(s)...\n", unacked_count);
+    }
+    for (int i = 0; i < unacked_count; i++) {
+        if (!send_frame(&unacked[i])) {
+            break; // Still disconnected - the next resume tries again
+        }
+    }
+    
+    ReleaseMutex(unacked_mutex);
+}
+
+// Send a whole frame. The event loop's socket is non-blocking, so wait
+// for buffer space rather than fail on WSAEWOULDBLOCK
+int send_frame(const Message *msg) {
+    return send_all((const char*)msg, sizeof(Message));
+}
+
+// Send a frame only if the socket has room to take it now: returns -1,
+// having sent nothing, if it would block (FD_WRITE follows when there is
+// room again), else as send_frame
+int try_send_frame(const Message *msg) {
+    int sent = send(server_socket, (const char*)msg, sizeof(Message), 0);
+    if (sent == SOCKET_ERROR) {
+        return WSAGetLastError() == WSAEWOULDBLOCK ? -1 : 0;
+    }
+    return send_all((const char*)msg + sent, sizeof(Message) - sent);
+}
+
+int send_all(const char *data, int remaining) {
+    while (remaining > 0) {
+        int sent = send(server_socket, data, remaining, 0);
+        if (sent == SOCKET_ERROR) {
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                return 0;
+            }
+            
+            fd_set writeSet;
+            FD_ZERO(&writeSet);
+            FD_SET(server_socket, &writeSet);
+            struct timeval timeout;
+            timeout.tv_sec = 1;
+            timeout.tv_usec = 0;
+            if (select(0, NULL, &writeSet, NULL, &timeout) <= 0) {
+                return 0;
+            }
+            continue;
+        }
+        data += sent;
+        remaining -= sent;
+    }
+    return 1;
+}
+
+// Fill in a chat or private message, with the '#' marker the receivers strip
+void build_chat_message(Message *msg, int type, unsigned int recipient_id, const char *text) {
+    memset(msg, 0, sizeof(Message));
+    msg->type = type;
+    msg->recipient_id = recipient_id;
+    snprintf(msg->content, MAX_MESSAGE, "#%s", text); // Add # as a marker
+}
+
+// Take in MSG_USERS content: "<id> <name>\n" lines
+void learn_users(const char *lines) {
+    WaitForSingleObject(users_mutex, INFINITE);
+    while (*lines != '\0') {
+        unsigned int id;
+        char name[MAX_USERNAME];
+        if (sscanf(lines, "%u %49[^\n]", &id, name) == 2 && id != 0 && id <= MAX_USER_ID) {
+            if (id > user_name_count) {
+                unsigned int count = user_name_count ? user_name_count : 64;
+                while (count < id) {
+                    count *= 2;
+                }
+                char (*names)[MAX_USERNAME] = realloc(user_names, count * sizeof(*names));
+                if (names == NULL) {
+                    break;
+                }
+                memset(names + user_name_count, 0, (count - user_name_count) * sizeof(*names));
+                user_names = names;
+                user_name_count = count;
+            }
+            strcpy(user_names[id - 1], name);
+        }
+        const char *next = strchr(lines, '\n');
+        if (next == NULL) {
+            break;
+        }
+        lines = next + 1;
+    }
+    ReleaseMutex(users_mutex);
+}
+
+// Copy the name for id into name (MAX_USERNAME bytes). An ID we haven't
+// heard of yet shows as "#<id>" and has the server send the names again.
+void user_name(unsigned int id, char *name) {
+    if (id == 0) {
+        strcpy(name, "SERVER");
+        return;
+    }
+    WaitForSingleObject(users_mutex, INFINITE);
+    int known = id <= user_name_count && user_names[id - 1][0] != '\0';
+    if (known) {
+        strcpy(name, user_names[id - 1]);
+    }
+    int ask = !known && id > users_requested;
+    if (ask) {
+        users_requested = id;
+    }
+    ReleaseMutex(users_mutex);
+    
+    if (!known) {
+        snprintf(name, MAX_USERNAME, "#%u", id);
+    }
+    if (ask && logged_in) {
+        Message request;
+        memset(&request, 0, sizeof(Message));
+        request.type = MSG_USERS;
+        send_frame(&request);
+    }
+}
+
+// Returns name's ID, or 0 if the server never told us of such a user
+unsigned int find_user_id(const char *name) {
+    unsigned int id = 0;
+    WaitForSingleObject(users_mutex, INFINITE);
+    for (unsigned int i = 0; i < user_name_count; i++) {
+        if (strcmp(user_names[i], name) == 0) {
+            id = i + 1;
+            break;
+        }
+    }
+    ReleaseMutex(users_mutex);
+    return id;
+}
+
+// Send text as a chat or private message. Text too long for one frame goes
+// as numbered fragments, each tracked and acked like a message of its own.
+// Returns like send_tracked_message; -1 also if the text is too long or
+// the recipient unknown
+int send_chat_text(int type, const char *recipient, const char *text) {
+    size_t length = strlen(text);
+    if (length > MAX_LONG_MESSAGE) {
+        printf("Message too long (limit %d characters).\n", MAX_LONG_MESSAGE);
+        return -1;
+    }
+    unsigned int recipient_id = 0;
+    if (recipient != NULL && (recipient_id = find_user_id(recipient)) == 0) {
+        printf("No such user: %s\n", recipient);
+        return -1;
+    }
+    
+    int fragments = (int)((length + FRAGMENT_TEXT - 1) / FRAGMENT_TEXT);
+    Message msg;
+    if (fragments <= 1) {
+        build_chat_message(&msg, type, recipient_id, text);
+        if (type == MSG_PRIVATE) {
+            track_request(&msg); // The delivery confirmation echoes it
+        }
+        return send_tracked_message(&msg);
+    }
+    
+    // The event loop can't wait for acks mid-message, so the whole message
+    // has to fit the send window
+    WaitForSingleObject(unacked_mutex, INFINITE);
+    int room = MAX_UNACKED - unacked_count;
+    ReleaseMutex(unacked_mutex);
+    if (event_loop_mode && room < fragments) {
+        printf("Too many unacknowledged messages - message not sent.\n");
+        return -1;
+    }
+    
+    int result = 1;
+    for (int i = 0; i < fragments; i++) {
+        char piece[FRAGMENT_TEXT + 1];
+        size_t offset = (size_t)i * FRAGMENT_TEXT;
+        size_t piece_length = length - offset < FRAGMENT_TEXT ? length - offset : FRAGMENT_TEXT;
+        memcpy(piece, text + offset, piece_length);
+        piece[piece_length] = '\0';
+        
+        build_chat_message(&msg, type, recipient_id, piece);
+        msg.fragment = (unsigned short)(i + 1);
+        msg.fragments = (unsigned short)fragments;
+        if (type == MSG_PRIVATE && i == fragments - 1) {
+            track_request(&msg); // Confirmed once, with the last fragment
+        }
+        
+        int sent = send_tracked_message(&msg);
+        if (sent < 0) {
+            return -1;
+        }
+        if (sent == 0) {
+            result = 0; // Buffered; the rest is buffered behind it
+        }
+    }
+    return result;
+}
+
+// Add one fragment's text to its sender's message
+// Returns the whole text (caller frees it) once the last fragment is in
+char *reassemble_fragment(const Message *msg, const char *text) {
+    reassembly_t *slot = NULL;
+    reassembly_t *free_slot = NULL;
+    for (int i = 0; i < MAX_REASSEMBLY; i++) {
+        if (!reassembly[i].in_use) {
+            if (free_slot == NULL) {
+                free_slot = &reassembly[i];
+            }
+        } else if (reassembly[i].type == msg->type && reassembly[i].sender_id == msg->sender_id) {
+            slot = &reassembly[i];
+            break;
+        }
+    }
+    
+    // A first fragment starts over (the previous message was cut short)
+    if (slot != NULL && (msg->fragment == 1 || msg->fragment != slot->next)) {
+        free(slot->text);
+        memset(slot, 0, sizeof(reassembly_t));
+        free_slot = slot;
+        slot = NULL;
+    }
+    if (slot == NULL) {
+        if (msg->fragment != 1 || free_slot == NULL) {
+            return NULL; // Missed the start, or too many at once - drop it
+        }
+        slot = free_slot;
+        slot->in_use = 1;
+        slot->sender_id = msg->sender_id;
+        slot->type = msg->type;
+        slot->next = 1;
+    }
+    
+    size_t text_length = strlen(text);
+    char *grown = realloc(slot->text, slot->length + text_length + 1);
+    if (grown == NULL) {
+        free(slot->text);
+        memset(slot, 0, sizeof(reassembly_t));
+        return NULL;
+    }
+    memcpy(grown + slot->length, text, text_length + 1);
+    slot->text = grown;
+    slot->length += text_length;
+    slot->next++;
+    
+    if (msg->fragment < msg->fragments) {
+        return NULL;
+    }
+    
+    char *whole = slot->text;
+    memset(slot, 0, sizeof(reassembly_t));
+    return whole;
+}
+
+// Event-loop mode: one thread waits on both the console and the socket, so
+// messages print the moment they arrive and the line being typed is
+// redrawn underneath them - no receiver thread, no polling, no lost keys.
+// Timed work (reconnect attempts, the multicast silence check) sets the
+// wait's timeout instead of sleeping, so input is never held up.
+void run_event_loop() {
+    HANDLE console_in = GetStdHandle(STD_INPUT_HANDLE);
+    DWORD saved_mode = 0;
+    int is_console = GetConsoleMode(console_in, &saved_mode);
+    
+    // We echo and edit the line ourselves
+    if (is_console) {
+        SetConsoleMode(console_in, ENABLE_WINDOW_INPUT);
+    }
+    
+    // FD_WRITE: room in the socket buffer again, after an upload filled it
+    WSAEVENT net_event = WSACreateEvent();
+    if (net_event == WSA_INVALID_EVENT ||
+        WSAEventSelect(server_socket, net_event, FD_READ | FD_WRITE | FD_CLOSE) == SOCKET_ERROR) {
+        printf("Event setup failed. Error Code: %d\n", WSAGetLastError());
+        return;
+    }
+    
+    // A console handle can be waited on; piped or redirected input (bots,
+    // scripts) can't, so a thread reads it and signals each buffer
+    if (!is_console) {
+        piped_ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+        piped_taken = CreateEvent(NULL, FALSE, FALSE, NULL);
+        HANDLE reader = piped_ready != NULL && piped_taken != NULL ?
+                        CreateThread(NULL, 0, read_piped_input, console_in, 0, NULL) : NULL;
+        if (reader == NULL) {
+            printf("Input setup failed. Error Code: %d\n", GetLastError());
+            WSAEventSelect(server_socket, net_event, 0);
+            WSACloseEvent(net_event);
+            return;
+        }
+        CloseHandle(reader);
+    }
+    
+    printf("Event-loop mode. Type /help for commands; plain text is sent to everyone.\n");
+    redraw_input_line();
+    
+    int input_open = 1;
+    while (running) {
+        HANDLE handles[3];
+        DWORD count = 0;
+        DWORD net_slot = 3, input_slot = 3, group_slot = 3; // 3 = not waited on
+        DWORD timeout = INFINITE;
+        DWORD now = GetTickCount();
+        
+        // While the connection is down there is no socket to wait on, only
+        // the time of the next attempt
+        if (reconnect_attempt == 0) {
+            net_slot = count;
+            handles[count++] = net_event;
+        } else {
+            timeout = (LONG)(reconnect_due - now) > 0 ? reconnect_due - now : 0;
+        }
+        if (input_open) {
+            input_slot = count;
+            handles[count++] = is_console ? console_in : piped_ready;
+        }
+        if (mcast_socket != INVALID_SOCKET) {
+            group_slot = count;
+            handles[count++] = mcast_event;
+            
+            // Wake when the group will have been quiet too long
+            if (mcast_request_id == 0) {
+                DWORD quiet = now - mcast_heard;
+                DWORD left = quiet < MCAST_SILENCE_MS ? MCAST_SILENCE_MS - quiet : 0;
+                timeout = left < timeout ? left : timeout;
+            }
+        }
+        if (upload_sending && !upload_blocked && reconnect_attempt == 0) {
+            timeout = 0; // The socket has room for more chunks now
+        }
+        DWORD which = WAIT_TIMEOUT;
+        if (count > 0) {
+            which = WaitForMultipleObjects(count, handles, FALSE, timeout);
+        } else {
+            Sleep(timeout); // Reconnecting with nothing else to watch
+        }
+        
+        if (which == WAIT_OBJECT_0 + net_slot) {
+            if (!drain_socket(net_event)) {
+                break;
+            }
+        } else if (which == WAIT_OBJECT_0 + input_slot) {
+            if (is_console) {
+                read_console_keys(console_in);
+            } else {
+                input_open = take_piped_input();
+            }
+        } else if (which == WAIT_OBJECT_0 + group_slot) {
+            WSANETWORKEVENTS events;
+            WSAEnumNetworkEvents(mcast_socket, mcast_event, &events);
+            multicast_read();
+        } else if (which == WAIT_FAILED) {
+            printf("Wait failed. Error Code: %d\n", GetLastError());
+            break;
+        }
+        
+        if (reconnect_attempt > 0 && (LONG)(GetTickCount() - reconnect_due) >= 0 &&
+            !continue_reconnect(net_event)) {
+            break;
+        }
+        
+        // A few chunks per pass, so typing and incoming chat stay responsive
+        if (upload_sending && reconnect_attempt == 0) {
+            pump_upload(UPLOAD_BURST);
+        }
+        multicast_poll();
+    }
+    
+    WSAEventSelect(server_socket, net_event, 0);
+    WSACloseEvent(net_event);
+    if (is_console) {
+        SetConsoleMode(console_in, saved_mode);
+    }
+}
+
+// Read everything the socket has, act on each complete frame
+// Returns 0 once the connection is gone for good
+int drain_socket(WSAEVENT net_event) {
+    WSANETWORKEVENTS events;
+    WSAEnumNetworkEvents(server_socket, net_event, &events);
+    
+    while (1) {
+        // Raw download bytes follow their MSG_FILE_DATA header
+        if (raw_remaining > 0) {
+            char data[4096];
+            int received = recv(server_socket, data,
+                                raw_remaining < sizeof(data) ? (int)raw_remaining : (int)sizeof(data), 0);
+            if (received > 0) {
+                raw_remaining -= received;
+                write_download_data(data, received);
+                continue;
+            }
+            if (received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+                return 1;
+            }
+        }
+        
+        int received = raw_remaining > 0 ? 0 :
+                       recv(server_socket, frame_buffer + frame_length, sizeof(Message) - frame_length, 0);
+        if (received > 0) {
+            frame_length += received;
+            if (frame_length == sizeof(Message)) {
+                Message msg;
+                memcpy(&msg, frame_buffer, sizeof(Message));
+                frame_length = 0;
+                
+                clear_input_line();
+                handle_incoming_message(&msg);
+                redraw_input_line();
+            }
+            continue;
+        }
+        
+        if (received == SOCKET_ERROR && WSAGetLastError() == WSAEWOULDBLOCK) {
+            return 1; // Drained
+        }
+        
+        // Disconnected: resume the session if we have one. The loop makes
+        // the attempts, so typing carries on in between
+        clear_input_line();
+        printf("Server disconnected.\n");
+        frame_length = 0;
+        raw_remaining = 0;
+        if (logged_in && session_token[0] != '\0') {
+            WSAEventSelect(server_socket, net_event, 0);
+            reconnect_attempt = 1;
+            reconnect_due = GetTickCount();
+            redraw_input_line();
+            return 1;
+        }
+        logged_in = 0;
+        return 0;
+    }
+}
+
+// Make the reconnect attempt that is due, or schedule the next one
+// Returns 0 once there are no attempts left
+int continue_reconnect(WSAEVENT net_event) {
+    clear_input_line();
+    int result = try_reconnect(reconnect_attempt);
+    if (result > 0) {
+        reconnect_attempt = 0;
+        WSAEventSelect(server_socket, net_event, FD_READ | FD_WRITE | FD_CLOSE);
+    } else if (result == 0 && reconnect_attempt < RECONNECT_ATTEMPTS) {
+        // Back off so a restarted server isn't stormed
+        reconnect_due = GetTickCount() + 500 * reconnect_attempt;
+        reconnect_attempt++;
+    } else {
+        printf("Could not reconnect to the server.\n");
+        logged_in = 0;
+        return 0;
+    }
+    redraw_input_line();
+    return 1;
+}
+
+void read_console_keys(HANDLE console_in) {
+    INPUT_RECORD records[64];
+    DWORD count = 0;
+    
+    if (!ReadConsoleInput(console_in, records, 64, &count)) {
+        return;
+    }
+    
+    for (DWORD i = 0; i < count; i++) {
+        if (records[i].EventType != KEY_EVENT || !records[i].Event.KeyEvent.bKeyDown) {
+            continue; // Mouse, focus and key-up events
+        }
+        
+        KEY_EVENT_RECORD *key = &records[i].Event.KeyEvent;
+        for (WORD repeat = 0; repeat < key->wRepeatCount; repeat++) {
+            if (key->wVirtualKeyCode == VK_RETURN) {
+                input_char('\n');
+            } else if (key->wVirtualKeyCode == VK_BACK) {
+                input_char('\b');
+            } else if (key->wVirtualKeyCode == VK_ESCAPE) {
+                clear_input_line();
+                input_length = 0;
+                redraw_input_line();
+            } else if ((unsigned char)key->uChar.AsciiChar >= 32) {
+                input_char(key->uChar.AsciiChar);
+            }
+        }
+    }
+    fflush(stdout);
+}
+
+// Reader thread for piped/redirected input: blocks in ReadFile, then hands
+// the buffer to the event loop and waits for it to be used
+DWORD WINAPI read_piped_input(LPVOID arg) {
+    HANDLE input = (HANDLE)arg;
+    while (1) {
+        DWORD got = 0;
+        if (!ReadFile(input, piped_buffer, sizeof(piped_buffer), &got, NULL)) {
+            got = 0; // Writer closed the pipe
+        }
+        piped_length = got;
+        SetEvent(piped_ready);
+        if (got == 0) {
+            return 0;
+        }
+        WaitForSingleObject(piped_taken, INFINITE);
+    }
+}
+
+// Type out the buffer the reader thread handed over
+// Returns 0 once piped/redirected input has ended
+int take_piped_input() {
+    DWORD got = piped_length;
+    for (DWORD i = 0; i < got; i++) {
+        if (piped_buffer[i] != '\r') {
+            input_char(piped_buffer[i]);
+        }
+    }
+    fflush(stdout);
+    SetEvent(piped_taken);
+    return got > 0;
+}
+
+// Line editor: echo, backspace and submit on newline
+void input_char(char c) {
+    if (c == '\n') {
+        printf("\n");
+        input_line[input_length] = '\0';
+        input_length = 0;
+        handle_command(input_line);
+        redraw_input_line();
+    } else if (c == '\b') {
+        if (input_length > 0) {
+            input_length--;
+            printf("\b \b");
+        }
+    } else if (input_length < MAX_LONG_MESSAGE) {
+        input_line[input_length++] = c;
+        putchar(c);
+    }
+}
+
+void clear_input_line() {
+    printf("\r%*s\r", input_length + 2, "");
+}
+
+void redraw_input_line() {
+    printf("> %.*s", input_length, input_line);
+    fflush(stdout);
+}
+
+// One typed line: a /command, or a public message
+void handle_command(char *line) {
+    Message msg;
+    
+    if (line[0] == '\0') {
+        return;
+    }
+    
+    if (line[0] != '/') {
+        // Plain text goes to everyone
+        if (!logged_in) {
+            printf("You must be logged in to send messages. Use /login <user> <password>\n");
+            return;
+        }
+        if (send_chat_text(MSG_CHAT, NULL, line) == 0) {
+            printf("Send failed - the message will be resent after reconnecting.\n");
+        }
+        return;
+    }
+    
+    char *command = strtok(line, " ");
+    char *arg1 = strtok(NULL, " ");
+    char *rest = strtok(NULL, "");
+    
+    if (strcmp(command, "/help") == 0) {
+        printf("/register <user> <password>  /login <user> <password>  /logout\n");
+        printf("/msg <user> <text>  /history [last n]  /search <text>  /quit\n");
+        printf("/upload <file> [user]  /download <id> <save as>  /stats (admins)\n");
+        printf("/stats locks on|off  /trace on [every] | off | dump (admins)\n");
+    } else if ((strcmp(command, "/login") == 0 || strcmp(command, "/register") == 0) && rest != NULL) {
+        memset(&msg, 0, sizeof(Message));
+        msg.type = command[1] == 'l' ? MSG_LOGIN : MSG_REGISTER;
+        snprintf(msg.content, MAX_MESSAGE, "%.*s:%.*s", MAX_USERNAME - 1, arg1, MAX_PASSWORD - 1, rest);
+        if (msg.type == MSG_LOGIN) {
+            strncpy(username, arg1, MAX_USERNAME - 1);
+            username[MAX_USERNAME - 1] = '\0';
+        }
+        track_request(&msg);
+        send_frame(&msg);
+    } else if (strcmp(command, "/msg") == 0 && rest != NULL && logged_in) {
+        if (send_chat_text(MSG_PRIVATE, arg1, rest) == 0) {
+            printf("Send failed - the message will be resent after reconnecting.\n");
+        }
+    } else if (strcmp(command, "/history") == 0 || (strcmp(command, "/search") == 0 && arg1 != NULL)) {
+        // Served from the local cache; without a session it is synced first
+        show_query[0] = '\0';
+        show_last = 0;
+        if (command[1] == 'h') {
+            show_last = arg1 ? (unsigned int)atoi(arg1) : 0;
+        } else {
+            snprintf(show_query, MAX_MESSAGE, "%s%s%s", arg1, rest ? " " : "", rest ? rest : "");
+        }
+        if (logged_in && !cache_behind) {
+            show_cached_history(show_query[0] ? show_query : NULL, show_last);
+        } else {
+            sync_history_cache();
+            show_after_sync = 1;
+        }
+    } else if (strcmp(command, "/upload") == 0 && arg1 != NULL && logged_in) {
+        if (rest != NULL) {
+            rest = strtok(rest, " "); // Recipient
+        }
+        begin_upload(arg1, rest);
+    } else if (strcmp(command, "/download") == 0 && rest != NULL && logged_in) {
+        begin_download(arg1, rest);
+    } else if (strcmp(command, "/stats") == 0 && logged_in) {
+        memset(&msg, 0, sizeof(Message));
+        msg.type = MSG_STATS;
+        if (arg1 != NULL) {
+            snprintf(msg.content, MAX_MESSAGE, "%s%s%s", arg1, rest ? " " : "", rest ? rest : "");
+        }
+        track_request(&msg);
+        send_frame(&msg);
+    } else if (strcmp(command, "/trace") == 0 && arg1 != NULL && logged_in) {
+        memset(&msg, 0, sizeof(Message));
+        msg.type = MSG_TRACE;
+        snprintf(msg.content, MAX_MESSAGE, "%s%s%s", arg1, rest ? " " : "", rest ? rest : "");
+        track_request(&msg);
+        send_frame(&msg);
+    } else if (strcmp(command, "/logout") == 0 && logged_in) {
+        memset(&msg, 0, sizeof(Message));
+        msg.type = MSG_LOGOUT;
+        send_frame(&msg);
+        logged_in = 0;
+        session_token[0] = '\0';
+        multicast_close();
+        printf("You have been logged out.\n");
+    } else if (strcmp(command, "/quit") == 0) {
+        running = 0;
+    } else {
+        printf("Unknown or incomplete command (or not logged in). Type /help.\n");
+    }
+}
+
+// Record a new session from the login response
+void begin_session(const Message *msg) {
+    // Keep the session token so a dropped connection can resume
+    strncpy(session_token, msg->token, SESSION_TOKEN_LEN - 1);
+    session_token[SESSION_TOKEN_LEN - 1] = '\0';
+    last_seq = msg->seq;
+    resume_through = 0;
+    own_user_id = msg->recipient_id; // Resumes present it with the token
+    users_requested = 0;
+    
+    // New session: message IDs start over
+    WaitForSingleObject(unacked_mutex, INFINITE);
+    unacked_count = 0;
+    next_msg_id = 1;
+    ReleaseMutex(unacked_mutex);
+    
+    // Fetch only what was logged since the cache was last updated
+    sync_history_cache();
+    multicast_subscribe();
+}
+
+// Act on one frame from the server and print it
+// Returns 0 if nothing was printed (acks, replayed duplicates)
+int handle_incoming_message(Message *msg) {
+    // Resent over TCP to fill a multicast gap: msg_id is its multicast
+    // seq, and the repair stays pending until the "repaired" reply
+    if (msg->request_id != 0 && msg->request_id == mcast_repair_id &&
+        msg->type != MSG_MULTICAST && msg->type != MSG_ERROR) {
+        return multicast_accept(msg->msg_id, msg);
+    }
+    
+    // Which of our requests this answers, if any. History, search and
+    // stats replies span many frames and stay pending until the last one
+    int request_type = 0;
+    if (msg->request_id != 0) {
+        int done = msg->type == MSG_HISTORY ? strncmp(msg->content, "--- End of History", 18) == 0 :
+                   msg->type == MSG_STATS ? msg->fragment == msg->fragments : 1;
+        request_type = finish_request(msg->request_id, !done);
+    }
+    
+    // Drop records a resume already replayed (they can still
+    // arrive live if they were broadcast during the reconnect)
+    if ((msg->type == MSG_CHAT || msg->type == MSG_PRIVATE) && msg->seq != 0) {
+        if (msg->seq <= resume_through && msg->seq <= last_seq) {
+            return 0;
+        }
+        if (msg->seq > last_seq) {
+            last_seq = msg->seq;
+        }
+        
+        // Keep the history cache current while records arrive in order,
+        // in the server's log format with the names spelled out
+        char line[MAX_LOG_LINE];
+        log_record_t record;
+        record.msg = *msg;
+        user_name(msg->sender_id, record.sender);
+        user_name(msg->recipient_id, record.recipient);
+        if (msg->sender_id != 0) {
+            decrypt_message(record.msg.content);
+        }
+        format_log_line(&record, line, sizeof(line));
+        if (!cache_record(msg->seq, line)) {
+            cache_behind = 1;
+        }
+    }
+    
+    char sender[MAX_USERNAME];
+    user_name(msg->sender_id, sender);
+    char when[26];
+    message_time(msg, when, sizeof(when));
+    
+    // Process message based on type
+    switch (msg->type) {
+        case MSG_CHAT: {
+            // Fix: Added curly braces around this case code
+            char decrypted_content[MAX_MESSAGE];
+            strcpy(decrypted_content, msg->content);
+            
+            // Only decrypt messages from regular users, not SERVER messages
+            if (msg->sender_id != 0) {
+                decrypt_message(decrypted_content);
+                
+                // Remove the marker character if present
+                if (decrypted_content[0] == '#') {
+                    memmove(decrypted_content, decrypted_content + 1, strlen(decrypted_content));
+                }
+            }
+            
+            if (msg->fragments > 0) {
+                char *whole = reassemble_fragment(msg, decrypted_content);
+                if (whole == NULL) {
+                    return 0; // More to come
+                }
+                printf("\n[%s] %s: %s\n", when, sender, whole);
+                free(whole);
+                break;
+            }
+            printf("\n[%s] %s: %s\n", when, sender, decrypted_content);
+            break;
+        }
+        
+        case MSG_PRIVATE: {
+            // Fix: Added curly braces around this case code
+            char private_content[MAX_MESSAGE];
+            strcpy(private_content, msg->content);
+            decrypt_message(private_content);
+            
+            // Remove the marker character if present
+            if (private_content[0] == '#') {
+                memmove(private_content, private_content + 1, strlen(private_content));
+            }
+            
+            if (msg->fragments > 0) {
+                char *whole = reassemble_fragment(msg, private_content);
+                if (whole == NULL) {
+                    return 0; // More to come
+                }
+                printf("\n[PRIVATE] [%s] %s: %s\n", when, sender, whole);
+                free(whole);
+                break;
+            }
+            printf("\n[PRIVATE] [%s] %s: %s\n", when, sender, private_content);
+            break;
+        }
+        
+        case MSG_USERS:
+            learn_users(msg->content);
+            return 0;
+        
+        case MSG_STATS:
+            if (msg->fragment <= 1) {
+                printf("\n--- Server stats ---\n");
+            }
+            printf("%s", msg->content);
+            break;
+        
+        case MSG_HISTORY: {
+            const char *record = msg->fragments > 0 ? join_history_part(msg) : msg->content;
+            if (record == NULL) {
+                return 0; // More parts to come
+            }
+            if (msg->request_id != 0 && msg->request_id == sync_request_id) {
+                handle_sync_frame(msg, record);
+                return 0;
+            }
+            char shown[MAX_LOG_LINE];
+            display_log_line(record, shown, sizeof(shown));
+            printf("\n%s\n", shown);
+            break;
+        }
+        
+        case MSG_SUCCESS:
+            // In the event loop, login responses arrive here too
+            if (request_type == MSG_LOGIN && !logged_in) {
+                logged_in = 1;
+                begin_session(msg);
+            }
+            if (request_type == MSG_RESUME) {
+                // Missed messages follow, up to msg->seq; msg_id
+                // says which of our sends the server already has
+                resume_through = msg->seq;
+                handle_ack(msg->msg_id);
+                retransmit_unacked();
+                
+                // Pick transfers up where they stopped
+                if (upload_file != NULL) {
+                    send_upload_offer();
+                }
+                if (download_file != NULL) {
+                    send_download_request();
+                }
+                
+                // The new connection gets public messages over TCP until it asks
+                multicast_subscribe();
+            }
+            if (msg->request_id != 0 && msg->request_id == upload_request_id) {
+                handle_upload_response(msg);
+            }
+            printf("\n[SERVER] %s\n", msg->content);
+            break;
+        
+        case MSG_FILE_DATA:
+            if (msg->request_id != 0 && msg->request_id == download_request_id) {
+                handle_download_frame(msg);
+            }
+            return 0;
+        
+        case MSG_ACK:
+            handle_ack(msg->msg_id);
+            return 0; // Nothing to show - keep the prompt as it is
+        
+        case MSG_MULTICAST:
+            return handle_multicast_reply(msg);
+        
+        case MSG_ERROR:
+            printf("\n[ERROR] %s\n", msg->content);
+            if (msg->request_id != 0 && msg->request_id == sync_request_id) {
+                finish_sync(); // Show what we have even if the server won't sync
+            }
+            if (msg->request_id != 0 && msg->request_id == upload_request_id) {
+                handle_upload_response(msg);
+            }
+            if (msg->request_id != 0 && msg->request_id == download_request_id && download_file != NULL) {
+                // Keep the .part file; /download again resumes it
+                fclose(download_file);
+                download_file = NULL;
+                download_request_id = 0;
+            }
+            if (request_type == MSG_RESUME) {
+                session_token[0] = '\0';
+                logged_in = 0;
+                printf("Please log in again.\n");
+            }
+            if (msg->request_id != 0 && msg->request_id == mcast_repair_id) {
+                multicast_repair_done(); // Whatever didn't come is lost
+            }
+            if (msg->request_id != 0 && msg->request_id == mcast_request_id) {
+                multicast_wanted = 0; // Not on this server - stay on TCP
+                multicast_close();
+            }
+            break;
+        
+        default:
+            printf("\n[UNKNOWN] Received unknown message type: %d\n", msg->type);
+            break;
+    }
+    
+    return 1;
+}
+
+// Give msg the next request ID and remember what kind of request it is
+unsigned int track_request(Message *msg) {
+    WaitForSingleObject(requests_mutex, INFINITE);
+    unsigned int request_id = next_request_id++;
+    if (next_request_id == 0) {
+        next_request_id = 1; // 0 means "no request"
+    }
+    pending_request_t *pending = &pending_requests[request_id % MAX_PENDING_REQUESTS];
+    pending->id = request_id;
+    pending->type = msg->type;
+    ReleaseMutex(requests_mutex);
+    
+    msg->request_id = request_id;
+    return request_id;
+}
+
+// Match a response to its request; keep leaves it pending for more frames
+// Returns the request's message type, or 0 if it is unknown or finished
+int finish_request(unsigned int request_id, int keep) {
+    WaitForSingleObject(requests_mutex, INFINITE);
+    pending_request_t *pending = &pending_requests[request_id % MAX_PENDING_REQUESTS];
+    int type = 0;
+    if (pending->id == request_id) {
+        type = pending->type;
+        if (!keep) {
+            pending->id = 0;
+        }
+    }
+    ReleaseMutex(requests_mutex);
+    return type;
+}
+
+// Wait for the response to one request (before the receiver thread runs);
+// frames for other requests and broadcasts are handled as they arrive
+// Returns 1 with *response filled in, or 0 on timeout or disconnect
+int wait_for_response(unsigned int request_id, Message *response, int timeout_ms) {
+    DWORD deadline = GetTickCount() + timeout_ms;
+    
+    for (;;) {
+        int remaining = (int)(deadline - GetTickCount());
+        if (remaining <= 0) {
+            return 0;
+        }
+        
+        fd_set readSet;
+        FD_ZERO(&readSet);
+        FD_SET(server_socket, &readSet);
+        
+        struct timeval timeout;
+        timeout.tv_sec = remaining / 1000;
+        timeout.tv_usec = (remaining % 1000) * 1000;
+        
+        int ready = select(0, &readSet, NULL, NULL, &timeout);
+        if (ready == SOCKET_ERROR) {
+            return 0;
+        }
+        if (ready == 0) {
+            continue;
+        }
+        
+        if (recv_full(server_socket, (char*)response, sizeof(Message)) <= 0) {
+            printf("Connection to server lost.\n");
+            return 0;
+        }
+        if (response->request_id == request_id) {
+            finish_request(request_id, 0);
+            return 1;
+        }
+        handle_incoming_message(response);
+    }
+}
+
+// Open the history cache for this server and index the records in it
+void open_history_cache() {
+    char path[64];
+    snprintf(path, sizeof(path), "history_%s_%d.txt", server_ip, server_port);
+    
+    cache_file = fopen(path, "a+");
+    if (cache_file == NULL) {
+        perror("Failed to open history cache");
+        return;
+    }
+    
+    char line[MAX_LOG_LINE];
+    long offset = 0;
+    fseek(cache_file, 0, SEEK_SET);
+    while (fgets(line, sizeof(line), cache_file)) {
+        unsigned int seq = (unsigned int)strtoul(line, NULL, 10);
+        if (seq != cache_seq + 1) {
+            break; // Truncated or damaged: keep the good prefix
+        }
+        cache_record(seq, NULL);
+        if (cache_seq != seq) {
+            break;
+        }
+        cache_offsets[seq - 1] = offset;
+        offset = ftell(cache_file);
+    }
+    fseek(cache_file, 0, SEEK_END);
+    
+    printf("History cache: %s (%u records)\n", path, cache_seq);
+}
+
+// Forget every cached record (the server's log no longer matches it)
+void reset_history_cache() {
+    char path[64];
+    snprintf(path, sizeof(path), "history_%s_%d.txt", server_ip, server_port);
+    
+    WaitForSingleObject(cache_mutex, INFINITE);
+    if (cache_file != NULL) {
+        fclose(cache_file);
+    }
+    cache_file = fopen(path, "w+");
+    cache_seq = 0;
+    ReleaseMutex(cache_mutex);
+}
+
+// Append record seq to the cache if it is the next one. A NULL line only
+// indexes a record already in the file (used while loading it).
+// Returns 0 if records between the cache and seq are missing
+int cache_record(unsigned int seq, const char *line) {
+    int result = 1;
+    
+    WaitForSingleObject(cache_mutex, INFINITE);
+    if (seq > cache_seq + 1) {
+        result = 0;
+    } else if (seq == cache_seq + 1 && cache_file != NULL) {
+        if (seq > cache_capacity) {
+            unsigned int new_capacity = cache_capacity ? cache_capacity * 2 : 1024;
+            long *grown = realloc(cache_offsets, new_capacity * sizeof(long));
+            if (grown == NULL) {
+                ReleaseMutex(cache_mutex);
+                return 1; // Stop caching rather than fail the message
+            }
+            cache_offsets = grown;
+            cache_capacity = new_capacity;
+        }
+        if (line != NULL) {
+            fseek(cache_file, 0, SEEK_END);
+            cache_offsets[seq - 1] = ftell(cache_file);
+            fprintf(cache_file, "%u %s\n", seq, line);
+            fflush(cache_file);
+        }
+        cache_seq = seq;
+    }
+    ReleaseMutex(cache_mutex);
+    
+    return result;
+}
+
+// Ask for every record after the high-water mark (unless already asking)
+void sync_history_cache() {
+    if (sync_request_id != 0 || cache_file == NULL) {
+        return;
+    }
+    
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.type = MSG_HISTORY;
+    msg.seq = cache_seq;
+    unsigned int request_id = track_request(&msg);
+    
+    ResetEvent(sync_done);
+    sync_request_id = request_id;
+    cache_behind = 0;
+    if (!send_frame(&msg)) {
+        finish_request(request_id, 0);
+        cache_behind = 1;
+        finish_sync();
+    }
+}
+
+// The sync ended (or failed): wake anyone waiting and show pending output
+void finish_sync() {
+    sync_request_id = 0;
+    SetEvent(sync_done);
+    
+    if (show_after_sync) {
+        show_after_sync = 0;
+        show_cached_history(show_query[0] ? show_query : NULL, show_last);
+    }
+}
+
+// A long history record comes in parts, numbered like message fragments
+// and in order. Returns the whole line once the last part is in, else NULL.
+const char *join_history_part(const Message *msg) {
+    if (msg->fragment <= 1) {
+        history_length = 0;
+    }
+    int length = (int)strnlen(msg->content, MAX_MESSAGE);
+    if (length > (int)sizeof(history_line) - 1 - history_length) {
+        length = (int)sizeof(history_line) - 1 - history_length;
+    }
+    memcpy(history_line + history_length, msg->content, length);
+    history_length += length;
+    history_line[history_length] = '\0';
+    return msg->fragment >= msg->fragments ? history_line : NULL;
+}
+
+// One frame of a sync: cache the record (line, joined if it came in
+// parts), or finish up at the end marker
+void handle_sync_frame(const Message *msg, const char *line) {
+    if (strncmp(line, "--- End of History", 18) != 0) {
+        if (msg->seq != 0) {
+            cache_record(msg->seq, line);
+        }
+        return;
+    }
+    
+    // The end marker carries the server's last seq; a shorter log means the
+    // server's history was replaced, so start the cache over
+    if (msg->seq < cache_seq) {
+        printf("\nServer history no longer matches the local cache - refreshing it.\n");
+        sync_request_id = 0;
+        reset_history_cache();
+        sync_history_cache();
+        return;
+    }
+    
+    finish_sync();
+}
+
+// Print cached records (the last `last` of them, or all if 0), optionally
+// only those containing query - no server round trip
+void show_cached_history(const char *query, unsigned int last) {
+    char line[MAX_LOG_LINE];
+    int matches = 0;
+    
+    WaitForSingleObject(cache_mutex, INFINITE);
+    if (cache_file == NULL) {
+        ReleaseMutex(cache_mutex);
+        printf("Chat history not available.\n");
+        return;
+    }
+    
+    log_query_t prepared;
+    if (query != NULL) {
+        prepare_log_query(query, &prepared);
+    }
+    
+    unsigned int first = (last != 0 && cache_seq > last) ? cache_seq - last + 1 : 1;
+    if (query != NULL) {
+        printf("\n--- Search results for \"%s\" ---\n", query);
+    } else {
+        printf("\n--- Chat History ---\n");
+    }
+    
+    fseek(cache_file, first <= cache_seq ? cache_offsets[first - 1] : 0, SEEK_SET);
+    for (unsigned int seq = first; seq <= cache_seq && fgets(line, sizeof(line), cache_file); seq++) {
+        line[strcspn(line, "\n")] = 0;
+        char *text = strchr(line, ' ');
+        text = text ? text + 1 : line;
+        if (query != NULL && !log_line_matches(text, &prepared)) {
+            continue;
+        }
+        char shown[MAX_LOG_LINE];
+        display_log_line(text, shown, sizeof(shown));
+        printf("%s\n", shown);
+        matches++;
+    }
+    fseek(cache_file, 0, SEEK_END);
+    ReleaseMutex(cache_mutex);
+    
+    if (query != NULL) {
+        printf("--- End of History (%d matches) ---\n", matches);
+    } else {
+        printf("--- End of History ---\n");
+    }
+}
+
+void upload_file_menu() {
+    char path[MAX_PATH];
+    char recipient[MAX_USERNAME];
+    
+    printf("\n===== Upload File =====\n");
+    printf("Enter file path: ");
+    fgets(path, sizeof(path), stdin);
+    path[strcspn(path, "\n")] = 0; // Remove newline
+    
+    printf("Send to (username, or Enter for everyone): ");
+    fgets(recipient, sizeof(recipient), stdin);
+    recipient[strcspn(recipient, "\n")] = 0; // Remove newline
+    
+    if (!begin_upload(path, recipient[0] ? recipient : NULL)) {
+        return;
+    }
+    
+    // The receiver thread gets the server's answer to the offer
+    if (WaitForSingleObject(upload_ready, 15000) != WAIT_OBJECT_0) {
+        printf("No response from server - the upload will resume after reconnecting.\n");
+        return;
+    }
+    while (pump_upload(64)) {
+        printf("\rSent %u of %u chunks", upload_next, upload_chunks);
+        fflush(stdout);
+    }
+    printf("\n");
+}
+
+void download_file_menu() {
+    char hash[SHA256_HEX_LEN + 2];
+    char name[MAX_PATH];
+    
+    printf("\n===== Download File =====\n");
+    printf("Enter file ID: ");
+    fgets(hash, sizeof(hash), stdin);
+    hash[strcspn(hash, "\n")] = 0; // Remove newline
+    
+    printf("Save as: ");
+    fgets(name, sizeof(name), stdin);
+    name[strcspn(name, "\n")] = 0; // Remove newline
+    
+    // The receiver thread writes the file and reports when it's done
+    begin_download(hash, name);
+}
+
+// Hash the file and offer it to the server; recipient NULL = everyone
+// Returns 0 if the upload could not be started
+int begin_upload(const char *path, const char *recipient) {
+    if (upload_file != NULL) {
+        printf("An upload is already in progress.\n");
+        return 0;
+    }
+    unsigned int recipient_id = 0;
+    if (recipient != NULL && (recipient_id = find_user_id(recipient)) == 0) {
+        printf("No such user: %s\n", recipient);
+        return 0;
+    }
+    
+    unsigned char digest[SHA256_LEN];
+    if (!sha256_file(path, digest, &upload_size) || (upload_file = fopen(path, "rb")) == NULL) {
+        printf("Cannot read %s\n", path);
+        return 0;
+    }
+    hex_encode(digest, SHA256_LEN, upload_hash);
+    upload_chunks = (unsigned int)((upload_size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE);
+    
+    const char *name = path;
+    for (const char *p = path; *p; p++) {
+        if (*p == '\\' || *p == '/') {
+            name = p + 1;
+        }
+    }
+    strncpy(upload_name, name, MAX_PATH - 1);
+    upload_name[MAX_PATH - 1] = '\0';
+    upload_recipient_id = recipient_id;
+    
+    send_upload_offer();
+    return 1;
+}
+
+// The server answers with the chunk to (re)start from
+void send_upload_offer() {
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.type = MSG_FILE_OFFER;
+    msg.recipient_id = upload_recipient_id;
+    snprintf(msg.content, MAX_MESSAGE, "%llu %s %s", upload_size, upload_hash, upload_name);
+    
+    ResetEvent(upload_ready);
+    upload_sending = 0;
+    upload_request_id = track_request(&msg);
+    send_frame(&msg);
+}
+
+// Send up to max_chunks more chunks of the upload
+// Returns 1 while there is more to send
+int pump_upload(int max_chunks) {
+    Message msg;
+    
+    WaitForSingleObject(upload_mutex, INFINITE);
+    for (int sent = 0; sent < max_chunks && upload_sending && upload_next < upload_chunks; sent++) {
+        memset(&msg, 0, sizeof(Message));
+        msg.type = MSG_FILE_CHUNK;
+        msg.seq = upload_next;
+        msg.request_id = upload_request_id;
+        
+        _fseeki64(upload_file, (long long)upload_next * FILE_CHUNK_SIZE, SEEK_SET);
+        msg.length = (unsigned int)fread(msg.content, 1, FILE_CHUNK_SIZE, upload_file);
+        
+        // A full socket buffer waits for FD_WRITE; a failed send waits for
+        // the reconnect, which re-offers the file
+        int sent = try_send_frame(&msg);
+        upload_blocked = sent < 0;
+        if (sent < 0) {
+            break;
+        }
+        if (sent == 0) {
+            upload_sending = 0;
+            break;
+        }
+        upload_next++;
+    }
+    
+    // Everything is sent: the server confirms once it has checked the hash
+    if (upload_next >= upload_chunks) {
+        upload_sending = 0;
+    }
+    int more = upload_sending;
+    ReleaseMutex(upload_mutex);
+    return more;
+}
+
+// The server's answer to an offer, its completion notice or an error
+void handle_upload_response(const Message *msg) {
+    WaitForSingleObject(upload_mutex, INFINITE);
+    if (msg->type == MSG_SUCCESS && msg->seq < upload_chunks) {
+        upload_next = msg->seq;
+        upload_sending = 1;
+        upload_blocked = 0;
+        SetEvent(upload_ready);
+    } else {
+        // Complete (or already on the server), or failed
+        end_upload();
+    }
+    ReleaseMutex(upload_mutex);
+}
+
+void end_upload() {
+    WaitForSingleObject(upload_mutex, INFINITE);
+    if (upload_file != NULL) {
+        fclose(upload_file);
+        upload_file = NULL;
+    }
+    upload_sending = 0;
+    upload_request_id = 0;
+    SetEvent(upload_ready);
+    ReleaseMutex(upload_mutex);
+}
+
+// Download an attachment into name, resuming a partial name.part
+// Returns 0 if it could not be started
+int begin_download(const char *hash, const char *name) {
+    if (download_file != NULL) {
+        printf("A download is already in progress.\n");
+        return 0;
+    }
+    
+    char part_path[MAX_PATH];
+    snprintf(part_path, sizeof(part_path), "%s.part", name);
+    download_file = fopen(part_path, "r+b");
+    if (download_file == NULL) {
+        download_file = fopen(part_path, "w+b");
+    }
+    if (download_file == NULL) {
+        printf("Cannot write %s\n", part_path);
+        return 0;
+    }
+    
+    strncpy(download_hash, hash, SHA256_HEX_LEN - 1);
+    download_hash[SHA256_HEX_LEN - 1] = '\0';
+    strncpy(download_name, name, MAX_PATH - 1);
+    download_name[MAX_PATH - 1] = '\0';
+    
+    _fseeki64(download_file, 0, SEEK_END);
+    long long stored = _ftelli64(download_file);
+    download_received = stored > 0 ? (unsigned long long)stored : 0;
+    download_size = 0;
+    
+    send_download_request();
+    return 1;
+}
+
+// Ask for the file from the last whole chunk we have
+void send_download_request() {
+    unsigned int from_chunk = (unsigned int)(download_received / FILE_CHUNK_SIZE);
+    download_received = (unsigned long long)from_chunk * FILE_CHUNK_SIZE;
+    _fseeki64(download_file, (long long)download_received, SEEK_SET);
+    raw_remaining = 0;
+    
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.type = MSG_FILE_GET;
+    msg.seq = from_chunk;
+    strcpy(msg.content, download_hash);
+    download_request_id = track_request(&msg);
+    send_frame(&msg);
+}
+
+// A header with the file's size, or a segment whose raw bytes follow
+void handle_download_frame(const Message *msg) {
+    if (msg->length == 0) {
+        unsigned long long size;
+        char hash[SHA256_HEX_LEN];
+        if (sscanf(msg->content, "%llu %64s", &size, hash) != 2 || strcmp(hash, download_hash) != 0) {
+            printf("\nUnexpected download response.\n");
+            return;
+        }
+        download_size = size;
+        printf("\nDownloading %s (%llu bytes)...\n", download_name, size);
+        if (download_received >= download_size) {
+            finish_download();
+        }
+        return;
+    }
+    
+    raw_remaining = msg->length;
+    
+    // The event loop reads them as they arrive; the receiver thread can block
+    if (!event_loop_mode) {
+        read_download_data();
+    }
+}
+
+void read_download_data() {
+    char data[4096];
+    
+    while (raw_remaining > 0) {
+        int received = recv(server_socket, data,
+                            raw_remaining < sizeof(data) ? (int)raw_remaining : (int)sizeof(data), 0);
+        if (received <= 0) {
+            return; // The receiver notices the disconnect and resumes
+        }
+        raw_remaining -= received;
+        write_download_data(data, received);
+    }
+}
+
+void write_download_data(const char *data, int length) {
+    if (download_file == NULL) {
+        return; // Download was abandoned - discard
+    }
+    
+    fwrite(data, 1, length, download_file);
+    download_received += length;
+    if (download_size != 0 && download_received >= download_size) {
+        finish_download();
+    }
+}
+
+// Everything arrived: check the content hash and give the file its name
+void finish_download() {
+    char part_path[MAX_PATH];
+    snprintf(part_path, sizeof(part_path), "%s.part", download_name);
+    
+    fclose(download_file);
+    download_file = NULL;
+    download_request_id = 0;
+    
+    unsigned char digest[SHA256_LEN];
+    char digest_hex[SHA256_HEX_LEN];
+    unsigned long long size;
+    if (!sha256_file(part_path, digest, &size)) {
+        printf("\nCannot read %s\n", part_path);
+        return;
+    }
+    hex_encode(digest, SHA256_LEN, digest_hex);
+    
+    if (strcmp(digest_hex, download_hash) != 0) {
+        DeleteFile(part_path);
+        printf("\nDownload of %s was corrupted - try again.\n", download_name);
+    } else if (!MoveFileEx(part_path, download_name, MOVEFILE_REPLACE_EXISTING)) {
+        printf("\nDownloaded to %s (could not rename it).\n", part_path);
+    } else {
+        printf("\nDownloaded %s (%llu bytes).\n", download_name, size);
+    }
+}
+
+// Send an MSG_MULTICAST request; returns its request ID
+unsigned int send_multicast_request(const char *content) {
+    Message msg;
+    memset(&msg, 0, sizeof(Message));
+    msg.type = MSG_MULTICAST;
+    strncpy(msg.content, content, MAX_MESSAGE - 1);
+    unsigned int request_id = track_request(&msg);
+    send_frame(&msg);
+    return request_id;
+}
+
+// Ask for public messages over multicast (after a login or resume); the
+// reply says where to join and the seq to start after
+void multicast_subscribe() {
+    if (!multicast_wanted) {
+        return;
+    }
+    multicast_close();
+    mcast_request_id = send_multicast_request("on");
+}
+
+// Leave the group and forget what was held (logout, or subscribing again)
+void multicast_close() {
+    if (mcast_socket != INVALID_SOCKET) {
+        closesocket(mcast_socket);
+        mcast_socket = INVALID_SOCKET;
+    }
+    memset(mcast_window_seq, 0, sizeof(mcast_window_seq));
+    mcast_next = 0;
+    mcast_highest = 0;
+    mcast_request_id = 0;
+    mcast_repair_id = 0;
+}
+
+// Join group on --multicast-if (or any interface); several clients on one
+// host can listen on the same port
+// Returns 0 if the socket can't be set up
+int open_multicast(const char *group, int port) {
+    SOCKET sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (sock == INVALID_SOCKET) {
+        return 0;
+    }
+    BOOL reuse = TRUE;
+    setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, (const char *)&reuse, sizeof(reuse));
+    
+    struct sockaddr_in local;
+    memset(&local, 0, sizeof(local));
+    local.sin_family = AF_INET;
+    local.sin_port = htons(port);
+    local.sin_addr.s_addr = htonl(INADDR_ANY);
+    
+    struct ip_mreq membership;
+    membership.imr_multiaddr.s_addr = inet_addr(group);
+    membership.imr_interface.s_addr = multicast_if[0] != '\0' ? inet_addr(multicast_if) : htonl(INADDR_ANY);
+    u_long non_blocking = 1;
+    if (bind(sock, (struct sockaddr *)&local, sizeof(local)) == SOCKET_ERROR ||
+        setsockopt(sock, IPPROTO_IP, IP_ADD_MEMBERSHIP, (const char *)&membership, sizeof(membership)) == SOCKET_ERROR ||
+        ioctlsocket(sock, FIONBIO, &non_blocking) == SOCKET_ERROR ||
+        (event_loop_mode && WSAEventSelect(sock, mcast_event, FD_READ) == SOCKET_ERROR)) {
+        printf("\nMulticast setup failed. Error Code: %d\n", WSAGetLastError());
+        closesocket(sock);
+        return 0;
+    }
+    mcast_socket = sock;
+    return 1;
+}
+
+// The server's answer to "on", "off" or "repair"
+// Returns 1 if something was printed
+int handle_multicast_reply(const Message *msg) {
+    if (strncmp(msg->content, "repaired", 8) == 0) {
+        return msg->request_id == mcast_repair_id ? multicast_repair_done() > 0 : 0;
+    }
+    if (msg->request_id == 0 || msg->request_id != mcast_request_id) {
+        return 0; // Superseded by a later subscribe
+    }
+    mcast_request_id = 0;
+    
+    unsigned int epoch = 0;
+    if (sscanf(msg->content, "off %u", &epoch) == 1) {
+        // Public messages after msg_id come over TCP now; whatever the
+        // group still owed us before it is repaired. A different epoch is
+        // a different server (an upgrade took our connection over), which
+        // never sent us anything: start over with it instead.
+        if (mcast_socket != INVALID_SOCKET) {
+            closesocket(mcast_socket);
+            mcast_socket = INVALID_SOCKET;
+        }
+        if (epoch != mcast_epoch && multicast_wanted) {
+            multicast_deliver(0);
+            cache_behind = 1;
+            multicast_subscribe();
+            return 0;
+        }
+        if (msg->msg_id > mcast_highest) {
+            mcast_highest = msg->msg_id;
+        }
+        multicast_request_repair();
+        printf("\n[MULTICAST] Public messages back over TCP\n");
+        return 1;
+    }
+    
+    // "<group> <port> <epoch> <key hex>": everything after msg_id goes to
+    // the group only, so even if joining fails those seqs are ours to repair
+    char group[16];
+    char key_hex[MCAST_KEY_HEX_LEN];
+    int port;
+    mcast_next = msg->msg_id + 1;
+    mcast_highest = msg->msg_id;
+    if (sscanf(msg->content, "%15s %d %u %64s", group, &port, &mcast_epoch, key_hex) != 4 ||
+        strlen(key_hex) != MCAST_KEY_LEN * 2 || !hex_decode(key_hex, mcast_key, MCAST_KEY_LEN) ||
+        !open_multicast(group, port)) {
+        printf("\n[MULTICAST] Could not join the group; staying on TCP\n");
+        multicast_wanted = 0;
+        mcast_request_id = send_multicast_request("off");
+        return 1;
+    }
+    mcast_heard = GetTickCount();
+    printf("\n[MULTICAST] Public messages now over %s:%d\n", group, port);
+    return 1;
+}
+
+// Read every datagram waiting on the group socket
+// Returns how many messages were shown
+int multicast_read() {
+    int shown = 0;
+    mcast_frame_t frame;
+    while (mcast_socket != INVALID_SOCKET) {
+        int received = recvfrom(mcast_socket, (char *)&frame, sizeof(mcast_frame_t), 0, NULL, NULL);
+        if (received == SOCKET_ERROR) {
+            break; // Drained
+        }
+        // Only our server's key opens a datagram, so nobody else on the LAN
+        // can inject messages. Another server instance's seqs mean nothing
+        // to us; if ours has gone, the silence check notices. Even a sealed
+        // seq can't be further ahead than the server's repair ring.
+        if (!mcast_open(mcast_key, &frame, received) || frame.epoch != mcast_epoch ||
+            (frame.seq > mcast_highest && frame.seq - mcast_highest > MCAST_RING)) {
+            continue;
+        }
+        mcast_heard = GetTickCount();
+        
+        if (event_loop_mode) {
+            clear_input_line();
+        }
+        if (frame.length == 0) {
+            // Heartbeat: anything up to its seq we haven't had was lost
+            if (frame.seq > mcast_highest) {
+                mcast_highest = frame.seq;
+            }
+            multicast_request_repair();
+        } else {
+            shown += multicast_accept(frame.seq, &frame.msg);
+        }
+        if (event_loop_mode) {
+            redraw_input_line();
+        }
+    }
+    return shown;
+}
+
+// Take public message seq, from the group or a repair, and deliver all
+// that is now in order. Returns how many were shown
+int multicast_accept(unsigned int seq, const Message *msg) {
+    if (mcast_next == 0 || seq < mcast_next) {
+        return 0; // Already delivered (or given up on)
+    }
+    
+    // Too far ahead to hold: give up on the oldest gap
+    int shown = 0;
+    if (seq - mcast_next >= MCAST_WINDOW) {
+        shown += multicast_deliver(seq - MCAST_WINDOW);
+    }
+    mcast_window[seq % MCAST_WINDOW] = *msg;
+    mcast_window_seq[seq % MCAST_WINDOW] = seq;
+    if (seq > mcast_highest) {
+        mcast_highest = seq;
+    }
+    
+    shown += multicast_deliver(0);
+    multicast_request_repair();
+    return shown;
+}
+
+// Deliver held messages in seq order, counting any missing seq up to
+// through as lost. Returns how many were shown (a loss notice included)
+int multicast_deliver(unsigned int through) {
+    int shown = 0, lost = 0;
+    while (1) {
+        unsigned int slot = mcast_next % MCAST_WINDOW;
+        if (mcast_window_seq[slot] == mcast_next) {
+            Message msg = mcast_window[slot];
+            mcast_window_seq[slot] = 0;
+            mcast_next++;
+            msg.request_id = 0;
+            msg.msg_id = 0;
+            // The group echoes our own messages; over TCP we never get them
+            if (own_user_id == 0 || msg.sender_id != own_user_id) {
+                shown += handle_incoming_message(&msg);
+            }
+        } else if (mcast_next <= through) {
+            lost++;
+            mcast_next++;
+        } else {
+            break;
+        }
+    }
+    
+    if (lost > 0) {
+        cache_behind = 1; // The next history view fetches them
+        printf("\n[MULTICAST] %d public message(s) could not be recovered\n", lost);
+        shown++;
+    }
+    return shown;
+}
+
+// Ask for the oldest gap over TCP, one repair at a time
+void multicast_request_repair() {
+    if (mcast_repair_id != 0 || mcast_next == 0 || mcast_highest < mcast_next) {
+        return;
+    }
+    unsigned int to = mcast_highest;
+    if (to - mcast_next >= MCAST_WINDOW) {
+        to = mcast_next + MCAST_WINDOW - 1;
+    }
+    while (to > mcast_next && mcast_window_seq[to % MCAST_WINDOW] == to) {
+        to--; // Already held
+    }
+    
+    char content[64];
+    snprintf(content, sizeof(content), "repair %u %u", mcast_next, to);
+    mcast_repair_to = to;
+    mcast_repair_id = send_multicast_request(content);
+}
+
+// The repair is over: what it didn't bring is lost. Returns how many
+// messages were shown
+int multicast_repair_done() {
+    mcast_repair_id = 0;
+    int shown = multicast_deliver(mcast_repair_to);
+    multicast_request_repair();
+    return shown;
+}
+
+// Nothing from the group for MCAST_SILENCE_MS, heartbeats included:
+// multicast isn't reaching us (or the server changed), so ask for TCP
+// Returns 1 if a notice was printed
+int multicast_poll() {
+    if (mcast_socket == INVALID_SOCKET || mcast_request_id != 0 ||
+        GetTickCount() - mcast_heard < MCAST_SILENCE_MS) {
+        return 0;
+    }
+    if (event_loop_mode) {
+        clear_input_line();
+    }
+    printf("\n[MULTICAST] Nothing heard from the group for %d s\n", MCAST_SILENCE_MS / 1000);
+    if (event_loop_mode) {
+        redraw_input_line();
+    }
+    mcast_request_id = send_multicast_request("off");
+    return 1;
+}
+
 void cleanup() {
     // If logged in, send logout message
     if (logged_in) {
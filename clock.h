@@ -0,0 +1,103 @@
+#ifndef CLOCK_H
+#define CLOCK_H
+// Coarse server clock: a ticker thread publishes the current time so that
+// stamping a message is a read and a copy, not a system call and a format
+#include "common.h"
+
+#define CLOCK_TICK_MS 10              // Resolution of message timestamps
+#define CLOCK_IDLE_TICKS 100          // Unread ticks before the ticker sleeps
+
+volatile LONGLONG clock_us = 0;       // Epoch microseconds as of the last tick
+volatile LONG clock_version = 0;      // Odd while clock_text is being rewritten
+char clock_text[26];                  // clock_us formatted for display
+unsigned long long clock_text_second = 0;
+volatile LONG clock_read = 0;         // Someone read the time since the last tick
+volatile LONG clock_idle = 0;         // 1 = the ticker sleeps, 2 = a reader is ticking
+HANDLE clock_wake;                    // Auto-reset: wakes an idle ticker
+
+// Publish the time; the text is only reformatted when the second changes
+void clock_tick() {
+    unsigned long long now = epoch_us_now();
+    unsigned long long second = now / 1000000;
+
+    if (second != clock_text_second) {
+        char text[26];
+        format_timestamp(now, text, sizeof(text));
+
+        InterlockedIncrement(&clock_version);
+        memcpy(clock_text, text, sizeof(clock_text));
+        InterlockedIncrement(&clock_version);
+        clock_text_second = second;
+    }
+    InterlockedExchange64(&clock_us, (LONGLONG)now);
+}
+
+// Ticks while the time is being read. After CLOCK_IDLE_TICKS without a
+// reader it stops waking up until one comes along.
+DWORD WINAPI clock_ticker(LPVOID arg) {
+    int unread = 0;
+    while (1) {
+        Sleep(CLOCK_TICK_MS);
+        unread = InterlockedExchange(&clock_read, 0) ? 0 : unread + 1;
+        if (unread >= CLOCK_IDLE_TICKS) {
+            // The reader that clears clock_idle ticks for us before waking
+            // us, so there is only ever one writer
+            InterlockedExchange(&clock_idle, 1);
+            WaitForSingleObject(clock_wake, INFINITE);
+            unread = 0;
+            continue;
+        }
+        clock_tick();
+    }
+    return 0;
+}
+
+// Call once before any thread stamps messages
+int clock_start() {
+    clock_tick();
+    clock_wake = CreateEvent(NULL, FALSE, FALSE, NULL);
+    if (clock_wake == NULL) {
+        return 0;
+    }
+    HANDLE ticker = CreateThread(NULL, 0, clock_ticker, NULL, 0, NULL);
+    if (ticker == NULL) {
+        return 0;
+    }
+    CloseHandle(ticker);
+    return 1;
+}
+
+unsigned long long clock_now_us() {
+    // The first read after a quiet spell refreshes the stale time itself;
+    // any other reader meanwhile waits the moment that takes
+    if (clock_idle) {
+        if (InterlockedCompareExchange(&clock_idle, 2, 1) == 1) {
+            clock_tick();
+            InterlockedExchange(&clock_idle, 0);
+            SetEvent(clock_wake);
+        }
+        while (clock_idle == 2) {
+            YieldProcessor();
+        }
+    }
+    if (!clock_read) {
+        InterlockedExchange(&clock_read, 1);
+    }
+    return (unsigned long long)InterlockedCompareExchange64(&clock_us, 0, 0);
+}
+
+// Stamp a message with the current time, epoch and preformatted
+void clock_stamp(Message *msg) {
+    msg->time_us = clock_now_us();
+
+    // Retry if the ticker rewrote the text while we were copying it
+    LONG version;
+    do {
+        version = clock_version;
+        MemoryBarrier();
+        memcpy(msg->timestamp, clock_text, sizeof(msg->timestamp));
+        MemoryBarrier();
+    } while ((version & 1) != 0 || version != clock_version);
+}
+
+#endif // CLOCK_H
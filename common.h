@@ -1,6 +1,7 @@
 #ifndef COMMON_H
 #define COMMON_H
 // common header file-
+#define _CRT_RAND_S  // Enables rand_s() for session tokens
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -20,11 +21,12 @@
 #define MAX_USERNAME 50
 #define MAX_PASSWORD 50
 #define MAX_MESSAGE 1000
+#define MAX_LOG_LINE (MAX_USERNAME * 2 + MAX_MESSAGE * 2 + 64) // One record, content escaped
 #define BUFFER_SIZE 1200
-#define MAX_CLIENTS 10
 #define USERS_FILE "users.txt"
 #define CHATLOG_FILE "chatlog.txt"
 #define SERVER_PORT 8888
+#define SESSION_TOKEN_LEN 33 // 32 hex chars + terminator
 
 // Message types:-
 #define MSG_REGISTER 1
@@ -35,31 +37,329 @@
 #define MSG_LOGOUT 6
 #define MSG_SUCCESS 7
 #define MSG_ERROR 8
+#define MSG_SEARCH 9
+#define MSG_REPL_SUBSCRIBE 10 // Follower -> leader: stream log records after seq
+#define MSG_REPL_RECORD 11    // Leader -> follower: one log record
+#define MSG_RESUME 12         // Reconnect with a session token from seq
+#define MSG_ACK 13            // Cumulative ack: every msg_id up to this one was received
+#define MSG_FILE_OFFER 14     // Start/resume an upload: content = "<size> <sha256 hex> <name>"
+#define MSG_FILE_CHUNK 15     // Upload data: chunk seq, length bytes of content
+#define MSG_FILE_GET 16       // Download: content = sha256 hex, from chunk seq
+#define MSG_FILE_DATA 17      // Download header; length raw file bytes follow it
+#define MSG_STATS 18          // Admin: server metrics as text, one or more frames
+#define MSG_TRACE 19          // Admin: content = "on [every]", "off" or "dump"
+#define MSG_MULTICAST 20      // Public messages over multicast: content = "on", "off" or "repair <from> <to>"
+#define MSG_USERS 21          // Server -> client: user names, content = "<id> <name>\n" lines
+
+#define ACK_BATCH 16          // Server acks at least every ACK_BATCH messages
+#define MAX_UNACKED 64        // Client send window (and server dedup window)
+#define FILE_CHUNK_SIZE MAX_MESSAGE // Transfer offsets are in units of this
+#define FRAGMENT_TEXT (MAX_MESSAGE - 2) // Text per fragment (after the '#' marker, before the terminator)
+#define MAX_LONG_MESSAGE 16384 // Default cap on a chat/private message's text
 
 // Message structure - defined in common.h only
 typedef struct {
     int type;
-    char sender[MAX_USERNAME];
-    char recipient[MAX_USERNAME]; // For private messages only 
-    char timestamp[26];
+    unsigned int seq; // Chat log sequence number (1-based line number), 0 if not a log record
+    unsigned int msg_id; // Client-assigned per-session ID for chat/private messages, 0 if none
+                         // (server -> client multicast repairs and replies: the multicast seq)
+    unsigned int request_id; // Client-assigned; echoed on every response to the request, 0 if none
+    unsigned int length; // Bytes of binary payload (file transfers), 0 for text
+    unsigned short fragment;  // Long chat/private messages: this is part fragment
+    unsigned short fragments; // of fragments (both 0 for a message that fits one frame)
+    unsigned int sender_id;    // Server-assigned user IDs (0 = SERVER, or no recipient).
+    unsigned int recipient_id; // Frames carry no names: clients learn them from MSG_USERS
+    unsigned long long time_us; // When the server stamped it: epoch microseconds (0 = none)
+    char timestamp[26];           // The same time preformatted, for display only
+    char token[SESSION_TOKEN_LEN]; // Session token (login response / resume request)
     char content[MAX_MESSAGE];
 } Message;
 
 // Client structure - defined in common.h only
 typedef struct {
     SOCKET socket;
-    char username[MAX_USERNAME];
     int is_logged_in;
+    int is_follower; // Replication follower subscribed to the chat log
+    int session;     // Index into the server's session table, -1 if none
+    int auth_pending; // Register/login queued on the auth worker pool
+    unsigned int user_id; // Interned username while logged in, 0 otherwise (the name is looked up from it)
+    unsigned int generation; // Bumped each time the server frees the slot
+    int live;        // Position in the server's list of logged-in clients, -1 if none
+    int is_multicast; // Gets public messages over multicast instead of this connection
 } client_t;
 
+// Receive exactly size bytes from a blocking socket: TCP may split a frame
+// across reads or join it to the next, so one recv isn't one Message.
+// Returns size, or what the failing recv returned (0 closed, SOCKET_ERROR).
+int recv_full(SOCKET sock, char *buffer, int size) {
+    int received = 0;
+    while (received < size) {
+        int got = recv(sock, buffer + received, size - received, 0);
+        if (got <= 0) {
+            return got;
+        }
+        received += got;
+    }
+    return received;
+}
+
+// Current time as microseconds since the Unix epoch
+unsigned long long epoch_us_now() {
+    FILETIME ft;
+    GetSystemTimeAsFileTime(&ft); // 100 ns units since 1601
+    unsigned long long ticks = ((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+    return (ticks - 116444736000000000ULL) / 10;
+}
+
+// Local time for display, e.g. "2024-05-01 12:00:00"
+void format_timestamp(unsigned long long time_us, char *timestamp, size_t size) {
+    time_t seconds = (time_t)(time_us / 1000000);
+    struct tm local_time;
+    
+    // localtime() shares one buffer between threads; localtime_s doesn't
+    if (localtime_s(&local_time, &seconds) != 0) {
+        snprintf(timestamp, size, "%llu", time_us);
+        return;
+    }
+    strftime(timestamp, size, "%Y-%m-%d %H:%M:%S", &local_time);
+}
+
 // Function to get current timestamp
 void get_timestamp(char *timestamp, size_t size) {
-    time_t now;
-    struct tm *local_time;
+    format_timestamp(epoch_us_now(), timestamp, size);
+}
+
+// A received message's time for display: formatted here from time_us,
+// or as the sender formatted it if it has none
+void message_time(const Message *msg, char *timestamp, size_t size) {
+    if (msg->time_us != 0) {
+        format_timestamp(msg->time_us, timestamp, size);
+    } else {
+        snprintf(timestamp, size, "%s", msg->timestamp);
+    }
+}
+
+// A record must stay on one line: newlines in the text (and the backslash
+// that escapes them) are written as \n, \r and \\. out needs room for
+// twice the text.
+void escape_log_text(const char *text, char *out, size_t size) {
+    size_t used = 0;
+    for (; *text != '\0' && used + 2 < size; text++) {
+        if (*text == '\n' || *text == '\r' || *text == '\\') {
+            out[used++] = '\\';
+            out[used++] = *text == '\n' ? 'n' : *text == '\r' ? 'r' : '\\';
+        } else {
+            out[used++] = *text;
+        }
+    }
+    out[used] = '\0';
+}
+
+// Undo escape_log_text in place. Any other backslash (older records,
+// Windows paths) is left as it is.
+void unescape_log_text(char *text) {
+    char *out = text;
+    for (; *text != '\0'; text++) {
+        if (*text == '\\' && (text[1] == 'n' || text[1] == 'r' || text[1] == '\\')) {
+            text++;
+            *out++ = *text == 'n' ? '\n' : *text == 'r' ? '\r' : '\\';
+        } else {
+            *out++ = *text;
+        }
+    }
+    *out = '\0';
+}
+
+// A chat log record: the frame's fields plus the names the log spells out,
+// which frames carry only as IDs
+typedef struct {
+    Message msg;
+    char sender[MAX_USERNAME];
+    char recipient[MAX_USERNAME]; // For private messages only
+} log_record_t;
+
+// Format a record as one chat log line (without newline)
+void format_log_line(const log_record_t *record, char *line, size_t size) {
+    const Message *msg = &record->msg;
+    // Fragments of a long message are logged one per line, tagged " [k/n]"
+    char part[16] = "";
+    if (msg->fragments > 0) {
+        snprintf(part, sizeof(part), " [%u/%u]", msg->fragment, msg->fragments);
+    }
+    
+    // Records carry their epoch microseconds; formatting is left to
+    // whoever displays them (older records have the formatted time)
+    char when[32];
+    if (msg->time_us != 0) {
+        snprintf(when, sizeof(when), "%llu", msg->time_us);
+    } else {
+        snprintf(when, sizeof(when), "%s", msg->timestamp);
+    }
+    
+    char content[MAX_MESSAGE * 2];
+    escape_log_text(msg->content, content, sizeof(content));
+    
+    if (msg->type == MSG_PRIVATE) {
+        snprintf(line, size, "[%s] %s -> %s%s: %s", 
+                 when, record->sender, record->recipient, part, content);
+    } else {
+        snprintf(line, size, "[%s] %s%s: %s", 
+                 when, record->sender, part, content);
+    }
+}
+
+// Copy at most size-1 bytes of [start, end) into dest
+void copy_field(char *dest, size_t size, const char *start, const char *end) {
+    size_t len = (size_t)(end - start);
+    if (len >= size) {
+        len = size - 1;
+    }
+    memcpy(dest, start, len);
+    dest[len] = '\0';
+}
+
+// Parse a chat log line back into a record (inverse of format_log_line)
+// Returns 1 on success, 0 if the line is not a chat record (or has no sender)
+int parse_log_line(const char *line, log_record_t *record) {
+    memset(record, 0, sizeof(log_record_t));
+    Message *msg = &record->msg;
+    
+    // Timestamp: "[...] "
+    if (line[0] != '[') {
+        return 0;
+    }
+    const char *ts_end = strchr(line, ']');
+    if (ts_end == NULL || ts_end[1] != ' ') {
+        return 0;
+    }
+    // "[<epoch us>]", or "[<formatted time>]" in older records
+    size_t digits = strspn(line + 1, "0123456789");
+    if (digits > 0 && line + 1 + digits == ts_end) {
+        msg->time_us = strtoull(line + 1, NULL, 10);
+    } else {
+        copy_field(msg->timestamp, sizeof(msg->timestamp), line + 1, ts_end);
+    }
     
-    time(&now);
-    local_time = localtime(&now);
-    strftime(timestamp, size, "%Y-%m-%d %H:%M:%S", local_time);
+    // Sender (and recipient for private messages) up to the first ": "
+    const char *who = ts_end + 2;
+    const char *colon = strstr(who, ": ");
+    if (colon == NULL) {
+        return 0;
+    }
+    
+    // Fragment tag " [k/n]" right before the colon
+    const char *who_end = colon;
+    if (colon > who && colon[-1] == ']') {
+        const char *tag = colon - 1;
+        while (tag > who && *tag != '[') {
+            tag--;
+        }
+        unsigned int fragment, fragments;
+        if (tag > who && tag[-1] == ' ' && sscanf(tag, "[%u/%u]", &fragment, &fragments) == 2) {
+            msg->fragment = (unsigned short)fragment;
+            msg->fragments = (unsigned short)fragments;
+            who_end = tag - 1;
+        }
+    }
+    
+    const char *arrow = strstr(who, " -> ");
+    if (arrow != NULL && arrow < who_end) {
+        msg->type = MSG_PRIVATE;
+        copy_field(record->sender, sizeof(record->sender), who, arrow);
+        copy_field(record->recipient, sizeof(record->recipient), arrow + 4, who_end);
+    } else {
+        msg->type = MSG_CHAT;
+        copy_field(record->sender, sizeof(record->sender), who, who_end);
+    }
+    
+    // Unescaped, the text is at most half as long: it fits again
+    char content[MAX_MESSAGE * 2];
+    copy_field(content, sizeof(content), colon + 2, colon + 2 + strlen(colon + 2));
+    unescape_log_text(content);
+    copy_field(msg->content, sizeof(msg->content), content, content + strlen(content));
+    return record->sender[0] != '\0';
+}
+
+// A log line as shown to people: the epoch microseconds formatted as local
+// time. Lines that aren't records, or have no epoch time, are copied as is.
+void display_log_line(const char *line, char *out, size_t size) {
+    const char *ts_end = line[0] == '[' ? strchr(line, ']') : NULL;
+    size_t digits = strspn(line + (line[0] != '\0'), "0123456789");
+    if (ts_end == NULL || digits == 0 || line + 1 + digits != ts_end) {
+        snprintf(out, size, "%s", line);
+        return;
+    }
+    
+    char timestamp[26];
+    format_timestamp(strtoull(line + 1, NULL, 10), timestamp, sizeof(timestamp));
+    snprintf(out, size, "[%s%s", timestamp, ts_end);
+}
+
+// A history search, prepared once instead of formatting every record's
+// time to compare: the text is looked for in the names and message, and
+// a query that is a local date or time prefix ("2024-05-01",
+// "2024-05-01 14:30") also matches the records from that period
+typedef struct {
+    char text[MAX_MESSAGE];
+    unsigned long long from_us;   // Period matched, [from_us, to_us); 0 = none
+    unsigned long long to_us;
+} log_query_t;
+
+void prepare_log_query(const char *query, log_query_t *prepared) {
+    static const char *formats[] = {
+        "%d-%d-%d %d:%d:%d%n", "%d-%d-%d %d:%d%n", "%d-%d-%d %d%n", "%d-%d-%d%n", "%d-%d%n"
+    };
+    memset(prepared, 0, sizeof(log_query_t));
+    snprintf(prepared->text, sizeof(prepared->text), "%s", query);
+    
+    for (int i = 0; i < 5; i++) {
+        int field[6] = { 0, 1, 1, 0, 0, 0 };
+        int used = -1;
+        int *out[7] = { &field[0], &field[1], &field[2], &field[3], &field[4], &field[5], NULL };
+        out[6 - i] = &used; // %n follows the last field of this format
+        int count = sscanf(query, formats[i], out[0], out[1], out[2], out[3], out[4], out[5], out[6]);
+        if (count != 6 - i || used != (int)strlen(query) || field[0] < 1970) {
+            continue;
+        }
+        
+        // The period ends where the last field given ticks over
+        struct tm start;
+        memset(&start, 0, sizeof(start));
+        start.tm_year = field[0] - 1900;
+        start.tm_mon = field[1] - 1;
+        start.tm_mday = field[2];
+        start.tm_hour = field[3];
+        start.tm_min = field[4];
+        start.tm_sec = field[5];
+        start.tm_isdst = -1;
+        struct tm end = start;
+        int *last[] = { &end.tm_sec, &end.tm_min, &end.tm_hour, &end.tm_mday, &end.tm_mon };
+        (*last[i])++;
+        
+        time_t from = mktime(&start);
+        time_t to = mktime(&end);
+        if (from >= 0 && to > from) {
+            prepared->from_us = (unsigned long long)from * 1000000ULL;
+            prepared->to_us = (unsigned long long)to * 1000000ULL;
+        }
+        return;
+    }
+}
+
+// Match a log line without formatting its time. Records with a formatted
+// time (older logs) are matched as written.
+int log_line_matches(const char *line, const log_query_t *query) {
+    const char *ts_end = line[0] == '[' ? strchr(line, ']') : NULL;
+    size_t digits = strspn(line + (line[0] != '\0'), "0123456789");
+    if (ts_end == NULL || digits == 0 || line + 1 + digits != ts_end) {
+        return strstr(line, query->text) != NULL;
+    }
+    
+    unsigned long long time_us = strtoull(line + 1, NULL, 10);
+    if (time_us >= query->from_us && time_us < query->to_us) {
+        return 1;
+    }
+    return strstr(ts_end + 1, query->text) != NULL;
 }
 
 // Simple Caesar cipher encryption (shift by 3)
@@ -0,0 +1,288 @@
+#ifndef FILTER_H
+#define FILTER_H
+// Content filter: every pattern from the filter file compiled into one
+// Aho-Corasick automaton, so a message is checked against all of them in a
+// single pass. Transitions are a flat table of states x byte classes (bytes
+// that appear in no pattern share class 0, letters match either case), and
+// the scan skips ahead to the next byte that can start a pattern with SSE2
+// where available.
+//
+// Filter file lines are "<action> <pattern>", action one of reject, mask,
+// flag; blank lines and lines starting with # are skipped. Patterns match
+// anywhere in the text, including inside words.
+#include "common.h"
+#include <ctype.h>
+#if defined(_M_X64) || defined(__SSE2__)
+#include <emmintrin.h>
+#define FILTER_SSE2
+#endif
+
+#define FILTER_FLAG 1                // Let through, report it
+#define FILTER_MASK 2                // Let through with the match starred out
+#define FILTER_REJECT 4              // Don't deliver
+#define FILTER_MAX_PATTERN 255
+#define FILTER_MAX_STATES 65535      // Transitions are 16-bit
+#define FILTER_SIMD_BYTES 8          // Most distinct start bytes the SSE2 skip handles
+#define FILTER_NONE 0xFFFF           // No transition yet, while building
+
+typedef struct {
+    int patterns;
+    int states;
+    int classes;
+    unsigned char byte_class[256];
+    unsigned char is_start[256];     // Byte can begin a pattern
+    unsigned char start_bytes[FILTER_SIMD_BYTES];
+    int start_count;                 // 0 = too many start bytes for the SSE2 skip
+    unsigned short *next;            // next[state * classes + class]
+    unsigned char *actions;          // FILTER_* bits of every pattern ending at state
+    unsigned char *mask_length;      // Longest masked pattern ending at state
+} filter_t;
+
+void filter_free(filter_t *filter) {
+    if (filter != NULL) {
+        free(filter->next);
+        free(filter->actions);
+        free(filter->mask_length);
+        free(filter);
+    }
+}
+
+// Compile a filter file. Returns NULL (with a reason in error) if it can't
+// be read or has a bad line; an empty file gives a filter that matches nothing.
+filter_t *filter_load(const char *path, char *error, size_t error_size) {
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        snprintf(error, error_size, "cannot open %s", path);
+        return NULL;
+    }
+
+    // Patterns first: the alphabet and table size depend on all of them
+    int capacity = 64, count = 0, total = 0, line_number = 0;
+    char (*patterns)[FILTER_MAX_PATTERN + 1] = malloc(capacity * sizeof(*patterns));
+    unsigned char *pattern_actions = malloc(capacity);
+    char line[FILTER_MAX_PATTERN + 32];
+    error[0] = '\0';
+    while (patterns != NULL && pattern_actions != NULL && error[0] == '\0' && fgets(line, sizeof(line), file)) {
+        line_number++;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0' || line[0] == '#') {
+            continue;
+        }
+        char *pattern = strchr(line, ' ');
+        if (pattern != NULL) {
+            *pattern++ = '\0';
+        }
+        int action = strcmp(line, "reject") == 0 ? FILTER_REJECT :
+                     strcmp(line, "mask") == 0 ? FILTER_MASK :
+                     strcmp(line, "flag") == 0 ? FILTER_FLAG : 0;
+        if (action == 0 || pattern == NULL || pattern[0] == '\0' || strlen(pattern) > FILTER_MAX_PATTERN) {
+            snprintf(error, error_size, "%s:%d: expected \"reject|mask|flag <pattern>\"", path, line_number);
+            break;
+        }
+        if (count == capacity) {
+            capacity *= 2;
+            void *grown = realloc(patterns, capacity * sizeof(*patterns));
+            void *grown_actions = grown != NULL ? realloc(pattern_actions, capacity) : NULL;
+            if (grown != NULL) {
+                patterns = grown;
+            }
+            if (grown_actions == NULL) {
+                snprintf(error, error_size, "out of memory");
+                break;
+            }
+            pattern_actions = grown_actions;
+        }
+        for (int i = 0; pattern[i] != '\0'; i++) {
+            pattern[i] = (char)tolower((unsigned char)pattern[i]);
+        }
+        strcpy(patterns[count], pattern);
+        pattern_actions[count] = (unsigned char)action;
+        total += (int)strlen(pattern);
+        count++;
+    }
+    fclose(file);
+    if (total + 1 > FILTER_MAX_STATES) {
+        snprintf(error, error_size, "%s: patterns too long in total", path);
+    }
+
+    filter_t *filter = patterns != NULL && pattern_actions != NULL && error[0] == '\0' ?
+                       calloc(1, sizeof(filter_t)) : NULL;
+    if (filter == NULL) {
+        if (error[0] == '\0') {
+            snprintf(error, error_size, "out of memory");
+        }
+        free(patterns);
+        free(pattern_actions);
+        return NULL;
+    }
+
+    // Byte classes: one per distinct (lowercased) pattern byte, shared by
+    // both cases of a letter
+    filter->classes = 1;
+    for (int p = 0; p < count; p++) {
+        for (const unsigned char *b = (const unsigned char *)patterns[p]; *b != '\0'; b++) {
+            if (filter->byte_class[*b] == 0) {
+                filter->byte_class[*b] = (unsigned char)filter->classes;
+                filter->byte_class[toupper(*b)] = (unsigned char)filter->classes;
+                filter->classes++;
+            }
+        }
+    }
+
+    // Trie of the patterns, in the flat table
+    int max_states = total + 1;
+    int classes = filter->classes;
+    filter->next = malloc((size_t)max_states * classes * sizeof(unsigned short));
+    filter->actions = calloc(max_states, 1);
+    filter->mask_length = calloc(max_states, 1);
+    int *fail = malloc(max_states * sizeof(int));
+    int *queue = malloc(max_states * sizeof(int));
+    if (filter->next == NULL || filter->actions == NULL || filter->mask_length == NULL ||
+        fail == NULL || queue == NULL) {
+        snprintf(error, error_size, "out of memory");
+        filter_free(filter);
+        free(fail);
+        free(queue);
+        free(patterns);
+        free(pattern_actions);
+        return NULL;
+    }
+    memset(filter->next, 0xFF, (size_t)max_states * classes * sizeof(unsigned short));
+    filter->states = 1;
+    for (int p = 0; p < count; p++) {
+        int state = 0;
+        int length = 0;
+        for (const unsigned char *b = (const unsigned char *)patterns[p]; *b != '\0'; b++, length++) {
+            unsigned short *slot = &filter->next[state * classes + filter->byte_class[*b]];
+            if (*slot == FILTER_NONE) {
+                *slot = (unsigned short)filter->states++;
+            }
+            state = *slot;
+        }
+        filter->actions[state] |= pattern_actions[p];
+        if (pattern_actions[p] == FILTER_MASK && length > filter->mask_length[state]) {
+            filter->mask_length[state] = (unsigned char)length;
+        }
+
+        unsigned char first = (unsigned char)patterns[p][0];
+        filter->is_start[first] = 1;
+        filter->is_start[toupper(first)] = 1;
+    }
+    filter->patterns = count;
+
+    // Fail links, breadth first, folded into the table so every state has
+    // a transition on every class and the scan never backtracks
+    int head = 0, tail = 0;
+    for (int c = 0; c < classes; c++) {
+        unsigned short *slot = &filter->next[c];
+        if (*slot == FILTER_NONE) {
+            *slot = 0;
+        } else {
+            fail[*slot] = 0;
+            queue[tail++] = *slot;
+        }
+    }
+    while (head < tail) {
+        int state = queue[head++];
+        filter->actions[state] |= filter->actions[fail[state]];
+        if (filter->mask_length[fail[state]] > filter->mask_length[state]) {
+            filter->mask_length[state] = filter->mask_length[fail[state]];
+        }
+        for (int c = 0; c < classes; c++) {
+            unsigned short *slot = &filter->next[state * classes + c];
+            unsigned short fallback = filter->next[fail[state] * classes + c];
+            if (*slot == FILTER_NONE) {
+                *slot = fallback;
+            } else {
+                fail[*slot] = fallback;
+                queue[tail++] = *slot;
+            }
+        }
+    }
+
+    // Few enough start bytes to compare a block against each of them
+    for (int b = 0; b < 256; b++) {
+        if (filter->is_start[b]) {
+            if (filter->start_count == FILTER_SIMD_BYTES) {
+                filter->start_count = 0;
+                break;
+            }
+            filter->start_bytes[filter->start_count++] = (unsigned char)b;
+        }
+    }
+
+    free(fail);
+    free(queue);
+    free(patterns);
+    free(pattern_actions);
+    return filter;
+}
+
+// Next position at or after i where a pattern could start
+size_t filter_skip(const filter_t *filter, const char *text, size_t i, size_t length) {
+#ifdef FILTER_SSE2
+    if (filter->start_count > 0) {
+        __m128i needles[FILTER_SIMD_BYTES];
+        for (int n = 0; n < filter->start_count; n++) {
+            needles[n] = _mm_set1_epi8((char)filter->start_bytes[n]);
+        }
+        while (i + 16 <= length) {
+            __m128i block = _mm_loadu_si128((const __m128i *)(text + i));
+            __m128i hits = _mm_cmpeq_epi8(block, needles[0]);
+            for (int n = 1; n < filter->start_count; n++) {
+                hits = _mm_or_si128(hits, _mm_cmpeq_epi8(block, needles[n]));
+            }
+            int bits = _mm_movemask_epi8(hits);
+            if (bits != 0) {
+                while ((bits & 1) == 0) {
+                    bits >>= 1;
+                    i++;
+                }
+                return i;
+            }
+            i += 16;
+        }
+    }
+#endif
+    while (i < length && !filter->is_start[(unsigned char)text[i]]) {
+        i++;
+    }
+    return i;
+}
+
+// Run text through the filter, starring out masked matches in place.
+// *state carries the automaton across calls, so the fragments of one long
+// message are scanned as one text (start it at 0); a masked match that
+// began in an earlier fragment is only starred out from this one on.
+// Returns the FILTER_* bits of everything that matched; stops at the first
+// reject, since nothing else matters then.
+int filter_scan(const filter_t *filter, unsigned int *scan_state, char *text, size_t length) {
+    int found = 0;
+    unsigned int state = *scan_state;
+    for (size_t i = 0; i < length; i++) {
+        if (state == 0) {
+            i = filter_skip(filter, text, i, length);
+            if (i == length) {
+                break;
+            }
+        }
+        state = filter->next[state * filter->classes + filter->byte_class[(unsigned char)text[i]]];
+
+        int actions = filter->actions[state];
+        if (actions != 0) {
+            found |= actions;
+            if (actions & FILTER_REJECT) {
+                break;
+            }
+            size_t masked = filter->mask_length[state];
+            if (masked > i + 1) {
+                masked = i + 1;
+            }
+            memset(text + i + 1 - masked, '*', masked);
+        }
+    }
+    *scan_state = state;
+    return found;
+}
+
+#endif // FILTER_H
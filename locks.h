@@ -0,0 +1,159 @@
+#ifndef LOCKS_H
+#define LOCKS_H
+// Profiled mutexes: a Win32 mutex that, while lock_profiling is on, records
+// per call site how often it was taken, how often it had to wait, and how
+// long it waited and held the lock - and, since the waiting site is only
+// the victim, how long the others waited while this site held it. Off, it
+// costs a flag test over a plain WaitForSingleObject/ReleaseMutex.
+#include "common.h"
+#include "metrics.h"
+
+#define LOCK_MAX_SITES 128           // Call sites reported; later ones go unrecorded
+#define LOCK_REPORT_TOP 10           // Sites listed in the stats, by total wait
+
+typedef struct lock_site {
+    const char *function;
+    int line;
+    const char *lock;                // Name of the lock taken here, set on first use
+    volatile LONG registered;
+    // Only updated while holding the lock, so plain adds are enough
+    unsigned long long acquisitions;
+    unsigned long long contended;    // Had to wait for another thread
+    unsigned long long wait_us;
+    unsigned long long max_wait_us;
+    unsigned long long hold_us;
+    unsigned long long max_hold_us;
+    unsigned long long blocked_us;   // Others' waits that began while this site held it
+} lock_site_t;
+
+typedef struct {
+    HANDLE handle;
+    const char *name;
+    DWORD owner;                     // Thread holding it, 0 = free
+    int depth;                       // Win32 mutexes are recursive
+    lock_site_t *volatile holder;    // Site that took it, if profiled; read by waiters
+    unsigned long long acquired_us;
+} profiled_lock_t;
+
+volatile LONG lock_profiling = 0;
+lock_site_t *lock_sites[LOCK_MAX_SITES];
+volatile LONG lock_site_count = 0;
+
+// Returns 0 if the mutex can't be created
+int lock_init(profiled_lock_t *lock, const char *name) {
+    memset(lock, 0, sizeof(profiled_lock_t));
+    lock->name = name;
+    lock->handle = CreateMutex(NULL, FALSE, NULL);
+    return lock->handle != NULL;
+}
+
+void lock_acquire_at(profiled_lock_t *lock, lock_site_t *site) {
+    DWORD self = GetCurrentThreadId();
+    if (lock->owner == self) {
+        WaitForSingleObject(lock->handle, INFINITE);
+        lock->depth++;
+        return;
+    }
+    if (!lock_profiling) {
+        WaitForSingleObject(lock->handle, INFINITE);
+        lock->owner = self;
+        lock->depth = 1;
+        lock->holder = NULL;
+        return;
+    }
+
+    unsigned long long wait_us = 0;
+    lock_site_t *blocker = NULL;
+    int contended = WaitForSingleObject(lock->handle, 0) == WAIT_TIMEOUT;
+    if (contended) {
+        // Whoever holds it now is who we wait for (NULL if it was taken
+        // before profiling was turned on)
+        blocker = lock->holder;
+        unsigned long long started = metrics_now_us();
+        WaitForSingleObject(lock->handle, INFINITE);
+        wait_us = metrics_now_us() - started;
+    }
+    lock->owner = self;
+    lock->depth = 1;
+    lock->holder = site;
+    lock->acquired_us = metrics_now_us();
+
+    if (InterlockedCompareExchange(&site->registered, 1, 0) == 0) {
+        site->lock = lock->name;
+        LONG slot = InterlockedIncrement(&lock_site_count) - 1;
+        if (slot < LOCK_MAX_SITES) {
+            lock_sites[slot] = site;
+        }
+    }
+    site->acquisitions++;
+    site->contended += contended;
+    site->wait_us += wait_us;
+    if (wait_us > site->max_wait_us) {
+        site->max_wait_us = wait_us;
+    }
+    if (blocker != NULL) {
+        blocker->blocked_us += wait_us; // Its lock is ours now, so this is safe too
+    }
+}
+
+// Each call site gets its own counters
+#define lock_acquire(lock) do { \
+    static lock_site_t lock_site_ = { __FUNCTION__, __LINE__ }; \
+    lock_acquire_at((lock), &lock_site_); \
+} while (0)
+
+void lock_release(profiled_lock_t *lock) {
+    if (--lock->depth == 0) {
+        lock_site_t *site = lock->holder;
+        if (site != NULL) {
+            unsigned long long held = metrics_now_us() - lock->acquired_us;
+            site->hold_us += held;
+            if (held > site->max_hold_us) {
+                site->max_hold_us = held;
+            }
+            lock->holder = NULL;
+        }
+        lock->owner = 0;
+    }
+    ReleaseMutex(lock->handle);
+}
+
+// A site's rank in the report: what it waited or made others wait, whichever is more
+unsigned long long lock_site_cost(const lock_site_t *site) {
+    return site->wait_us > site->blocked_us ? site->wait_us : site->blocked_us;
+}
+
+// The sites that waited, or were waited for, longest in total, one "lock"
+// line each. Returns the text length
+int lock_report(char *text, size_t size) {
+    lock_site_t *sorted[LOCK_MAX_SITES];
+    int count = lock_site_count < LOCK_MAX_SITES ? (int)lock_site_count : LOCK_MAX_SITES;
+    int found = 0;
+    for (int i = 0; i < count; i++) {
+        if (lock_sites[i] != NULL) {
+            sorted[found++] = lock_sites[i];
+        }
+    }
+    for (int i = 1; i < found; i++) {
+        lock_site_t *site = sorted[i];
+        int j = i;
+        while (j > 0 && lock_site_cost(sorted[j - 1]) < lock_site_cost(site)) {
+            sorted[j] = sorted[j - 1];
+            j--;
+        }
+        sorted[j] = site;
+    }
+
+    int length = 0;
+    for (int i = 0; i < found && i < LOCK_REPORT_TOP; i++) {
+        lock_site_t *site = sorted[i];
+        length += snprintf(text + length, length < (int)size ? size - length : 0,
+                           "lock %s %s:%d acquired %llu contended %llu wait_us %llu max_wait_us %llu "
+                           "hold_us %llu max_hold_us %llu blocked_us %llu\n",
+                           site->lock, site->function, site->line, site->acquisitions, site->contended,
+                           site->wait_us, site->max_wait_us, site->hold_us, site->max_hold_us, site->blocked_us);
+    }
+    return length < (int)size ? length : (int)size - 1;
+}
+
+#endif // LOCKS_H
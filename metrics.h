@@ -0,0 +1,190 @@
+#ifndef METRICS_H
+#define METRICS_H
+// Server metrics: counters and latency histograms kept per thread, so the
+// hot path only bumps a number no other thread writes. Readers add up every
+// thread's copy when stats are asked for.
+#include "common.h"
+
+#define METRICS_MAX_THREADS 64       // Threads with a slot of their own; the rest share one
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS) // Buckets per power of two: values are within ~6%
+#define HIST_BUCKETS (HIST_SUB * 32)  // Covers up to 2^35 (about 9.5 hours in microseconds)
+#define MSG_TYPE_LIMIT 32             // Per-type message counters
+
+// Counters
+#define M_ACCEPTS 0
+#define M_REJECTS 1                  // Refused: no free client slot
+#define M_LOGINS 2
+#define M_AUTH_FAILURES 3
+#define M_FRAMES_QUEUED 4
+#define M_FRAMES_DROPPED 5           // Lane full or connection gone
+#define M_FRAMES_SENT 6
+#define M_BYTES_SENT 7
+#define M_HISTORY_BYTES 8            // History and search replies
+#define M_FILE_BYTES 9               // Downloads
+#define M_LOG_APPENDS 10
+#define M_FILTER_REJECTS 11
+#define M_FILTER_MASKS 12
+#define M_FILTER_FLAGS 13
+#define M_MCAST_SENT 14              // Multicast datagrams (heartbeats not counted)
+#define M_MCAST_REPAIRS 15           // Multicast messages resent over TCP
+#define M_MESSAGES 16                // + message type: frames received
+#define M_COUNTERS (M_MESSAGES + MSG_TYPE_LIMIT)
+
+// Histograms
+#define H_FANOUT 0                   // Recipients per chat/private message
+#define H_QUEUE_DEPTH 1              // Lane depth a frame was queued behind
+#define H_LOG_APPEND_US 2            // Chat log append, open to close
+#define H_AUTH_US 3                  // Register/login, queued to answered
+#define H_COUNT 4
+
+typedef struct {
+    volatile LONG claimed;
+    volatile LONGLONG counters[M_COUNTERS];
+    volatile LONG histograms[H_COUNT][HIST_BUCKETS];
+    volatile LONGLONG histogram_max[H_COUNT];
+} metrics_slot_t;
+
+metrics_slot_t metrics_slots[METRICS_MAX_THREADS];
+metrics_slot_t metrics_shared;       // Updated with interlocked operations
+DWORD metrics_tls = TLS_OUT_OF_INDEXES;
+LARGE_INTEGER metrics_frequency;
+
+void metrics_init() {
+    metrics_tls = TlsAlloc();
+    QueryPerformanceFrequency(&metrics_frequency);
+}
+
+// Microseconds from the performance counter, for timing operations
+unsigned long long metrics_now_us() {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (unsigned long long)(counter.QuadPart / metrics_frequency.QuadPart) * 1000000ULL +
+           (unsigned long long)(counter.QuadPart % metrics_frequency.QuadPart) * 1000000ULL /
+           (unsigned long long)metrics_frequency.QuadPart;
+}
+
+// This thread's slot, claimed on first use. A slot keeps its counts after
+// its thread exits; the next thread to claim it adds to them.
+metrics_slot_t *metrics_slot() {
+    metrics_slot_t *slot = TlsGetValue(metrics_tls);
+    if (slot != NULL) {
+        return slot;
+    }
+    for (int i = 0; i < METRICS_MAX_THREADS; i++) {
+        if (InterlockedCompareExchange(&metrics_slots[i].claimed, 1, 0) == 0) {
+            slot = &metrics_slots[i];
+            TlsSetValue(metrics_tls, slot);
+            return slot;
+        }
+    }
+    return &metrics_shared;
+}
+
+void metrics_thread_exit() {
+    metrics_slot_t *slot = TlsGetValue(metrics_tls);
+    if (slot != NULL) {
+        TlsSetValue(metrics_tls, NULL);
+        InterlockedExchange(&slot->claimed, 0);
+    }
+}
+
+void metrics_add(int counter, long long amount) {
+    metrics_slot_t *slot = metrics_slot();
+    if (slot == &metrics_shared) {
+        InterlockedExchangeAdd64(&slot->counters[counter], amount);
+    } else {
+        slot->counters[counter] += amount;
+    }
+}
+
+// Log-linear bucket: exact below HIST_SUB, then HIST_SUB per power of two
+int hist_bucket(unsigned long long value) {
+    if (value < HIST_SUB) {
+        return (int)value;
+    }
+    int top = HIST_SUB_BITS;
+    while ((value >> (top + 1)) != 0) {
+        top++;
+    }
+    int bucket = (top - HIST_SUB_BITS + 1) * HIST_SUB + (int)((value >> (top - HIST_SUB_BITS)) & (HIST_SUB - 1));
+    return bucket < HIST_BUCKETS ? bucket : HIST_BUCKETS - 1;
+}
+
+// Largest value that lands in bucket
+unsigned long long hist_bucket_limit(int bucket) {
+    if (bucket < HIST_SUB) {
+        return (unsigned long long)bucket;
+    }
+    int shift = bucket / HIST_SUB - 1;
+    unsigned long long sub = (unsigned long long)(bucket % HIST_SUB);
+    return ((HIST_SUB + sub + 1) << shift) - 1;
+}
+
+void metrics_record(int histogram, unsigned long long value) {
+    metrics_slot_t *slot = metrics_slot();
+    int bucket = hist_bucket(value);
+    if (slot == &metrics_shared) {
+        InterlockedIncrement(&slot->histograms[histogram][bucket]);
+    } else {
+        slot->histograms[histogram][bucket]++;
+    }
+    if ((LONGLONG)value > slot->histogram_max[histogram]) {
+        slot->histogram_max[histogram] = (LONGLONG)value; // A lost race only loses a max
+    }
+}
+
+long long metrics_counter(int counter) {
+    long long total = metrics_shared.counters[counter];
+    for (int i = 0; i < METRICS_MAX_THREADS; i++) {
+        total += metrics_slots[i].counters[counter];
+    }
+    return total;
+}
+
+typedef struct {
+    unsigned long long count;
+    unsigned long long p50;
+    unsigned long long p90;
+    unsigned long long p99;
+    unsigned long long p999;
+    unsigned long long max;
+} histogram_summary_t;
+
+// Percentiles are bucket limits, so they overstate by at most one bucket
+void metrics_histogram(int histogram, histogram_summary_t *summary) {
+    static unsigned long long merged[HIST_BUCKETS]; // Callers serialize on stats_mutex
+    memset(merged, 0, sizeof(merged));
+    memset(summary, 0, sizeof(histogram_summary_t));
+
+    for (int i = 0; i <= METRICS_MAX_THREADS; i++) {
+        metrics_slot_t *slot = i < METRICS_MAX_THREADS ? &metrics_slots[i] : &metrics_shared;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            merged[b] += (unsigned long)slot->histograms[histogram][b];
+        }
+        if ((unsigned long long)slot->histogram_max[histogram] > summary->max) {
+            summary->max = (unsigned long long)slot->histogram_max[histogram];
+        }
+    }
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        summary->count += merged[b];
+    }
+    if (summary->count == 0) {
+        return;
+    }
+
+    unsigned long long seen = 0;
+    unsigned long long *targets[] = { &summary->p50, &summary->p90, &summary->p99, &summary->p999 };
+    unsigned long long ranks[] = { summary->count * 500 / 1000, summary->count * 900 / 1000,
+                                   summary->count * 990 / 1000, summary->count * 999 / 1000 };
+    int next = 0;
+    for (int b = 0; b < HIST_BUCKETS && next < 4; b++) {
+        seen += merged[b];
+        while (next < 4 && seen > ranks[next]) {
+            unsigned long long limit = hist_bucket_limit(b);
+            *targets[next++] = limit < summary->max ? limit : summary->max;
+        }
+    }
+}
+
+#endif // METRICS_H
@@ -0,0 +1,547 @@
+#include "common.h"
+#include "password.h"
+#include "pool.h"
+#include "clock.h"
+#include "filter.h"
+
+// Microbenchmarks for the primitives every message passes through. Each
+// benchmark is calibrated to run for at least RUN_MS, then repeated RUNS
+// times on one pinned CPU; results go out as JSON for comparing builds.
+
+#define RUNS 7
+#define RUN_MS 50
+#define MAX_SAMPLES 1024              // Log records used as benchmark data
+#define SYNTHETIC_USERS 1000          // Size of the generated users file
+#define BENCH_LOG_FILE "microbench_log.tmp"
+#define BENCH_USERS_FILE "microbench_users.tmp"
+#define BENCH_FILTER_FILE "microbench_filter.tmp"
+#define SYNTHETIC_PATTERNS 200        // Size of the generated content filter
+#define REGRESSION_THRESHOLD 1.10     // Slower than the baseline by more than this fails
+
+typedef void (*bench_fn)(int iterations);
+
+typedef struct {
+    const char *name;
+    bench_fn fn;
+    double bytes_per_op;              // 0 if not meaningful
+} benchmark_t;
+
+typedef struct {
+    const char *name;
+    long long iterations;             // Per run
+    double ns_median;
+    double ns_min;
+    double ns_max;
+    double bytes_per_op;
+} result_t;
+
+// Configuration (from command line)
+char log_path[MAX_PATH] = CHATLOG_FILE;
+char json_path[MAX_PATH] = "";        // Empty = stdout
+char filter[64] = "";                 // Only benchmarks whose name contains this
+char baseline_path[MAX_PATH] = "";    // Earlier --json output to compare against
+int pin_cpu = 0;
+
+// Benchmark data
+log_record_t samples[MAX_SAMPLES];
+char sample_lines[MAX_SAMPLES][MAX_LOG_LINE];
+int sample_count = 0;
+double average_content = 0;
+char cipher_text[MAX_SAMPLES][MAX_MESSAGE]; // Sample contents the cipher benchmarks rewrite
+char user_names[SYNTHETIC_USERS][MAX_USERNAME];
+int lookup_order[MAX_SAMPLES];        // Users to look up, drawn once so rand() isn't timed
+char password_record[PASSWORD_RECORD_LEN];
+pool_t bench_pool;
+FILE *bench_log = NULL;               // Kept open across runs, like the server's log
+filter_t *content_filter;
+LARGE_INTEGER counter_frequency;
+volatile unsigned int sink;           // Keeps results from being optimized away
+
+// Function prototypes
+void parse_arguments(int argc, char *argv[]);
+void load_samples();
+void synthesize_samples();
+void write_users_file();
+void build_content_filter();
+double now_ns();
+void run_benchmark(const benchmark_t *benchmark, result_t *result);
+int compare_doubles(const void *a, const void *b);
+void write_json(FILE *out, const result_t *results, int count);
+int compare_baseline(const char *path, const result_t *results, int count);
+void bench_encrypt(int iterations);
+void bench_decrypt(int iterations);
+void bench_frame_copy(int iterations);
+void bench_format_log_line(int iterations);
+void bench_parse_log_line(int iterations);
+void bench_display_log_line(int iterations);
+void bench_log_append(int iterations);
+void bench_user_lookup(int iterations);
+void bench_password_verify(int iterations);
+void bench_sha256_frame(int iterations);
+void bench_clock_stamp(int iterations);
+void bench_pool_alloc_free(int iterations);
+void bench_content_filter(int iterations);
+
+int main(int argc, char *argv[]) {
+    parse_arguments(argc, argv);
+    QueryPerformanceFrequency(&counter_frequency);
+
+    // Pin to one CPU at high priority so runs are comparable
+    if (SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)1 << pin_cpu) == 0) {
+        fprintf(stderr, "Cannot pin to CPU %d. Error Code: %d\n", pin_cpu, GetLastError());
+        return 1;
+    }
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_HIGHEST);
+
+    // Same data on every run: the chat log's first records, or generated
+    // ones of the same shape
+    srand(12345);
+    load_samples();
+    if (sample_count == 0) {
+        synthesize_samples();
+    }
+    for (int i = 0; i < sample_count; i++) {
+        strcpy(cipher_text[i], samples[i].msg.content);
+    }
+    write_users_file();
+    if (!password_hash("correct horse", MIN_HASH_COST, password_record, sizeof(password_record))) {
+        fprintf(stderr, "Cannot allocate the password hash table\n");
+        return 1;
+    }
+    pool_init(&bench_pool, "bench", sizeof(Message));
+    build_content_filter();
+    clock_tick();
+
+    benchmark_t benchmarks[] = {
+        { "encrypt_message", bench_encrypt, average_content },
+        { "decrypt_message", bench_decrypt, average_content },
+        { "frame_copy", bench_frame_copy, sizeof(Message) },
+        { "format_log_line", bench_format_log_line, 0 },
+        { "parse_log_line", bench_parse_log_line, 0 },
+        { "display_log_line", bench_display_log_line, 0 },
+        { "log_append", bench_log_append, 0 },
+        { "user_lookup", bench_user_lookup, 0 },
+        { "password_verify_min_cost", bench_password_verify, 0 },
+        { "sha256_frame", bench_sha256_frame, sizeof(Message) },
+        { "clock_stamp", bench_clock_stamp, 0 },
+        { "pool_alloc_free", bench_pool_alloc_free, 0 },
+        { "content_filter", bench_content_filter, average_content },
+    };
+    int benchmark_count = (int)(sizeof(benchmarks) / sizeof(benchmarks[0]));
+
+    result_t results[sizeof(benchmarks) / sizeof(benchmarks[0])];
+    int result_count = 0;
+    for (int i = 0; i < benchmark_count; i++) {
+        if (filter[0] != '\0' && strstr(benchmarks[i].name, filter) == NULL) {
+            continue;
+        }
+        fprintf(stderr, "%-26s", benchmarks[i].name);
+        run_benchmark(&benchmarks[i], &results[result_count]);
+        fprintf(stderr, "%12.1f ns/op\n", results[result_count].ns_median);
+        result_count++;
+    }
+
+    if (bench_log != NULL) {
+        fclose(bench_log);
+    }
+    DeleteFile(BENCH_LOG_FILE);
+    DeleteFile(BENCH_FILTER_FILE);
+    DeleteFile(BENCH_USERS_FILE);
+
+    FILE *out = stdout;
+    if (json_path[0] != '\0') {
+        out = fopen(json_path, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Cannot write %s\n", json_path);
+            return 1;
+        }
+    }
+    write_json(out, results, result_count);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    if (baseline_path[0] != '\0' && !compare_baseline(baseline_path, results, result_count)) {
+        return 2;
+    }
+    return 0;
+}
+
+void parse_arguments(int argc, char *argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            strncpy(log_path, argv[++i], MAX_PATH - 1);
+        } else if (strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            strncpy(json_path, argv[++i], MAX_PATH - 1);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            strncpy(filter, argv[++i], sizeof(filter) - 1);
+        } else if (strcmp(argv[i], "--cpu") == 0 && i + 1 < argc) {
+            pin_cpu = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+            strncpy(baseline_path, argv[++i], MAX_PATH - 1);
+        } else {
+            fprintf(stderr, "Usage: microbench.exe [--log chatlog.txt] [--json results.json] "
+                            "[--baseline old.json] [--filter name] [--cpu n]\n");
+            exit(1);
+        }
+    }
+
+    if (pin_cpu < 0 || pin_cpu >= (int)(sizeof(DWORD_PTR) * 8)) {
+        fprintf(stderr, "--cpu must be between 0 and %d\n", (int)(sizeof(DWORD_PTR) * 8) - 1);
+        exit(1);
+    }
+}
+
+// Benchmark data from the chat log's first MAX_SAMPLES records
+void load_samples() {
+    FILE *file = fopen(log_path, "r");
+    if (file == NULL) {
+        return;
+    }
+
+    char line[MAX_LOG_LINE];
+    double total = 0;
+    while (sample_count < MAX_SAMPLES && fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "\n")] = 0;
+        if (!parse_log_line(line, &samples[sample_count])) {
+            continue;
+        }
+        strcpy(sample_lines[sample_count], line);
+        total += strlen(samples[sample_count].msg.content);
+        sample_count++;
+    }
+    fclose(file);
+
+    if (sample_count > 0) {
+        average_content = total / sample_count;
+    }
+}
+
+// No log to draw from: records shaped like it - short names, mostly
+// short messages with the occasional long one, one in ten private
+void synthesize_samples() {
+    static const char *words[] = { "hello", "ok", "the", "meeting", "is", "at", "noon", "thanks",
+                                   "see", "you", "Tomorrow", "build", "passed", "lunch?" };
+    int word_count = (int)(sizeof(words) / sizeof(words[0]));
+    double total = 0;
+    unsigned long long time_us = 1714564800000000ULL;
+
+    for (sample_count = 0; sample_count < MAX_SAMPLES; sample_count++) {
+        log_record_t *record = &samples[sample_count];
+        Message *msg = &record->msg;
+        memset(record, 0, sizeof(log_record_t));
+        msg->type = rand() % 10 == 0 ? MSG_PRIVATE : MSG_CHAT;
+        snprintf(record->sender, MAX_USERNAME, "user%d", rand() % 50);
+        if (msg->type == MSG_PRIVATE) {
+            snprintf(record->recipient, MAX_USERNAME, "user%d", rand() % 50);
+        }
+        time_us += (unsigned long long)(rand() % 5000) * 1000;
+        msg->time_us = time_us;
+
+        int target = rand() % 20 == 0 ? 200 + rand() % 600 : 10 + rand() % 60;
+        int length = snprintf(msg->content, MAX_MESSAGE, "#");
+        while (length < target) {
+            length += snprintf(msg->content + length, MAX_MESSAGE - length, "%s ", words[rand() % word_count]);
+        }
+
+        format_log_line(record, sample_lines[sample_count], sizeof(sample_lines[sample_count]));
+        total += length;
+    }
+    average_content = total / sample_count;
+}
+
+// users.txt shape: "name:$mh$<cost>$<salt>$<hash>" per line
+void write_users_file() {
+    FILE *file = fopen(BENCH_USERS_FILE, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot write %s\n", BENCH_USERS_FILE);
+        exit(1);
+    }
+    for (int i = 0; i < SYNTHETIC_USERS; i++) {
+        snprintf(user_names[i], MAX_USERNAME, "user%04d", i);
+        fprintf(file, "%s:$mh$15$%032x$%064x\n", user_names[i], i, i);
+    }
+    fclose(file);
+    for (int i = 0; i < MAX_SAMPLES; i++) {
+        lookup_order[i] = rand() % SYNTHETIC_USERS;
+    }
+}
+
+// A moderation list's worth of flag patterns (flag, so scanning leaves
+// the samples as they are)
+void build_content_filter() {
+    FILE *file = fopen(BENCH_FILTER_FILE, "w");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot write %s\n", BENCH_FILTER_FILE);
+        exit(1);
+    }
+    for (int i = 0; i < SYNTHETIC_PATTERNS; i++) {
+        char pattern[9];
+        int length = 4 + rand() % 5;
+        for (int j = 0; j < length; j++) {
+            pattern[j] = (char)('a' + rand() % 26);
+        }
+        pattern[length] = '\0';
+        fprintf(file, "flag %s\n", pattern);
+    }
+    fclose(file);
+
+    char error[MAX_PATH + 64];
+    content_filter = filter_load(BENCH_FILTER_FILE, error, sizeof(error));
+    if (content_filter == NULL) {
+        fprintf(stderr, "Cannot build the content filter: %s\n", error);
+        exit(1);
+    }
+}
+
+double now_ns() {
+    LARGE_INTEGER counter;
+    QueryPerformanceCounter(&counter);
+    return (double)counter.QuadPart * 1e9 / (double)counter_frequency.QuadPart;
+}
+
+int compare_doubles(const void *a, const void *b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+// Find an iteration count that takes at least RUN_MS, then time RUNS runs
+void run_benchmark(const benchmark_t *benchmark, result_t *result) {
+    int iterations = 1;
+    while (1) {
+        double start = now_ns();
+        benchmark->fn(iterations);
+        double elapsed = now_ns() - start;
+        if (elapsed >= RUN_MS * 1e6 || iterations >= (1 << 30)) {
+            break;
+        }
+        // Aim a little past the target so the next try usually lands
+        double scale = elapsed > 0 ? (RUN_MS * 1.2e6) / elapsed : 100;
+        if (scale > 100) {
+            scale = 100;
+        }
+        iterations = (int)(iterations * scale) + 1;
+    }
+
+    double per_op[RUNS];
+    for (int run = 0; run < RUNS; run++) {
+        double start = now_ns();
+        benchmark->fn(iterations);
+        per_op[run] = (now_ns() - start) / iterations;
+    }
+    qsort(per_op, RUNS, sizeof(double), compare_doubles);
+
+    result->name = benchmark->name;
+    result->iterations = iterations;
+    result->ns_median = per_op[RUNS / 2];
+    result->ns_min = per_op[0];
+    result->ns_max = per_op[RUNS - 1];
+    result->bytes_per_op = benchmark->bytes_per_op;
+}
+
+void write_json(FILE *out, const result_t *results, int count) {
+    char timestamp[26];
+    get_timestamp(timestamp, sizeof(timestamp));
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"timestamp\": \"%s\",\n", timestamp);
+    fprintf(out, "  \"cpu\": %d,\n", pin_cpu);
+    fprintf(out, "  \"runs\": %d,\n", RUNS);
+    fprintf(out, "  \"samples\": %d,\n", sample_count);
+    fprintf(out, "  \"benchmarks\": [\n");
+    for (int i = 0; i < count; i++) {
+        const result_t *r = &results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"iterations\": %lld, \"ns_per_op\": %.2f, "
+                     "\"ns_per_op_min\": %.2f, \"ns_per_op_max\": %.2f",
+                r->name, r->iterations, r->ns_median, r->ns_min, r->ns_max);
+        if (r->bytes_per_op > 0) {
+            fprintf(out, ", \"mb_per_s\": %.1f", r->bytes_per_op / r->ns_median * 1e9 / (1024 * 1024));
+        }
+        fprintf(out, "}%s\n", i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+// Compare against an earlier run's JSON. Returns 0 if anything got slower
+// than REGRESSION_THRESHOLD allows
+int compare_baseline(const char *path, const result_t *results, int count) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Cannot open baseline %s\n", path);
+        return 0;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    char *text = malloc(size + 1);
+    if (text == NULL) {
+        fclose(file);
+        return 0;
+    }
+    size = (long)fread(text, 1, size, file);
+    text[size] = '\0';
+    fclose(file);
+
+    int ok = 1;
+    fprintf(stderr, "\nCompared with %s:\n", path);
+    for (int i = 0; i < count; i++) {
+        char key[96];
+        snprintf(key, sizeof(key), "\"name\": \"%s\"", results[i].name);
+        char *entry = strstr(text, key);
+        char *field = entry ? strstr(entry, "\"ns_per_op\": ") : NULL;
+        if (field == NULL) {
+            fprintf(stderr, "%-26s (not in baseline)\n", results[i].name);
+            continue;
+        }
+
+        double before = atof(field + strlen("\"ns_per_op\": "));
+        double ratio = before > 0 ? results[i].ns_median / before : 1;
+        int regressed = ratio > REGRESSION_THRESHOLD;
+        fprintf(stderr, "%-26s %12.1f -> %12.1f ns/op  %+6.1f%%%s\n", results[i].name, before,
+                results[i].ns_median, (ratio - 1) * 100, regressed ? "  REGRESSION" : "");
+        if (regressed) {
+            ok = 0;
+        }
+    }
+    free(text);
+    return ok;
+}
+
+// The benchmarks. Each walks the sample records round-robin.
+
+// The cipher works in place, so these rewrite a copy of the contents and
+// the samples stay as the other benchmarks expect
+void bench_encrypt(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        encrypt_message(cipher_text[i % sample_count]);
+    }
+    sink += (unsigned char)cipher_text[0][0];
+}
+
+void bench_decrypt(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        decrypt_message(cipher_text[i % sample_count]);
+    }
+    sink += (unsigned char)cipher_text[0][0];
+}
+
+// The wire format is the Message struct itself, so serializing a frame
+// (queueing it, or reading it off the socket) is this copy
+void bench_frame_copy(int iterations) {
+    static Message frame;
+    for (int i = 0; i < iterations; i++) {
+        memcpy(&frame, &samples[i % sample_count].msg, sizeof(Message));
+        sink += frame.type;
+    }
+}
+
+void bench_format_log_line(int iterations) {
+    char line[MAX_LOG_LINE];
+    for (int i = 0; i < iterations; i++) {
+        format_log_line(&samples[i % sample_count], line, sizeof(line));
+        sink += (unsigned char)line[1];
+    }
+}
+
+void bench_parse_log_line(int iterations) {
+    log_record_t record;
+    for (int i = 0; i < iterations; i++) {
+        parse_log_line(sample_lines[i % sample_count], &record);
+        sink += record.msg.type;
+    }
+}
+
+void bench_display_log_line(int iterations) {
+    char shown[MAX_LOG_LINE];
+    for (int i = 0; i < iterations; i++) {
+        display_log_line(sample_lines[i % sample_count], shown, sizeof(shown));
+        sink += (unsigned char)shown[1];
+    }
+}
+
+// What add_to_chat_log does per record: append one line to the open log
+// and flush it
+void bench_log_append(int iterations) {
+    char line[MAX_LOG_LINE];
+    if (bench_log == NULL && (bench_log = fopen(BENCH_LOG_FILE, "w")) == NULL) {
+        return;
+    }
+    for (int i = 0; i < iterations; i++) {
+        format_log_line(&samples[i % sample_count], line, sizeof(line));
+        fseek(bench_log, 0, SEEK_END);
+        sink += (unsigned int)ftell(bench_log);
+        fprintf(bench_log, "%s\n", line);
+        fflush(bench_log);
+    }
+}
+
+// What find_user_record does before any hashing: scan users.txt for a name
+void bench_user_lookup(int iterations) {
+    char line[MAX_USERNAME + PASSWORD_RECORD_LEN + 2];
+    for (int i = 0; i < iterations; i++) {
+        const char *username = user_names[lookup_order[i % MAX_SAMPLES]];
+        FILE *file = fopen(BENCH_USERS_FILE, "r");
+        if (file == NULL) {
+            return;
+        }
+        while (fgets(line, sizeof(line), file)) {
+            char *colon = strchr(line, ':');
+            if (colon == NULL) {
+                continue;
+            }
+            *colon = '\0';
+            if (strcmp(username, line) == 0) {
+                sink += (unsigned char)colon[1];
+                break;
+            }
+        }
+        fclose(file);
+    }
+}
+
+// The lowest cost the server accepts; each step up in --hash-cost doubles it
+void bench_password_verify(int iterations) {
+    int cost;
+    for (int i = 0; i < iterations; i++) {
+        sink += password_verify("correct horse", password_record, &cost);
+    }
+}
+
+// Upload verification hashes every chunk-sized frame of a file
+void bench_sha256_frame(int iterations) {
+    unsigned char digest[SHA256_LEN];
+    sha256_ctx ctx;
+    for (int i = 0; i < iterations; i++) {
+        sha256_init(&ctx);
+        sha256_update(&ctx, &samples[i % sample_count].msg, sizeof(Message));
+        sha256_final(&ctx, digest);
+        sink += digest[0];
+    }
+}
+
+void bench_clock_stamp(int iterations) {
+    static Message frame;
+    for (int i = 0; i < iterations; i++) {
+        clock_stamp(&frame);
+        sink += (unsigned int)frame.time_us;
+    }
+}
+
+// One queued frame's allocation and release, on a warm per-thread cache
+void bench_pool_alloc_free(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        void *node = pool_alloc(&bench_pool);
+        sink += (unsigned int)(uintptr_t)node;
+        pool_free(&bench_pool, node);
+    }
+}
+
+// The filter pass every chat/private message takes
+void bench_content_filter(int iterations) {
+    for (int i = 0; i < iterations; i++) {
+        char *content = samples[i % sample_count].msg.content;
+        unsigned int state = 0;
+        sink += filter_scan(content_filter, &state, content, strlen(content));
+    }
+}
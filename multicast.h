@@ -0,0 +1,114 @@
+#ifndef MULTICAST_H
+#define MULTICAST_H
+// Multicast fan-out datagrams: each public message goes to the group once.
+// Receivers put them in order by seq and fetch any they missed over their
+// TCP connection (MSG_MULTICAST "repair"). Anyone on the LAN can join the
+// group or send to it, so every datagram is sealed with a key the server
+// picks per epoch and hands out only over a logged-in TCP session: the
+// message is encrypted with a SHA-256 keystream bound to (epoch, seq), and
+// the whole datagram carries an HMAC-SHA256.
+#include "common.h"
+#include "sha256.h"
+#include <stddef.h> // offsetof
+
+#define MCAST_MAGIC 0x4d434154       // "MCAT"
+#define MCAST_KEY_LEN 32
+#define MCAST_KEY_HEX_LEN (MCAST_KEY_LEN * 2 + 1)
+#define MCAST_RING 1024              // Latest datagrams the server keeps for repairs
+
+typedef struct {
+    unsigned int magic;
+    unsigned int epoch;              // Server instance: seq starts over when it changes
+    unsigned int seq;                // 1, 2, ...; a heartbeat repeats the latest one
+    unsigned int length;             // Bytes of msg sent: sizeof(Message), 0 for a heartbeat
+    unsigned char mac[SHA256_LEN];   // HMAC over the fields above and msg as sent
+    Message msg;                     // Encrypted
+} mcast_frame_t;
+
+#define MCAST_HEADER_LEN ((int)offsetof(mcast_frame_t, msg))
+
+// HMAC-SHA256 (RFC 2104) of data under a MCAST_KEY_LEN key
+void mcast_hmac(const unsigned char *key, const void *data, size_t length, unsigned char *out) {
+    unsigned char pad[64];
+    sha256_ctx ctx;
+
+    memset(pad, 0x36, sizeof(pad));
+    for (int i = 0; i < MCAST_KEY_LEN; i++) {
+        pad[i] ^= key[i];
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, pad, sizeof(pad));
+    sha256_update(&ctx, data, length);
+    sha256_final(&ctx, out);
+
+    memset(pad, 0x5c, sizeof(pad));
+    for (int i = 0; i < MCAST_KEY_LEN; i++) {
+        pad[i] ^= key[i];
+    }
+    sha256_init(&ctx);
+    sha256_update(&ctx, pad, sizeof(pad));
+    sha256_update(&ctx, out, SHA256_LEN);
+    sha256_final(&ctx, out);
+}
+
+// XOR msg with SHA-256(key, epoch, seq, block) blocks; its own inverse.
+// (epoch, seq) is never reused for another message, as heartbeats carry none.
+void mcast_crypt(const unsigned char *key, mcast_frame_t *frame) {
+    unsigned char *bytes = (unsigned char *)&frame->msg;
+    unsigned char stream[SHA256_LEN];
+    for (unsigned int block = 0; block * SHA256_LEN < sizeof(Message); block++) {
+        sha256_ctx ctx;
+        sha256_init(&ctx);
+        sha256_update(&ctx, key, MCAST_KEY_LEN);
+        sha256_update(&ctx, &frame->epoch, sizeof(frame->epoch));
+        sha256_update(&ctx, &frame->seq, sizeof(frame->seq));
+        sha256_update(&ctx, &block, sizeof(block));
+        sha256_final(&ctx, stream);
+        for (unsigned int i = 0; i < SHA256_LEN && block * SHA256_LEN + i < sizeof(Message); i++) {
+            bytes[block * SHA256_LEN + i] ^= stream[i];
+        }
+    }
+}
+
+// Encrypt (if it carries a message) and sign a frame; returns the bytes to send
+int mcast_seal(const unsigned char *key, mcast_frame_t *frame) {
+    frame->magic = MCAST_MAGIC;
+    if (frame->length > 0) {
+        frame->length = sizeof(Message);
+        mcast_crypt(key, frame);
+    }
+    memset(frame->mac, 0, SHA256_LEN);
+    unsigned char mac[SHA256_LEN];
+    mcast_hmac(key, frame, MCAST_HEADER_LEN + frame->length, mac);
+    memcpy(frame->mac, mac, SHA256_LEN);
+    return MCAST_HEADER_LEN + frame->length;
+}
+
+// Check a received datagram of size bytes and decrypt it in place
+// Returns 0 if it is malformed or was not sealed with key
+int mcast_open(const unsigned char *key, mcast_frame_t *frame, int size) {
+    if (size < MCAST_HEADER_LEN || frame->magic != MCAST_MAGIC ||
+        (frame->length != 0 && frame->length != sizeof(Message)) ||
+        size != MCAST_HEADER_LEN + (int)frame->length) {
+        return 0;
+    }
+    unsigned char received[SHA256_LEN], expected[SHA256_LEN];
+    memcpy(received, frame->mac, SHA256_LEN);
+    memset(frame->mac, 0, SHA256_LEN);
+    mcast_hmac(key, frame, size, expected);
+
+    // Constant-time compare
+    unsigned char diff = 0;
+    for (int i = 0; i < SHA256_LEN; i++) {
+        diff |= received[i] ^ expected[i];
+    }
+    if (diff != 0) {
+        return 0;
+    }
+    if (frame->length > 0) {
+        mcast_crypt(key, frame);
+    }
+    return 1;
+}
+
+#endif // MULTICAST_H
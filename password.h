@@ -0,0 +1,127 @@
+#ifndef PASSWORD_H
+#define PASSWORD_H
+// Salted, memory-hard password hashing for users.txt
+#include "common.h"
+#include "sha256.h"
+
+#define PASSWORD_SALT_LEN 16
+#define PASSWORD_HASH_LEN 32
+#define DEFAULT_HASH_COST 15    // log2 of the number of 32-byte blocks: 2^15 = 1 MB per hash
+#define MIN_HASH_COST 10
+#define MAX_HASH_COST 24
+#define PASSWORD_RECORD_LEN 112 // "$mh$<cost>$<salt hex>$<hash hex>"
+
+// Stored record format: $mh$<cost>$<32 hex salt>$<64 hex hash>
+// Anything else in the password column is a legacy plaintext password
+
+// Memory-hard hash in the style of scrypt's ROMix, with SHA-256 as the
+// mixing function: fill 2^cost blocks sequentially, then read them back in
+// a data-dependent order so the whole table has to stay in memory.
+// Returns 0 if the table could not be allocated.
+int password_hash_raw(const char *password, const unsigned char *salt, int cost, unsigned char *out) {
+    uint32_t blocks = 1u << cost;
+    unsigned char (*table)[PASSWORD_HASH_LEN] = malloc((size_t)blocks * PASSWORD_HASH_LEN);
+    if (table == NULL) {
+        return 0;
+    }
+
+    unsigned char x[PASSWORD_HASH_LEN];
+    sha256_ctx ctx;
+    size_t password_len = strlen(password);
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, salt, PASSWORD_SALT_LEN);
+    sha256_update(&ctx, password, password_len);
+    sha256_final(&ctx, x);
+
+    for (uint32_t i = 0; i < blocks; i++) {
+        memcpy(table[i], x, PASSWORD_HASH_LEN);
+        sha256_init(&ctx);
+        sha256_update(&ctx, x, PASSWORD_HASH_LEN);
+        sha256_update(&ctx, &i, sizeof(i));
+        sha256_final(&ctx, x);
+    }
+
+    for (uint32_t i = 0; i < blocks; i++) {
+        uint32_t j = ((uint32_t)x[0] | ((uint32_t)x[1] << 8) | ((uint32_t)x[2] << 16) |
+                      ((uint32_t)x[3] << 24)) & (blocks - 1);
+        for (int k = 0; k < PASSWORD_HASH_LEN; k++) {
+            x[k] ^= table[j][k];
+        }
+        sha256_init(&ctx);
+        sha256_update(&ctx, x, PASSWORD_HASH_LEN);
+        sha256_update(&ctx, &i, sizeof(i));
+        sha256_final(&ctx, x);
+    }
+
+    sha256_init(&ctx);
+    sha256_update(&ctx, x, PASSWORD_HASH_LEN);
+    sha256_update(&ctx, password, password_len);
+    sha256_final(&ctx, out);
+
+    free(table);
+    return 1;
+}
+
+int password_is_hashed(const char *record) {
+    return strncmp(record, "$mh$", 4) == 0;
+}
+
+// Hash password with a fresh random salt into a users.txt record
+// Returns 0 on failure
+int password_hash(const char *password, int cost, char *record, size_t size) {
+    unsigned char salt[PASSWORD_SALT_LEN];
+    unsigned char hash[PASSWORD_HASH_LEN];
+
+    for (int i = 0; i < PASSWORD_SALT_LEN; i += 4) {
+        unsigned int r;
+        rand_s(&r);
+        memcpy(salt + i, &r, 4);
+    }
+
+    if (!password_hash_raw(password, salt, cost, hash)) {
+        return 0;
+    }
+
+    char salt_hex[PASSWORD_SALT_LEN * 2 + 1];
+    char hash_hex[PASSWORD_HASH_LEN * 2 + 1];
+    hex_encode(salt, PASSWORD_SALT_LEN, salt_hex);
+    hex_encode(hash, PASSWORD_HASH_LEN, hash_hex);
+    snprintf(record, size, "$mh$%d$%s$%s", cost, salt_hex, hash_hex);
+    return 1;
+}
+
+// Check password against a stored record (hashed or legacy plaintext)
+// Returns 1 on match; *cost is the record's cost, or 0 for plaintext
+int password_verify(const char *password, const char *record, int *cost) {
+    *cost = 0;
+    if (!password_is_hashed(record)) {
+        return strcmp(password, record) == 0;
+    }
+
+    // $mh$<cost>$<salt>$<hash>
+    char salt_hex[PASSWORD_SALT_LEN * 2 + 1];
+    char hash_hex[PASSWORD_HASH_LEN * 2 + 1];
+    if (sscanf(record, "$mh$%d$%32[0-9a-f]$%64[0-9a-f]", cost, salt_hex, hash_hex) != 3 ||
+        *cost < MIN_HASH_COST || *cost > MAX_HASH_COST) {
+        return 0;
+    }
+
+    unsigned char salt[PASSWORD_SALT_LEN];
+    unsigned char expected[PASSWORD_HASH_LEN];
+    unsigned char actual[PASSWORD_HASH_LEN];
+    if (!hex_decode(salt_hex, salt, PASSWORD_SALT_LEN) ||
+        !hex_decode(hash_hex, expected, PASSWORD_HASH_LEN) ||
+        !password_hash_raw(password, salt, *cost, actual)) {
+        return 0;
+    }
+
+    // Constant-time compare
+    unsigned char diff = 0;
+    for (int i = 0; i < PASSWORD_HASH_LEN; i++) {
+        diff |= expected[i] ^ actual[i];
+    }
+    return diff == 0;
+}
+
+#endif // PASSWORD_H
@@ -0,0 +1,246 @@
+#ifndef POOL_H
+#define POOL_H
+// Fixed-size object pools for the server's hot paths
+#include "common.h"
+
+#define POOL_SLAB_OBJECTS 64  // Objects carved from each malloc'd slab
+#define POOL_CACHE_SIZE 32    // Objects a thread keeps for itself
+#define POOL_MAX_CACHES 64    // Threads with a cache of their own; others share the pool list
+
+// Objects are carved from slabs that are never given back, so once a pool
+// has grown to the server's working set, allocating and freeing is just
+// moving objects between free lists. Each thread keeps a small cache and
+// only takes the pool mutex to move half a cache's worth at a time.
+
+typedef struct pool_object {
+    struct pool_object *next;
+} pool_object_t;
+
+// One thread's cache; only that thread touches it while it is claimed
+typedef struct {
+    volatile LONG claimed;
+    pool_object_t *head;
+    int count;
+    unsigned long long allocs;    // Served to this thread (stats)
+    unsigned long long frees;
+} pool_cache_t;
+
+typedef struct {
+    const char *name;
+    size_t object_size;
+    int numa_local;               // Carve slabs on the NUMA node of whichever thread grows the pool
+    HANDLE mutex;                 // Guards free_list, slabs and the counters below
+    DWORD tls;                    // This thread's pool_cache_t
+    pool_object_t *free_list;
+    int free_count;
+    void *slabs;                  // Each slab starts with the pointer to the next
+    int slab_count;
+    unsigned long long refills;   // Batches moved pool -> cache
+    unsigned long long flushes;   // Batches moved cache -> pool
+    unsigned long long uncached_allocs; // Counts from exited threads and threads without a cache
+    unsigned long long uncached_frees;
+    pool_cache_t caches[POOL_MAX_CACHES];
+} pool_t;
+
+typedef struct {
+    int objects;                  // Carved so far
+    int in_use;
+    int free;                     // On the pool list and in thread caches
+    int slabs;
+    unsigned long long allocs;
+    unsigned long long frees;
+    unsigned long long refills;
+    unsigned long long flushes;
+} pool_stats_t;
+
+// Call once, before any thread uses the pool
+void pool_init(pool_t *pool, const char *name, size_t object_size) {
+    memset(pool, 0, sizeof(pool_t));
+    pool->name = name;
+    pool->object_size = object_size < sizeof(pool_object_t) ? sizeof(pool_object_t) : object_size;
+    // Keep objects aligned for anything they may hold
+    pool->object_size = (pool->object_size + 15) & ~(size_t)15;
+    pool->mutex = CreateMutex(NULL, FALSE, NULL);
+    pool->tls = TlsAlloc();
+}
+
+// Carve a new slab onto the free list. Caller holds the pool mutex.
+// Returns 0 if out of memory
+int pool_grow(pool_t *pool) {
+    size_t header = (sizeof(void*) + 15) & ~(size_t)15;
+    size_t size = header + pool->object_size * POOL_SLAB_OBJECTS;
+    char *slab;
+    UCHAR node;
+    if (pool->numa_local && GetNumaProcessorNode((UCHAR)GetCurrentProcessorNumber(), &node)) {
+        // The thread that runs dry is the one queueing frames, not always
+        // the writer that sends them: a broadcast allocates every
+        // recipient's node on the sender's thread. So the objects are
+        // only local to their users when those threads share a node.
+        slab = VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT,
+                                  PAGE_READWRITE, node);
+    } else {
+        slab = malloc(size);
+    }
+    if (slab == NULL) {
+        return 0;
+    }
+    *(void**)slab = pool->slabs;
+    pool->slabs = slab;
+    pool->slab_count++;
+
+    for (int i = POOL_SLAB_OBJECTS - 1; i >= 0; i--) {
+        pool_object_t *object = (pool_object_t*)(slab + header + pool->object_size * i);
+        object->next = pool->free_list;
+        pool->free_list = object;
+    }
+    pool->free_count += POOL_SLAB_OBJECTS;
+
+    if ((pool->slab_count & (pool->slab_count - 1)) == 0) {
+        printf("Pool %s grew to %d objects\n", pool->name, pool->slab_count * POOL_SLAB_OBJECTS);
+    }
+    return 1;
+}
+
+// This thread's cache, claimed on first use; NULL if every cache is taken
+pool_cache_t *pool_thread_cache(pool_t *pool) {
+    pool_cache_t *cache = TlsGetValue(pool->tls);
+    if (cache != NULL) {
+        return cache;
+    }
+    for (int i = 0; i < POOL_MAX_CACHES; i++) {
+        if (InterlockedCompareExchange(&pool->caches[i].claimed, 1, 0) == 0) {
+            cache = &pool->caches[i];
+            TlsSetValue(pool->tls, cache);
+            return cache;
+        }
+    }
+    return NULL;
+}
+
+// Returns NULL only if the pool cannot grow
+void *pool_alloc(pool_t *pool) {
+    pool_cache_t *cache = pool_thread_cache(pool);
+    pool_object_t *object = NULL;
+
+    if (cache != NULL && cache->head != NULL) {
+        object = cache->head;
+        cache->head = object->next;
+        cache->count--;
+        cache->allocs++;
+        return object;
+    }
+
+    WaitForSingleObject(pool->mutex, INFINITE);
+    if (pool->free_list == NULL && !pool_grow(pool)) {
+        ReleaseMutex(pool->mutex);
+        return NULL;
+    }
+    object = pool->free_list;
+    pool->free_list = object->next;
+    pool->free_count--;
+
+    if (cache != NULL) {
+        // Refill half the cache so the next allocations stay local
+        while (cache->count < POOL_CACHE_SIZE / 2 && pool->free_list != NULL) {
+            pool_object_t *next = pool->free_list;
+            pool->free_list = next->next;
+            pool->free_count--;
+            next->next = cache->head;
+            cache->head = next;
+            cache->count++;
+        }
+        pool->refills++;
+        cache->allocs++;
+    } else {
+        pool->uncached_allocs++;
+    }
+    ReleaseMutex(pool->mutex);
+    return object;
+}
+
+// Move count objects from the cache to the pool list
+void pool_flush_cache(pool_t *pool, pool_cache_t *cache, int count) {
+    WaitForSingleObject(pool->mutex, INFINITE);
+    while (count-- > 0 && cache->head != NULL) {
+        pool_object_t *object = cache->head;
+        cache->head = object->next;
+        cache->count--;
+        object->next = pool->free_list;
+        pool->free_list = object;
+        pool->free_count++;
+    }
+    pool->flushes++;
+    ReleaseMutex(pool->mutex);
+}
+
+void pool_free(pool_t *pool, void *ptr) {
+    pool_object_t *object = ptr;
+    pool_cache_t *cache = pool_thread_cache(pool);
+
+    if (cache == NULL) {
+        WaitForSingleObject(pool->mutex, INFINITE);
+        object->next = pool->free_list;
+        pool->free_list = object;
+        pool->free_count++;
+        pool->uncached_frees++;
+        ReleaseMutex(pool->mutex);
+        return;
+    }
+
+    object->next = cache->head;
+    cache->head = object;
+    cache->count++;
+    cache->frees++;
+
+    // A thread that only frees (a writer) hands the surplus back in batches
+    if (cache->count >= POOL_CACHE_SIZE) {
+        pool_flush_cache(pool, cache, POOL_CACHE_SIZE / 2);
+    }
+}
+
+// Give this thread's cache back before the thread exits
+void pool_thread_exit(pool_t *pool) {
+    pool_cache_t *cache = TlsGetValue(pool->tls);
+    if (cache == NULL) {
+        return;
+    }
+    pool_flush_cache(pool, cache, cache->count);
+
+    WaitForSingleObject(pool->mutex, INFINITE);
+    pool->uncached_allocs += cache->allocs;
+    pool->uncached_frees += cache->frees;
+    cache->allocs = 0;
+    cache->frees = 0;
+    ReleaseMutex(pool->mutex);
+
+    TlsSetValue(pool->tls, NULL);
+    InterlockedExchange(&cache->claimed, 0);
+}
+
+// Usage snapshot; other threads' cache counters are read without their
+// owners stopping, so the figures are approximate while the server is busy
+void pool_get_stats(pool_t *pool, pool_stats_t *stats) {
+    memset(stats, 0, sizeof(pool_stats_t));
+
+    WaitForSingleObject(pool->mutex, INFINITE);
+    stats->slabs = pool->slab_count;
+    stats->objects = pool->slab_count * POOL_SLAB_OBJECTS;
+    stats->free = pool->free_count;
+    stats->allocs = pool->uncached_allocs;
+    stats->frees = pool->uncached_frees;
+    stats->refills = pool->refills;
+    stats->flushes = pool->flushes;
+    for (int i = 0; i < POOL_MAX_CACHES; i++) {
+        pool_cache_t *cache = &pool->caches[i];
+        if (cache->claimed) {
+            stats->free += cache->count;
+            stats->allocs += cache->allocs;
+            stats->frees += cache->frees;
+        }
+    }
+    ReleaseMutex(pool->mutex);
+
+    stats->in_use = stats->objects - stats->free;
+}
+
+#endif // POOL_H
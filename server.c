@@ -1,27 +1,439 @@
 #include "common.h"
+#include "password.h"
+#include "pool.h"
+#include "clock.h"
+#include "metrics.h"
+#include "trace.h"
+#include "locks.h"
+#include "filter.h"
+#include "affinity.h"
+#include "multicast.h"
+#include <mswsock.h> // TransmitFile
+#include <sddl.h>    // Handoff pipe DACL
+#include <limits.h>
+
+#pragma comment(lib, "mswsock.lib")
+#pragma comment(lib, "advapi32.lib")
+
+// Global variables
+client_t *clients;                // Connection table, see acquire_slot
+profiled_lock_t clients_mutex;
+
+// Connection table: address space for max_clients slots is reserved up
+// front and committed CLIENT_CHUNK slots at a time as connections arrive,
+// so slots never move and an idle server stays small. Free slots are kept
+// on a stack. A handle is a slot index tagged with the slot's generation,
+// which changes each time the slot is freed, so a handle held across a
+// wait can't be mistaken for the next connection in the same slot.
+// Logged-in clients are also kept in the dense live_clients array, which
+// is what broadcasts walk.
+#define DEFAULT_MAX_CLIENTS 1024
+#define CLIENT_INDEX_BITS 16
+#define CLIENT_LIMIT (1 << CLIENT_INDEX_BITS)
+#define CLIENT_CHUNK 64               // Slots committed at a time
+int max_clients = DEFAULT_MAX_CLIENTS;
+int listen_backlog = SOMAXCONN;
+volatile LONG client_capacity = 0; // Slots committed and initialized so far
+int *free_slots;                  // Stack of free slot indices
+int free_count = 0;
+int *live_clients;                // Slots of logged-in clients, in no order
+int live_count = 0;
+
+// Server configuration (from command line)
+int server_port = SERVER_PORT;
+char chatlog_path[MAX_PATH] = CHATLOG_FILE;
+int is_follower = 0;              // Read-only replica of a leader's chat log
+char leader_ip[16] = "127.0.0.1";
+int leader_port = SERVER_PORT;
+char repl_secret[MAX_PASSWORD] = ""; // --repl-secret: what a follower must present to subscribe
+int max_message_length = MAX_LONG_MESSAGE; // Longest chat/private text, across its fragments
+
+// Chat log state - log_mutex serializes appends and orders replication
+// Lock order: log_mutex before clients_mutex
+profiled_lock_t log_mutex;
+unsigned int log_seq = 0;         // Sequence number of the last record in the log
+long *log_offsets = NULL;         // log_offsets[seq - 1] = file offset of record seq
+unsigned int log_capacity = 0;
+FILE *chat_log = NULL;            // Open for appends for the life of the process
+
+// Snapshots of the log index: every snapshot_interval seconds (and before
+// a handoff) the record offsets go to <log>.snap with the log size they
+// cover. Startup maps the snapshot and scans only the records after it.
+#define SNAPSHOT_MAGIC 0x50414e53    // "SNAP"
+#define SNAPSHOT_VERSION 1
+#define DEFAULT_SNAPSHOT_INTERVAL 300
+
+typedef struct {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int records;         // log_offsets[0..records) follow the header
+    unsigned int offset_size;     // sizeof(long) of the build that wrote it
+    long log_size;                // Where the last covered record ends
+} snapshot_header_t;
+
+int snapshot_interval = DEFAULT_SNAPSHOT_INTERVAL; // Seconds, 0 = never
+HANDLE snapshot_mutex;            // One writer at a time
+
+// Content filter (filter.h) for chat and private messages, recompiled when
+// its file changes and swapped in whole, so messages never wait on a
+// reload. Scans hold filter_lock shared; the swap takes it exclusive, so
+// the old filter is freed only once no scan can still be using it.
+#define FILTER_FILE "filter.txt"
+#define FILTER_POLL_MS 2000
+char filter_path[MAX_PATH] = FILTER_FILE;
+filter_t *active_filter = NULL;   // NULL = no filter file
+SRWLOCK filter_lock = SRWLOCK_INIT; // Guards active_filter and filter_generation
+FILETIME filter_written;          // Last write time of the file we compiled
+LONG filter_generation = 0;       // Bumped on each reload
+
+// A connection's progress through the filter. The fragments of a long
+// message are scanned as one text, so a pattern split across them is
+// still caught; a reject drops the rest, last fragment included, so
+// receivers never put the message together.
+typedef struct {
+    int rejecting;                // Dropping the rest of a message the filter refused
+    unsigned int state;           // Automaton state after the previous fragment
+    LONG generation;              // filter_generation state belongs to
+} filter_stream_t;
+
+// File transfers: attachments are stored by content hash as
+// attachments/<sha256 hex>, with uploads in progress kept as .part
+#define ATTACHMENTS_DIR "attachments"
+#define DEFAULT_MAX_ATTACHMENT_MB 64
+unsigned long long max_attachment_size = DEFAULT_MAX_ATTACHMENT_MB * 1024ULL * 1024ULL;
+
+// An upload in progress, owned by its connection's handle_client thread
+typedef struct {
+    FILE *file;                   // The .part file, NULL if no upload
+    int claimed;                  // hash is in uploading_hashes
+    char hash[SHA256_HEX_LEN];
+    char name[MAX_PATH];
+    unsigned int recipient_id;    // 0 = shared with everyone
+    unsigned long long size;
+    unsigned int chunks;
+    unsigned int next_chunk;
+    unsigned int request_id;      // The offer's, echoed on completion and errors
+} upload_t;
+
+// Hashes with an upload in progress: two connections offering the same
+// file would both write its .part, so the second is told to wait
+char (*uploading_hashes)[SHA256_HEX_LEN] = NULL;
+int uploading_count = 0;
+int uploading_capacity = 0;
+HANDLE uploading_mutex;
+
+// Usernames interned to compact IDs, so routing and session checks compare
+// integers. A user's ID is their position among the valid names in
+// users.txt, which stays the same across restarts. 0 means no user (SERVER, unknown names).
+#define USER_ID_MIN_BUCKETS 256
+
+typedef struct {
+    char name[MAX_USERNAME];
+} user_name_t;
+
+user_name_t *user_names = NULL;   // user_names[id - 1]
+unsigned int user_count = 0;
+unsigned int user_capacity = 0;
+unsigned int *user_buckets = NULL; // Open addressing on name hash: ID, 0 = empty
+unsigned int user_bucket_count = 0;
+HANDLE user_ids_mutex;
+
+// Resumable sessions, one per user: sessions[user_id - 1], checked against
+// the token issued at login. A session outlives its connection; logging in
+// again replaces it and logging out ends it, so the table never holds more
+// than the registered users.
+#define SESSION_TTL_SECONDS 3600
+#define RESUME_MAX_RECORDS 4096       // Replayed at most; older ones come from a history sync
+#define RESUME_FINAL_PASS 64          // Records left to replay when log_mutex is taken
+
+typedef struct {
+    char token[SESSION_TOKEN_LEN];
+    unsigned int user_id;
+    time_t expires;               // 0 = free slot
+    unsigned int acked_id;        // Every msg_id up to here has been received
+    unsigned long long window;    // Bit i set = acked_id + 1 + i received out of order
+} session_t;
+
+session_t *sessions = NULL;
+int session_capacity = 0;
+profiled_lock_t sessions_mutex;
+
+// Authentication worker pool - password hashing is deliberately expensive,
+// so register/login run here instead of on the connection threads
+#define AUTH_QUEUE_SIZE 32
+#define MAX_AUTH_WORKERS 16
+#define USERS_LINE_LEN (MAX_USERNAME + PASSWORD_RECORD_LEN + 2)
 
 typedef struct {
+    int type;                     // MSG_REGISTER or MSG_LOGIN
+    unsigned int request_id;      // Echoed on the response
+    int index;                    // Client slot that asked
+    unsigned int handle;          // Detects a slot reused by a new connection
     SOCKET socket;
     char username[MAX_USERNAME];
-    int is_logged_in;
-} client_t;
+    char password[MAX_PASSWORD];
+    unsigned long long queued_us; // For the auth latency histogram
+} auth_job_t;
 
-// Global variables
-client_t clients[MAX_CLIENTS];
-HANDLE clients_mutex;
+auth_job_t auth_queue[AUTH_QUEUE_SIZE];
+int auth_head = 0;
+int auth_count = 0;
+HANDLE auth_mutex;
+HANDLE auth_items;                // Semaphore counting queued jobs
+profiled_lock_t users_mutex;      // Serializes users.txt reads and rewrites
+int auth_worker_count = 2;
+int hash_cost = DEFAULT_HASH_COST;
+
+// Outbound path: every frame to a client goes through its lanes and is
+// written by that connection's writer thread, highest priority lane first
+#define LANE_CONTROL 0               // Responses, errors, acks
+#define LANE_INTERACTIVE 1           // Live chat, DMs, announcements, replication
+#define LANE_BULK 2                  // History/search pages, fed by the bulk scheduler
+#define LANE_COUNT 3
+#define MAX_LANE_DEPTH 1024          // Beyond this a slow client starts losing frames
+#define BULK_LANE_DEPTH 4            // Bulk frames queued ahead of the writer
+#define BULK_QUANTUM (2 * sizeof(Message)) // DRR bytes per round per unit of weight
+#define STREAM_SCAN_BUDGET 256       // Log lines a search may scan per frame attempt
+#define FILE_SEGMENT_SIZE (16 * FILE_CHUNK_SIZE) // Raw bytes per download frame
+
+// Bulk stream kinds and their scheduling weights
+#define STREAM_HISTORY 1
+#define STREAM_SEARCH 2
+#define STREAM_FILE 3
+#define WEIGHT_HISTORY 1
+#define WEIGHT_SEARCH 1
+#define WEIGHT_FILE 8                // Enough credit for one segment per round
+
+typedef struct out_node {
+    struct out_node *next;
+    Message msg;
+    HANDLE file;                  // Download segment: length bytes at offset follow msg
+    unsigned long long offset;
+    DWORD length;
+    unsigned int trace_id;        // Sampled message this frame belongs to (trace.h), or 0
+    unsigned long long queued_us;
+} out_node_t;
+
+typedef struct {
+    out_node_t *head;
+    out_node_t *tail;
+    int count;
+} lane_t;
+
+// A history or search reply or a download, produced a frame at a time as
+// the scheduler grants it bandwidth instead of all at once on the
+// connection thread
+typedef struct {
+    int kind;                     // 0 = no stream
+    unsigned int request_id;      // Echoed on every frame of the reply
+    FILE *file;
+    HANDLE handle;                // Download: the attachment
+    char hash[SHA256_HEX_LEN];
+    unsigned long long size;
+    unsigned long long offset;    // Download: next byte to send
+    log_query_t query;            // Search
+    unsigned int seq;             // Log record last read
+    int matches;
+    char line[MAX_LOG_LINE];      // History/search: a record too long for one frame
+    int line_length;
+    unsigned short part;          // Parts of line sent so far
+    unsigned short parts;         // 0 = nothing left of line
+    int state;                    // 0 = start marker, 1 = records, 2 = end marker
+    int weight;
+    long deficit;                 // DRR credit in bytes
+} bulk_stream_t;
+
+typedef struct {
+    SOCKET socket;                // Connection the lanes belong to (INVALID_SOCKET = idle)
+    HANDLE mutex;
+    HANDLE ready;                 // Auto-reset: frames were queued
+    HANDLE space;                 // Auto-reset: the writer took a frame
+    HANDLE writer;
+    int closing;
+    int sending;                  // The writer has a frame in hand
+    volatile LONG parked;         // Its connection thread waits out a handoff
+    unsigned int dropped;         // Frames lost to a full lane, not yet reported
+    int producing;                // The bulk scheduler is reading stream without mutex
+    lane_t lanes[LANE_COUNT];
+    bulk_stream_t stream;
+} outbound_t;
+
+outbound_t *outbound;             // Same slots as clients
+pool_t node_pool;                 // Every out_node_t comes from here
+
+// Stats (metrics.h) go to admins as MSG_STATS, and as text to anyone who
+// connects to the loopback-only stats port
+#define STATS_TEXT_SIZE 8192
+char admin_users[256] = "";       // Comma-separated usernames, from --admin
+int stats_port = 0;               // 0 = no stats endpoint
+HANDLE stats_mutex;               // Serializes format_stats
+time_t server_started;
+HANDLE bulk_event;                // Auto-reset: a stream started or a bulk frame left
+
+// Traces (trace.h) are dumped on MSG_TRACE "dump" from an admin or on
+// Ctrl+Break at the server console
+HANDLE trace_mutex;               // One dump at a time
+
+// Multicast fan-out (--multicast group:port): a public message goes to the
+// group once for every client that asked for it that way (MSG_MULTICAST
+// "on"), instead of one TCP copy each. The last MCAST_RING datagrams are
+// kept for clients repairing a gap over TCP, and a heartbeat repeats the
+// latest seq so a loss at the end of a burst is noticed too.
+#define MCAST_HEARTBEAT_MS 1000
+char multicast_group[16] = "";    // Empty = off
+int multicast_port = 0;
+char multicast_if[16] = "";       // Interface to send on, e.g. 127.0.0.1 (empty = default)
+int multicast_ttl = 1;            // Stay on the local subnet
+SOCKET mcast_socket = INVALID_SOCKET;
+struct sockaddr_in mcast_addr;
+unsigned int mcast_epoch;
+unsigned char mcast_key[MCAST_KEY_LEN]; // Seals this epoch's datagrams (multicast.h)
+char mcast_key_hex[MCAST_KEY_HEX_LEN];  // Given out with MSG_MULTICAST "on"
+unsigned int mcast_seq = 0;       // Last datagram sent; guarded by clients_mutex
+mcast_frame_t *mcast_ring;        // mcast_ring[seq % MCAST_RING], unsealed
+
+// Hot upgrade: a new server started with --upgrade connects to the running
+// one's pipe. The old server stops reading between frames, drains its
+// queues and passes over the listening socket, its idle connections and
+// the session table, then exits. Sockets travel as WSADuplicateSocket
+// protocol info, so clients never see a disconnect.
+#define HANDOFF_PIPE "\\\\.\\pipe\\chatserver-%d"
+#define HANDOFF_VERSION 5
+#define HANDOFF_DRAIN_MS 10000       // Give up if connections are still busy by then
+
+typedef struct {
+    DWORD pid;                    // WSADuplicateSocket needs the target process
+    unsigned int version;
+    unsigned int message_size;    // Both binaries must agree on these layouts
+    unsigned int client_size;
+    unsigned int session_size;
+} handoff_hello_t;
+
+typedef struct {
+    int accepted;                 // 0 = refused, nothing follows
+    int connections;              // handoff_client_t records that follow
+    int session_count;            // Then this many session_t
+    WSAPROTOCOL_INFO listener;
+} handoff_state_t;
+
+typedef struct {
+    client_t client;              // socket is recreated from info
+    WSAPROTOCOL_INFO info;
+} handoff_client_t;
+
+int upgrade = 0;                  // --upgrade: take over from the server on this port
+volatile LONG handing_off = 0;    // Connection threads park while set
+HANDLE handoff_begin;             // Manual-reset: set with handing_off, wakes waiting threads
+HANDLE handoff_resume;            // Manual-reset: the handoff was abandoned
+HANDLE handoff_pipe = INVALID_HANDLE_VALUE;
+DWORD handoff_pid;
+handoff_state_t handoff_state;
+handoff_client_t *handoff_clients; // max_clients of them, while handing off
+session_t *handoff_sessions;      // handoff_state.session_count of them
+int handoff_count = 0;
 
 // Function prototypes
 DWORD WINAPI handle_client(LPVOID arg);
+int valid_username(const char *username);
 int authenticate_user(const char *username, const char *password);
 int register_user(const char *username, const char *password);
+int find_user_record(const char *username, char *record, size_t size);
+int update_user_record(const char *username, const char *record);
+int submit_auth_job(int index, Message *msg);
+DWORD WINAPI auth_worker(LPVOID arg);
+void complete_login(int index, unsigned int handle, SOCKET client_socket, const char *username, unsigned int request_id);
 void broadcast_message(Message *msg, SOCKET sender_socket);
 void send_private_message(Message *msg, SOCKET sender_socket);
-void send_chat_history(SOCKET client_socket);
+int check_fragment(int index, Message *msg);
 void add_to_chat_log(Message *msg);
+unsigned int append_log_line(const char *line);
+int queue_log_line(int index, SOCKET sock, unsigned int seq, const char *line, int wait);
+int read_log_line(FILE *file, char *line, int size);
+int send_log_records(FILE *file, int index, SOCKET sock, unsigned int *seq, unsigned int target, unsigned int from_seq);
+int replication_allowed(int index, Message *msg);
+void serve_follower(int index, unsigned int from_seq);
+DWORD WINAPI replication_client(LPVOID arg);
+void send_server_error(int index, unsigned int request_id, const char *text);
+int start_outbound(int index, SOCKET sock);
+void stop_outbound(int index);
+int queue_message(int index, SOCKET sock, const Message *msg, int lane);
+int queue_message_wait(int index, SOCKET sock, const Message *msg, int lane);
+DWORD WINAPI outbound_writer(LPVOID arg);
+int start_bulk_stream(int index, int kind, const char *query, unsigned int from_seq, unsigned int request_id);
+void close_bulk_stream(bulk_stream_t *stream);
+int next_stream_frame(bulk_stream_t *stream, out_node_t *node);
+int next_record_part(bulk_stream_t *stream, Message *frame);
+int next_file_frame(bulk_stream_t *stream, out_node_t *node);
+int start_file_stream(int index, const char *hash, unsigned int from_chunk, unsigned int request_id);
+void free_out_node(out_node_t *node);
+int is_admin(unsigned int user_id);
+int format_stats(char *text, size_t size);
+void send_stats(int index, Message *request);
+DWORD WINAPI stats_listener(LPVOID arg);
+void handle_trace_command(int index, Message *msg);
+int start_multicast();
+void multicast_send(const Message *msg);
+DWORD WINAPI multicast_heartbeat(LPVOID arg);
+void handle_multicast_command(int index, Message *msg);
+int dump_trace(char *path, size_t size);
+BOOL WINAPI console_handler(DWORD event);
+int pipe_read(HANDLE pipe, void *buffer, DWORD size);
+int process_user(HANDLE process, BYTE *token_user, DWORD size);
+int handoff_peer_trusted(DWORD pid);
+int handoff_pipe_security(SECURITY_ATTRIBUTES *security);
+int pipe_write(HANDLE pipe, const void *buffer, DWORD size);
+DWORD WINAPI handoff_listener(LPVOID arg);
+int connection_idle(int index);
+void park_connection(int index);
+void cancel_arrival(SOCKET sock, WSAOVERLAPPED *arrival, int *pending);
+void hand_off(SOCKET listener);
+SOCKET take_over();
+void adopt_connections();
+int valid_file_hash(const char *hash);
+void handle_file_offer(int index, upload_t *upload, Message *msg);
+void handle_file_chunk(int index, upload_t *upload, Message *msg);
+void finish_upload(int index, upload_t *upload);
+void close_upload(upload_t *upload);
+int claim_upload_hash(upload_t *upload);
+void release_upload_hash(upload_t *upload);
+void share_attachment(int index, const upload_t *upload);
+DWORD WINAPI bulk_scheduler(LPVOID arg);
+void record_log_offset(unsigned int seq, long offset);
+unsigned int load_snapshot(long *covered);
+int write_snapshot();
+DWORD WINAPI snapshot_writer(LPVOID arg);
+int filter_message(int index, Message *msg, filter_stream_t *stream);
+void refresh_filter();
+DWORD WINAPI filter_watcher(LPVOID arg);
+unsigned int hash_username(const char *name);
+unsigned int *find_user_bucket(const char *name);
+unsigned int find_user_id(const char *name);
+unsigned int intern_user(const char *name);
+int user_id_name(unsigned int id, char *name);
+void client_username(int index, char *name);
+int send_user_directory(int index, SOCKET sock, int wait);
+void announce_user(unsigned int id, const char *name);
+void load_user_ids();
+int grow_sessions(int capacity);
+int create_session(unsigned int user_id, char *token);
+int find_session(unsigned int user_id, const char *token);
+int accept_message_id(int index, unsigned int msg_id);
+void send_ack(int index);
+void end_session(unsigned int user_id);
+void drop_session(int slot, const char *token);
+void resume_session(int index, Message *msg);
+int replay_missed(FILE *file, int index, SOCKET sock, unsigned int user_id, unsigned int *seq, unsigned int target, int wait);
+void parse_arguments(int argc, char *argv[]);
 void initialize_server();
+int grow_clients();
+int acquire_slot(SOCKET client_socket);
+void release_slot(int index);
+void set_logged_in(int index, int logged_in);
+unsigned int client_handle(int index);
+int handle_index(unsigned int handle);
 void cleanup_winsock();
 
-int main() {
+int main(int argc, char *argv[]) {
     SOCKET server_socket, client_socket;
     struct sockaddr_in server_addr, client_addr;
     HANDLE thread_handle;
@@ -34,58 +446,104 @@ int main() {
         return 1;
     }
     
-    // Create mutex for thread synchronization
-    clients_mutex = CreateMutex(NULL, FALSE, NULL);
-    if (clients_mutex == NULL) {
-        printf("CreateMutex error: %d\n", GetLastError());
+    parse_arguments(argc, argv);
+    if (!affinity_check()) {
         WSACleanup();
         return 1;
     }
     
-    // Initialize client list
-    initialize_server();
-    
-    // Create socket
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket == INVALID_SOCKET) {
-        printf("Socket creation failed. Error Code: %d\n", WSAGetLastError());
-        CloseHandle(clients_mutex);
+    // Create mutexes for thread synchronization
+    lock_init(&clients_mutex, "clients_mutex");
+    lock_init(&log_mutex, "log_mutex");
+    lock_init(&sessions_mutex, "sessions_mutex");
+    auth_mutex = CreateMutex(NULL, FALSE, NULL);
+    lock_init(&users_mutex, "users_mutex");
+    user_ids_mutex = CreateMutex(NULL, FALSE, NULL);
+    stats_mutex = CreateMutex(NULL, FALSE, NULL);
+    trace_mutex = CreateMutex(NULL, FALSE, NULL);
+    handoff_begin = CreateEvent(NULL, TRUE, FALSE, NULL);
+    handoff_resume = CreateEvent(NULL, TRUE, FALSE, NULL);
+    snapshot_mutex = CreateMutex(NULL, FALSE, NULL);
+    uploading_mutex = CreateMutex(NULL, FALSE, NULL);
+    auth_items = CreateSemaphore(NULL, 0, AUTH_QUEUE_SIZE, NULL);
+    bulk_event = CreateEvent(NULL, FALSE, FALSE, NULL);
+    pool_init(&node_pool, "out_node", sizeof(out_node_t));
+    node_pool.numa_local = affinity_masks[AFFINITY_CONNECTION] != 0;
+    metrics_init();
+    trace_init();
+    server_started = time(NULL);
+    if (!clock_start()) {
+        printf("Clock thread creation failed. Error Code: %d\n", GetLastError());
         WSACleanup();
         return 1;
     }
-    
-    // Set socket options for reuse
-    int opt = 1;
-    if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt)) == SOCKET_ERROR) {
-        printf("Setsockopt failed. Error Code: %d\n", WSAGetLastError());
-        closesocket(server_socket);
-        CloseHandle(clients_mutex);
+    if (clients_mutex.handle == NULL || log_mutex.handle == NULL || sessions_mutex.handle == NULL ||
+        auth_mutex == NULL || users_mutex.handle == NULL || user_ids_mutex == NULL || auth_items == NULL ||
+        bulk_event == NULL || stats_mutex == NULL || trace_mutex == NULL || handoff_resume == NULL || handoff_begin == NULL ||
+        snapshot_mutex == NULL || uploading_mutex == NULL) {
+        printf("CreateMutex error: %d\n", GetLastError());
         WSACleanup();
         return 1;
     }
     
-    // Prepare server address
-    memset(&server_addr, 0, sizeof(server_addr));
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(SERVER_PORT);
-    
-    // Bind socket
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
-        printf("Bind failed. Error Code: %d\n", WSAGetLastError());
-        closesocket(server_socket);
-        CloseHandle(clients_mutex);
-        WSACleanup();
-        return 1;
+    // Hot upgrade: wait for the running server to go quiet and take its
+    // listener and connections before reading any of its files
+    if (upgrade) {
+        server_socket = take_over();
+        if (server_socket == INVALID_SOCKET) {
+            WSACleanup();
+            return 1;
+        }
     }
     
-    // Listen for connections
-    if (listen(server_socket, 5) == SOCKET_ERROR) {
-        printf("Listen failed. Error Code: %d\n", WSAGetLastError());
-        closesocket(server_socket);
-        CloseHandle(clients_mutex);
-        WSACleanup();
-        return 1;
+    // Initialize client list
+    initialize_server();
+    load_user_ids();
+    
+    // A handed-over listener is already bound and listening
+    if (!upgrade) {
+        // Create socket
+        server_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (server_socket == INVALID_SOCKET) {
+            printf("Socket creation failed. Error Code: %d\n", WSAGetLastError());
+            CloseHandle(clients_mutex.handle);
+            WSACleanup();
+            return 1;
+        }
+        
+        // Set socket options for reuse
+        int opt = 1;
+        if (setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, (const char*)&opt, sizeof(opt)) == SOCKET_ERROR) {
+            printf("Setsockopt failed. Error Code: %d\n", WSAGetLastError());
+            closesocket(server_socket);
+            CloseHandle(clients_mutex.handle);
+            WSACleanup();
+            return 1;
+        }
+        
+        // Prepare server address
+        memset(&server_addr, 0, sizeof(server_addr));
+        server_addr.sin_family = AF_INET;
+        server_addr.sin_addr.s_addr = INADDR_ANY;
+        server_addr.sin_port = htons(server_port);
+        
+        // Bind socket
+        if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) == SOCKET_ERROR) {
+            printf("Bind failed. Error Code: %d\n", WSAGetLastError());
+            closesocket(server_socket);
+            CloseHandle(clients_mutex.handle);
+            WSACleanup();
+            return 1;
+        }
+        
+        // Listen for connections
+        if (listen(server_socket, listen_backlog) == SOCKET_ERROR) {
+            printf("Listen failed. Error Code: %d\n", WSAGetLastError());
+            closesocket(server_socket);
+            CloseHandle(clients_mutex.handle);
+            WSACleanup();
+            return 1;
+        }
     }
     
     // Print the server's local and public IP for clients to connect
@@ -95,17 +553,143 @@ int main() {
     char *local_ip = inet_ntoa(*(struct in_addr*)(he->h_addr_list[0]));
     
     printf("Server started. Listening on:\n");
-    printf("- Local IP (for same network): %s:%d\n", local_ip, SERVER_PORT);
+    printf("- Local IP (for same network): %s:%d\n", local_ip, server_port);
     printf("- For connections from other networks, you need to set up port forwarding\n");
-    printf("  in your router for port %d\n", SERVER_PORT);
+    printf("  in your router for port %d\n", server_port);
+    printf("Chat log: %s (%u records)\n", chatlog_path, log_seq);
+    affinity_report();
+    
+    // Start the authentication workers below normal priority so a login
+    // storm can't starve the threads delivering messages
+    printf("Auth workers: %d (hash cost 2^%d)\n", auth_worker_count, hash_cost);
+    for (int i = 0; i < auth_worker_count; i++) {
+        thread_handle = CreateThread(NULL, 0, auth_worker, (LPVOID)(DWORD_PTR)i, 0, NULL);
+        if (thread_handle == NULL) {
+            printf("Auth worker creation failed. Error Code: %d\n", GetLastError());
+            closesocket(server_socket);
+            CloseHandle(clients_mutex.handle);
+            WSACleanup();
+            return 1;
+        }
+        SetThreadPriority(thread_handle, THREAD_PRIORITY_BELOW_NORMAL);
+        CloseHandle(thread_handle);
+    }
+    
+    // Bulk scheduler: shares history/search bandwidth fairly between clients
+    thread_handle = CreateThread(NULL, 0, bulk_scheduler, NULL, 0, NULL);
+    if (thread_handle == NULL) {
+        printf("Bulk scheduler creation failed. Error Code: %d\n", GetLastError());
+        closesocket(server_socket);
+        CloseHandle(clients_mutex.handle);
+        WSACleanup();
+        return 1;
+    }
+    CloseHandle(thread_handle);
+    
+    if (stats_port > 0) {
+        thread_handle = CreateThread(NULL, 0, stats_listener, NULL, 0, NULL);
+        if (thread_handle == NULL) {
+            printf("Stats thread creation failed. Error Code: %d\n", GetLastError());
+        } else {
+            CloseHandle(thread_handle);
+        }
+    }
+    
+    // Ctrl+Break dumps the trace rings; Ctrl+C still stops the server
+    SetConsoleCtrlHandler(console_handler, TRUE);
+    if (trace_sample_every > 0) {
+        printf("Tracing 1 in %ld messages (Ctrl+Break to dump)\n", (long)trace_sample_every);
+    }
+    
+    // Followers tail the leader's log and only serve history/search
+    if (is_follower) {
+        printf("Running as read-only follower of %s:%d\n", leader_ip, leader_port);
+        thread_handle = CreateThread(NULL, 0, replication_client, NULL, 0, NULL);
+        if (thread_handle == NULL) {
+            printf("Replication thread creation failed. Error Code: %d\n", GetLastError());
+            closesocket(server_socket);
+            CloseHandle(clients_mutex.handle);
+            WSACleanup();
+            return 1;
+        }
+        CloseHandle(thread_handle);
+    }
+    
+    // The filter is in place before the first message is read
+    refresh_filter();
+    thread_handle = CreateThread(NULL, 0, filter_watcher, NULL, 0, NULL);
+    if (thread_handle == NULL) {
+        printf("Filter thread creation failed. Error Code: %d\n", GetLastError());
+    } else {
+        CloseHandle(thread_handle);
+    }
+    
+    if (snapshot_interval > 0) {
+        thread_handle = CreateThread(NULL, 0, snapshot_writer, NULL, 0, NULL);
+        if (thread_handle == NULL) {
+            printf("Snapshot thread creation failed. Error Code: %d\n", GetLastError());
+        } else {
+            CloseHandle(thread_handle);
+        }
+    }
+    
+    // Public messages to the multicast group; without it clients that ask
+    // are told no and stay on TCP
+    if (multicast_group[0] != '\0' && start_multicast()) {
+        printf("Multicast: %s:%d (ttl %d)\n", multicast_group, multicast_port, multicast_ttl);
+        thread_handle = CreateThread(NULL, 0, multicast_heartbeat, NULL, 0, NULL);
+        if (thread_handle == NULL) {
+            printf("Multicast heartbeat creation failed. Error Code: %d\n", GetLastError());
+        } else {
+            CloseHandle(thread_handle);
+        }
+    }
+    
+    // Connections taken over from the old server carry on where they were
+    if (upgrade) {
+        adopt_connections();
+    }
+    
+    // Wait for the next upgrade
+    thread_handle = CreateThread(NULL, 0, handoff_listener, NULL, 0, NULL);
+    if (thread_handle == NULL) {
+        printf("Handoff thread creation failed. Error Code: %d\n", GetLastError());
+    } else {
+        CloseHandle(thread_handle);
+    }
     
-    // Accept and handle client connections
+    // Accept and handle client connections. The accept thread owns the
+    // listener, so it runs the handoff: it sleeps until a connection is
+    // pending or a handoff begins.
+    affinity_pin(AFFINITY_ACCEPT, -1);
+    WSAEVENT accept_event = WSACreateEvent();
+    WSAEventSelect(server_socket, accept_event, FD_ACCEPT);
+    HANDLE accept_wake[2] = { accept_event, handoff_begin };
     while (1) {
+        if (handing_off) {
+            hand_off(server_socket);
+            continue;
+        }
+        
+        if (WaitForMultipleObjects(2, accept_wake, FALSE, INFINITE) != WAIT_OBJECT_0) {
+            continue;
+        }
+        WSAResetEvent(accept_event); // accept() signals it again while more are pending
+        
         client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &client_len);
         if (client_socket == INVALID_SOCKET) {
-            printf("Accept failed. Error Code: %d\n", WSAGetLastError());
+            if (WSAGetLastError() != WSAEWOULDBLOCK) {
+                printf("Accept failed. Error Code: %d\n", WSAGetLastError());
+            }
             continue;
         }
+        metrics_add(M_ACCEPTS, 1);
+        
+        // The new socket inherits the listener's event selection and
+        // non-blocking mode; the writer thread needs blocking sends
+        unsigned long blocking = 0;
+        WSAEventSelect(client_socket, NULL, 0);
+        ioctlsocket(client_socket, FIONBIO, &blocking);
         
         char client_ip[INET_ADDRSTRLEN];
         // Use inet_ntoa instead of inet_ntop for better compatibility
@@ -113,34 +697,33 @@ int main() {
         printf("New connection from %s:%d\n", client_ip, ntohs(client_addr.sin_port));
         
         // Find free slot for client
-        int slot = -1;
-        WaitForSingleObject(clients_mutex, INFINITE);
-        for (int i = 0; i < MAX_CLIENTS; i++) {
-            if (clients[i].socket == INVALID_SOCKET) {
-                clients[i].socket = client_socket;
-                clients[i].is_logged_in = 0;
-                slot = i;
-                break;
-            }
-        }
-        ReleaseMutex(clients_mutex);
+        lock_acquire(&clients_mutex);
+        int slot = acquire_slot(client_socket);
+        lock_release(&clients_mutex);
         
         if (slot == -1) {
             printf("Server full, rejecting client\n");
+            metrics_add(M_REJECTS, 1);
             closesocket(client_socket);
             continue;
         }
         
         // Create thread to handle client - fixed parameter passing
         DWORD slot_id = (DWORD)slot;
-        thread_handle = CreateThread(NULL, 0, handle_client, (LPVOID)slot_id, 0, NULL);
+        thread_handle = NULL;
+        if (start_outbound(slot, client_socket)) {
+            thread_handle = CreateThread(NULL, 0, handle_client, (LPVOID)slot_id, 0, NULL);
+            if (thread_handle == NULL) {
+                stop_outbound(slot);
+            }
+        }
         if (thread_handle == NULL) {
             printf("Thread creation failed. Error Code: %d\n", GetLastError());
             closesocket(client_socket);
             
-            WaitForSingleObject(clients_mutex, INFINITE);
-            clients[slot].socket = INVALID_SOCKET;
-            ReleaseMutex(clients_mutex);
+            lock_acquire(&clients_mutex);
+            release_slot(slot);
+            lock_release(&clients_mutex);
         } else {
             CloseHandle(thread_handle); // Detach thread
         }
@@ -148,16 +731,130 @@ int main() {
     
     // Clean up
     closesocket(server_socket);
-    CloseHandle(clients_mutex);
+    CloseHandle(clients_mutex.handle);
     WSACleanup();
     return 0;
 }
 
+void parse_arguments(int argc, char *argv[]) {
+    // Usage: server.exe [port] [--log file] [--follow leader_ip:port]
+    //                   [--auth-workers n] [--hash-cost log2] [--max-attachment MB]
+    //                   [--max-message chars] [--admin user,...] [--stats-port port]
+    //                   [--trace every] [--lock-profile] [--upgrade]
+    //                   [--snapshot-interval seconds] [--filter file]
+    //                   [--max-clients n] [--backlog n] [--cpus role=list]...
+    //                   [--multicast group:port] [--multicast-if ip] [--multicast-ttl n]
+    //                   [--repl-secret secret]
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            strncpy(chatlog_path, argv[++i], sizeof(chatlog_path) - 1);
+            chatlog_path[sizeof(chatlog_path) - 1] = '\0';
+        } else if (strcmp(argv[i], "--follow") == 0 && i + 1 < argc) {
+            char *leader = argv[++i];
+            char *colon = strchr(leader, ':');
+            if (colon != NULL) {
+                leader_port = atoi(colon + 1);
+                *colon = '\0';
+            }
+            strncpy(leader_ip, leader, sizeof(leader_ip) - 1);
+            leader_ip[sizeof(leader_ip) - 1] = '\0';
+            is_follower = 1;
+        } else if (strcmp(argv[i], "--repl-secret") == 0 && i + 1 < argc) {
+            strncpy(repl_secret, argv[++i], sizeof(repl_secret) - 1);
+        } else if (strcmp(argv[i], "--auth-workers") == 0 && i + 1 < argc) {
+            auth_worker_count = atoi(argv[++i]);
+            if (auth_worker_count < 1) {
+                auth_worker_count = 1;
+            } else if (auth_worker_count > MAX_AUTH_WORKERS) {
+                auth_worker_count = MAX_AUTH_WORKERS;
+            }
+        } else if (strcmp(argv[i], "--hash-cost") == 0 && i + 1 < argc) {
+            hash_cost = atoi(argv[++i]);
+            if (hash_cost < MIN_HASH_COST) {
+                hash_cost = MIN_HASH_COST;
+            } else if (hash_cost > MAX_HASH_COST) {
+                hash_cost = MAX_HASH_COST;
+            }
+        } else if (strcmp(argv[i], "--max-attachment") == 0 && i + 1 < argc) {
+            max_attachment_size = strtoull(argv[++i], NULL, 10) * 1024ULL * 1024ULL;
+        } else if (strcmp(argv[i], "--max-message") == 0 && i + 1 < argc) {
+            max_message_length = atoi(argv[++i]);
+            if (max_message_length < FRAGMENT_TEXT) {
+                max_message_length = FRAGMENT_TEXT;
+            } else if (max_message_length > 65535 * FRAGMENT_TEXT) {
+                max_message_length = 65535 * FRAGMENT_TEXT;
+            }
+        } else if (strcmp(argv[i], "--admin") == 0 && i + 1 < argc) {
+            strncpy(admin_users, argv[++i], sizeof(admin_users) - 1);
+        } else if (strcmp(argv[i], "--stats-port") == 0 && i + 1 < argc) {
+            stats_port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc) {
+            trace_sample_every = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--lock-profile") == 0) {
+            lock_profiling = 1;
+        } else if (strcmp(argv[i], "--upgrade") == 0) {
+            upgrade = 1;
+        } else if (strcmp(argv[i], "--snapshot-interval") == 0 && i + 1 < argc) {
+            snapshot_interval = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            strncpy(filter_path, argv[++i], sizeof(filter_path) - 1);
+        } else if (strcmp(argv[i], "--max-clients") == 0 && i + 1 < argc) {
+            max_clients = atoi(argv[++i]);
+            if (max_clients < 1) {
+                max_clients = 1;
+            } else if (max_clients > CLIENT_LIMIT) {
+                max_clients = CLIENT_LIMIT;
+            }
+        } else if (strcmp(argv[i], "--cpus") == 0 && i + 1 < argc) {
+            if (!affinity_parse(argv[++i])) {
+                printf("Bad --cpus %s: expected accept|conn|auth|background=<cpu list>, e.g. auth=2-3\n", argv[i]);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(argv[i], "--multicast") == 0 && i + 1 < argc) {
+            char *group = argv[++i];
+            char *colon = strchr(group, ':');
+            if (colon == NULL || atoi(colon + 1) <= 0) {
+                printf("Bad --multicast %s: expected group:port, e.g. 239.255.0.1:8890\n", group);
+                exit(EXIT_FAILURE);
+            }
+            multicast_port = atoi(colon + 1);
+            *colon = '\0';
+            strncpy(multicast_group, group, sizeof(multicast_group) - 1);
+        } else if (strcmp(argv[i], "--multicast-if") == 0 && i + 1 < argc) {
+            strncpy(multicast_if, argv[++i], sizeof(multicast_if) - 1);
+        } else if (strcmp(argv[i], "--multicast-ttl") == 0 && i + 1 < argc) {
+            multicast_ttl = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--backlog") == 0 && i + 1 < argc) {
+            listen_backlog = atoi(argv[++i]);
+            if (listen_backlog < 1) {
+                listen_backlog = 1;
+            }
+        } else if (atoi(argv[i]) > 0) {
+            server_port = atoi(argv[i]);
+        } else {
+            printf("Usage: %s [port] [--log file] [--follow leader_ip:port] "
+                   "[--auth-workers n] [--hash-cost log2] [--max-attachment MB] "
+                   "[--max-message chars] [--admin user,...] [--stats-port port] "
+                   "[--trace every] [--lock-profile] [--upgrade] "
+                   "[--snapshot-interval seconds] [--filter file] "
+                   "[--max-clients n] [--backlog n] [--cpus role=list]... "
+                   "[--multicast group:port] [--multicast-if ip] [--multicast-ttl n] "
+                   "[--repl-secret secret]\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
 void initialize_server() {
-    // Initialize client array
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        clients[i].socket = INVALID_SOCKET;
-        clients[i].is_logged_in = 0;
+    // Reserve the connection table; grow_clients commits it as needed
+    clients = VirtualAlloc(NULL, (SIZE_T)max_clients * sizeof(client_t), MEM_RESERVE, PAGE_READWRITE);
+    outbound = VirtualAlloc(NULL, (SIZE_T)max_clients * sizeof(outbound_t), MEM_RESERVE, PAGE_READWRITE);
+    free_slots = malloc(max_clients * sizeof(int));
+    live_clients = malloc(max_clients * sizeof(int));
+    if (clients == NULL || outbound == NULL || free_slots == NULL || live_clients == NULL || !grow_clients() ||
+        !grow_sessions(max_clients)) {
+        printf("Failed to allocate the connection table. Error Code: %d\n", GetLastError());
+        exit(EXIT_FAILURE);
     }
     
     // Create users file if it doesn't exist
@@ -169,419 +866,3620 @@ void initialize_server() {
         exit(EXIT_FAILURE);
     }
     
-    // Create chat log file if it doesn't exist
-    file = fopen(CHATLOG_FILE, "a");
-    if (file != NULL) {
-        fclose(file);
-    } else {
+    // Attachments live next to the log
+    CreateDirectory(ATTACHMENTS_DIR, NULL);
+    
+    // Create chat log file if it doesn't exist, and keep it open: an
+    // fopen per record would allocate a CRT buffer and a handle each time
+    chat_log = fopen(chatlog_path, "a");
+    if (chat_log == NULL) {
         perror("Failed to create chat log file");
         exit(EXIT_FAILURE);
     }
+    
+    // Index existing records so new appends continue the sequence and
+    // resumes can seek straight to the first missed record. A snapshot
+    // covers the front of the log; only the records after it are read.
+    long covered = 0;
+    log_seq = load_snapshot(&covered);
+    unsigned int from_snapshot = log_seq;
+    file = fopen(chatlog_path, "r");
+    if (file != NULL) {
+        char line[MAX_LOG_LINE];
+        fseek(file, covered, SEEK_SET);
+        long offset = ftell(file);
+        while (fgets(line, sizeof(line), file)) {
+            if (strchr(line, '\n') != NULL) {
+                record_log_offset(++log_seq, offset);
+                offset = ftell(file);
+            }
+        }
+        fclose(file);
+    }
+    if (from_snapshot > 0) {
+        printf("Log index: %u records from snapshot, %u read from the log\n",
+               from_snapshot, log_seq - from_snapshot);
+    }
+}
+
+// Commit and set up the next CLIENT_CHUNK slots of the connection table,
+// on the NUMA node of the connection threads' CPUs if they are pinned
+// Caller holds clients_mutex (or is still starting up)
+// Returns 0 if the table is at max_clients or out of memory or handles
+int grow_clients() {
+    int first = client_capacity;
+    int count = max_clients - first < CLIENT_CHUNK ? max_clients - first : CLIENT_CHUNK;
+    if (count <= 0 ||
+        affinity_commit(&clients[first], count * sizeof(client_t), AFFINITY_CONNECTION) == NULL ||
+        affinity_commit(&outbound[first], count * sizeof(outbound_t), AFFINITY_CONNECTION) == NULL) {
+        return 0;
+    }
+    
+    int ready = 0;
+    for (int i = first; i < first + count; i++) {
+        memset(&clients[i], 0, sizeof(client_t));
+        clients[i].socket = INVALID_SOCKET;
+        clients[i].session = -1;
+        clients[i].live = -1;
+        
+        memset(&outbound[i], 0, sizeof(outbound_t));
+        outbound[i].socket = INVALID_SOCKET;
+        outbound[i].mutex = CreateMutex(NULL, FALSE, NULL);
+        outbound[i].ready = CreateEvent(NULL, FALSE, FALSE, NULL);
+        outbound[i].space = CreateEvent(NULL, FALSE, FALSE, NULL);
+        if (outbound[i].mutex == NULL || outbound[i].ready == NULL || outbound[i].space == NULL) {
+            printf("Failed to create outbound queue. Error Code: %d\n", GetLastError());
+            
+            // The slots before this one are kept; this one is set up again
+            // by the next call, so its handles would be lost
+            HANDLE created[3] = { outbound[i].mutex, outbound[i].ready, outbound[i].space };
+            for (int h = 0; h < 3; h++) {
+                if (created[h] != NULL) {
+                    CloseHandle(created[h]);
+                }
+            }
+            outbound[i].mutex = outbound[i].ready = outbound[i].space = NULL;
+            break;
+        }
+        ready++;
+    }
+    
+    // Lowest index on top; other threads may scan up to the new
+    // capacity as soon as it is published
+    for (int i = first + ready - 1; i >= first; i--) {
+        free_slots[free_count++] = i;
+    }
+    InterlockedExchange(&client_capacity, first + ready);
+    return ready > 0;
+}
+
+// Take a free slot for a new connection, growing the table if needed
+// Caller holds clients_mutex. Returns the slot, -1 if the server is full
+int acquire_slot(SOCKET client_socket) {
+    if (free_count == 0 && !grow_clients()) {
+        return -1;
+    }
+    int index = free_slots[--free_count];
+    client_t *client = &clients[index];
+    client->socket = client_socket;
+    client->is_logged_in = 0;
+    client->is_follower = 0;
+    client->session = -1;
+    client->auth_pending = 0;
+    client->user_id = 0;
+    client->live = -1;
+    client->is_multicast = 0;
+    return index;
+}
+
+// Give a slot back once its connection is closed. Caller holds clients_mutex.
+void release_slot(int index) {
+    set_logged_in(index, 0);
+    clients[index].socket = INVALID_SOCKET;
+    clients[index].generation++;
+    free_slots[free_count++] = index;
+}
+
+// Keep live_clients in step with is_logged_in. Caller holds clients_mutex.
+void set_logged_in(int index, int logged_in) {
+    client_t *client = &clients[index];
+    if (logged_in && client->live < 0) {
+        client->live = live_count;
+        live_clients[live_count++] = index;
+    } else if (!logged_in && client->live >= 0) {
+        // Move the last entry into the hole
+        int last = live_clients[--live_count];
+        live_clients[client->live] = last;
+        clients[last].live = client->live;
+        client->live = -1;
+    }
+    client->is_logged_in = logged_in;
+}
+
+unsigned int client_handle(int index) {
+    return clients[index].generation << CLIENT_INDEX_BITS | (unsigned int)index;
+}
+
+// The slot a handle refers to, -1 if that connection has gone
+// Caller holds clients_mutex
+int handle_index(unsigned int handle) {
+    int index = (int)(handle & (CLIENT_LIMIT - 1));
+    if (index >= client_capacity || client_handle(index) != handle ||
+        clients[index].socket == INVALID_SOCKET) {
+        return -1;
+    }
+    return index;
 }
 
 DWORD WINAPI handle_client(LPVOID arg) {
     // Fixed typecasting for thread argument
     int index = (int)(DWORD_PTR)arg;
     SOCKET client_socket = clients[index].socket;
+    affinity_pin(AFFINITY_CONNECTION, index);
     Message msg;
     int read_size;
+    int ack_pending = 0; // Accepted chat/private messages not yet acked
+    filter_stream_t filter_stream; // The content filter's place in a long message
+    memset(&filter_stream, 0, sizeof(filter_stream_t));
+    upload_t upload;
+    memset(&upload, 0, sizeof(upload_t));
     
-    while ((read_size = recv(client_socket, (char*)&msg, sizeof(Message), 0)) > 0) {
+    // A zero-byte overlapped receive signals arrival when a frame starts to
+    // come in. WSAEventSelect would do the same but makes the socket
+    // non-blocking under the writer thread's send() and TransmitFile.
+    WSAOVERLAPPED arrival;
+    memset(&arrival, 0, sizeof(WSAOVERLAPPED));
+    arrival.hEvent = WSACreateEvent();
+    int arrival_pending = 0;
+    
+    for (;;) {
+        // Batch acks: flush once the client's burst has been drained
+        if (ack_pending > 0) {
+            unsigned long buffered = 0;
+            ioctlsocket(client_socket, FIONREAD, &buffered);
+            if (buffered < sizeof(Message) || ack_pending >= ACK_BATCH) {
+                send_ack(index);
+                ack_pending = 0;
+            }
+        }
+        
+        // A hot upgrade is taking connections over: stop between frames,
+        // once no upload or login of ours is half done
+        int can_park = upload.file == NULL && !clients[index].auth_pending;
+        if (handing_off && can_park) {
+            if (ack_pending > 0) {
+                send_ack(index);
+                ack_pending = 0;
+            }
+            cancel_arrival(client_socket, &arrival, &arrival_pending);
+            park_connection(index);
+            continue;
+        }
+        
+        // Sleep until the next frame or a handoff. During one we can't park
+        // yet: check back every few ms, as the auth worker finishing our
+        // login doesn't wake us.
+        DWORD got = 0;
+        DWORD flags = 0;
+        if (!arrival_pending) {
+            WSABUF none = { 0, NULL };
+            WSAResetEvent(arrival.hEvent);
+            if (WSARecv(client_socket, &none, 1, &got, &flags, &arrival, NULL) == SOCKET_ERROR &&
+                WSAGetLastError() != WSA_IO_PENDING) {
+                read_size = SOCKET_ERROR;
+                break;
+            }
+            arrival_pending = 1;
+        }
+        HANDLE wake[2] = { arrival.hEvent, handoff_begin };
+        if (WaitForMultipleObjects(handing_off ? 1 : 2, wake, FALSE, handing_off ? 10 : INFINITE) != WAIT_OBJECT_0) {
+            continue;
+        }
+        arrival_pending = 0;
+        
+        // The socket is blocking again, so this waits out a split frame
+        read_size = WSAGetOverlappedResult(client_socket, &arrival, &got, FALSE, &flags) ?
+                    recv_full(client_socket, (char*)&msg, sizeof(Message)) : SOCKET_ERROR;
+        if (read_size <= 0) {
+            break;
+        }
+        unsigned int trace_id = 0;
+        unsigned long long trace_started = 0;
+        unsigned long long stage;
+        if (msg.type > 0 && msg.type < MSG_TYPE_LIMIT) {
+            metrics_add(M_MESSAGES + msg.type, 1);
+        }
+        
+        // Followers are read-only: live traffic belongs to the leader. Users
+        // log in to read history there, but register with the leader.
+        if (is_follower && msg.type != MSG_HISTORY && msg.type != MSG_SEARCH &&
+            msg.type != MSG_LOGIN && msg.type != MSG_LOGOUT && msg.type != MSG_USERS &&
+            msg.type != MSG_REPL_SUBSCRIBE) {
+            send_server_error(index, msg.request_id, "Read-only follower: connect to the leader for live chat");
+            continue;
+        }
+        
         // Process message based on type
         switch (msg.type) {
-            case MSG_REGISTER: {
-                // Extract password from message content
-                char password[MAX_PASSWORD];
-                strcpy(password, msg.content);
-                
-                // Try to register
-                int result = register_user(msg.sender, password);
-                
-                // Send response
-                Message response;
-                response.type = result ? MSG_SUCCESS : MSG_ERROR;
-                strcpy(response.sender, "SERVER");
-                get_timestamp(response.timestamp, sizeof(response.timestamp));
-                
-                if (result) {
-                    strcpy(response.content, "Registration successful");
-                } else {
-                    strcpy(response.content, "Username already exists");
+            case MSG_REGISTER:
+            case MSG_LOGIN:
+                // Hashing runs on the auth pool; the worker answers on this
+                // socket and completes the login when it is done
+                if (clients[index].auth_pending) {
+                    send_server_error(index, msg.request_id, "Authentication already in progress");
+                } else if (!submit_auth_job(index, &msg)) {
+                    send_server_error(index, msg.request_id, "Server busy, please try again");
                 }
-                
-                send(client_socket, (const char*)&response, sizeof(Message), 0);
                 break;
-            }
             
-            case MSG_LOGIN: {
-                // Extract password from message content
-                char password[MAX_PASSWORD];
-                strcpy(password, msg.content);
-                
-                // Authenticate user
-                int result = authenticate_user(msg.sender, password);
-                
-                // Send response
-                Message response;
-                response.type = result ? MSG_SUCCESS : MSG_ERROR;
-                strcpy(response.sender, "SERVER");
-                get_timestamp(response.timestamp, sizeof(response.timestamp));
-                
-                if (result) {
-                    strcpy(response.content, "Login successful");
-                    
-                    // Update client info
-                    WaitForSingleObject(clients_mutex, INFINITE);
-                    strcpy(clients[index].username, msg.sender);
-                    clients[index].is_logged_in = 1;
-                    ReleaseMutex(clients_mutex);
-                    
-                    // Announce new user
-                    Message announce;
-                    announce.type = MSG_CHAT;
-                    strcpy(announce.sender, "SERVER");
-                    get_timestamp(announce.timestamp, sizeof(announce.timestamp));
-                    sprintf(announce.content, "%s has joined the chat", msg.sender);
-                    broadcast_message(&announce, INVALID_SOCKET);
-                    add_to_chat_log(&announce);
-                } else {
-                    strcpy(response.content, "Invalid username or password");
-                }
-                
-                send(client_socket, (const char*)&response, sizeof(Message), 0);
+            case MSG_RESUME:
+                resume_session(index, &msg);
+                break;
+            
+            case MSG_STATS:
+                send_stats(index, &msg);
+                break;
+            
+            case MSG_TRACE:
+                handle_trace_command(index, &msg);
+                break;
+            
+            case MSG_MULTICAST:
+                handle_multicast_command(index, &msg);
                 break;
-            }
             
             case MSG_CHAT:
                 // Check if user is logged in
                 if (!clients[index].is_logged_in) {
-                    Message error;
-                    error.type = MSG_ERROR;
-                    strcpy(error.sender, "SERVER");
-                    get_timestamp(error.timestamp, sizeof(error.timestamp));
-                    strcpy(error.content, "You must be logged in to send messages");
-                    send(client_socket, (const char*)&error, sizeof(Message), 0);
+                    send_server_error(index, msg.request_id, "You must be logged in to send messages");
                     continue;
                 }
                 
-                // Process message
-                get_timestamp(msg.timestamp, sizeof(msg.timestamp));
+                // A retransmit of something we already have: ack it again only
+                ack_pending++;
+                if (!accept_message_id(index, msg.msg_id) || !check_fragment(index, &msg)) {
+                    break;
+                }
+                
+                // Sampled messages record their stages (trace.h)
+                trace_id = trace_sample();
+                if (trace_id != 0) {
+                    trace_started = trace_start(trace_id);
+                    trace_set_current(trace_id);
+                }
+                
+                // Moderation: may star out part of the text, or refuse it
+                if (!filter_message(index, &msg, &filter_stream)) {
+                    break;
+                }
+                
+                // Process message - the sender is whoever this connection logged in as
+                clock_stamp(&msg);
+                msg.sender_id = clients[index].user_id;
+                msg.recipient_id = 0;
+                
+                // Add original message to log first so the copy carries its seq
+                add_to_chat_log(&msg);
                 
                 // Fix: Create a copy of the original message for broadcasting
                 Message broadcast_copy = msg;
+                broadcast_copy.request_id = 0;
                 
                 // Only encrypt messages from regular users, not from SERVER
-                if (strcmp(broadcast_copy.sender, "SERVER") != 0) {
+                if (broadcast_copy.sender_id != 0) {
+                    stage = trace_start(trace_id);
                     encrypt_message(broadcast_copy.content);
+                    trace_span(trace_id, "encrypt", stage);
                 }
                 broadcast_message(&broadcast_copy, client_socket);
-                
-                // Add original message to log (no need to decrypt since we never encrypted it)
-                add_to_chat_log(&msg);
                 break;
                 
             case MSG_PRIVATE:
                 // Check if user is logged in
                 if (!clients[index].is_logged_in) {
-                    Message error;
-                    error.type = MSG_ERROR;
-                    strcpy(error.sender, "SERVER");
-                    get_timestamp(error.timestamp, sizeof(error.timestamp));
-                    strcpy(error.content, "You must be logged in to send messages");
-                    send(client_socket, (const char*)&error, sizeof(Message), 0);
+                    send_server_error(index, msg.request_id, "You must be logged in to send messages");
                     continue;
                 }
                 
-                // Process private message
-                get_timestamp(msg.timestamp, sizeof(msg.timestamp));
+                ack_pending++;
+                if (!accept_message_id(index, msg.msg_id) || !check_fragment(index, &msg)) {
+                    break;
+                }
+                
+                trace_id = trace_sample();
+                if (trace_id != 0) {
+                    trace_started = trace_start(trace_id);
+                    trace_set_current(trace_id);
+                }
+                
+                if (!filter_message(index, &msg, &filter_stream)) {
+                    break;
+                }
+                
+                // Process private message; it is routed by recipient ID,
+                // which must name a registered user to be logged
+                char recipient[MAX_USERNAME];
+                if (!user_id_name(msg.recipient_id, recipient)) {
+                    if (msg.fragment == msg.fragments) {
+                        send_server_error(index, msg.request_id, "No such user");
+                    }
+                    break;
+                }
+                clock_stamp(&msg);
+                msg.sender_id = clients[index].user_id;
+                
+                // Add original message to log first so the copy carries its seq
+                add_to_chat_log(&msg);
                 
                 // Fix: Create a copy of the original message for sending
                 Message private_copy = msg;
                 
+                stage = trace_start(trace_id);
                 encrypt_message(private_copy.content);
+                trace_span(trace_id, "encrypt", stage);
                 send_private_message(&private_copy, client_socket);
-                
-                // Add original message to log
-                add_to_chat_log(&msg);
                 break;
                 
             case MSG_HISTORY:
                 // Check if user is logged in
                 if (!clients[index].is_logged_in) {
-                    Message error;
-                    error.type = MSG_ERROR;
-                    strcpy(error.sender, "SERVER");
-                    get_timestamp(error.timestamp, sizeof(error.timestamp));
-                    strcpy(error.content, "You must be logged in to view history");
-                    send(client_socket, (const char*)&error, sizeof(Message), 0);
+                    send_server_error(index, msg.request_id, "You must be logged in to view history");
                     continue;
                 }
                 
-                send_chat_history(client_socket);
+                // Streamed in the bulk lane so live traffic keeps flowing;
+                // msg.seq is the client's high-water mark (0 = everything)
+                start_bulk_stream(index, STREAM_HISTORY, NULL, msg.seq, msg.request_id);
                 break;
                 
-            case MSG_LOGOUT:
-                WaitForSingleObject(clients_mutex, INFINITE);
-                if (clients[index].is_logged_in) {
-                    // Announce user logout
-                    Message announce;
-                    announce.type = MSG_CHAT;
-                    strcpy(announce.sender, "SERVER");
-                    get_timestamp(announce.timestamp, sizeof(announce.timestamp));
-                    sprintf(announce.content, "%s has left the chat", clients[index].username);
-                    
-                    clients[index].is_logged_in = 0;
-                    ReleaseMutex(clients_mutex);
-                    
-                    broadcast_message(&announce, INVALID_SOCKET);
-                    add_to_chat_log(&announce);
-                } else {
-                    ReleaseMutex(clients_mutex);
-                }
+            case MSG_SEARCH:
+                if (!clients[index].is_logged_in) {
+                    send_server_error(index, msg.request_id, "You must be logged in to search history");
+                    continue;
+                }
+                
+                msg.content[MAX_MESSAGE - 1] = '\0';
+                start_bulk_stream(index, STREAM_SEARCH, msg.content, 0, msg.request_id);
+                break;
+                
+            case MSG_USERS:
+                // A client that saw an ID it doesn't know yet
+                if (!clients[index].is_logged_in) {
+                    send_server_error(index, msg.request_id, "You must be logged in to list users");
+                    continue;
+                }
+                send_user_directory(index, client_socket, 1);
+                break;
+                
+            case MSG_REPL_SUBSCRIBE:
+                // The stream is the whole log, private messages included
+                if (!replication_allowed(index, &msg)) {
+                    send_server_error(index, msg.request_id, "Replication needs the leader's --repl-secret or an admin login");
+                    continue;
+                }
+                serve_follower(index, msg.seq);
+                break;
+            
+            case MSG_FILE_OFFER:
+            case MSG_FILE_CHUNK:
+            case MSG_FILE_GET:
+                if (!clients[index].is_logged_in) {
+                    send_server_error(index, msg.request_id, "You must be logged in to transfer files");
+                    continue;
+                }
+                
+                if (msg.type == MSG_FILE_OFFER) {
+                    handle_file_offer(index, &upload, &msg);
+                } else if (msg.type == MSG_FILE_CHUNK) {
+                    handle_file_chunk(index, &upload, &msg);
+                } else {
+                    // Relayed from disk in the bulk lane, behind live chat
+                    msg.content[MAX_MESSAGE - 1] = '\0';
+                    start_file_stream(index, msg.content, msg.seq, msg.request_id);
+                }
+                break;
+                
+            case MSG_LOGOUT:
+                lock_acquire(&clients_mutex);
+                if (clients[index].is_logged_in) {
+                    // Announce user logout
+                    Message announce;
+                    memset(&announce, 0, sizeof(Message));
+                    announce.type = MSG_CHAT;
+                    clock_stamp(&announce);
+                    char username[MAX_USERNAME];
+                    client_username(index, username);
+                    sprintf(announce.content, "%s has left the chat", username);
+                    
+                    set_logged_in(index, 0);
+                    unsigned int user_id = clients[index].user_id;
+                    clients[index].user_id = 0;
+                    lock_release(&clients_mutex);
+                    
+                    // An explicit logout ends the session for good
+                    end_session(user_id);
+                    
+                    // A follower's log only ever takes the leader's records
+                    if (!is_follower) {
+                        add_to_chat_log(&announce);
+                        broadcast_message(&announce, INVALID_SOCKET);
+                    }
+                } else {
+                    lock_release(&clients_mutex);
+                }
                 break;
         }
+        
+        // The whole of a sampled message's handling, around its stages
+        if (trace_id != 0) {
+            trace_span(trace_id, msg.type == MSG_CHAT ? "chat" : "private", trace_started);
+            trace_set_current(0);
+        }
     }
     
-    // Client disconnected
+    // Client disconnected; a partial upload stays on disk to be resumed
+    close_upload(&upload);
+    
+    lock_acquire(&clients_mutex);
+    clients[index].session = -1;
+    lock_release(&clients_mutex);
+    
     if (read_size == 0) {
         printf("Client disconnected\n");
         
-        WaitForSingleObject(clients_mutex, INFINITE);
+        lock_acquire(&clients_mutex);
         if (clients[index].is_logged_in) {
-            // Announce disconnect
+            // Announce disconnect (the session stays valid for a resume)
             Message announce;
+            memset(&announce, 0, sizeof(Message));
             announce.type = MSG_CHAT;
-            strcpy(announce.sender, "SERVER");
-            get_timestamp(announce.timestamp, sizeof(announce.timestamp));
-            sprintf(announce.content, "%s has disconnected", clients[index].username);
+            clock_stamp(&announce);
+            char username[MAX_USERNAME];
+            client_username(index, username);
+            sprintf(announce.content, "%s has disconnected", username);
             
-            clients[index].is_logged_in = 0;
-            ReleaseMutex(clients_mutex);
+            set_logged_in(index, 0);
+            clients[index].user_id = 0;
+            lock_release(&clients_mutex);
             
-            broadcast_message(&announce, INVALID_SOCKET);
-            add_to_chat_log(&announce);
+            if (!is_follower) {
+                add_to_chat_log(&announce);
+                broadcast_message(&announce, INVALID_SOCKET);
+            }
         } else {
-            ReleaseMutex(clients_mutex);
+            lock_release(&clients_mutex);
         }
     } else if (read_size == SOCKET_ERROR) {
         printf("recv failed. Error Code: %d\n", WSAGetLastError());
     }
+    cancel_arrival(client_socket, &arrival, &arrival_pending);
+    WSACloseEvent(arrival.hEvent);
+    
+    // Clean up client slot - unhook it from broadcasts, stop the writer
+    // and drop whatever was still queued, and only then free the slot
+    lock_acquire(&clients_mutex);
+    set_logged_in(index, 0);
+    clients[index].is_follower = 0;
+    clients[index].user_id = 0;
+    lock_release(&clients_mutex);
+    
+    stop_outbound(index);
     
-    // Clean up client slot
-    WaitForSingleObject(clients_mutex, INFINITE);
+    lock_acquire(&clients_mutex);
     closesocket(clients[index].socket);
-    clients[index].socket = INVALID_SOCKET;
-    clients[index].is_logged_in = 0;
-    ReleaseMutex(clients_mutex);
+    release_slot(index);
+    lock_release(&clients_mutex);
     
+    pool_thread_exit(&node_pool);
+    metrics_thread_exit();
+    trace_thread_exit();
     return 0;
 }
 
-int authenticate_user(const char *username, const char *password) {
+// Queue a register/login request for the auth workers
+// Returns 0 if the queue is full
+int submit_auth_job(int index, Message *msg) {
+    WaitForSingleObject(auth_mutex, INFINITE);
+    if (auth_count == AUTH_QUEUE_SIZE) {
+        ReleaseMutex(auth_mutex);
+        return 0;
+    }
+    
+    auth_job_t *job = &auth_queue[(auth_head + auth_count) % AUTH_QUEUE_SIZE];
+    job->type = msg->type;
+    job->request_id = msg->request_id;
+    job->index = index;
+    job->handle = client_handle(index);
+    job->socket = clients[index].socket;
+    
+    // content = "<name>:<password>"; names can't hold a ':'
+    msg->content[MAX_MESSAGE - 1] = '\0';
+    char *colon = strchr(msg->content, ':');
+    const char *password = colon != NULL ? colon + 1 : "";
+    copy_field(job->username, sizeof(job->username), msg->content, colon != NULL ? colon : msg->content);
+    strncpy(job->password, password, MAX_PASSWORD - 1);
+    job->password[MAX_PASSWORD - 1] = '\0';
+    SecureZeroMemory(msg->content, sizeof(msg->content));
+    job->queued_us = metrics_now_us();
+    auth_count++;
+    clients[index].auth_pending = 1;
+    ReleaseMutex(auth_mutex);
+    
+    ReleaseSemaphore(auth_items, 1, NULL);
+    return 1;
+}
+
+DWORD WINAPI auth_worker(LPVOID arg) {
+    auth_job_t job;
+    affinity_pin(AFFINITY_AUTH, (int)(DWORD_PTR)arg);
+    
+    while (1) {
+        WaitForSingleObject(auth_items, INFINITE);
+        
+        WaitForSingleObject(auth_mutex, INFINITE);
+        job = auth_queue[auth_head];
+        auth_head = (auth_head + 1) % AUTH_QUEUE_SIZE;
+        auth_count--;
+        ReleaseMutex(auth_mutex);
+        
+        int result = job.type == MSG_REGISTER ? register_user(job.username, job.password)
+                                              : authenticate_user(job.username, job.password);
+        SecureZeroMemory(job.password, sizeof(job.password));
+        metrics_record(H_AUTH_US, metrics_now_us() - job.queued_us);
+        if (!result) {
+            metrics_add(M_AUTH_FAILURES, 1);
+        }
+        
+        // The client may have gone away while we were hashing. Its slot
+        // can be reused any time clients_mutex is free, so every step that
+        // touches it checks the handle again under the lock.
+        lock_acquire(&clients_mutex);
+        int still_connected = handle_index(job.handle) == job.index;
+        if (still_connected) {
+            clients[job.index].auth_pending = 0;
+        }
+        lock_release(&clients_mutex);
+        if (!still_connected) {
+            continue;
+        }
+        
+        if (job.type == MSG_LOGIN && result) {
+            complete_login(job.index, job.handle, job.socket, job.username, job.request_id);
+            continue;
+        }
+        if (job.type == MSG_REGISTER && result) {
+            announce_user(find_user_id(job.username), job.username);
+        }
+        
+        // Send response
+        Message response;
+        memset(&response, 0, sizeof(Message));
+        response.type = result ? MSG_SUCCESS : MSG_ERROR;
+        response.request_id = job.request_id;
+        clock_stamp(&response);
+        
+        if (job.type == MSG_REGISTER) {
+            strcpy(response.content, result ? "Registration successful" : "Username already exists");
+        } else {
+            strcpy(response.content, "Invalid username or password");
+        }
+        
+        lock_acquire(&clients_mutex);
+        if (handle_index(job.handle) == job.index) {
+            queue_message(job.index, job.socket, &response, LANE_CONTROL);
+        }
+        lock_release(&clients_mutex);
+    }
+    
+    return 0;
+}
+
+// Mark the client logged in, answer with a session token and announce it.
+// Nothing happens if handle no longer names the connection at index.
+void complete_login(int index, unsigned int handle, SOCKET client_socket, const char *username, unsigned int request_id) {
+    Message response;
+    memset(&response, 0, sizeof(Message));
+    response.type = MSG_SUCCESS;
+    response.request_id = request_id;
+    clock_stamp(&response);
+    
+    // Issue a session token for fast reconnects; seq tells the
+    // client where the log stands so it can resume from there
+    strcpy(response.content, "Login successful");
+    unsigned int user_id = intern_user(username);
+    response.recipient_id = user_id; // The client's own ID
+    int session = create_session(user_id, response.token);
+    lock_acquire(&log_mutex);
+    response.seq = log_seq;
+    lock_release(&log_mutex);
+    
+    // Update client info, unless the connection closed (and its slot was
+    // maybe reused) since the auth worker looked. Respond in the same
+    // critical section, before the announcement, so the token arrives first,
+    // then the names for the IDs every later frame carries.
+    lock_acquire(&clients_mutex);
+    int still_connected = handle_index(handle) == index;
+    if (still_connected) {
+        clients[index].user_id = user_id;
+        set_logged_in(index, 1);
+        clients[index].session = session;
+        
+        // The user's other connections lose the session this one replaced
+        for (int n = 0; n < live_count && session >= 0; n++) {
+            int other = live_clients[n];
+            if (other != index && clients[other].session == session) {
+                clients[other].session = -1;
+            }
+        }
+        queue_message(index, client_socket, &response, LANE_CONTROL);
+        send_user_directory(index, client_socket, 0);
+    }
+    lock_release(&clients_mutex);
+    if (!still_connected) {
+        drop_session(session, response.token);
+        return;
+    }
+    
+    metrics_add(M_LOGINS, 1);
+    if (is_follower) {
+        return; // Logged in to read history; nothing goes to a follower's log
+    }
+    
+    // Announce new user
+    Message announce;
+    memset(&announce, 0, sizeof(Message));
+    announce.type = MSG_CHAT;
+    clock_stamp(&announce);
+    sprintf(announce.content, "%s has joined the chat", username);
+    add_to_chat_log(&announce);
+    broadcast_message(&announce, INVALID_SOCKET);
+}
+
+// Look up a user's stored password record (hash or legacy plaintext)
+// Returns 1 if the user exists
+int find_user_record(const char *username, char *record, size_t size) {
+    int found = 0;
+    
+    lock_acquire(&users_mutex);
     FILE *file = fopen(USERS_FILE, "r");
     if (file == NULL) {
+        lock_release(&users_mutex);
         return 0;
     }
     
-    char line[MAX_USERNAME + MAX_PASSWORD + 2];
-    char stored_username[MAX_USERNAME];
-    char stored_password[MAX_PASSWORD];
-    
+    char line[USERS_LINE_LEN];
     while (fgets(line, sizeof(line), file)) {
         // Remove newline
         line[strcspn(line, "\n")] = 0;
         
         // Parse username and password (format: username:password)
-        char *token = strtok(line, ":");
-        if (token != NULL) {
-            strcpy(stored_username, token);
-            token = strtok(NULL, ":");
-            if (token != NULL) {
-                strcpy(stored_password, token);
-                
-                // Compare credentials
-                if (strcmp(username, stored_username) == 0 && 
-                    strcmp(password, stored_password) == 0) {
-                    fclose(file);
-                    return 1; // Authentication successful
-                }
-            }
+        char *colon = strchr(line, ':');
+        if (colon == NULL) {
+            continue;
+        }
+        *colon = '\0';
+        
+        if (strcmp(username, line) == 0) {
+            strncpy(record, colon + 1, size - 1);
+            record[size - 1] = '\0';
+            found = 1;
+            break;
         }
     }
     
     fclose(file);
-    return 0; // Authentication failed
+    lock_release(&users_mutex);
+    return found;
+}
+
+// Replace a user's password record, rewriting users.txt atomically
+int update_user_record(const char *username, const char *record) {
+    char temp_path[MAX_PATH];
+    snprintf(temp_path, sizeof(temp_path), "%s.tmp", USERS_FILE);
+    
+    lock_acquire(&users_mutex);
+    FILE *in = fopen(USERS_FILE, "r");
+    FILE *out = fopen(temp_path, "w");
+    if (in == NULL || out == NULL) {
+        if (in != NULL) fclose(in);
+        if (out != NULL) fclose(out);
+        lock_release(&users_mutex);
+        return 0;
+    }
+    
+    char line[USERS_LINE_LEN];
+    size_t name_len = strlen(username);
+    while (fgets(line, sizeof(line), in)) {
+        if (strncmp(line, username, name_len) == 0 && line[name_len] == ':') {
+            fprintf(out, "%s:%s\n", username, record);
+        } else {
+            fputs(line, out);
+        }
+    }
+    
+    fclose(in);
+    fclose(out);
+    int ok = MoveFileEx(temp_path, USERS_FILE, MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+    lock_release(&users_mutex);
+    
+    if (!ok) {
+        printf("Failed to update users file. Error Code: %d\n", GetLastError());
+    }
+    return ok;
+}
+
+// ':' separates the fields in users.txt, and a line break or other control
+// character would split a users.txt line or a log record
+int valid_username(const char *username) {
+    if (username[0] == '\0') {
+        return 0;
+    }
+    for (const unsigned char *c = (const unsigned char *)username; *c != '\0'; c++) {
+        if (*c == ':' || *c < 0x20 || *c == 0x7f) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Runs on an auth worker: verifying a hash costs hash_cost memory and time
+int authenticate_user(const char *username, const char *password) {
+    char stored[PASSWORD_RECORD_LEN];
+    if (!valid_username(username) || !find_user_record(username, stored, sizeof(stored))) {
+        return 0;
+    }
+    
+    int cost;
+    if (!password_verify(password, stored, &cost)) {
+        return 0; // Authentication failed
+    }
+    
+    // Migrate plaintext entries (and hashes at an old cost) on first login
+    if (cost != hash_cost) {
+        char record[PASSWORD_RECORD_LEN];
+        if (password_hash(password, hash_cost, record, sizeof(record))) {
+            update_user_record(username, record);
+        }
+    }
+    
+    return 1; // Authentication successful
 }
 
+// Runs on an auth worker
 int register_user(const char *username, const char *password) {
+    if (!valid_username(username)) {
+        return 0;
+    }
+    
+    // Hash before taking the lock so other logins aren't held up
+    char record[PASSWORD_RECORD_LEN];
+    if (!password_hash(password, hash_cost, record, sizeof(record))) {
+        return 0;
+    }
+    
     // Check if username already exists
-    FILE *file = fopen(USERS_FILE, "r");
-    if (file != NULL) {
-        char line[MAX_USERNAME + MAX_PASSWORD + 2];
-        char stored_username[MAX_USERNAME];
-        
-        while (fgets(line, sizeof(line), file)) {
-            // Remove newline
-            line[strcspn(line, "\n")] = 0;
-            
-            // Parse username
-            char *token = strtok(line, ":");
-            if (token != NULL) {
-                strcpy(stored_username, token);
-                
-                // Check if username exists
-                if (strcmp(username, stored_username) == 0) {
-                    fclose(file);
-                    return 0; // Username already exists
-                }
-            }
-        }
-        
-        fclose(file);
+    char existing[PASSWORD_RECORD_LEN];
+    lock_acquire(&users_mutex);
+    if (find_user_record(username, existing, sizeof(existing))) {
+        lock_release(&users_mutex);
+        return 0; // Username already exists
     }
     
     // Add new user
-    file = fopen(USERS_FILE, "a");
+    FILE *file = fopen(USERS_FILE, "a");
     if (file == NULL) {
+        lock_release(&users_mutex);
         return 0;
     }
     
-    fprintf(file, "%s:%s\n", username, password);
+    fprintf(file, "%s:%s\n", username, record);
     fclose(file);
+    intern_user(username); // Next ID = its line in the file
+    lock_release(&users_mutex);
     
     return 1; // Registration successful
 }
 
 void broadcast_message(Message *msg, SOCKET sender_socket) {
-    WaitForSingleObject(clients_mutex, INFINITE);
+    int recipients = 0;
+    int multicast_members = 0;
+    unsigned int trace_id = trace_current();
+    unsigned long long stage = trace_start(trace_id);
+    lock_acquire(&clients_mutex);
+    trace_span(trace_id, "clients_mutex wait", stage);
+    stage = trace_start(trace_id);
     
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].socket != INVALID_SOCKET && clients[i].is_logged_in && 
-            clients[i].socket != sender_socket) {
-            // Fix: Create a copy of the message for each recipient to avoid any issues
-            Message recipient_copy = *msg;
-            
-            if (send(clients[i].socket, (const char*)&recipient_copy, sizeof(Message), 0) == SOCKET_ERROR) {
-                printf("Send failed. Error Code: %d\n", WSAGetLastError());
-            }
+    for (int n = 0; n < live_count; n++) {
+        int i = live_clients[n];
+        if (clients[i].is_multicast) {
+            // One datagram below covers them all (the sender drops its own)
+            multicast_members++;
+            recipients += clients[i].socket != sender_socket;
+        } else if (clients[i].socket != sender_socket) {
+            // Queued, not sent: a slow recipient can't hold up the others
+            queue_message(i, clients[i].socket, msg, LANE_INTERACTIVE);
+            recipients++;
         }
     }
+    if (multicast_members > 0) {
+        multicast_send(msg);
+    }
     
-    ReleaseMutex(clients_mutex);
+    lock_release(&clients_mutex);
+    trace_span(trace_id, "fanout", stage);
+    metrics_record(H_FANOUT, recipients);
 }
 
 void send_private_message(Message *msg, SOCKET sender_socket) {
-    WaitForSingleObject(clients_mutex, INFINITE);
+    unsigned int trace_id = trace_current();
+    unsigned long long stage = trace_start(trace_id);
+    lock_acquire(&clients_mutex);
+    trace_span(trace_id, "clients_mutex wait", stage);
+    
+    // The request ID belongs to the sender's confirmation only
+    unsigned int request_id = msg->request_id;
+    msg->request_id = 0;
     
     // Send to recipient
     int found = 0;
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (clients[i].socket != INVALID_SOCKET && clients[i].is_logged_in && 
-            strcmp(clients[i].username, msg->recipient) == 0) {
-            // Fix: Create a copy of the message to avoid any potential issues
-            Message recipient_copy = *msg;
-            
-            if (send(clients[i].socket, (const char*)&recipient_copy, sizeof(Message), 0) == SOCKET_ERROR) {
-                printf("Send failed. Error Code: %d\n", WSAGetLastError());
-            }
+    for (int n = 0; n < live_count && msg->recipient_id != 0; n++) {
+        int i = live_clients[n];
+        if (clients[i].user_id == msg->recipient_id) {
+            queue_message(i, clients[i].socket, msg, LANE_INTERACTIVE);
             found = 1;
             break;
         }
     }
     
+    metrics_record(H_FANOUT, found);
+    
+    // Confirm a long message once, with its last fragment
+    if (msg->fragment != msg->fragments) {
+        lock_release(&clients_mutex);
+        return;
+    }
+    
     // Send confirmation to sender
     Message response;
+    memset(&response, 0, sizeof(Message));
     response.type = found ? MSG_SUCCESS : MSG_ERROR;
-    strcpy(response.sender, "SERVER");
-    get_timestamp(response.timestamp, sizeof(response.timestamp));
+    response.request_id = request_id;
+    response.recipient_id = msg->recipient_id;
+    clock_stamp(&response);
     
+    char recipient[MAX_USERNAME];
+    if (!user_id_name(msg->recipient_id, recipient)) {
+        recipient[0] = '\0';
+    }
     if (found) {
-        sprintf(response.content, "Private message sent to %s", msg->recipient);
+        sprintf(response.content, "Private message sent to %s", recipient);
     } else {
-        sprintf(response.content, "User %s not found or offline", msg->recipient);
+        sprintf(response.content, "User %s not found or offline", recipient);
     }
     
     // Find sender
-    for (int i = 0; i < MAX_CLIENTS; i++) {
+    for (int n = 0; n < live_count; n++) {
+        int i = live_clients[n];
         if (clients[i].socket == sender_socket) {
-            send(clients[i].socket, (const char*)&response, sizeof(Message), 0);
+            queue_message(i, sender_socket, &response, LANE_CONTROL);
             break;
         }
     }
     
-    ReleaseMutex(clients_mutex);
+    lock_release(&clients_mutex);
 }
 
-void send_chat_history(SOCKET client_socket) {
-    FILE *file = fopen(CHATLOG_FILE, "r");
-    if (file == NULL) {
-        Message error;
-        error.type = MSG_ERROR;
-        strcpy(error.sender, "SERVER");
-        get_timestamp(error.timestamp, sizeof(error.timestamp));
-        strcpy(error.content, "Chat history not available");
-        send(client_socket, (const char*)&error, sizeof(Message), 0);
+// Long messages arrive as fragments, each logged and forwarded as soon as
+// it arrives (cut-through) - nothing is buffered here to reassemble them.
+// Returns 0 if this fragment is refused (it is still acked, so the client
+// doesn't resend it).
+int check_fragment(int index, Message *msg) {
+    msg->content[MAX_MESSAGE - 1] = '\0';
+    if (msg->fragments == 0 && msg->fragment == 0) {
+        return 1; // Fits one frame
+    }
+    
+    if (msg->fragment == 0 || msg->fragment > msg->fragments) {
+        send_server_error(index, msg->request_id, "Malformed message fragment");
+        return 0;
+    }
+    
+    int max_fragments = (max_message_length + FRAGMENT_TEXT - 1) / FRAGMENT_TEXT;
+    if (msg->fragments > max_fragments) {
+        if (msg->fragment == 1) {
+            char text[64];
+            snprintf(text, sizeof(text), "Message too long (limit %d characters)", max_message_length);
+            send_server_error(index, msg->request_id, text);
+        }
+        return 0;
+    }
+    return 1;
+}
+
+// Run a chat/private message through the content filter. Returns 0 if it
+// is refused (the sender is told once per message). Fragments already
+// forwarded can't be taken back, so a refused fragment takes the rest of
+// its long message with it.
+int filter_message(int index, Message *msg, filter_stream_t *stream) {
+    if (stream->rejecting && msg->fragment > 1) {
+        stream->rejecting = msg->fragment < msg->fragments;
+        return 0;
+    }
+    stream->rejecting = 0;
+    
+    AcquireSRWLockShared(&filter_lock);
+    filter_t *filter = active_filter;
+    if (filter == NULL) {
+        ReleaseSRWLockShared(&filter_lock);
+        return 1;
+    }
+    
+    // A continuation picks up where the previous fragment left off, unless
+    // the filter was reloaded in between; its '#' marker isn't text
+    char *text = msg->content;
+    if (msg->fragment <= 1 || stream->generation != filter_generation) {
+        stream->state = 0;
+    } else if (text[0] == '#') {
+        text++;
+    }
+    stream->generation = filter_generation;
+    
+    unsigned int trace_id = trace_current();
+    unsigned long long stage = trace_start(trace_id);
+    int found = filter_scan(filter, &stream->state, text, strlen(text));
+    ReleaseSRWLockShared(&filter_lock);
+    trace_span(trace_id, "filter", stage);
+    if (found == 0) {
+        return 1;
+    }
+    
+    // Flags are for moderators: who, not what (it may be a leaked secret)
+    if (found & FILTER_FLAG) {
+        metrics_add(M_FILTER_FLAGS, 1);
+        char username[MAX_USERNAME];
+        client_username(index, username);
+        printf("Filter: flagged a %s message from %s\n",
+               msg->type == MSG_PRIVATE ? "private" : "chat", username);
+    }
+    if (found & FILTER_REJECT) {
+        metrics_add(M_FILTER_REJECTS, 1);
+        stream->rejecting = msg->fragment < msg->fragments;
+        send_server_error(index, msg->request_id, "Message blocked by the content filter");
+        return 0;
+    }
+    if (found & FILTER_MASK) {
+        metrics_add(M_FILTER_MASKS, 1);
+    }
+    return 1;
+}
+
+// Recompile the filter if its file changed since the last look. A bad file
+// keeps the filter we have; a deleted one turns filtering off.
+void refresh_filter() {
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    filter_t *filter = NULL;
+    if (GetFileAttributesEx(filter_path, GetFileExInfoStandard, &info)) {
+        if (active_filter != NULL && CompareFileTime(&info.ftLastWriteTime, &filter_written) == 0) {
+            return;
+        }
+        char error[MAX_PATH + 64];
+        filter = filter_load(filter_path, error, sizeof(error));
+        if (filter == NULL) {
+            printf("Content filter not loaded: %s\n", error);
+            return;
+        }
+        filter_written = info.ftLastWriteTime;
+        printf("Content filter: %d patterns from %s\n", filter->patterns, filter_path);
+    } else if (active_filter == NULL) {
+        return;
+    } else {
+        printf("Content filter: %s removed, filtering off\n", filter_path);
+    }
+    
+    // Waits out the scans in progress (microseconds each); new ones see
+    // the new filter
+    AcquireSRWLockExclusive(&filter_lock);
+    filter_t *replaced = active_filter;
+    active_filter = filter;
+    filter_generation++;
+    ReleaseSRWLockExclusive(&filter_lock);
+    filter_free(replaced);
+}
+
+DWORD WINAPI filter_watcher(LPVOID arg) {
+    affinity_pin(AFFINITY_BACKGROUND, -1);
+    while (1) {
+        Sleep(FILTER_POLL_MS);
+        refresh_filter();
+    }
+    return 0;
+}
+
+int valid_file_hash(const char *hash) {
+    if (strlen(hash) != SHA256_HEX_LEN - 1) {
+        return 0;
+    }
+    return strspn(hash, "0123456789abcdef") == SHA256_HEX_LEN - 1;
+}
+
+// Start (or resume) an upload: tell the client which chunk to send next,
+// counting whole chunks already in the .part file from an earlier attempt
+void handle_file_offer(int index, upload_t *upload, Message *msg) {
+    close_upload(upload);
+    
+    msg->content[MAX_MESSAGE - 1] = '\0';
+    if (sscanf(msg->content, "%llu %64s %259[^\n]", &upload->size, upload->hash, upload->name) != 3 ||
+        !valid_file_hash(upload->hash)) {
+        send_server_error(index, msg->request_id, "Invalid file offer");
+        return;
+    }
+    if (upload->size > max_attachment_size) {
+        send_server_error(index, msg->request_id, "File is larger than the server allows");
+        return;
+    }
+    char recipient[MAX_USERNAME];
+    if (msg->recipient_id != 0 && !user_id_name(msg->recipient_id, recipient)) {
+        send_server_error(index, msg->request_id, "No such user");
         return;
     }
+    upload->recipient_id = msg->recipient_id;
+    upload->chunks = (unsigned int)((upload->size + FILE_CHUNK_SIZE - 1) / FILE_CHUNK_SIZE);
+    upload->request_id = msg->request_id;
     
-    char line[MAX_USERNAME + MAX_MESSAGE + 50];
-    Message history;
-    history.type = MSG_HISTORY;
-    strcpy(history.sender, "SERVER");
+    Message response;
+    memset(&response, 0, sizeof(Message));
+    response.type = MSG_SUCCESS;
+    response.request_id = msg->request_id;
+    clock_stamp(&response);
     
-    // Send start message
-    strcpy(history.content, "--- Chat History ---");
-    get_timestamp(history.timestamp, sizeof(history.timestamp));
-    send(client_socket, (const char*)&history, sizeof(Message), 0);
+    // Stored by content, so a file anyone uploaded before is just shared
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/%s", ATTACHMENTS_DIR, upload->hash);
+    FILE *existing = fopen(path, "rb");
+    if (existing != NULL) {
+        fclose(existing);
+        response.seq = upload->chunks;
+        strcpy(response.content, "File already on the server");
+        queue_message(index, clients[index].socket, &response, LANE_CONTROL);
+        share_attachment(index, upload);
+        return;
+    }
     
-    // Send each line of history
-    while (fgets(line, sizeof(line), file)) {
-        // Remove newline
-        line[strcspn(line, "\n")] = 0;
-        
-        strcpy(history.content, line);
-        send(client_socket, (const char*)&history, sizeof(Message), 0);
-        
-        // Add small delay to prevent flooding
-        Sleep(10); // Windows equivalent of usleep(10000)
+    if (!claim_upload_hash(upload)) {
+        send_server_error(index, msg->request_id, "This file is already being uploaded - try again later");
+        return;
+    }
+    
+    snprintf(path, sizeof(path), "%s/%s.part", ATTACHMENTS_DIR, upload->hash);
+    upload->file = fopen(path, "r+b");
+    if (upload->file == NULL) {
+        upload->file = fopen(path, "w+b");
+    }
+    if (upload->file == NULL) {
+        send_server_error(index, msg->request_id, "Cannot store the file");
+        release_upload_hash(upload);
+        return;
     }
     
-    // Send end message
-    strcpy(history.content, "--- End of History ---");
-    get_timestamp(history.timestamp, sizeof(history.timestamp));
-    send(client_socket, (const char*)&history, sizeof(Message), 0);
+    _fseeki64(upload->file, 0, SEEK_END);
+    long long stored = _ftelli64(upload->file);
+    if (stored < 0 || (unsigned long long)stored > upload->size) {
+        // Not ours after all - start over
+        fclose(upload->file);
+        upload->file = fopen(path, "w+b");
+        stored = 0;
+        if (upload->file == NULL) {
+            send_server_error(index, msg->request_id, "Cannot store the file");
+            release_upload_hash(upload);
+            return;
+        }
+    }
+    upload->next_chunk = (unsigned int)(stored / FILE_CHUNK_SIZE);
+    _fseeki64(upload->file, (long long)upload->next_chunk * FILE_CHUNK_SIZE, SEEK_SET);
     
-    fclose(file);
+    response.seq = upload->next_chunk;
+    snprintf(response.content, MAX_MESSAGE, "Send from chunk %u of %u", upload->next_chunk, upload->chunks);
+    queue_message(index, clients[index].socket, &response, LANE_CONTROL);
+    
+    if (upload->next_chunk == upload->chunks) {
+        finish_upload(index, upload);
+        close_upload(upload);
+    }
 }
 
-void add_to_chat_log(Message *msg) {
-    FILE *file = fopen(CHATLOG_FILE, "a");
-    if (file == NULL) {
-        perror("Failed to open chat log");
+// Chunks must arrive in order; anything else ends the upload and the
+// client resumes it with a new offer
+void handle_file_chunk(int index, upload_t *upload, Message *msg) {
+    if (upload->file == NULL) {
+        send_server_error(index, msg->request_id, "No upload in progress");
         return;
     }
     
-    if (msg->type == MSG_PRIVATE) {
-        fprintf(file, "[%s] %s -> %s: %s\n", 
-                msg->timestamp, msg->sender, msg->recipient, msg->content);
-    } else {
-        fprintf(file, "[%s] %s: %s\n", 
-                msg->timestamp, msg->sender, msg->content);
+    unsigned long long offset = (unsigned long long)msg->seq * FILE_CHUNK_SIZE;
+    unsigned long long expected = upload->size - offset;
+    if (expected > FILE_CHUNK_SIZE) {
+        expected = FILE_CHUNK_SIZE;
+    }
+    if (msg->seq != upload->next_chunk || msg->length != expected) {
+        send_server_error(index, upload->request_id, "Unexpected file chunk - offer the file again to resume");
+        close_upload(upload);
+        return;
     }
     
-    fclose(file);
+    if (fwrite(msg->content, 1, msg->length, upload->file) != msg->length) {
+        send_server_error(index, upload->request_id, "Cannot store the file");
+        close_upload(upload);
+        return;
+    }
+    
+    upload->next_chunk++;
+    if (upload->next_chunk == upload->chunks) {
+        finish_upload(index, upload);
+        close_upload(upload);
+    }
+}
+
+// All chunks are in: check the content hash, publish the file, tell everyone
+void finish_upload(int index, upload_t *upload) {
+    fclose(upload->file);
+    upload->file = NULL;
+    
+    char part_path[MAX_PATH];
+    char path[MAX_PATH];
+    snprintf(part_path, sizeof(part_path), "%s/%s.part", ATTACHMENTS_DIR, upload->hash);
+    snprintf(path, sizeof(path), "%s/%s", ATTACHMENTS_DIR, upload->hash);
+    
+    unsigned char digest[SHA256_LEN];
+    char digest_hex[SHA256_HEX_LEN];
+    unsigned long long size = 0;
+    if (!sha256_file(part_path, digest, &size)) {
+        send_server_error(index, upload->request_id, "Cannot read the uploaded file");
+        return;
+    }
+    hex_encode(digest, SHA256_LEN, digest_hex);
+    
+    if (size != upload->size || strcmp(digest_hex, upload->hash) != 0) {
+        DeleteFile(part_path);
+        send_server_error(index, upload->request_id, "File was corrupted in transfer - upload it again");
+        return;
+    }
+    if (!MoveFileEx(part_path, path, MOVEFILE_REPLACE_EXISTING)) {
+        send_server_error(index, upload->request_id, "Cannot store the file");
+        return;
+    }
+    
+    Message response;
+    memset(&response, 0, sizeof(Message));
+    response.type = MSG_SUCCESS;
+    response.request_id = upload->request_id;
+    response.seq = upload->chunks;
+    clock_stamp(&response);
+    snprintf(response.content, MAX_MESSAGE, "Upload complete: %s", upload->name);
+    queue_message(index, clients[index].socket, &response, LANE_CONTROL);
+    
+    share_attachment(index, upload);
+}
+
+// Also the end of a finished upload: the hash stays claimed until the
+// .part file has been checked and renamed
+void close_upload(upload_t *upload) {
+    if (upload->file != NULL) {
+        fclose(upload->file);
+    }
+    release_upload_hash(upload);
+    memset(upload, 0, sizeof(upload_t));
+}
+
+// Returns 0 if another connection is uploading the same file
+int claim_upload_hash(upload_t *upload) {
+    int claimed = 1;
+    WaitForSingleObject(uploading_mutex, INFINITE);
+    for (int i = 0; i < uploading_count && claimed; i++) {
+        claimed = strcmp(uploading_hashes[i], upload->hash) != 0;
+    }
+    if (claimed && uploading_count == uploading_capacity) {
+        int capacity = uploading_capacity > 0 ? uploading_capacity * 2 : 16;
+        char (*grown)[SHA256_HEX_LEN] = realloc(uploading_hashes, capacity * sizeof(*grown));
+        if (grown == NULL) {
+            claimed = 0;
+        } else {
+            uploading_hashes = grown;
+            uploading_capacity = capacity;
+        }
+    }
+    if (claimed) {
+        strcpy(uploading_hashes[uploading_count++], upload->hash);
+        upload->claimed = 1;
+    }
+    ReleaseMutex(uploading_mutex);
+    return claimed;
+}
+
+void release_upload_hash(upload_t *upload) {
+    if (!upload->claimed) {
+        return;
+    }
+    WaitForSingleObject(uploading_mutex, INFINITE);
+    for (int i = 0; i < uploading_count; i++) {
+        if (strcmp(uploading_hashes[i], upload->hash) == 0) {
+            uploading_count--;
+            memmove(uploading_hashes[i], uploading_hashes[uploading_count], SHA256_HEX_LEN);
+            break;
+        }
+    }
+    ReleaseMutex(uploading_mutex);
+    upload->claimed = 0;
+}
+
+// Post the download command as a chat or private message from the uploader
+void share_attachment(int index, const upload_t *upload) {
+    Message share;
+    memset(&share, 0, sizeof(Message));
+    share.type = upload->recipient_id != 0 ? MSG_PRIVATE : MSG_CHAT;
+    share.sender_id = clients[index].user_id;
+    share.recipient_id = upload->recipient_id;
+    clock_stamp(&share);
+    snprintf(share.content, MAX_MESSAGE, "#shared %s (%llu bytes): /download %s %s",
+             upload->name, upload->size, upload->hash, upload->name);
+    
+    add_to_chat_log(&share);
+    
+    Message copy = share;
+    encrypt_message(copy.content);
+    if (share.type == MSG_PRIVATE) {
+        send_private_message(&copy, clients[index].socket);
+    } else {
+        broadcast_message(&copy, clients[index].socket);
+    }
+}
+
+// Log a chat or private message, spelling out the names its IDs stand
+// for, and set msg->seq to its record's
+void add_to_chat_log(Message *msg) {
+    log_record_t record;
+    memset(&record, 0, sizeof(log_record_t));
+    record.msg = *msg;
+    if (msg->sender_id == 0 || !user_id_name(msg->sender_id, record.sender)) {
+        strcpy(record.sender, "SERVER");
+    }
+    if (msg->type == MSG_PRIVATE && !user_id_name(msg->recipient_id, record.recipient)) {
+        record.recipient[0] = '\0';
+    }
+    
+    char line[MAX_LOG_LINE];
+    format_log_line(&record, line, sizeof(line));
+    msg->seq = append_log_line(line);
+}
+
+// Append one line to the log and push it to subscribed followers
+// Returns its seq
+unsigned int append_log_line(const char *line) {
+    unsigned int trace_id = trace_current();
+    unsigned long long stage = trace_start(trace_id);
+    lock_acquire(&log_mutex);
+    trace_span(trace_id, "log_mutex wait", stage);
+    
+    unsigned long long started = metrics_now_us();
+    
+    // Flushed at once: history, resume and followers read the file
+    fseek(chat_log, 0, SEEK_END);
+    long offset = ftell(chat_log);
+    fprintf(chat_log, "%s\n", line);
+    fflush(chat_log);
+    metrics_record(H_LOG_APPEND_US, metrics_now_us() - started);
+    trace_span(trace_id, "log append", started);
+    metrics_add(M_LOG_APPENDS, 1);
+    
+    unsigned int seq = ++log_seq;
+    record_log_offset(seq, offset);
+    
+    // Push the record to subscribed followers while still holding log_mutex
+    // so they see records in log order. A follower too slow to keep up has
+    // the record dropped; it sees the gap in sequence numbers and resubscribes
+    lock_acquire(&clients_mutex);
+    for (int i = 0; i < client_capacity; i++) {
+        if (clients[i].socket != INVALID_SOCKET && clients[i].is_follower) {
+            queue_log_line(i, clients[i].socket, seq, line, 0);
+        }
+    }
+    lock_release(&clients_mutex);
+    
+    lock_release(&log_mutex);
+    return seq;
+}
+
+// Send one log line to a follower as MSG_REPL_RECORD, as is, so its log
+// matches ours byte for byte. A line too long for one frame goes in parts,
+// numbered like message fragments and all with the record's seq.
+// wait = 0 queues without waiting for room. Returns 0 if a part was
+// dropped or the follower went away.
+int queue_log_line(int index, SOCKET sock, unsigned int seq, const char *line, int wait) {
+    Message record;
+    memset(&record, 0, sizeof(Message));
+    record.type = MSG_REPL_RECORD;
+    record.seq = seq;
+    
+    int length = (int)strlen(line);
+    int offset = 0;
+    if (length >= MAX_MESSAGE) {
+        record.fragments = (unsigned short)((length + MAX_MESSAGE - 2) / (MAX_MESSAGE - 1));
+    }
+    do {
+        int piece = length - offset < MAX_MESSAGE - 1 ? length - offset : MAX_MESSAGE - 1;
+        memcpy(record.content, line + offset, piece);
+        record.content[piece] = '\0';
+        offset += piece;
+        if (record.fragments > 0) {
+            record.fragment++;
+        }
+        if (!(wait ? queue_message_wait : queue_message)(index, sock, &record, LANE_INTERACTIVE)) {
+            return 0;
+        }
+    } while (offset < length);
+    return 1;
+}
+
+// Read the next record: one whole line, newline removed. Like the index
+// built at startup, a line too long for the buffer is still one record,
+// cut short. Returns 0 at the end of the file.
+int read_log_line(FILE *file, char *line, int size) {
+    if (!fgets(line, size, file)) {
+        return 0;
+    }
+    size_t length = strcspn(line, "\n");
+    if (line[length] == '\0') {
+        int c;
+        while ((c = fgetc(file)) != EOF && c != '\n') {
+            // Skip the rest
+        }
+    }
+    line[length] = '\0';
+    return 1;
+}
+
+// Stream log lines up to target as MSG_REPL_RECORD, skipping those at or
+// below from_seq. Every line is sent, so the follower's sequence numbers
+// match ours. Returns 0 if the file ended early or the send failed.
+int send_log_records(FILE *file, int index, SOCKET sock, unsigned int *seq, unsigned int target, unsigned int from_seq) {
+    char line[MAX_LOG_LINE];
+    
+    while (*seq < target) {
+        if (!read_log_line(file, line, sizeof(line))) {
+            return 0;
+        }
+        (*seq)++;
+        
+        if (*seq <= from_seq) {
+            continue;
+        }
+        if (!queue_log_line(index, sock, *seq, line, 1)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// A subscriber gets every record, so it must present the --repl-secret
+// (in content) or be logged in as an admin. Without a secret configured,
+// only admins can subscribe.
+int replication_allowed(int index, Message *msg) {
+    msg->content[MAX_MESSAGE - 1] = '\0';
+    size_t length = strlen(repl_secret);
+    int matches = length > 0 && strlen(msg->content) == length;
+    
+    // Constant-time compare
+    unsigned char diff = 0;
+    for (size_t i = 0; matches && i < length; i++) {
+        diff |= (unsigned char)(repl_secret[i] ^ msg->content[i]);
+    }
+    SecureZeroMemory(msg->content, sizeof(msg->content));
+    if (matches && diff == 0) {
+        return 1;
+    }
+    return clients[index].is_logged_in && is_admin(clients[index].user_id);
+}
+
+void serve_follower(int index, unsigned int from_seq) {
+    SOCKET follower_socket = clients[index].socket;
+    
+    printf("Follower subscribed from seq %u\n", from_seq);
+    
+    FILE *file = fopen(chatlog_path, "r");
+    if (file == NULL) {
+        send_server_error(index, 0, "Chat log not available");
+        return;
+    }
+    
+    // Catch up without blocking appends, then send the last few records
+    // and subscribe under log_mutex so nothing is missed or duplicated
+    unsigned int seq = 0;
+    while (1) {
+        lock_acquire(&log_mutex);
+        unsigned int target = log_seq;
+        int final_pass = (target - seq <= 64);
+        if (!final_pass) {
+            lock_release(&log_mutex);
+        }
+        
+        int ok = send_log_records(file, index, follower_socket, &seq, target, from_seq);
+        
+        if (final_pass) {
+            if (ok) {
+                lock_acquire(&clients_mutex);
+                clients[index].is_follower = 1;
+                lock_release(&clients_mutex);
+            }
+            lock_release(&log_mutex);
+            break;
+        }
+        if (!ok) {
+            break;
+        }
+    }
+    
+    fclose(file);
+}
+
+// Replication follower: tail the leader's log by sequence number and
+// reconnect + resubscribe from the local high-water mark on disconnect
+DWORD WINAPI replication_client(LPVOID arg) {
+    affinity_pin(AFFINITY_BACKGROUND, -1);
+    struct sockaddr_in leader_addr;
+    memset(&leader_addr, 0, sizeof(leader_addr));
+    leader_addr.sin_family = AF_INET;
+    leader_addr.sin_port = htons(leader_port);
+    leader_addr.sin_addr.s_addr = inet_addr(leader_ip);
+    
+    while (1) {
+        SOCKET leader_socket = socket(AF_INET, SOCK_STREAM, 0);
+        if (leader_socket == INVALID_SOCKET) {
+            printf("Replication socket creation failed. Error Code: %d\n", WSAGetLastError());
+            Sleep(2000);
+            continue;
+        }
+        
+        if (connect(leader_socket, (struct sockaddr *)&leader_addr, sizeof(leader_addr)) == SOCKET_ERROR) {
+            printf("Cannot reach leader %s:%d. Error Code: %d - retrying in 2 seconds\n",
+                   leader_ip, leader_port, WSAGetLastError());
+            closesocket(leader_socket);
+            Sleep(2000);
+            continue;
+        }
+        
+        // Subscribe from our last applied record
+        Message msg;
+        memset(&msg, 0, sizeof(Message));
+        msg.type = MSG_REPL_SUBSCRIBE;
+        strcpy(msg.content, repl_secret);
+        lock_acquire(&log_mutex);
+        msg.seq = log_seq;
+        lock_release(&log_mutex);
+        
+        printf("Connected to leader, resuming from seq %u\n", msg.seq);
+        send(leader_socket, (const char*)&msg, sizeof(Message), 0);
+        SecureZeroMemory(msg.content, sizeof(msg.content));
+        
+        // A long line arrives in parts, back to back
+        char line[MAX_LOG_LINE];
+        int line_length = 0;
+        unsigned short part = 0;
+        
+        while (recv_full(leader_socket, (char*)&msg, sizeof(Message)) > 0) {
+            if (msg.type == MSG_ERROR) {
+                msg.content[MAX_MESSAGE - 1] = '\0';
+                printf("Leader error: %s\n", msg.content);
+                continue;
+            }
+            if (msg.type != MSG_REPL_RECORD) {
+                // The leader sends nothing else: we have lost the frame
+                // boundaries, so start over from our last record
+                printf("Unexpected frame type %d from the leader - resubscribing\n", msg.type);
+                break;
+            }
+            
+            // Only this thread appends on a follower, so log_seq is stable here
+            if (msg.seq <= log_seq) {
+                continue; // Already applied
+            }
+            if (msg.seq != log_seq + 1) {
+                printf("Replication gap (have %u, got %u) - resubscribing\n", log_seq, msg.seq);
+                break;
+            }
+            
+            // Parts of a long line come back to back, from the first
+            msg.content[MAX_MESSAGE - 1] = '\0';
+            int length = (int)strlen(msg.content);
+            if (msg.fragments > 0 ? msg.fragment != part + 1 : part != 0) {
+                printf("Record %u arrived incomplete - resubscribing\n", msg.seq);
+                break;
+            }
+            if (part == 0) {
+                line_length = 0;
+            }
+            if (line_length + length >= MAX_LOG_LINE) {
+                printf("Record %u is too long - resubscribing\n", msg.seq);
+                break;
+            }
+            memcpy(line + line_length, msg.content, length + 1);
+            line_length += length;
+            part = msg.fragment < msg.fragments ? msg.fragment : 0;
+            if (part != 0) {
+                continue; // More parts to come
+            }
+            append_log_line(line);
+        }
+        
+        printf("Lost connection to leader - reconnecting\n");
+        closesocket(leader_socket);
+        Sleep(2000);
+    }
+    
+    return 0;
+}
+
+// Remember where record seq starts (caller holds log_mutex or is single-threaded)
+void record_log_offset(unsigned int seq, long offset) {
+    if (seq > log_capacity) {
+        unsigned int new_capacity = log_capacity ? log_capacity * 2 : 1024;
+        while (new_capacity < seq) {
+            new_capacity *= 2;
+        }
+        long *grown = realloc(log_offsets, new_capacity * sizeof(long));
+        if (grown == NULL) {
+            perror("Failed to grow chat log index");
+            return;
+        }
+        log_offsets = grown;
+        log_capacity = new_capacity;
+    }
+    log_offsets[seq - 1] = offset;
+}
+
+// Startup: take the log index from <log>.snap if it still fits the log,
+// i.e. its last record ends exactly where the snapshot says. Returns the
+// records covered and sets *covered to where they end; 0 without one.
+unsigned int load_snapshot(long *covered) {
+    char path[MAX_PATH + 8];
+    snprintf(path, sizeof(path), "%s.snap", chatlog_path);
+    *covered = 0;
+    
+    HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    const snapshot_header_t *header = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart >= (LONGLONG)sizeof(snapshot_header_t)) {
+        mapping = CreateFileMapping(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    }
+    if (mapping != NULL) {
+        header = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    
+    unsigned int records = 0;
+    if (header != NULL && header->magic == SNAPSHOT_MAGIC && header->version == SNAPSHOT_VERSION &&
+        header->offset_size == sizeof(long) && header->records > 0 &&
+        size.QuadPart == (LONGLONG)(sizeof(snapshot_header_t) + (size_t)header->records * sizeof(long))) {
+        const long *offsets = (const long *)(header + 1);
+        
+        FILE *log = fopen(chatlog_path, "r");
+        char line[MAX_LOG_LINE];
+        int fits = log != NULL && fseek(log, offsets[header->records - 1], SEEK_SET) == 0 &&
+                   fgets(line, sizeof(line), log) != NULL && strchr(line, '\n') != NULL &&
+                   ftell(log) == header->log_size;
+        if (log != NULL) {
+            fclose(log);
+        }
+        
+        unsigned int capacity = header->records > 1024 ? header->records : 1024;
+        long *index = fits ? malloc(capacity * sizeof(long)) : NULL;
+        if (index != NULL) {
+            memcpy(index, offsets, header->records * sizeof(long));
+            free(log_offsets);
+            log_offsets = index;
+            log_capacity = capacity;
+            records = header->records;
+            *covered = header->log_size;
+        } else {
+            printf("Snapshot %s doesn't match the chat log - reading the whole log\n", path);
+        }
+    }
+    
+    if (header != NULL) {
+        UnmapViewOfFile(header);
+    }
+    if (mapping != NULL) {
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    return records;
+}
+
+// Write the log index to <log>.snap. The index is copied under log_mutex
+// so it matches the log size recorded with it; the file is written to the
+// side and renamed over the last snapshot once complete.
+// Returns the records covered, -1 on failure
+int write_snapshot() {
+    WaitForSingleObject(snapshot_mutex, INFINITE);
+    
+    lock_acquire(&log_mutex);
+    unsigned int records = log_seq;
+    long *offsets = records > 0 ? malloc(records * sizeof(long)) : NULL;
+    long log_size = -1;
+    FILE *log = offsets != NULL ? fopen(chatlog_path, "r") : NULL;
+    if (log != NULL) {
+        memcpy(offsets, log_offsets, records * sizeof(long));
+        fseek(log, 0, SEEK_END);
+        log_size = ftell(log);
+        fclose(log);
+    }
+    lock_release(&log_mutex);
+    
+    char path[MAX_PATH + 8];
+    char temp_path[MAX_PATH + 12];
+    snprintf(path, sizeof(path), "%s.snap", chatlog_path);
+    snprintf(temp_path, sizeof(temp_path), "%s.snap.tmp", chatlog_path);
+    
+    snapshot_header_t header;
+    header.magic = SNAPSHOT_MAGIC;
+    header.version = SNAPSHOT_VERSION;
+    header.records = records;
+    header.offset_size = sizeof(long);
+    header.log_size = log_size;
+    
+    int ok = 0;
+    FILE *file = log_size >= 0 ? fopen(temp_path, "wb") : NULL;
+    if (file != NULL) {
+        ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+             fwrite(offsets, sizeof(long), records, file) == records;
+        ok = fclose(file) == 0 && ok;
+        ok = ok && MoveFileEx(temp_path, path, MOVEFILE_REPLACE_EXISTING) != 0;
+    }
+    free(offsets);
+    ReleaseMutex(snapshot_mutex);
+    
+    if (!ok && records > 0) {
+        printf("Failed to write snapshot %s. Error Code: %d\n", path, GetLastError());
+        return -1;
+    }
+    return ok ? (int)records : 0;
+}
+
+DWORD WINAPI snapshot_writer(LPVOID arg) {
+    unsigned int last_records = 0;
+    affinity_pin(AFFINITY_BACKGROUND, -1);
+    while (1) {
+        Sleep(snapshot_interval * 1000);
+        
+        // Nothing new since the last one: keep it
+        lock_acquire(&log_mutex);
+        unsigned int records = log_seq;
+        lock_release(&log_mutex);
+        if (records != last_records && write_snapshot() >= 0) {
+            last_records = records;
+        }
+    }
+    return 0;
+}
+
+// FNV-1a
+unsigned int hash_username(const char *name) {
+    unsigned int hash = 2166136261u;
+    for (const unsigned char *p = (const unsigned char*)name; *p != '\0'; p++) {
+        hash = (hash ^ *p) * 16777619u;
+    }
+    return hash;
+}
+
+// Bucket holding name's ID, or the empty bucket where it would go
+// Caller holds user_ids_mutex and user_bucket_count > 0
+unsigned int *find_user_bucket(const char *name) {
+    unsigned int mask = user_bucket_count - 1;
+    unsigned int i = hash_username(name) & mask;
+    while (user_buckets[i] != 0 && strcmp(user_names[user_buckets[i] - 1].name, name) != 0) {
+        i = (i + 1) & mask;
+    }
+    return &user_buckets[i];
+}
+
+// Returns the user's ID, or 0 if name was never registered
+unsigned int find_user_id(const char *name) {
+    unsigned int id = 0;
+    WaitForSingleObject(user_ids_mutex, INFINITE);
+    if (user_bucket_count > 0) {
+        id = *find_user_bucket(name);
+    }
+    ReleaseMutex(user_ids_mutex);
+    return id;
+}
+
+// Returns name's ID, assigning the next one if it is new (0 if out of memory
+// or the name is empty)
+unsigned int intern_user(const char *name) {
+    if (name[0] == '\0') {
+        return 0; // Never a user, whatever users.txt holds
+    }
+    WaitForSingleObject(user_ids_mutex, INFINITE);
+    if (user_bucket_count > 0) {
+        unsigned int id = *find_user_bucket(name);
+        if (id != 0) {
+            ReleaseMutex(user_ids_mutex);
+            return id;
+        }
+    }
+    
+    if (user_count == user_capacity) {
+        unsigned int capacity = user_capacity ? user_capacity * 2 : 64;
+        user_name_t *names = realloc(user_names, capacity * sizeof(user_name_t));
+        if (names == NULL) {
+            ReleaseMutex(user_ids_mutex);
+            return 0;
+        }
+        user_names = names;
+        user_capacity = capacity;
+    }
+    
+    // Keep the table at most half full
+    if ((user_count + 1) * 2 > user_bucket_count) {
+        unsigned int count = user_bucket_count ? user_bucket_count * 2 : USER_ID_MIN_BUCKETS;
+        unsigned int *buckets = calloc(count, sizeof(unsigned int));
+        if (buckets == NULL) {
+            ReleaseMutex(user_ids_mutex);
+            return 0;
+        }
+        free(user_buckets);
+        user_buckets = buckets;
+        user_bucket_count = count;
+        for (unsigned int id = 1; id <= user_count; id++) {
+            *find_user_bucket(user_names[id - 1].name) = id;
+        }
+    }
+    
+    strncpy(user_names[user_count].name, name, MAX_USERNAME - 1);
+    user_names[user_count].name[MAX_USERNAME - 1] = '\0';
+    user_count++;
+    *find_user_bucket(user_names[user_count - 1].name) = user_count;
+    unsigned int id = user_count;
+    ReleaseMutex(user_ids_mutex);
+    return id;
+}
+
+// Copy the name for id into name (MAX_USERNAME bytes). Returns 0 if unknown
+int user_id_name(unsigned int id, char *name) {
+    int found = 0;
+    WaitForSingleObject(user_ids_mutex, INFINITE);
+    if (id >= 1 && id <= user_count) {
+        strcpy(name, user_names[id - 1].name);
+        found = 1;
+    }
+    ReleaseMutex(user_ids_mutex);
+    return found;
+}
+
+// The name client index logged in as (MAX_USERNAME bytes), "" if none
+void client_username(int index, char *name) {
+    if (!user_id_name(clients[index].user_id, name)) {
+        name[0] = '\0';
+    }
+}
+
+// Send client index every ID with its name, as MSG_USERS frames of
+// "<id> <name>\n" lines. wait = 0 queues without waiting for room.
+// Returns 0 if a frame was dropped or the client went away.
+int send_user_directory(int index, SOCKET sock, int wait) {
+    Message frame;
+    unsigned int id = 1;
+    int more = 1;
+    
+    while (more) {
+        memset(&frame, 0, sizeof(Message));
+        frame.type = MSG_USERS;
+        size_t used = 0;
+        
+        // One frame's worth at a time: registrations only wait that long
+        WaitForSingleObject(user_ids_mutex, INFINITE);
+        for (; id <= user_count; id++) {
+            int length = snprintf(frame.content + used, MAX_MESSAGE - used, "%u %s\n", id, user_names[id - 1].name);
+            if (length < 0 || used + length >= MAX_MESSAGE) {
+                break;
+            }
+            used += length;
+        }
+        more = id <= user_count;
+        ReleaseMutex(user_ids_mutex);
+        frame.content[used] = '\0';
+        
+        if (!(wait ? queue_message_wait : queue_message)(index, sock, &frame, LANE_CONTROL)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Tell everyone logged in the name of a newly registered user
+void announce_user(unsigned int id, const char *name) {
+    if (id == 0) {
+        return;
+    }
+    Message frame;
+    memset(&frame, 0, sizeof(Message));
+    frame.type = MSG_USERS;
+    snprintf(frame.content, MAX_MESSAGE, "%u %s\n", id, name);
+    
+    lock_acquire(&clients_mutex);
+    for (int n = 0; n < live_count; n++) {
+        int i = live_clients[n];
+        queue_message(i, clients[i].socket, &frame, LANE_CONTROL);
+    }
+    lock_release(&clients_mutex);
+}
+
+// Give every registered user their ID, in users.txt order
+void load_user_ids() {
+    FILE *file = fopen(USERS_FILE, "r");
+    if (file == NULL) {
+        return;
+    }
+    
+    char line[USERS_LINE_LEN];
+    while (fgets(line, sizeof(line), file)) {
+        char *colon = strchr(line, ':');
+        if (colon == NULL) {
+            continue;
+        }
+        *colon = '\0';
+        if (!valid_username(line)) {
+            continue; // No login can match it, so it gets no ID
+        }
+        intern_user(line);
+    }
+    fclose(file);
+    
+    printf("Loaded %u user IDs\n", user_count);
+}
+
+// Make room for at least capacity sessions; new slots are free. Caller
+// holds sessions_mutex, or runs before any connection. Returns 0 if out
+// of memory, leaving the table as it was.
+int grow_sessions(int capacity) {
+    if (capacity <= session_capacity) {
+        return 1;
+    }
+    session_t *grown = realloc(sessions, (size_t)capacity * sizeof(session_t));
+    if (grown == NULL) {
+        return 0;
+    }
+    memset(grown + session_capacity, 0, (size_t)(capacity - session_capacity) * sizeof(session_t));
+    sessions = grown;
+    session_capacity = capacity;
+    return 1;
+}
+
+// Start user_id's session, replacing any earlier one, and write its new
+// token. Returns the session's slot, or -1 if out of memory.
+int create_session(unsigned int user_id, char *token) {
+    // Token: 128 random bits as hex
+    unsigned int r;
+    token[0] = '\0';
+    for (int i = 0; i < 4; i++) {
+        rand_s(&r);
+        sprintf(token + i * 8, "%08x", r);
+    }
+    if (user_id == 0) {
+        return -1;
+    }
+    
+    time_t now = time(NULL);
+    lock_acquire(&sessions_mutex);
+    int slot = (int)user_id - 1;
+    if (slot >= session_capacity &&
+        !grow_sessions(slot >= session_capacity * 2 ? slot + 1 : session_capacity * 2)) {
+        lock_release(&sessions_mutex);
+        token[0] = '\0';
+        return -1;
+    }
+    
+    strcpy(sessions[slot].token, token);
+    sessions[slot].user_id = user_id;
+    sessions[slot].expires = now + SESSION_TTL_SECONDS;
+    sessions[slot].acked_id = 0;
+    sessions[slot].window = 0;
+    
+    lock_release(&sessions_mutex);
+    return slot;
+}
+
+// Returns the slot (and extends the session) if token is live for user_id, else -1
+int find_session(unsigned int user_id, const char *token) {
+    int found = -1;
+    time_t now = time(NULL);
+    int slot = (int)user_id - 1;
+    
+    lock_acquire(&sessions_mutex);
+    if (user_id != 0 && slot < session_capacity && sessions[slot].expires >= now &&
+        strcmp(sessions[slot].token, token) == 0) {
+        sessions[slot].expires = now + SESSION_TTL_SECONDS;
+        found = slot;
+    }
+    lock_release(&sessions_mutex);
+    
+    return found;
+}
+
+void end_session(unsigned int user_id) {
+    int slot = (int)user_id - 1;
+    lock_acquire(&sessions_mutex);
+    if (user_id != 0 && slot < session_capacity) {
+        sessions[slot].expires = 0;
+        sessions[slot].token[0] = '\0';
+    }
+    lock_release(&sessions_mutex);
+}
+
+// End the session in slot if it is still the one token was issued for,
+// e.g. one issued to a connection that closed first
+void drop_session(int slot, const char *token) {
+    lock_acquire(&sessions_mutex);
+    if (slot >= 0 && slot < session_capacity && strcmp(sessions[slot].token, token) == 0) {
+        sessions[slot].expires = 0;
+        sessions[slot].token[0] = '\0';
+    }
+    lock_release(&sessions_mutex);
+}
+
+// Sliding-window dedup of client message IDs. Returns 1 if msg_id is new
+// (or the client doesn't use IDs), 0 if it is a retransmitted duplicate or
+// beyond the window, which a client keeping to MAX_UNACKED never sends
+int accept_message_id(int index, unsigned int msg_id) {
+    int session = clients[index].session;
+    if (msg_id == 0 || session < 0) {
+        return 1;
+    }
+    
+    int is_new = 1;
+    lock_acquire(&sessions_mutex);
+    session_t *s = &sessions[session];
+    
+    if (s->user_id != clients[index].user_id) {
+        is_new = 1; // Session was evicted - nothing to dedup against
+    } else if (msg_id <= s->acked_id) {
+        is_new = 0;
+    } else {
+        unsigned int offset = msg_id - s->acked_id - 1;
+        if (offset >= MAX_UNACKED) {
+            // Sliding up to it would ack IDs never received: drop it unacked
+            is_new = 0;
+        } else if (s->window & (1ULL << offset)) {
+            is_new = 0;
+        } else {
+            s->window |= 1ULL << offset;
+        }
+        
+        // Advance the cumulative ack over the contiguous prefix
+        while (s->window & 1) {
+            s->window >>= 1;
+            s->acked_id++;
+        }
+    }
+    
+    lock_release(&sessions_mutex);
+    return is_new;
+}
+
+// Send one cumulative ack covering every msg_id received so far
+void send_ack(int index) {
+    int session = clients[index].session;
+    if (session < 0) {
+        return;
+    }
+    
+    Message ack;
+    memset(&ack, 0, sizeof(Message));
+    ack.type = MSG_ACK;
+    lock_acquire(&sessions_mutex);
+    ack.msg_id = sessions[session].acked_id;
+    lock_release(&sessions_mutex);
+    
+    queue_message(index, clients[index].socket, &ack, LANE_CONTROL);
+}
+
+// Reconnect with a session token: no password check and no full history,
+// just the records after msg->seq that this user is allowed to see
+void resume_session(int index, Message *msg) {
+    SOCKET client_socket = clients[index].socket;
+    
+    // sender_id is the ID the client was given at login
+    msg->token[SESSION_TOKEN_LEN - 1] = '\0';
+    unsigned int user_id = msg->sender_id;
+    int session = find_session(user_id, msg->token);
+    if (session < 0) {
+        send_server_error(index, msg->request_id, "Session expired, please log in again");
+        return;
+    }
+    
+    // Replay without log_mutex, like a follower's catch-up: only the last
+    // few records are sent under it, together with marking the client
+    // logged in, so nothing is missed or duplicated and appends never wait
+    // on a slow resumer. The position is taken under the lock, as the
+    // index may be reallocated by an append.
+    FILE *file = fopen(chatlog_path, "r");
+    lock_acquire(&log_mutex);
+    unsigned int target = log_seq;
+    unsigned int from_seq = msg->seq < target ? msg->seq : target;
+    if (target - from_seq > RESUME_MAX_RECORDS) {
+        from_seq = target - RESUME_MAX_RECORDS; // The client's history sync fetches the rest
+    }
+    if (file != NULL) {
+        if (from_seq < target) {
+            fseek(file, log_offsets[from_seq], SEEK_SET);
+        } else {
+            fseek(file, 0, SEEK_END);
+        }
+    }
+    lock_release(&log_mutex);
+    
+    Message response;
+    memset(&response, 0, sizeof(Message));
+    response.type = MSG_SUCCESS;
+    response.request_id = msg->request_id;
+    response.seq = target; // Replay covers at least everything up to here
+    response.recipient_id = user_id;
+    lock_acquire(&sessions_mutex);
+    response.msg_id = sessions[session].acked_id; // Client resends anything after this
+    lock_release(&sessions_mutex);
+    strcpy(response.token, msg->token);
+    clock_stamp(&response);
+    strcpy(response.content, "Session resumed");
+    queue_message(index, client_socket, &response, LANE_CONTROL);
+    
+    // Users may have registered meanwhile. The names go in the control
+    // lane, so they arrive before the replay that refers to them.
+    send_user_directory(index, client_socket, 1);
+    
+    unsigned int seq = from_seq;
+    while (1) {
+        lock_acquire(&log_mutex);
+        target = log_seq;
+        int final_pass = (target - seq <= RESUME_FINAL_PASS);
+        if (!final_pass) {
+            lock_release(&log_mutex);
+        }
+        
+        // The final pass doesn't wait for room under log_mutex: the waits
+        // before it leave the lane at most half full (MAX_LANE_DEPTH / 2)
+        int ok = file != NULL && replay_missed(file, index, client_socket, user_id, &seq, target, !final_pass);
+        if (final_pass) {
+            break;
+        }
+        if (!ok) {
+            lock_acquire(&log_mutex);
+            break;
+        }
+    }
+    if (file != NULL) {
+        fclose(file);
+    }
+    
+    lock_acquire(&clients_mutex);
+    clients[index].user_id = user_id;
+    set_logged_in(index, 1);
+    clients[index].session = session;
+    lock_release(&clients_mutex);
+    
+    lock_release(&log_mutex);
+    
+    char username[MAX_USERNAME];
+    client_username(index, username);
+    printf("Session resumed for %s from seq %u\n", username, from_seq);
+}
+
+// Send the records after *seq up to target that user_id may see: public
+// messages and private ones to them, less what they sent themselves.
+// wait = 0 queues without waiting for room. Returns 0 if the file ended
+// early or the client went away.
+int replay_missed(FILE *file, int index, SOCKET sock, unsigned int user_id, unsigned int *seq, unsigned int target, int wait) {
+    char line[MAX_LOG_LINE];
+    log_record_t record;
+    
+    while (*seq < target) {
+        if (!read_log_line(file, line, sizeof(line))) {
+            return 0;
+        }
+        (*seq)++;
+        if (!parse_log_line(line, &record)) {
+            continue;
+        }
+        
+        // The log spells out names; frames carry IDs (0 for SERVER)
+        Message *missed = &record.msg;
+        if (strcmp(record.sender, "SERVER") != 0) {
+            missed->sender_id = find_user_id(record.sender);
+        }
+        if (missed->type == MSG_PRIVATE) {
+            missed->recipient_id = find_user_id(record.recipient);
+        }
+        if (missed->sender_id == user_id ||
+            (missed->type == MSG_PRIVATE && missed->recipient_id != user_id)) {
+            continue;
+        }
+        
+        missed->seq = *seq;
+        if (missed->sender_id != 0) {
+            encrypt_message(missed->content);
+        }
+        if (!(wait ? queue_message_wait : queue_message)(index, sock, missed, LANE_INTERACTIVE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Queue an error for the client in slot index (called from its own thread)
+void send_server_error(int index, unsigned int request_id, const char *text) {
+    Message error;
+    memset(&error, 0, sizeof(Message));
+    error.type = MSG_ERROR;
+    error.request_id = request_id;
+    clock_stamp(&error);
+    strncpy(error.content, text, MAX_MESSAGE - 1);
+    queue_message(index, clients[index].socket, &error, LANE_CONTROL);
+}
+
+int is_admin(unsigned int user_id) {
+    char username[MAX_USERNAME];
+    if (!user_id_name(user_id, username)) {
+        return 0;
+    }
+    size_t length = strlen(username);
+    const char *p = admin_users;
+    while (length > 0 && (p = strstr(p, username)) != NULL) {
+        if ((p == admin_users || p[-1] == ',') && (p[length] == ',' || p[length] == '\0')) {
+            return 1;
+        }
+        p += length;
+    }
+    return 0;
+}
+
+// The metrics and current state as "name value" lines
+// Returns the text length
+int format_stats(char *text, size_t size) {
+    static const char *type_names[] = {
+        "", "register", "login", "chat", "private", "history", "logout", "success", "error",
+        "search", "repl_subscribe", "repl_record", "resume", "ack", "file_offer", "file_chunk",
+        "file_get", "file_data", "stats", "trace", "multicast", "users"
+    };
+    int type_count = (int)(sizeof(type_names) / sizeof(type_names[0]));
+    int length = 0;
+#define STAT(...) length += snprintf(text + length, length < (int)size ? size - length : 0, __VA_ARGS__)
+    
+    // Gauges, read from the live state
+    int connections = 0, logged_in = 0, followers = 0, multicast = 0;
+    lock_acquire(&clients_mutex);
+    for (int i = 0; i < client_capacity; i++) {
+        if (clients[i].socket != INVALID_SOCKET) {
+            connections++;
+            logged_in += clients[i].is_logged_in;
+            followers += clients[i].is_follower;
+            multicast += clients[i].is_multicast;
+        }
+    }
+    unsigned int multicast_seq = mcast_seq;
+    lock_release(&clients_mutex);
+    
+    int queued = 0, deepest = 0, streams = 0;
+    for (int i = 0; i < client_capacity; i++) {
+        WaitForSingleObject(outbound[i].mutex, INFINITE);
+        for (int lane = 0; lane < LANE_COUNT; lane++) {
+            queued += outbound[i].lanes[lane].count;
+            if (outbound[i].lanes[lane].count > deepest) {
+                deepest = outbound[i].lanes[lane].count;
+            }
+        }
+        streams += outbound[i].stream.kind != 0;
+        ReleaseMutex(outbound[i].mutex);
+    }
+    
+    int sessions_live = 0;
+    time_t now = time(NULL);
+    lock_acquire(&sessions_mutex);
+    for (int i = 0; i < session_capacity; i++) {
+        sessions_live += sessions[i].expires >= now;
+    }
+    lock_release(&sessions_mutex);
+    
+    WaitForSingleObject(auth_mutex, INFINITE);
+    int auth_queued = auth_count;
+    ReleaseMutex(auth_mutex);
+    
+    lock_acquire(&log_mutex);
+    unsigned int records = log_seq;
+    lock_release(&log_mutex);
+    
+    pool_stats_t pool;
+    pool_get_stats(&node_pool, &pool);
+    
+    STAT("uptime_s %lld\n", (long long)(now - server_started));
+    STAT("connections %d\n", connections);
+    STAT("logged_in %d\n", logged_in);
+    STAT("client_slots %ld\n", (long)client_capacity);
+    STAT("max_clients %d\n", max_clients);
+    STAT("followers %d\n", followers);
+    STAT("multicast_members %d\n", multicast);
+    STAT("multicast_seq %u\n", multicast_seq);
+    STAT("sessions %d\n", sessions_live);
+    STAT("users %u\n", user_count);
+    STAT("log_records %u\n", records);
+    STAT("auth_queued %d\n", auth_queued);
+    STAT("frames_queued_now %d\n", queued);
+    STAT("deepest_lane %d\n", deepest);
+    STAT("bulk_streams %d\n", streams);
+    STAT("pool_nodes %d in_use %d\n", pool.objects, pool.in_use);
+    
+    // Counters
+    STAT("accepts %lld\n", metrics_counter(M_ACCEPTS));
+    STAT("rejects %lld\n", metrics_counter(M_REJECTS));
+    STAT("logins %lld\n", metrics_counter(M_LOGINS));
+    STAT("auth_failures %lld\n", metrics_counter(M_AUTH_FAILURES));
+    STAT("frames_queued %lld\n", metrics_counter(M_FRAMES_QUEUED));
+    STAT("frames_dropped %lld\n", metrics_counter(M_FRAMES_DROPPED));
+    STAT("frames_sent %lld\n", metrics_counter(M_FRAMES_SENT));
+    STAT("bytes_sent %lld\n", metrics_counter(M_BYTES_SENT));
+    STAT("history_bytes %lld\n", metrics_counter(M_HISTORY_BYTES));
+    STAT("file_bytes %lld\n", metrics_counter(M_FILE_BYTES));
+    STAT("log_appends %lld\n", metrics_counter(M_LOG_APPENDS));
+    STAT("filter_rejects %lld\n", metrics_counter(M_FILTER_REJECTS));
+    STAT("filter_masks %lld\n", metrics_counter(M_FILTER_MASKS));
+    STAT("filter_flags %lld\n", metrics_counter(M_FILTER_FLAGS));
+    STAT("multicast_sent %lld\n", metrics_counter(M_MCAST_SENT));
+    STAT("multicast_repairs %lld\n", metrics_counter(M_MCAST_REPAIRS));
+    for (int type = 1; type < type_count; type++) {
+        long long count = metrics_counter(M_MESSAGES + type);
+        if (count > 0) {
+            STAT("received_%s %lld\n", type_names[type], count);
+        }
+    }
+    
+    // Histograms
+    static const char *histogram_names[H_COUNT] = { "fanout", "queue_depth", "log_append_us", "auth_us" };
+    for (int h = 0; h < H_COUNT; h++) {
+        histogram_summary_t summary;
+        metrics_histogram(h, &summary);
+        STAT("%s count %llu p50 %llu p90 %llu p99 %llu p999 %llu max %llu\n", histogram_names[h],
+             summary.count, summary.p50, summary.p90, summary.p99, summary.p999, summary.max);
+    }
+    
+    // Lock profile, worst waits first (locks.h)
+    STAT("lock_profiling %d\n", (int)lock_profiling);
+    if (length < (int)size) {
+        length += lock_report(text + length, size - length);
+    }
+#undef STAT
+    
+    return length < (int)size ? length : (int)size - 1;
+}
+
+// Admins only: the stats text, split at line ends into as many frames as
+// it takes (numbered like message fragments). "locks on" or "locks off"
+// as the content switches lock profiling first.
+void send_stats(int index, Message *request) {
+    unsigned int request_id = request->request_id;
+    if (!clients[index].is_logged_in || !is_admin(clients[index].user_id)) {
+        send_server_error(index, request_id, "Stats are for server admins only");
+        return;
+    }
+    request->content[MAX_MESSAGE - 1] = '\0';
+    if (strcmp(request->content, "locks on") == 0 || strcmp(request->content, "locks off") == 0) {
+        InterlockedExchange(&lock_profiling, request->content[7] == 'n');
+    }
+    
+    char text[STATS_TEXT_SIZE];
+    WaitForSingleObject(stats_mutex, INFINITE);
+    int length = format_stats(text, sizeof(text));
+    ReleaseMutex(stats_mutex);
+    
+    // Split points first, so every frame knows the count
+    int starts[STATS_TEXT_SIZE / 64 + 2];
+    int frames = 0;
+    int start = 0;
+    while (start < length) {
+        int end = start + MAX_MESSAGE - 1;
+        if (end >= length) {
+            end = length;
+        } else {
+            int line_end = end;
+            while (line_end > start && text[line_end - 1] != '\n') {
+                line_end--;
+            }
+            if (line_end > start) {
+                end = line_end;
+            }
+        }
+        starts[frames++] = start;
+        start = end;
+    }
+    starts[frames] = length;
+    
+    for (int i = 0; i < frames; i++) {
+        Message reply;
+        memset(&reply, 0, sizeof(Message));
+        reply.type = MSG_STATS;
+        reply.request_id = request_id;
+        reply.fragment = (unsigned short)(i + 1);
+        reply.fragments = (unsigned short)frames;
+        clock_stamp(&reply);
+        memcpy(reply.content, text + starts[i], starts[i + 1] - starts[i]);
+        queue_message(index, clients[index].socket, &reply, LANE_CONTROL);
+    }
+}
+
+// Admins only: "on [every]" samples one message in every (default
+// TRACE_DEFAULT_EVERY), "off" stops sampling, "dump" writes out the rings
+void handle_trace_command(int index, Message *msg) {
+    if (!clients[index].is_logged_in || !is_admin(clients[index].user_id)) {
+        send_server_error(index, msg->request_id, "Tracing is for server admins only");
+        return;
+    }
+    msg->content[MAX_MESSAGE - 1] = '\0';
+    
+    Message reply;
+    memset(&reply, 0, sizeof(Message));
+    reply.type = MSG_SUCCESS;
+    reply.request_id = msg->request_id;
+    clock_stamp(&reply);
+    
+    if (strncmp(msg->content, "on", 2) == 0) {
+        int every = atoi(msg->content + 2);
+        if (every < 1) {
+            every = TRACE_DEFAULT_EVERY;
+        }
+        InterlockedExchange(&trace_sample_every, every);
+        sprintf(reply.content, "Tracing 1 in %d messages", every);
+    } else if (strcmp(msg->content, "off") == 0) {
+        InterlockedExchange(&trace_sample_every, 0);
+        strcpy(reply.content, "Tracing off");
+    } else if (strcmp(msg->content, "dump") == 0) {
+        char path[MAX_PATH];
+        int spans = dump_trace(path, sizeof(path));
+        if (spans < 0) {
+            send_server_error(index, msg->request_id, "Could not write the trace file");
+            return;
+        }
+        snprintf(reply.content, MAX_MESSAGE, "Wrote %d spans to %s", spans, path);
+    } else {
+        send_server_error(index, msg->request_id, "Usage: on [every] | off | dump");
+        return;
+    }
+    queue_message(index, clients[index].socket, &reply, LANE_CONTROL);
+}
+
+// Write the rings to trace-<epoch seconds>.json in the working directory
+int dump_trace(char *path, size_t size) {
+    WaitForSingleObject(trace_mutex, INFINITE);
+    snprintf(path, size, "trace-%llu.json", epoch_us_now() / 1000000);
+    int spans = trace_dump(path);
+    ReleaseMutex(trace_mutex);
+    
+    if (spans >= 0) {
+        printf("Trace: %d spans written to %s\n", spans, path);
+    }
+    return spans;
+}
+
+// Open the socket public messages go to the group on
+// Returns 0 if the group or interface is bad or the socket can't be set up
+int start_multicast() {
+    memset(&mcast_addr, 0, sizeof(mcast_addr));
+    mcast_addr.sin_family = AF_INET;
+    mcast_addr.sin_port = htons(multicast_port);
+    mcast_addr.sin_addr.s_addr = inet_addr(multicast_group);
+    if (!IN_MULTICAST(ntohl(mcast_addr.sin_addr.s_addr))) {
+        printf("Multicast off: %s is not a multicast group (224.0.0.0-239.255.255.255)\n", multicast_group);
+        return 0;
+    }
+    
+    mcast_ring = calloc(MCAST_RING, sizeof(mcast_frame_t));
+    mcast_socket = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+    if (mcast_ring == NULL || mcast_socket == INVALID_SOCKET) {
+        printf("Multicast off: could not create the socket. Error Code: %d\n", WSAGetLastError());
+        return 0;
+    }
+    
+    // Loopback on, so receivers on this host (or a test on 127.0.0.1) get it too
+    DWORD ttl = multicast_ttl, loop = 1;
+    setsockopt(mcast_socket, IPPROTO_IP, IP_MULTICAST_TTL, (const char *)&ttl, sizeof(ttl));
+    setsockopt(mcast_socket, IPPROTO_IP, IP_MULTICAST_LOOP, (const char *)&loop, sizeof(loop));
+    if (multicast_if[0] != '\0') {
+        struct in_addr local;
+        local.s_addr = inet_addr(multicast_if);
+        if (setsockopt(mcast_socket, IPPROTO_IP, IP_MULTICAST_IF, (const char *)&local, sizeof(local)) == SOCKET_ERROR) {
+            printf("Multicast off: can't send on interface %s. Error Code: %d\n", multicast_if, WSAGetLastError());
+            closesocket(mcast_socket);
+            mcast_socket = INVALID_SOCKET;
+            return 0;
+        }
+    }
+    
+    // A new epoch per run tells receivers seq has started over, and a new
+    // key keeps an old one from ever opening this run's datagrams
+    mcast_epoch = (unsigned int)(epoch_us_now() / 1000);
+    for (int i = 0; i < MCAST_KEY_LEN; i += sizeof(unsigned int)) {
+        unsigned int r;
+        rand_s(&r);
+        memcpy(mcast_key + i, &r, sizeof(r));
+    }
+    hex_encode(mcast_key, MCAST_KEY_LEN, mcast_key_hex);
+    return 1;
+}
+
+// Send one public message to the group and keep it for repairs
+// (called holding clients_mutex, which orders the seqs)
+void multicast_send(const Message *msg) {
+    mcast_frame_t *frame = &mcast_ring[++mcast_seq % MCAST_RING];
+    frame->epoch = mcast_epoch;
+    frame->seq = mcast_seq;
+    frame->length = sizeof(Message);
+    frame->msg = *msg;
+    frame->msg.request_id = 0;
+    
+    // The ring keeps it in the clear for repairs
+    mcast_frame_t sealed = *frame;
+    int size = mcast_seal(mcast_key, &sealed);
+    // Lost datagrams are the receivers' to repair; nothing to do here
+    sendto(mcast_socket, (const char *)&sealed, size, 0, (struct sockaddr *)&mcast_addr, sizeof(mcast_addr));
+    metrics_add(M_MCAST_SENT, 1);
+}
+
+// Repeat the latest seq every MCAST_HEARTBEAT_MS, so receivers notice
+// when the last datagrams of a burst were lost, and that the group is alive
+DWORD WINAPI multicast_heartbeat(LPVOID arg) {
+    affinity_pin(AFFINITY_BACKGROUND, -1);
+    mcast_frame_t beat;
+    memset(&beat, 0, sizeof(mcast_frame_t));
+    beat.epoch = mcast_epoch;
+    
+    while (1) {
+        Sleep(MCAST_HEARTBEAT_MS);
+        lock_acquire(&clients_mutex);
+        beat.seq = mcast_seq;
+        lock_release(&clients_mutex);
+        beat.length = 0; // Header only
+        int size = mcast_seal(mcast_key, &beat);
+        sendto(mcast_socket, (const char *)&beat, size, 0, (struct sockaddr *)&mcast_addr, sizeof(mcast_addr));
+    }
+    return 0;
+}
+
+// "on" switches this connection's public messages to the group and hands
+// out the epoch's key, "off" goes back to TCP; the reply's msg_id is the
+// last seq sent before the switch.
+// "repair <from> <to>" resends those seqs over TCP (msg_id = seq), then
+// replies "repaired <n>" with how many were no longer kept.
+void handle_multicast_command(int index, Message *msg) {
+    if (!clients[index].is_logged_in) {
+        send_server_error(index, msg->request_id, "You must be logged in to use multicast");
+        return;
+    }
+    if (mcast_socket == INVALID_SOCKET) {
+        send_server_error(index, msg->request_id, "Multicast is not enabled on this server");
+        return;
+    }
+    msg->content[MAX_MESSAGE - 1] = '\0';
+    
+    Message reply;
+    memset(&reply, 0, sizeof(Message));
+    reply.type = MSG_MULTICAST;
+    reply.request_id = msg->request_id;
+    clock_stamp(&reply);
+    SOCKET sock = clients[index].socket;
+    
+    unsigned int from, to;
+    if (strcmp(msg->content, "on") == 0 || strcmp(msg->content, "off") == 0) {
+        int on = msg->content[1] == 'n';
+        // Under the lock, and on the lane broadcasts use: every public
+        // message before the reply came over TCP, every one after it not
+        lock_acquire(&clients_mutex);
+        clients[index].is_multicast = on;
+        reply.msg_id = mcast_seq;
+        if (on) {
+            snprintf(reply.content, MAX_MESSAGE, "%s %d %u %s", multicast_group, multicast_port,
+                     mcast_epoch, mcast_key_hex);
+        } else {
+            snprintf(reply.content, MAX_MESSAGE, "off %u", mcast_epoch);
+        }
+        queue_message(index, sock, &reply, LANE_INTERACTIVE);
+        lock_release(&clients_mutex);
+        return;
+    }
+    if (sscanf(msg->content, "repair %u %u", &from, &to) != 2) {
+        send_server_error(index, msg->request_id, "Usage: on | off | repair <from> <to>");
+        return;
+    }
+    
+    lock_acquire(&clients_mutex);
+    unsigned int latest = mcast_seq;
+    lock_release(&clients_mutex);
+    if (from < 1 || to < from || to > latest || to - from >= MCAST_RING) {
+        send_server_error(index, msg->request_id, "Bad repair range");
+        return;
+    }
+    
+    int missing = 0;
+    for (unsigned int seq = from; seq <= to; seq++) {
+        Message repaired;
+        lock_acquire(&clients_mutex);
+        mcast_frame_t *frame = &mcast_ring[seq % MCAST_RING];
+        int kept = frame->seq == seq && frame->length > 0;
+        if (kept) {
+            repaired = frame->msg;
+        }
+        lock_release(&clients_mutex);
+        
+        if (!kept) {
+            missing++;
+            continue;
+        }
+        repaired.msg_id = seq;
+        repaired.request_id = msg->request_id;
+        // All of it or nothing: the client is waiting for every one
+        if (!queue_message_wait(index, sock, &repaired, LANE_INTERACTIVE)) {
+            return;
+        }
+        metrics_add(M_MCAST_REPAIRS, 1);
+    }
+    
+    reply.msg_id = to;
+    snprintf(reply.content, MAX_MESSAGE, "repaired %d", missing);
+    queue_message_wait(index, sock, &reply, LANE_INTERACTIVE);
+}
+
+// Ctrl+Break is the console's spare signal: dump traces and keep running
+BOOL WINAPI console_handler(DWORD event) {
+    if (event != CTRL_BREAK_EVENT) {
+        return FALSE; // Default handling: exit
+    }
+    char path[MAX_PATH];
+    if (dump_trace(path, sizeof(path)) < 0) {
+        printf("Trace dump failed. Error Code: %d\n", GetLastError());
+    }
+    return TRUE;
+}
+
+int pipe_read(HANDLE pipe, void *buffer, DWORD size) {
+    DWORD done = 0;
+    while (done < size) {
+        DWORD read = 0;
+        if (!ReadFile(pipe, (char *)buffer + done, size - done, &read, NULL) || read == 0) {
+            return 0;
+        }
+        done += read;
+    }
+    return 1;
+}
+
+int pipe_write(HANDLE pipe, const void *buffer, DWORD size) {
+    DWORD done = 0;
+    while (done < size) {
+        DWORD written = 0;
+        if (!WriteFile(pipe, (const char *)buffer + done, size - done, &written, NULL)) {
+            return 0;
+        }
+        done += written;
+    }
+    return 1;
+}
+
+// The user a process runs as, into token_user (a TOKEN_USER). Returns 0
+// if the process can't be queried.
+int process_user(HANDLE process, BYTE *token_user, DWORD size) {
+    HANDLE token;
+    DWORD needed;
+    if (!OpenProcessToken(process, TOKEN_QUERY, &token)) {
+        return 0;
+    }
+    int ok = GetTokenInformation(token, TokenUser, token_user, size, &needed);
+    CloseHandle(token);
+    return ok;
+}
+
+// The other end of the handoff pipe gets our sockets, or gives us its own:
+// it must run as our user, from an executable with our file name
+int handoff_peer_trusted(DWORD pid) {
+    char ours[MAX_PATH], theirs[MAX_PATH];
+    DWORD length = MAX_PATH;
+    BYTE our_user[256], their_user[256];
+    
+    HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE, pid);
+    if (process == NULL) {
+        return 0;
+    }
+    int ok = QueryFullProcessImageName(process, 0, theirs, &length) &&
+             GetModuleFileName(NULL, ours, MAX_PATH) > 0 &&
+             process_user(GetCurrentProcess(), our_user, sizeof(our_user)) &&
+             process_user(process, their_user, sizeof(their_user)) &&
+             EqualSid(((TOKEN_USER *)our_user)->User.Sid, ((TOKEN_USER *)their_user)->User.Sid);
+    CloseHandle(process);
+    
+    // The new build may live in another directory
+    const char *our_name = strrchr(ours, '\\');
+    const char *their_name = strrchr(theirs, '\\');
+    return ok && _stricmp(our_name != NULL ? our_name : ours, their_name != NULL ? their_name : theirs) == 0;
+}
+
+// A DACL for the handoff pipe that lets in only our user and SYSTEM; the
+// default one would let any local account connect. Free
+// security->lpSecurityDescriptor with LocalFree.
+int handoff_pipe_security(SECURITY_ATTRIBUTES *security) {
+    BYTE user[256];
+    char *sid = NULL;
+    char sddl[256];
+    
+    security->nLength = sizeof(SECURITY_ATTRIBUTES);
+    security->bInheritHandle = FALSE;
+    security->lpSecurityDescriptor = NULL;
+    if (!process_user(GetCurrentProcess(), user, sizeof(user)) ||
+        !ConvertSidToStringSid(((TOKEN_USER *)user)->User.Sid, &sid)) {
+        return 0;
+    }
+    snprintf(sddl, sizeof(sddl), "D:P(A;;GA;;;SY)(A;;GA;;;%s)", sid);
+    LocalFree(sid);
+    return ConvertStringSecurityDescriptorToSecurityDescriptor(sddl, SDDL_REVISION_1,
+                                                               &security->lpSecurityDescriptor, NULL);
+}
+
+// Old server: wait for a new binary on the handoff pipe, check it can
+// share our state, and hand the rest to the accept thread (hand_off)
+DWORD WINAPI handoff_listener(LPVOID arg) {
+    char name[64];
+    snprintf(name, sizeof(name), HANDOFF_PIPE, server_port);
+    affinity_pin(AFFINITY_BACKGROUND, -1);
+    
+    SECURITY_ATTRIBUTES security;
+    if (!handoff_pipe_security(&security)) {
+        printf("Upgrades disabled: no security descriptor for the handoff pipe. Error Code: %d\n", GetLastError());
+        return 0;
+    }
+    
+    while (1) {
+        // The server we replaced may still own the name for a moment. The
+        // first instance flag keeps anyone else from having created it.
+        HANDLE pipe = CreateNamedPipe(name, PIPE_ACCESS_DUPLEX | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                      PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                      1, 4096, 4096, 0, &security);
+        if (pipe == INVALID_HANDLE_VALUE) {
+            Sleep(1000);
+            continue;
+        }
+        
+        handoff_hello_t hello;
+        DWORD peer = 0;
+        if ((ConnectNamedPipe(pipe, NULL) || GetLastError() == ERROR_PIPE_CONNECTED) &&
+            pipe_read(pipe, &hello, sizeof(hello))) {
+            // The sockets go to hello.pid: it must be the process on the pipe
+            if (!GetNamedPipeClientProcessId(pipe, &peer) || peer != hello.pid || !handoff_peer_trusted(peer)) {
+                printf("Upgrade refused: process %lu is not our user's server\n", (unsigned long)peer);
+            } else if (hello.version == HANDOFF_VERSION && hello.message_size == sizeof(Message) &&
+                       hello.client_size == sizeof(client_t) && hello.session_size == sizeof(session_t)) {
+                handoff_pid = hello.pid;
+                handoff_pipe = pipe;
+                ResetEvent(handoff_resume);
+                InterlockedExchange(&handing_off, 1);
+                SetEvent(handoff_begin);
+                
+                // Only returns if the handoff was abandoned; hand_off closed the pipe
+                WaitForSingleObject(handoff_resume, INFINITE);
+                continue;
+            } else {
+                printf("Upgrade refused: process %lu has a different protocol version or layout\n",
+                       (unsigned long)hello.pid);
+            }
+            memset(&handoff_state, 0, sizeof(handoff_state));
+            pipe_write(pipe, &handoff_state, sizeof(handoff_state));
+        }
+        DisconnectNamedPipe(pipe);
+        CloseHandle(pipe);
+    }
+    return 0;
+}
+
+// Nothing of this connection's is in flight: no frames queued or being
+// written, no bulk stream. Caller holds clients_mutex.
+int connection_idle(int index) {
+    outbound_t *out = &outbound[index];
+    WaitForSingleObject(out->mutex, INFINITE);
+    int idle = !out->sending && out->stream.kind == 0;
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        idle = idle && out->lanes[lane].count == 0;
+    }
+    ReleaseMutex(out->mutex);
+    return idle && !clients[index].auth_pending;
+}
+
+// Connection thread: stop reading until the handoff is over. It is only
+// over for us if it was abandoned; otherwise the process exits meanwhile.
+void park_connection(int index) {
+    InterlockedExchange(&outbound[index].parked, 1);
+    WaitForSingleObject(handoff_resume, INFINITE);
+    InterlockedExchange(&outbound[index].parked, 0);
+}
+
+// Connection thread: withdraw its zero-byte receive, if one is pending,
+// and wait for it to finish so the socket can be duplicated or closed
+// and the OVERLAPPED reused
+void cancel_arrival(SOCKET sock, WSAOVERLAPPED *arrival, int *pending) {
+    if (*pending) {
+        DWORD got, flags;
+        CancelIoEx((HANDLE)sock, arrival);
+        WSAGetOverlappedResult(sock, arrival, &got, TRUE, &flags);
+        *pending = 0;
+    }
+}
+
+// Old server, on the accept thread: wait until every connection is parked
+// with nothing in flight, then send the listener, the connections and the
+// sessions to the new process, and exit once it has them. Returns if that
+// doesn't happen within HANDOFF_DRAIN_MS or the new process goes away, and
+// the server carries on as before.
+void hand_off(SOCKET listener) {
+    printf("Upgrade requested by process %lu: draining connections\n", (unsigned long)handoff_pid);
+    DWORD started = GetTickCount();
+    
+    // With every connection thread parked nothing queues frames any more.
+    // Followers are left out: they reconnect to the new server by themselves.
+    int waiting;
+    do {
+        Sleep(10);
+        waiting = 0;
+        lock_acquire(&clients_mutex);
+        for (int i = 0; i < client_capacity; i++) {
+            if (clients[i].socket != INVALID_SOCKET && !clients[i].is_follower &&
+                !(outbound[i].parked && connection_idle(i))) {
+                waiting++;
+            }
+        }
+        lock_release(&clients_mutex);
+    } while (waiting > 0 && GetTickCount() - started < HANDOFF_DRAIN_MS);
+    
+    // Nothing appends now: a fresh snapshot saves the new server the scan
+    if (waiting == 0) {
+        write_snapshot();
+    }
+    
+    memset(&handoff_state, 0, sizeof(handoff_state));
+    handoff_state.accepted = 1;
+    handoff_clients = malloc(max_clients * sizeof(handoff_client_t));
+    int ok = waiting == 0 && handoff_clients != NULL &&
+             WSADuplicateSocket(listener, handoff_pid, &handoff_state.listener) == 0;
+    
+    lock_acquire(&sessions_mutex);
+    handoff_sessions = malloc((size_t)session_capacity * sizeof(session_t));
+    ok = ok && handoff_sessions != NULL;
+    if (ok) {
+        memcpy(handoff_sessions, sessions, (size_t)session_capacity * sizeof(session_t));
+        handoff_state.session_count = session_capacity;
+    }
+    lock_release(&sessions_mutex);
+    
+    int count = 0;
+    lock_acquire(&clients_mutex);
+    for (int i = 0; i < client_capacity && ok; i++) {
+        if (clients[i].socket == INVALID_SOCKET || clients[i].is_follower) {
+            continue;
+        }
+        handoff_clients[count].client = clients[i];
+        ok = WSADuplicateSocket(clients[i].socket, handoff_pid, &handoff_clients[count].info) == 0;
+        count++;
+    }
+    lock_release(&clients_mutex);
+    handoff_state.connections = count;
+    
+    // The new process answers once it has recreated the sockets
+    char ack = 0;
+    ok = ok && pipe_write(handoff_pipe, &handoff_state, sizeof(handoff_state)) &&
+         pipe_write(handoff_pipe, handoff_clients, count * sizeof(handoff_client_t)) &&
+         pipe_write(handoff_pipe, handoff_sessions, handoff_state.session_count * sizeof(session_t)) &&
+         pipe_read(handoff_pipe, &ack, 1) && ack == 1;
+    if (ok) {
+        // Our descriptors close with the process; the sockets stay open
+        // through the new process's duplicates
+        printf("Handed off %d connections to process %lu\n", count, (unsigned long)handoff_pid);
+        ExitProcess(0);
+    }
+    
+    if (waiting > 0) {
+        printf("Upgrade abandoned: %d connections still busy\n", waiting);
+        memset(&handoff_state, 0, sizeof(handoff_state));
+        pipe_write(handoff_pipe, &handoff_state, sizeof(handoff_state));
+    } else {
+        printf("Upgrade abandoned. Error Code: %d\n", GetLastError());
+    }
+    free(handoff_clients);
+    free(handoff_sessions);
+    handoff_clients = NULL;
+    handoff_sessions = NULL;
+    DisconnectNamedPipe(handoff_pipe);
+    CloseHandle(handoff_pipe);
+    handoff_pipe = INVALID_HANDLE_VALUE;
+    ResetEvent(handoff_begin);
+    InterlockedExchange(&handing_off, 0);
+    SetEvent(handoff_resume);
+}
+
+// New server: ask the one running on our port to hand over, and recreate
+// the sockets it sends. Returns the listener, INVALID_SOCKET on failure.
+SOCKET take_over() {
+    char name[64];
+    snprintf(name, sizeof(name), HANDOFF_PIPE, server_port);
+    HANDLE pipe = CreateFile(name, GENERIC_READ | GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+    if (pipe == INVALID_HANDLE_VALUE) {
+        printf("No server on port %d to upgrade. Error Code: %d\n", server_port, GetLastError());
+        return INVALID_SOCKET;
+    }
+    
+    // Whoever created the pipe name gets our hello and hands us sockets
+    // and sessions: it has to be our user's server
+    DWORD owner = 0;
+    if (!GetNamedPipeServerProcessId(pipe, &owner) || !handoff_peer_trusted(owner)) {
+        printf("Not upgrading: the handoff pipe belongs to process %lu, not our user's server\n",
+               (unsigned long)owner);
+        CloseHandle(pipe);
+        return INVALID_SOCKET;
+    }
+    
+    handoff_hello_t hello;
+    hello.pid = GetCurrentProcessId();
+    hello.version = HANDOFF_VERSION;
+    hello.message_size = sizeof(Message);
+    hello.client_size = sizeof(client_t);
+    hello.session_size = sizeof(session_t);
+    printf("Waiting for the server on port %d to hand over...\n", server_port);
+    
+    // More connections than our --max-clients is a refusal too: the old
+    // server carries on with them
+    handoff_clients = malloc(max_clients * sizeof(handoff_client_t));
+    if (handoff_clients == NULL || !pipe_write(pipe, &hello, sizeof(hello)) ||
+        !pipe_read(pipe, &handoff_state, sizeof(handoff_state)) || !handoff_state.accepted ||
+        handoff_state.connections < 0 || handoff_state.connections > max_clients ||
+        !pipe_read(pipe, handoff_clients, handoff_state.connections * sizeof(handoff_client_t)) ||
+        handoff_state.session_count < 1 || handoff_state.session_count > INT_MAX / (int)sizeof(session_t) ||
+        (handoff_sessions = malloc((size_t)handoff_state.session_count * sizeof(session_t))) == NULL ||
+        !pipe_read(pipe, handoff_sessions, handoff_state.session_count * sizeof(session_t))) {
+        printf("Upgrade refused by the running server\n");
+        CloseHandle(pipe);
+        return INVALID_SOCKET;
+    }
+    
+    SOCKET listener = WSASocket(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+                                &handoff_state.listener, 0, WSA_FLAG_OVERLAPPED);
+    handoff_count = handoff_state.connections;
+    for (int i = 0; i < handoff_count; i++) {
+        handoff_clients[i].client.socket = WSASocket(FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO, FROM_PROTOCOL_INFO,
+                                                     &handoff_clients[i].info, 0, WSA_FLAG_OVERLAPPED);
+    }
+    
+    // Without the listener the old server must keep going
+    char ack = listener != INVALID_SOCKET;
+    if (!pipe_write(pipe, &ack, 1) || !ack) {
+        printf("Could not take over the listener. Error Code: %d\n", WSAGetLastError());
+        for (int i = 0; i < handoff_count; i++) {
+            closesocket(handoff_clients[i].client.socket);
+        }
+        if (listener != INVALID_SOCKET) {
+            closesocket(listener);
+        }
+        CloseHandle(pipe);
+        return INVALID_SOCKET;
+    }
+    CloseHandle(pipe);
+    return listener;
+}
+
+// New server: restore the sessions and start the connections take_over
+// received, as if they had just been accepted. They get fresh slots; a
+// slot index never leaves the process.
+void adopt_connections() {
+    // Same slots as before: the clients' session indexes refer to them
+    if (grow_sessions(handoff_state.session_count)) {
+        memcpy(sessions, handoff_sessions, (size_t)handoff_state.session_count * sizeof(session_t));
+    } else {
+        printf("Out of memory restoring sessions: clients will log in again\n");
+    }
+    free(handoff_sessions);
+    handoff_sessions = NULL;
+    
+    int adopted = 0;
+    for (int i = 0; i < handoff_count; i++) {
+        handoff_client_t *record = &handoff_clients[i];
+        if (record->client.socket == INVALID_SOCKET) {
+            continue;
+        }
+        
+        lock_acquire(&clients_mutex);
+        int index = acquire_slot(record->client.socket);
+        if (index >= 0) {
+            clients[index].session = record->client.session < session_capacity ? record->client.session : -1;
+            clients[index].user_id = record->client.user_id;
+            set_logged_in(index, record->client.is_logged_in);
+        }
+        lock_release(&clients_mutex);
+        if (index < 0) {
+            printf("Server full, dropping a handed-over connection\n");
+            closesocket(record->client.socket);
+            continue;
+        }
+        
+        HANDLE thread_handle = NULL;
+        if (start_outbound(index, record->client.socket)) {
+            thread_handle = CreateThread(NULL, 0, handle_client, (LPVOID)(DWORD_PTR)index, 0, NULL);
+            if (thread_handle == NULL) {
+                stop_outbound(index);
+            }
+        }
+        if (thread_handle == NULL) {
+            printf("Thread creation failed. Error Code: %d\n", GetLastError());
+            closesocket(record->client.socket);
+            lock_acquire(&clients_mutex);
+            clients[index].user_id = 0;
+            release_slot(index);
+            lock_release(&clients_mutex);
+            continue;
+        }
+        CloseHandle(thread_handle);
+        adopted++;
+    }
+    free(handoff_clients);
+    handoff_clients = NULL;
+    printf("Took over %d connections\n", adopted);
+}
+
+// Loopback-only stats: connect and read (e.g. curl http://127.0.0.1:port/).
+// Anything that looks like an HTTP request gets an HTTP response.
+DWORD WINAPI stats_listener(LPVOID arg) {
+    affinity_pin(AFFINITY_BACKGROUND, -1);
+    SOCKET listener = socket(AF_INET, SOCK_STREAM, 0);
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(stats_port);
+    
+    // After an upgrade the old server holds the port until it exits
+    int bound = 0;
+    for (int tries = 0; listener != INVALID_SOCKET && tries < (upgrade ? 10 : 1); tries++) {
+        if (tries > 0) {
+            Sleep(1000);
+        }
+        if (bind(listener, (struct sockaddr *)&addr, sizeof(addr)) != SOCKET_ERROR) {
+            bound = 1;
+            break;
+        }
+    }
+    if (!bound || listen(listener, 5) == SOCKET_ERROR) {
+        printf("Stats endpoint failed on port %d. Error Code: %d\n", stats_port, WSAGetLastError());
+        return 0;
+    }
+    printf("Stats: 127.0.0.1:%d\n", stats_port);
+    
+    char text[STATS_TEXT_SIZE];
+    while (1) {
+        SOCKET sock = accept(listener, NULL, NULL);
+        if (sock == INVALID_SOCKET) {
+            continue;
+        }
+        
+        // Give a request a moment to arrive; a bare connection gets the text too
+        DWORD timeout_ms = 200;
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout_ms, sizeof(timeout_ms));
+        char request[512];
+        int received = recv(sock, request, sizeof(request) - 1, 0);
+        int is_http = received >= 4 && strncmp(request, "GET ", 4) == 0;
+        
+        WaitForSingleObject(stats_mutex, INFINITE);
+        int length = format_stats(text, sizeof(text));
+        ReleaseMutex(stats_mutex);
+        
+        if (is_http) {
+            char header[128];
+            int header_length = snprintf(header, sizeof(header),
+                "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\nContent-Length: %d\r\n\r\n", length);
+            send(sock, header, header_length, 0);
+        }
+        send(sock, text, length, 0);
+        closesocket(sock);
+    }
+    return 0;
+}
+
+// Attach a fresh set of lanes and a writer thread to a new connection
+int start_outbound(int index, SOCKET sock) {
+    outbound_t *out = &outbound[index];
+    
+    WaitForSingleObject(out->mutex, INFINITE);
+    out->socket = sock;
+    out->closing = 0;
+    out->dropped = 0;
+    out->producing = 0;
+    memset(out->lanes, 0, sizeof(out->lanes));
+    memset(&out->stream, 0, sizeof(out->stream));
+    ReleaseMutex(out->mutex);
+    
+    out->writer = CreateThread(NULL, 0, outbound_writer, (LPVOID)(DWORD_PTR)index, 0, NULL);
+    if (out->writer == NULL) {
+        WaitForSingleObject(out->mutex, INFINITE);
+        out->socket = INVALID_SOCKET;
+        ReleaseMutex(out->mutex);
+        return 0;
+    }
+    return 1;
+}
+
+// Stop the writer and free anything still queued for this connection
+void stop_outbound(int index) {
+    outbound_t *out = &outbound[index];
+    
+    WaitForSingleObject(out->mutex, INFINITE);
+    out->closing = 1;
+    SOCKET sock = out->socket;
+    ReleaseMutex(out->mutex);
+    
+    // Unblock a writer stuck in send() to a dead peer
+    shutdown(sock, SD_BOTH);
+    SetEvent(out->ready);
+    WaitForSingleObject(out->writer, INFINITE);
+    CloseHandle(out->writer);
+    out->writer = NULL;
+    
+    // The bulk scheduler may be reading the stream; it signals space when
+    // it is done (the writer, the only other user, has exited)
+    WaitForSingleObject(out->mutex, INFINITE);
+    while (out->producing) {
+        ReleaseMutex(out->mutex);
+        WaitForSingleObject(out->space, INFINITE);
+        WaitForSingleObject(out->mutex, INFINITE);
+    }
+    for (int lane = 0; lane < LANE_COUNT; lane++) {
+        out_node_t *node = out->lanes[lane].head;
+        while (node != NULL) {
+            out_node_t *next = node->next;
+            free_out_node(node);
+            node = next;
+        }
+        out->lanes[lane].head = out->lanes[lane].tail = NULL;
+        out->lanes[lane].count = 0;
+    }
+    close_bulk_stream(&out->stream);
+    out->socket = INVALID_SOCKET;
+    ReleaseMutex(out->mutex);
+}
+
+// Queue a frame for the client in slot index. sock guards against the slot
+// having been taken over by a newer connection. Returns 0 if the frame was
+// dropped (connection gone or lane full).
+int queue_message(int index, SOCKET sock, const Message *msg, int lane) {
+    outbound_t *out = &outbound[index];
+    
+    out_node_t *node = pool_alloc(&node_pool);
+    if (node == NULL) {
+        return 0;
+    }
+    node->next = NULL;
+    node->msg = *msg;
+    node->file = NULL;
+    node->length = 0;
+    node->trace_id = trace_current();
+    node->queued_us = trace_start(node->trace_id);
+    
+    WaitForSingleObject(out->mutex, INFINITE);
+    lane_t *queue = &out->lanes[lane];
+    if (out->socket != sock || out->closing || queue->count >= MAX_LANE_DEPTH) {
+        // Counted for the client too: the writer tells it once it catches up
+        if (out->socket == sock && !out->closing && out->dropped++ == 0) {
+            printf("Outbound queue full for client %d, dropping messages\n", index);
+        }
+        ReleaseMutex(out->mutex);
+        pool_free(&node_pool, node);
+        metrics_add(M_FRAMES_DROPPED, 1);
+        return 0;
+    }
+    
+    metrics_record(H_QUEUE_DEPTH, queue->count);
+    metrics_add(M_FRAMES_QUEUED, 1);
+    if (queue->tail != NULL) {
+        queue->tail->next = node;
+    } else {
+        queue->head = node;
+    }
+    queue->tail = node;
+    queue->count++;
+    ReleaseMutex(out->mutex);
+    
+    SetEvent(out->ready);
+    return 1;
+}
+
+// Like queue_message, but waits for room instead of dropping - for replays
+// that must arrive complete (resume gaps, follower catch-up)
+int queue_message_wait(int index, SOCKET sock, const Message *msg, int lane) {
+    outbound_t *out = &outbound[index];
+    
+    while (1) {
+        WaitForSingleObject(out->mutex, INFINITE);
+        int alive = out->socket == sock && !out->closing;
+        int has_room = out->lanes[lane].count < MAX_LANE_DEPTH / 2;
+        ReleaseMutex(out->mutex);
+        
+        if (!alive) {
+            return 0;
+        }
+        if (has_room) {
+            return queue_message(index, sock, msg, lane);
+        }
+        WaitForSingleObject(out->space, 100);
+    }
+}
+
+// The only thread that writes to a connection's socket. Always takes the
+// highest priority frame available, so live chat never waits behind more
+// than the one bulk frame already on the wire.
+DWORD WINAPI outbound_writer(LPVOID arg) {
+    int index = (int)(DWORD_PTR)arg;
+    outbound_t *out = &outbound[index];
+    SOCKET sock = out->socket;
+    int failed = 0;
+    affinity_pin(AFFINITY_CONNECTION, index); // Same CPU as the reader
+    
+    while (1) {
+        WaitForSingleObject(out->ready, INFINITE);
+        
+        while (1) {
+            WaitForSingleObject(out->mutex, INFINITE);
+            if (out->closing) {
+                ReleaseMutex(out->mutex);
+                pool_thread_exit(&node_pool);
+                metrics_thread_exit();
+                trace_thread_exit();
+                return 0;
+            }
+            
+            out_node_t *node = NULL;
+            unsigned int missed = 0;
+            int lane;
+            out->sending = 0;
+            for (lane = 0; lane < LANE_COUNT; lane++) {
+                if (out->lanes[lane].head != NULL) {
+                    node = out->lanes[lane].head;
+                    out->lanes[lane].head = node->next;
+                    if (out->lanes[lane].head == NULL) {
+                        out->lanes[lane].tail = NULL;
+                    }
+                    out->lanes[lane].count--;
+                    out->sending = 1;
+                    break;
+                }
+            }
+            if (node == NULL) {
+                missed = out->dropped;
+                out->dropped = 0;
+            }
+            ReleaseMutex(out->mutex);
+            
+            if (node == NULL) {
+                // Caught up: tell the client what it lost while it was behind
+                if (missed > 0 && !failed) {
+                    Message notice;
+                    memset(&notice, 0, sizeof(Message));
+                    notice.type = MSG_ERROR;
+                    clock_stamp(&notice);
+                    snprintf(notice.content, MAX_MESSAGE,
+                             "Your connection fell behind and %u messages were dropped - view the history to see them",
+                             missed);
+                    failed = send(sock, (const char*)&notice, sizeof(Message), 0) == SOCKET_ERROR;
+                }
+                break;
+            }
+            trace_span(node->trace_id, "lane wait", node->queued_us);
+            unsigned long long sending = trace_start(node->trace_id);
+            
+            // After a failure keep draining so producers aren't blocked;
+            // the connection thread notices the disconnect on recv
+            if (!failed && node->file != NULL) {
+                // Download segment: the kernel sends the header and the file
+                // range together, without copying the data through us
+                TRANSMIT_FILE_BUFFERS head;
+                head.Head = &node->msg;
+                head.HeadLength = sizeof(Message);
+                head.Tail = NULL;
+                head.TailLength = 0;
+                
+                LARGE_INTEGER position;
+                position.QuadPart = (LONGLONG)node->offset;
+                if (!SetFilePointerEx(node->file, position, NULL, FILE_BEGIN) ||
+                    !TransmitFile(sock, node->file, node->length, 0, NULL, &head, 0)) {
+                    printf("TransmitFile failed. Error Code: %d\n", WSAGetLastError());
+                    failed = 1;
+                }
+            } else if (!failed && send(sock, (const char*)&node->msg, sizeof(Message), 0) == SOCKET_ERROR) {
+                printf("Send failed. Error Code: %d\n", WSAGetLastError());
+                failed = 1;
+            }
+            if (!failed) {
+                metrics_add(M_FRAMES_SENT, 1);
+                metrics_add(M_BYTES_SENT, sizeof(Message) + node->length);
+            }
+            trace_span(node->trace_id, "send", sending);
+            free_out_node(node);
+            
+            SetEvent(out->space);
+            if (lane == LANE_BULK) {
+                SetEvent(bulk_event);
+            }
+        }
+    }
+    
+    return 0;
+}
+
+// Begin streaming history or search results to a client, starting after
+// record from_seq (clients with a local cache ask only for what's new)
+int start_bulk_stream(int index, int kind, const char *query, unsigned int from_seq, unsigned int request_id) {
+    outbound_t *out = &outbound[index];
+    
+    FILE *file = fopen(chatlog_path, "r");
+    if (file == NULL) {
+        send_server_error(index, request_id, "Chat history not available");
+        return 0;
+    }
+    
+    // Skip straight to the first wanted record using the log index
+    lock_acquire(&log_mutex);
+    if (from_seq >= log_seq) {
+        from_seq = log_seq;
+        fseek(file, 0, SEEK_END);
+    } else if (from_seq > 0 && from_seq < log_capacity) {
+        fseek(file, log_offsets[from_seq], SEEK_SET);
+    } else {
+        from_seq = 0;
+    }
+    lock_release(&log_mutex);
+    
+    WaitForSingleObject(out->mutex, INFINITE);
+    if (out->stream.kind != 0) {
+        ReleaseMutex(out->mutex);
+        fclose(file);
+        send_server_error(index, request_id, "A history request is already in progress");
+        return 0;
+    }
+    
+    memset(&out->stream, 0, sizeof(bulk_stream_t));
+    out->stream.kind = kind;
+    out->stream.file = file;
+    out->stream.weight = kind == STREAM_SEARCH ? WEIGHT_SEARCH : WEIGHT_HISTORY;
+    out->stream.request_id = request_id;
+    out->stream.seq = from_seq;
+    if (query != NULL) {
+        prepare_log_query(query, &out->stream.query);
+    }
+    ReleaseMutex(out->mutex);
+    
+    SetEvent(bulk_event);
+    return 1;
+}
+
+// Begin relaying an attachment to a client from chunk from_chunk on
+// (a resumed download asks for the rest only)
+int start_file_stream(int index, const char *hash, unsigned int from_chunk, unsigned int request_id) {
+    outbound_t *out = &outbound[index];
+    
+    if (!valid_file_hash(hash)) {
+        send_server_error(index, request_id, "Invalid file ID");
+        return 0;
+    }
+    
+    char path[MAX_PATH];
+    snprintf(path, sizeof(path), "%s/%s", ATTACHMENTS_DIR, hash);
+    HANDLE file = CreateFile(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                             FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    LARGE_INTEGER size;
+    if (file == INVALID_HANDLE_VALUE) {
+        send_server_error(index, request_id, "No such file on the server");
+        return 0;
+    }
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        send_server_error(index, request_id, "File not available");
+        return 0;
+    }
+    
+    WaitForSingleObject(out->mutex, INFINITE);
+    if (out->stream.kind != 0) {
+        ReleaseMutex(out->mutex);
+        CloseHandle(file);
+        send_server_error(index, request_id, "A history request or download is already in progress");
+        return 0;
+    }
+    
+    memset(&out->stream, 0, sizeof(bulk_stream_t));
+    out->stream.kind = STREAM_FILE;
+    out->stream.handle = file;
+    out->stream.size = (unsigned long long)size.QuadPart;
+    out->stream.offset = (unsigned long long)from_chunk * FILE_CHUNK_SIZE;
+    if (out->stream.offset > out->stream.size) {
+        out->stream.offset = out->stream.size;
+    }
+    strcpy(out->stream.hash, hash);
+    out->stream.weight = WEIGHT_FILE;
+    out->stream.request_id = request_id;
+    ReleaseMutex(out->mutex);
+    
+    SetEvent(bulk_event);
+    return 1;
+}
+
+void close_bulk_stream(bulk_stream_t *stream) {
+    if (stream->file != NULL) {
+        fclose(stream->file);
+    }
+    if (stream->handle != NULL) {
+        CloseHandle(stream->handle);
+    }
+    memset(stream, 0, sizeof(bulk_stream_t));
+}
+
+void free_out_node(out_node_t *node) {
+    if (node->file != NULL) {
+        CloseHandle(node->file);
+    }
+    pool_free(&node_pool, node);
+}
+
+// Produce the next frame of a stream. Returns 1 if a frame was produced,
+// 0 when the stream is finished, -1 if a search used up its scan budget
+// without a match (try again next round)
+int next_stream_frame(bulk_stream_t *stream, out_node_t *node) {
+    Message *frame = &node->msg;
+    
+    node->file = NULL;
+    node->length = 0;
+    if (stream->kind == STREAM_FILE) {
+        return next_file_frame(stream, node);
+    }
+    
+    memset(frame, 0, sizeof(Message));
+    frame->type = MSG_HISTORY;
+    frame->request_id = stream->request_id;
+    
+    switch (stream->state) {
+        case 0:
+            // Header and end marker carry the first and last seq covered
+            frame->seq = stream->seq;
+            clock_stamp(frame);
+            if (stream->kind == STREAM_SEARCH) {
+                snprintf(frame->content, MAX_MESSAGE, "--- Search results for \"%s\" ---", stream->query.text);
+            } else {
+                strcpy(frame->content, "--- Chat History ---");
+            }
+            stream->state = 1;
+            return 1;
+            
+        case 1:
+            if (stream->part < stream->parts) {
+                return next_record_part(stream, frame);
+            }
+            for (int scanned = 0; scanned < STREAM_SCAN_BUDGET; scanned++) {
+                if (!read_log_line(stream->file, stream->line, sizeof(stream->line))) {
+                    stream->state = 2;
+                    return next_stream_frame(stream, node);
+                }
+                stream->seq++;
+                
+                if (stream->kind == STREAM_SEARCH && !log_line_matches(stream->line, &stream->query)) {
+                    continue;
+                }
+                stream->matches++;
+                
+                // A full fragment's line, with its prefix and escapes, can
+                // be twice a frame: send it in parts for the client to join
+                stream->line_length = (int)strlen(stream->line);
+                stream->part = 0;
+                stream->parts = 0;
+                if (stream->line_length >= MAX_MESSAGE) {
+                    stream->parts = (unsigned short)((stream->line_length + MAX_MESSAGE - 2) / (MAX_MESSAGE - 1));
+                    return next_record_part(stream, frame);
+                }
+                frame->seq = stream->seq;
+                strcpy(frame->content, stream->line);
+                return 1;
+            }
+            return -1;
+            
+        case 2:
+            frame->seq = stream->seq;
+            clock_stamp(frame);
+            if (stream->kind == STREAM_SEARCH) {
+                snprintf(frame->content, MAX_MESSAGE, "--- End of History (%d matches) ---", stream->matches);
+            } else {
+                strcpy(frame->content, "--- End of History ---");
+            }
+            stream->state = 3;
+            return 1;
+    }
+    
+    return 0;
+}
+
+// The next part of stream->line, numbered like message fragments (1 to
+// parts) and all with the record's seq
+int next_record_part(bulk_stream_t *stream, Message *frame) {
+    int offset = stream->part * (MAX_MESSAGE - 1);
+    int length = stream->line_length - offset;
+    if (length > MAX_MESSAGE - 1) {
+        length = MAX_MESSAGE - 1;
+    }
+    memcpy(frame->content, stream->line + offset, length);
+    frame->content[length] = '\0';
+    stream->part++;
+    frame->fragment = stream->part;
+    frame->fragments = stream->parts;
+    frame->seq = stream->seq;
+    return 1;
+}
+
+// A download: first a header with the file's size and hash, then segments
+// that the writer relays straight from disk. Each segment's node holds its
+// own handle, so the stream can finish while segments are still queued.
+int next_file_frame(bulk_stream_t *stream, out_node_t *node) {
+    Message *frame = &node->msg;
+    
+    memset(frame, 0, sizeof(Message));
+    frame->type = MSG_FILE_DATA;
+    frame->request_id = stream->request_id;
+    frame->seq = (unsigned int)(stream->offset / FILE_CHUNK_SIZE);
+    
+    if (stream->state == 0) {
+        snprintf(frame->content, MAX_MESSAGE, "%llu %s", stream->size, stream->hash);
+        stream->state = 1;
+        return 1;
+    }
+    
+    if (stream->offset >= stream->size) {
+        return 0;
+    }
+    
+    HANDLE process = GetCurrentProcess();
+    if (!DuplicateHandle(process, stream->handle, process, &node->file, 0, FALSE, DUPLICATE_SAME_ACCESS)) {
+        node->file = NULL;
+        return 0;
+    }
+    
+    unsigned long long remaining = stream->size - stream->offset;
+    node->offset = stream->offset;
+    node->length = remaining < FILE_SEGMENT_SIZE ? (DWORD)remaining : FILE_SEGMENT_SIZE;
+    frame->length = node->length;
+    stream->offset += node->length;
+    return 1;
+}
+
+// Deficit round robin over every connection with an active stream: each
+// round a stream earns BULK_QUANTUM * weight bytes of credit and spends it
+// on frames, but only while its bulk lane has room. Bulk traffic is thus
+// shared fairly between clients and never queues deeply ahead of chat.
+// The log is read with out->mutex released, so chat queued for the same
+// client never waits on disk; producing keeps the stream in place.
+DWORD WINAPI bulk_scheduler(LPVOID arg) {
+    affinity_pin(AFFINITY_BACKGROUND, -1);
+    while (1) {
+        int progress = 0;
+        
+        for (int i = 0; i < client_capacity; i++) {
+            outbound_t *out = &outbound[i];
+            
+            WaitForSingleObject(out->mutex, INFINITE);
+            bulk_stream_t *stream = &out->stream;
+            int room = BULK_LANE_DEPTH - out->lanes[LANE_BULK].count;
+            if (stream->kind == 0 || out->closing || out->socket == INVALID_SOCKET || room <= 0) {
+                ReleaseMutex(out->mutex);
+                continue;
+            }
+            long quantum = (long)(BULK_QUANTUM * stream->weight);
+            stream->deficit += quantum;
+            out->producing = 1;
+            ReleaseMutex(out->mutex);
+            
+            // Produce into a private list
+            out_node_t *head = NULL;
+            out_node_t *tail = NULL;
+            int queued = 0;
+            int result = 1;
+            while (stream->deficit >= (long)sizeof(Message) && queued < room) {
+                out_node_t *node = pool_alloc(&node_pool);
+                if (node == NULL) {
+                    break;
+                }
+                
+                result = next_stream_frame(stream, node);
+                if (result <= 0) {
+                    pool_free(&node_pool, node);
+                    if (result < 0) {
+                        stream->deficit -= sizeof(Message); // Scanning costs too
+                        progress = 1;
+                    }
+                    break;
+                }
+                
+                node->next = NULL;
+                node->trace_id = 0;
+                if (tail != NULL) {
+                    tail->next = node;
+                } else {
+                    head = node;
+                }
+                tail = node;
+                queued++;
+                stream->deficit -= sizeof(Message) + node->length;
+                metrics_add(M_FRAMES_QUEUED, 1);
+                metrics_add(stream->kind == STREAM_FILE ? M_FILE_BYTES : M_HISTORY_BYTES,
+                            sizeof(Message) + node->length);
+            }
+            
+            WaitForSingleObject(out->mutex, INFINITE);
+            out->producing = 0;
+            if (out->closing) {
+                // stop_outbound is waiting to free the lanes and the stream
+                ReleaseMutex(out->mutex);
+                while (head != NULL) {
+                    out_node_t *next = head->next;
+                    free_out_node(head);
+                    head = next;
+                }
+                SetEvent(out->space);
+                continue;
+            }
+            
+            if (head != NULL) {
+                lane_t *queue = &out->lanes[LANE_BULK];
+                if (queue->tail != NULL) {
+                    queue->tail->next = head;
+                } else {
+                    queue->head = head;
+                }
+                queue->tail = tail;
+                queue->count += queued;
+            }
+            if (result == 0) {
+                close_bulk_stream(stream);
+            }
+            
+            // A stream blocked on a full lane doesn't bank credit
+            if (stream->deficit > quantum) {
+                stream->deficit = quantum;
+            }
+            ReleaseMutex(out->mutex);
+            
+            if (queued > 0) {
+                SetEvent(out->ready);
+                progress = 1;
+            }
+        }
+        
+        if (!progress) {
+            WaitForSingleObject(bulk_event, 100);
+        }
+    }
+    
+    return 0;
 }
 
 void cleanup_winsock() {
     // Close all client sockets first
-    WaitForSingleObject(clients_mutex, INFINITE);
-    for (int i = 0; i < MAX_CLIENTS; i++) {
+    lock_acquire(&clients_mutex);
+    for (int i = 0; i < client_capacity; i++) {
         if (clients[i].socket != INVALID_SOCKET) {
             closesocket(clients[i].socket);
             clients[i].socket = INVALID_SOCKET;
         }
     }
-    ReleaseMutex(clients_mutex);
+    lock_release(&clients_mutex);
     
     // Clean up Winsock
     WSACleanup();
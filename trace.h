@@ -0,0 +1,143 @@
+#ifndef TRACE_H
+#define TRACE_H
+// Sampled per-message tracing: each thread records the stages it runs for a
+// traced message into its own ring buffer, without locks, and a dump writes
+// every ring out as Chrome trace JSON (chrome://tracing, ui.perfetto.dev).
+// With sampling off, each stage costs one load and a branch.
+#include "common.h"
+#include "metrics.h"
+
+#define TRACE_MAX_THREADS 64         // Threads with a ring; others record nothing
+#define TRACE_RING_SIZE 1024         // Spans kept per thread (power of two)
+#define TRACE_DEFAULT_EVERY 100      // Sampling rate for "on" without a number
+
+typedef struct {
+    const char *name;                // A string literal
+    unsigned int trace_id;
+    unsigned int duration_us;
+    unsigned long long start_us;
+} trace_span_t;
+
+typedef struct {
+    volatile LONG claimed;
+    DWORD thread_id;
+    volatile LONG head;              // Spans written so far; the ring keeps the last TRACE_RING_SIZE
+    trace_span_t spans[TRACE_RING_SIZE];
+} trace_ring_t;
+
+trace_ring_t trace_rings[TRACE_MAX_THREADS];
+volatile LONG trace_sample_every = 0; // Trace one message in this many, 0 = off
+volatile LONG trace_counter = 0;
+DWORD trace_ring_tls = TLS_OUT_OF_INDEXES;
+DWORD trace_current_tls = TLS_OUT_OF_INDEXES;
+
+void trace_init() {
+    trace_ring_tls = TlsAlloc();
+    trace_current_tls = TlsAlloc();
+}
+
+// A new trace ID if this message is sampled, else 0
+unsigned int trace_sample() {
+    LONG every = trace_sample_every;
+    if (every <= 0) {
+        return 0;
+    }
+    LONG n = InterlockedIncrement(&trace_counter);
+    return n % every == 0 ? (unsigned int)n : 0;
+}
+
+// The message this thread is handling, so code it calls (and frames it
+// queues) can attach spans to it without passing the ID down
+void trace_set_current(unsigned int trace_id) {
+    TlsSetValue(trace_current_tls, (LPVOID)(DWORD_PTR)trace_id);
+}
+
+unsigned int trace_current() {
+    if (trace_sample_every <= 0) {
+        return 0;
+    }
+    return (unsigned int)(DWORD_PTR)TlsGetValue(trace_current_tls);
+}
+
+// Start time for a span; free when the message isn't traced
+unsigned long long trace_start(unsigned int trace_id) {
+    return trace_id != 0 ? metrics_now_us() : 0;
+}
+
+trace_ring_t *trace_ring() {
+    trace_ring_t *ring = TlsGetValue(trace_ring_tls);
+    if (ring != NULL) {
+        return ring;
+    }
+    for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+        if (InterlockedCompareExchange(&trace_rings[i].claimed, 1, 0) == 0) {
+            ring = &trace_rings[i];
+            ring->thread_id = GetCurrentThreadId();
+            TlsSetValue(trace_ring_tls, ring);
+            return ring;
+        }
+    }
+    return NULL;
+}
+
+// Record a stage that ran from start_us until now
+void trace_span(unsigned int trace_id, const char *name, unsigned long long start_us) {
+    if (trace_id == 0) {
+        return;
+    }
+    trace_ring_t *ring = trace_ring();
+    if (ring == NULL) {
+        return;
+    }
+
+    trace_span_t *span = &ring->spans[ring->head & (TRACE_RING_SIZE - 1)];
+    unsigned long long now = metrics_now_us();
+    span->name = name;
+    span->trace_id = trace_id;
+    span->start_us = start_us;
+    span->duration_us = (unsigned int)(now - start_us);
+    MemoryBarrier(); // Publish the span before the new head
+    ring->head++;
+}
+
+void trace_thread_exit() {
+    trace_ring_t *ring = TlsGetValue(trace_ring_tls);
+    if (ring != NULL) {
+        TlsSetValue(trace_ring_tls, NULL);
+        InterlockedExchange(&ring->claimed, 0); // Its spans stay until reused
+    }
+}
+
+// Write every ring as Chrome trace JSON. Rings keep being written while
+// this runs, so a span overwritten mid-copy can come out garbled.
+// Returns the number of spans written, -1 if the file can't be created
+int trace_dump(const char *path) {
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+
+    int written = 0;
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    for (int i = 0; i < TRACE_MAX_THREADS; i++) {
+        trace_ring_t *ring = &trace_rings[i];
+        LONG head = ring->head;
+        LONG first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+        for (LONG n = first; n < head; n++) {
+            trace_span_t span = ring->spans[n & (TRACE_RING_SIZE - 1)];
+            if (span.name == NULL) {
+                continue;
+            }
+            fprintf(file, "%s{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %lu, "
+                          "\"ts\": %llu, \"dur\": %u, \"args\": {\"msg\": %u}}",
+                    written > 0 ? ",\n" : "", span.name, (unsigned long)ring->thread_id,
+                    span.start_us, span.duration_us, span.trace_id);
+            written++;
+        }
+    }
+    fprintf(file, "\n]}\n");
+    fclose(file);
+    return written;
+}
+
+#endif // TRACE_H